@@ -45,9 +45,21 @@
 #include "src/shared/queue.h"
 #include "src/shared/gatt-db.h"
 #include "src/shared/gatt-client.h"
+#include "src/shared/gatt-cache.h"
+#include "src/shared/hci.h"
 
 #define ATT_CID 4
 
+#define TRACE_MAX_PDUS 8192
+
+/* Link parameters asked for by --throughput */
+#define THROUGHPUT_TX_OCTETS	251
+#define THROUGHPUT_TX_TIME	2120
+#define THROUGHPUT_MIN_INTERVAL	0x0006	/* 7.5 ms */
+#define THROUGHPUT_MAX_INTERVAL	0x000c	/* 15 ms */
+#define THROUGHPUT_LATENCY	0
+#define THROUGHPUT_SUPV_TIMEOUT	0x00c8	/* 2 s */
+
 #define PRLOG(...) \
 	printf(__VA_ARGS__); print_prompt();
 
@@ -61,12 +73,18 @@
 #define COLOR_BOLDWHITE	"\x1B[1;37m"
 
 static bool verbose = false;
+static const char *trace_path;
+static const char *cache_dir = NULL;
+static bool throughput = false;
 
 struct client {
 	int fd;
+	bdaddr_t dst;
 	struct bt_att *att;
 	struct gatt_db *db;
 	struct bt_gatt_client *gatt;
+	struct bt_hci *hci;
+	uint16_t handle;
 
 	unsigned int reliable_session_id;
 };
@@ -175,9 +193,12 @@ static void service_removed_cb(struct gatt_db_attribute *attr, void *user_data)
 	log_service_event(attr, "Service Removed");
 }
 
-static struct client *client_create(int fd, uint16_t mtu)
+static struct client *client_create(int fd, uint16_t mtu,
+						const bdaddr_t *dst)
 {
 	struct client *cli;
+	uint8_t hash[16];
+	bool has_hash = false;
 
 	cli = new0(struct client, 1);
 	if (!cli) {
@@ -200,6 +221,9 @@ static struct client *client_create(int fd, uint16_t mtu)
 		return NULL;
 	}
 
+	if (trace_path && !bt_att_set_trace(cli->att, TRACE_MAX_PDUS, 0))
+		fprintf(stderr, "Failed to enable PDU capture\n");
+
 	if (!bt_att_register_disconnect(cli->att, att_disconnect_cb, NULL,
 								NULL)) {
 		fprintf(stderr, "Failed to set ATT disconnect handler\n");
@@ -217,7 +241,18 @@ static struct client *client_create(int fd, uint16_t mtu)
 		return NULL;
 	}
 
-	cli->gatt = bt_gatt_client_new(cli->db, cli->att, mtu);
+	bacpy(&cli->dst, dst);
+
+	if (!cache_dir)
+		cli->gatt = bt_gatt_client_new(cli->db, cli->att, mtu);
+	else {
+		if (gatt_cache_load(cli->db, cache_dir, dst, hash, &has_hash))
+			printf("Loaded GATT cache from %s\n", cache_dir);
+
+		cli->gatt = bt_gatt_client_new_cached(cli->db, cli->att, mtu,
+						has_hash ? hash : NULL);
+	}
+
 	if (!cli->gatt) {
 		fprintf(stderr, "Failed to create GATT client\n");
 		gatt_db_unref(cli->db);
@@ -247,6 +282,7 @@ static struct client *client_create(int fd, uint16_t mtu)
 
 static void client_destroy(struct client *cli)
 {
+	bt_hci_unref(cli->hci);
 	bt_gatt_client_unref(cli->gatt);
 	bt_att_unref(cli->att);
 	free(cli);
@@ -360,6 +396,24 @@ static void print_services_by_handle(struct client *cli, uint16_t handle)
 	gatt_db_foreach_service(cli->db, NULL, print_service, cli);
 }
 
+static void store_cache(struct client *cli)
+{
+	uint8_t hash[16];
+
+	if (!cache_dir)
+		return;
+
+	/* Without a Database Hash the cache could never be validated */
+	if (!bt_gatt_client_get_db_hash(cli->gatt, hash)) {
+		gatt_cache_remove(cache_dir, &cli->dst);
+		return;
+	}
+
+	if (!gatt_cache_store(cli->db, cache_dir, &cli->dst, hash)) {
+		PRLOG("Failed to store GATT cache in %s\n", cache_dir);
+	}
+}
+
 static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
 {
 	struct client *cli = user_data;
@@ -372,6 +426,10 @@ static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
 
 	PRLOG("GATT discovery procedures complete\n");
 
+	if (throughput)
+		printf("ATT MTU: %u\n", bt_att_get_mtu(cli->att));
+
+	store_cache(cli);
 	print_services(cli);
 	print_prompt();
 }
@@ -386,6 +444,11 @@ static void service_changed_cb(uint16_t start_handle, uint16_t end_handle,
 
 	gatt_db_foreach_service_in_range(cli->db, NULL, print_service, cli,
 						start_handle, end_handle);
+
+	/* The cached Database Hash is stale now, rediscover next time */
+	if (cache_dir)
+		gatt_cache_remove(cache_dir, &cli->dst);
+
 	print_prompt();
 }
 
@@ -532,6 +595,81 @@ static void cmd_read_multiple(struct client *cli, char *cmd_str)
 	free(value);
 }
 
+static void read_multiple_vl_usage(void)
+{
+	printf("Usage: read-multiple-vl <handle_1> <handle_2> ...\n");
+}
+
+static void read_multiple_vl_value_cb(uint16_t value_handle,
+					const uint8_t *value, uint16_t length,
+					bool truncated, void *user_data)
+{
+	int i;
+
+	printf("\n\thandle 0x%04x (%u bytes%s):", value_handle, length,
+						truncated ? ", truncated" : "");
+
+	for (i = 0; i < length; i++)
+		printf(" %02x", value[i]);
+}
+
+static void read_multiple_vl_cb(bool success, uint8_t att_ecode,
+							void *user_data)
+{
+	if (!success) {
+		PRLOG("\nRead multiple variable length request failed: "
+					"%s (0x%02x)\n",
+					ecode_to_string(att_ecode), att_ecode);
+		return;
+	}
+
+	PRLOG("\n");
+}
+
+static void cmd_read_multiple_vl(struct client *cli, char *cmd_str)
+{
+	int argc = 0;
+	uint16_t *handles;
+	char *argv[512];
+	int i;
+	char *endptr = NULL;
+
+	if (!bt_gatt_client_is_ready(cli->gatt)) {
+		printf("GATT client not initialized\n");
+		return;
+	}
+
+	if (!parse_args(cmd_str, sizeof(argv), argv, &argc) || argc < 2) {
+		read_multiple_vl_usage();
+		return;
+	}
+
+	handles = malloc(sizeof(uint16_t) * argc);
+	if (!handles) {
+		printf("Failed to construct value\n");
+		return;
+	}
+
+	for (i = 0; i < argc; i++) {
+		handles[i] = strtol(argv[i], &endptr, 0);
+		if (endptr == argv[i] || *endptr != '\0' || !handles[i]) {
+			printf("Invalid handle: %s\n", argv[i]);
+			free(handles);
+			return;
+		}
+	}
+
+	printf("Read multiple variable length values:");
+
+	if (!bt_gatt_client_read_multiple_vl(cli->gatt, handles, argc,
+						read_multiple_vl_value_cb,
+						read_multiple_vl_cb, NULL, NULL))
+		printf("\nFailed to initiate read multiple variable length "
+								"procedure\n");
+
+	free(handles);
+}
+
 static void read_value_usage(void)
 {
 	printf("Usage: read-value <value_handle>\n");
@@ -1306,6 +1444,48 @@ static void cmd_set_sign_key(struct client *cli, char *cmd_str)
 		set_sign_key_usage();
 }
 
+static void stats_usage(void)
+{
+	printf("Usage: stats [-r]\nOptions:\n"
+		"\t -r, --reset\tReset the counters after printing\n");
+}
+
+static void print_stats_line(const char *str, void *user_data)
+{
+	printf("%s\n", str);
+}
+
+static void cmd_stats(struct client *cli, char *cmd_str)
+{
+	char *argv[2];
+	int argc = 0;
+	bool reset = false;
+
+	if (!parse_args(cmd_str, 1, argv, &argc)) {
+		stats_usage();
+		return;
+	}
+
+	if (argc == 1) {
+		if (strcmp(argv[0], "-r") && strcmp(argv[0], "--reset")) {
+			stats_usage();
+			return;
+		}
+
+		reset = true;
+	}
+
+	printf("ATT statistics:\n");
+
+	if (!bt_att_print_stats(cli->att, print_stats_line, NULL)) {
+		printf("Failed to get ATT statistics\n");
+		return;
+	}
+
+	if (reset)
+		bt_att_reset_stats(cli->att);
+}
+
 static void cmd_help(struct client *cli, char *cmd_str);
 
 typedef void (*command_func_t)(struct client *cli, char *cmd_str);
@@ -1322,6 +1502,8 @@ static struct {
 	{ "read-long-value", cmd_read_long_value,
 		"\tRead a long characteristic or desctriptor value" },
 	{ "read-multiple", cmd_read_multiple, "\tRead Multiple" },
+	{ "read-multiple-vl", cmd_read_multiple_vl,
+				"\tRead Multiple Variable Length" },
 	{ "write-value", cmd_write_value,
 			"\tWrite a characteristic or descriptor value" },
 	{ "write-long-value", cmd_write_long_value,
@@ -1340,6 +1522,7 @@ static struct {
 				"\tGet security level on le connection"},
 	{ "set-sign-key", cmd_set_sign_key,
 				"\tSet signing key for signed write command"},
+	{ "stats", cmd_stats, "\tShow ATT statistics and latencies" },
 	{ }
 };
 
@@ -1401,6 +1584,17 @@ failed:
 	free(line);
 }
 
+static void dump_trace(struct client *cli)
+{
+	if (!trace_path)
+		return;
+
+	if (bt_att_dump_trace_file(cli->att, trace_path))
+		printf("Trace written to %s\n", trace_path);
+	else
+		fprintf(stderr, "Failed to write trace to %s\n", trace_path);
+}
+
 static void signal_cb(int signum, void *user_data)
 {
 	switch (signum) {
@@ -1408,6 +1602,9 @@ static void signal_cb(int signum, void *user_data)
 	case SIGTERM:
 		mainloop_quit();
 		break;
+	case SIGUSR1:
+		dump_trace(user_data);
+		break;
 	default:
 		break;
 	}
@@ -1481,6 +1678,190 @@ static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
 	return sock;
 }
 
+static int l2cap_le_eatt_connect(bdaddr_t *src, bdaddr_t *dst,
+						uint8_t dst_type, int sec)
+{
+	int sock;
+	struct sockaddr_l2 srcaddr, dstaddr;
+	struct bt_security btsec;
+	uint8_t mode = BT_MODE_EXT_FLOWCTL;
+
+	sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	if (sock < 0) {
+		perror("Failed to create EATT socket");
+		return -1;
+	}
+
+	memset(&srcaddr, 0, sizeof(srcaddr));
+	srcaddr.l2_family = AF_BLUETOOTH;
+	srcaddr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+	bacpy(&srcaddr.l2_bdaddr, src);
+
+	if (bind(sock, (struct sockaddr *)&srcaddr, sizeof(srcaddr)) < 0) {
+		perror("Failed to bind EATT socket");
+		close(sock);
+		return -1;
+	}
+
+	memset(&btsec, 0, sizeof(btsec));
+	btsec.level = sec;
+	if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &btsec,
+							sizeof(btsec)) != 0) {
+		fprintf(stderr, "Failed to set EATT security level\n");
+		close(sock);
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_BLUETOOTH, BT_MODE, &mode,
+							sizeof(mode)) != 0) {
+		perror("Failed to enable enhanced credit based mode");
+		close(sock);
+		return -1;
+	}
+
+	memset(&dstaddr, 0, sizeof(dstaddr));
+	dstaddr.l2_family = AF_BLUETOOTH;
+	dstaddr.l2_psm = htobs(BT_ATT_EATT_PSM);
+	dstaddr.l2_bdaddr_type = dst_type;
+	bacpy(&dstaddr.l2_bdaddr, dst);
+
+	if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0) {
+		perror("Failed to connect EATT channel");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void attach_eatt(struct client *cli, bdaddr_t *src, uint8_t dst_type,
+						int sec, int count)
+{
+	int i, fd;
+
+	for (i = 0; i < count; i++) {
+		fd = l2cap_le_eatt_connect(src, &cli->dst, dst_type, sec);
+		if (fd < 0)
+			break;
+
+		if (!bt_att_attach_fd(cli->att, fd)) {
+			fprintf(stderr, "Failed to attach EATT channel\n");
+			close(fd);
+			break;
+		}
+	}
+
+	printf("Using %u ATT bearer(s)\n", bt_att_get_channels(cli->att));
+}
+
+static const char *phy_to_str(uint8_t phy)
+{
+	switch (phy) {
+	case LE_PHY_1M:
+		return "1M";
+	case LE_PHY_2M:
+		return "2M";
+	case LE_PHY_CODED:
+		return "Coded";
+	default:
+		return "unknown";
+	}
+}
+
+static void data_length_cb(uint8_t status, uint16_t tx_octets,
+					uint16_t tx_time, uint16_t rx_octets,
+					uint16_t rx_time, void *user_data)
+{
+	if (status) {
+		PRLOG("Data length update failed: 0x%02x\n", status);
+		return;
+	}
+
+	if (!tx_octets) {
+		PRLOG("Data length unchanged\n");
+		return;
+	}
+
+	PRLOG("Data length: tx %u octets/%u us, rx %u octets/%u us\n",
+				tx_octets, tx_time, rx_octets, rx_time);
+}
+
+static void phy_cb(uint8_t status, uint8_t tx_phy, uint8_t rx_phy,
+							void *user_data)
+{
+	if (status) {
+		PRLOG("PHY update failed: 0x%02x\n", status);
+		return;
+	}
+
+	PRLOG("PHY: tx %s, rx %s\n", phy_to_str(tx_phy), phy_to_str(rx_phy));
+}
+
+static void conn_params_cb(uint8_t status, uint16_t interval,
+					uint16_t latency, uint16_t supv_timeout,
+					void *user_data)
+{
+	if (status) {
+		PRLOG("Connection update failed: 0x%02x\n", status);
+		return;
+	}
+
+	if (!interval) {
+		PRLOG("Connection parameters unchanged\n");
+		return;
+	}
+
+	PRLOG("Connection interval %u.%02u ms, latency %u, "
+				"supervision timeout %u ms\n",
+				interval * 125 / 100, interval * 125 % 100,
+				latency, supv_timeout * 10);
+}
+
+/*
+ * Ask for the largest link layer PDUs, the 2M PHY and a short connection
+ * interval, so that a large ATT MTU is not split into 27 octet fragments
+ * sent a few per interval. The procedures go out back to back.
+ */
+static void apply_throughput(struct client *cli, int dev_id)
+{
+	struct l2cap_conninfo info;
+	socklen_t len = sizeof(info);
+
+	if (dev_id < 0)
+		dev_id = hci_get_route(NULL);
+
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(cli->fd, SOL_L2CAP, L2CAP_CONNINFO, &info, &len) < 0) {
+		perror("Failed to get connection handle");
+		return;
+	}
+
+	cli->handle = info.hci_handle;
+
+	cli->hci = dev_id < 0 ? NULL : bt_hci_new_raw_device(dev_id);
+	if (!cli->hci) {
+		perror("Failed to open HCI device");
+		return;
+	}
+
+	if (!bt_hci_le_set_data_length(cli->hci, cli->handle,
+					THROUGHPUT_TX_OCTETS, THROUGHPUT_TX_TIME,
+					data_length_cb, cli, NULL))
+		fprintf(stderr, "Failed to request data length\n");
+
+	if (!bt_hci_le_set_phy(cli->hci, cli->handle, 0, LE_PHYS_2M,
+					LE_PHYS_2M, 0, phy_cb, cli, NULL))
+		fprintf(stderr, "Failed to request 2M PHY\n");
+
+	if (!bt_hci_le_update_conn(cli->hci, cli->handle,
+					THROUGHPUT_MIN_INTERVAL,
+					THROUGHPUT_MAX_INTERVAL,
+					THROUGHPUT_LATENCY,
+					THROUGHPUT_SUPV_TIMEOUT,
+					conn_params_cb, cli, NULL))
+		fprintf(stderr, "Failed to request connection update\n");
+}
+
 static void usage(void)
 {
 	printf("btgatt-client\n");
@@ -1493,7 +1874,14 @@ static void usage(void)
 		"\t-m, --mtu <mtu> \t\tThe ATT MTU to use\n"
 		"\t-s, --security-level <sec> \tSet security level (low|"
 								"medium|high)\n"
+		"\t-c, --cache-dir <dir>\t\tCache the remote database in dir\n"
+		"\t-e, --eatt <count>\t\tOpen count Enhanced ATT channels\n"
+		"\t-P, --throughput\t\tTune the link for throughput:\n"
+		"\t\t\t\t\tlargest MTU and data length, 2M\n"
+		"\t\t\t\t\tPHY, short connection interval\n"
 		"\t-v, --verbose\t\t\tEnable extra logging\n"
+		"\t-T, --trace <file>\t\tCapture PDUs, saved in btsnoop\n"
+		"\t\t\t\t\tformat on SIGUSR1 and on exit\n"
 		"\t-h, --help\t\t\tDisplay help\n");
 }
 
@@ -1503,7 +1891,11 @@ static struct option main_options[] = {
 	{ "type",		1, 0, 't' },
 	{ "mtu",		1, 0, 'm' },
 	{ "security-level",	1, 0, 's' },
+	{ "cache-dir",		1, 0, 'c' },
+	{ "eatt",		1, 0, 'e' },
+	{ "throughput",		0, 0, 'P' },
 	{ "verbose",		0, 0, 'v' },
+	{ "trace",		1, 0, 'T' },
 	{ "help",		0, 0, 'h' },
 	{ }
 };
@@ -1517,11 +1909,12 @@ int main(int argc, char *argv[])
 	bool dst_addr_given = false;
 	bdaddr_t src_addr, dst_addr;
 	int dev_id = -1;
+	int eatt = 0;
 	int fd;
 	sigset_t mask;
 	struct client *cli;
 
-	while ((opt = getopt_long(argc, argv, "+hvs:m:t:d:i:",
+	while ((opt = getopt_long(argc, argv, "+hvPs:m:t:d:i:c:e:T:",
 						main_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
@@ -1530,6 +1923,12 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose = true;
 			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'P':
+			throughput = true;
+			break;
 		case 's':
 			if (strcmp(optarg, "low") == 0)
 				sec = BT_SECURITY_LOW;
@@ -1580,6 +1979,18 @@ int main(int argc, char *argv[])
 			dst_addr_given = true;
 			break;
 
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'e':
+			eatt = atoi(optarg);
+			if (eatt < 0) {
+				fprintf(stderr, "Invalid EATT count: %d\n",
+									eatt);
+				return EXIT_FAILURE;
+			}
+
+			break;
 		case 'i':
 			dev_id = hci_devid(optarg);
 			if (dev_id < 0) {
@@ -1620,18 +2031,27 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (throughput && !mtu)
+		mtu = BT_ATT_MAX_LE_MTU;
+
 	mainloop_init();
 
 	fd = l2cap_le_att_connect(&src_addr, &dst_addr, dst_type, sec);
 	if (fd < 0)
 		return EXIT_FAILURE;
 
-	cli = client_create(fd, mtu);
+	cli = client_create(fd, mtu, &dst_addr);
 	if (!cli) {
 		close(fd);
 		return EXIT_FAILURE;
 	}
 
+	if (eatt)
+		attach_eatt(cli, &src_addr, dst_type, sec, eatt);
+
+	if (throughput)
+		apply_throughput(cli, dev_id);
+
 	if (mainloop_add_fd(fileno(stdin),
 				EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
 				prompt_read_cb, cli, NULL) < 0) {
@@ -1642,8 +2062,9 @@ int main(int argc, char *argv[])
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
 
-	mainloop_set_signal(&mask, signal_cb, NULL, NULL);
+	mainloop_set_signal(&mask, signal_cb, cli, NULL);
 
 	print_prompt();
 
@@ -1651,6 +2072,8 @@ int main(int argc, char *argv[])
 
 	printf("\n\nShutting down...\n");
 
+	dump_trace(cli);
+
 	client_destroy(cli);
 
 	return EXIT_SUCCESS;
@@ -28,6 +28,9 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "lib/bluetooth.h"
 #include "lib/hci.h"
@@ -42,6 +45,7 @@
 #include "src/shared/timeout.h"
 #include "src/shared/gatt-db.h"
 #include "src/shared/gatt-server.h"
+#include "src/shared/hci.h"
 
 #define UUID_GAP			0x1800
 #define UUID_GATT			0x1801
@@ -50,8 +54,29 @@
 #define UUID_HEART_RATE_BODY		0x2a38
 #define UUID_HEART_RATE_CTRL		0x2a39
 
+/* Fixed by the database table */
+#define HANDLE_GAP_SVC			0x0001
+#define HANDLE_DEVICE_NAME		0x0003
+#define HANDLE_GATT_SVC			0x0007
+#define HANDLE_SVC_CHNGD		0x0009
+#define HANDLE_SVC_CHNGD_CCC		0x000a
+#define HANDLE_HR_SVC			0x000d
+#define HANDLE_HR_MSRMT			0x000f
+#define HANDLE_HR_MSRMT_CCC		0x0010
+
 #define ATT_CID 4
 
+#define TRACE_MAX_PDUS 8192
+#define LISTEN_BACKLOG 32
+
+/* Link parameters asked for by --throughput */
+#define THROUGHPUT_TX_OCTETS	251
+#define THROUGHPUT_TX_TIME	2120
+#define THROUGHPUT_MIN_INTERVAL	0x0006	/* 7.5 ms */
+#define THROUGHPUT_MAX_INTERVAL	0x000c	/* 15 ms */
+#define THROUGHPUT_LATENCY	0
+#define THROUGHPUT_SUPV_TIMEOUT	0x00c8	/* 2 s */
+
 #define PRLOG(...) \
 	do { \
 		printf(__VA_ARGS__); \
@@ -74,39 +99,100 @@
 static const char test_device_name[] = "Very Long Test Device Name For Testing "
 				"ATT Protocol Operations On GATT Server";
 static bool verbose = false;
+static const char *trace_path;
 
+/* State shared by all connections, served from a single database */
 struct server {
-	int fd;
-	struct bt_att *att;
 	struct gatt_db *db;
-	struct bt_gatt_server *gatt;
+	uint16_t mtu;
+
+	int listen_fd;
+	struct queue *conns;
+	unsigned int next_conn_id;
+
+	/* Set when link tuning (--throughput) was asked for */
+	struct bt_hci *hci;
 
 	uint8_t *device_name;
 	size_t name_len;
 
+	bool has_sign_key;
+	uint8_t sign_key[16];
+
 	uint16_t gatt_svc_chngd_handle;
-	bool svc_chngd_enabled;
+	uint16_t gatt_svc_chngd_ccc_handle;
 
 	uint16_t hr_handle;
 	uint16_t hr_msrmt_handle;
+	uint16_t hr_msrmt_ccc_handle;
 	uint16_t hr_energy_expended;
 	bool hr_visible;
-	bool hr_msrmt_enabled;
 	int hr_ee_count;
 	unsigned int hr_timeout_id;
 };
 
+/* One connected client; its CCC values are kept by bt_gatt_server */
+struct conn {
+	struct server *server;
+	unsigned int id;
+	char addr[18];
+	bdaddr_t bdaddr;
+
+	struct bt_att *att;
+	struct bt_gatt_server *gatt;
+	uint32_t sign_cnt;
+
+	/* Link tuning, zero until the controller reported a change */
+	uint16_t handle;
+	unsigned int data_length_id;
+	unsigned int phy_id;
+	unsigned int conn_params_id;
+	uint16_t tx_octets;
+	uint16_t rx_octets;
+	uint8_t tx_phy;
+	uint8_t rx_phy;
+	uint16_t interval;
+};
+
 static void print_prompt(void)
 {
 	printf(COLOR_BLUE "[GATT server]" COLOR_OFF "# ");
 	fflush(stdout);
 }
 
+static bool match_conn_att(const void *a, const void *b)
+{
+	const struct conn *conn = a;
+
+	return conn->att == b;
+}
+
+static struct conn *conn_from_att(struct server *server, struct bt_att *att)
+{
+	return queue_find(server->conns, match_conn_att, att);
+}
+
+static bool match_conn_id(const void *a, const void *b)
+{
+	const struct conn *conn = a;
+
+	return conn->id == PTR_TO_UINT(b);
+}
+
+static void dump_trace(struct conn *conn);
+static void conn_destroy(void *data);
+
 static void att_disconnect_cb(int err, void *user_data)
 {
-	printf("Device disconnected: %s\n", strerror(err));
+	struct conn *conn = user_data;
+
+	PRLOG("Connection %u (%s) closed: %s\n", conn->id, conn->addr,
+								strerror(err));
 
-	mainloop_quit();
+	dump_trace(conn);
+
+	queue_remove(conn->server->conns, conn);
+	conn_destroy(conn);
 }
 
 static void att_debug_cb(const char *str, void *user_data)
@@ -195,29 +281,40 @@ done:
 	gatt_db_attribute_write_result(attrib, id, error);
 }
 
-static void gap_device_name_ext_prop_read_cb(struct gatt_db_attribute *attrib,
+static void gatt_service_changed_cb(struct gatt_db_attribute *attrib,
 					unsigned int id, uint16_t offset,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data)
 {
-	uint8_t value[2];
-
-	PRLOG("Device Name Extended Properties Read called\n");
-
-	value[0] = BT_GATT_CHRC_EXT_PROP_RELIABLE_WRITE;
-	value[1] = 0;
+	PRLOG("Service Changed Read called\n");
 
-	gatt_db_attribute_read_result(attrib, id, 0, value, sizeof(value));
+	gatt_db_attribute_read_result(attrib, id, 0, NULL, 0);
 }
 
-static void gatt_service_changed_cb(struct gatt_db_attribute *attrib,
+static void gatt_db_hash_read_cb(struct gatt_db_attribute *attrib,
 					unsigned int id, uint16_t offset,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data)
 {
-	PRLOG("Service Changed Read called\n");
+	struct server *server = user_data;
+	uint8_t hash[16];
 
-	gatt_db_attribute_read_result(attrib, id, 0, NULL, 0);
+	PRLOG("Database Hash Read called\n");
+
+	if (!gatt_db_get_hash(server->db, hash)) {
+		gatt_db_attribute_read_result(attrib, id,
+						BT_ATT_ERROR_UNLIKELY, NULL, 0);
+		return;
+	}
+
+	if (offset > sizeof(hash)) {
+		gatt_db_attribute_read_result(attrib, id,
+					BT_ATT_ERROR_INVALID_OFFSET, NULL, 0);
+		return;
+	}
+
+	gatt_db_attribute_read_result(attrib, id, 0, hash + offset,
+							sizeof(hash) - offset);
 }
 
 static void gatt_svc_chngd_ccc_read_cb(struct gatt_db_attribute *attrib,
@@ -225,13 +322,20 @@ static void gatt_svc_chngd_ccc_read_cb(struct gatt_db_attribute *attrib,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data)
 {
-	struct server *server = user_data;
+	struct conn *conn = conn_from_att(user_data, att);
 	uint8_t value[2];
 
 	PRLOG("Service Changed CCC Read called\n");
 
-	value[0] = server->svc_chngd_enabled ? 0x02 : 0x00;
-	value[1] = 0x00;
+	if (!conn) {
+		gatt_db_attribute_read_result(attrib, id,
+						BT_ATT_ERROR_UNLIKELY, NULL, 0);
+		return;
+	}
+
+	put_le16(bt_gatt_server_get_ccc(conn->gatt,
+					gatt_db_attribute_get_handle(attrib)),
+					value);
 
 	gatt_db_attribute_read_result(attrib, id, 0, value, sizeof(value));
 }
@@ -242,11 +346,16 @@ static void gatt_svc_chngd_ccc_write_cb(struct gatt_db_attribute *attrib,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data)
 {
-	struct server *server = user_data;
+	struct conn *conn = conn_from_att(user_data, att);
 	uint8_t ecode = 0;
 
 	PRLOG("Service Changed CCC Write called\n");
 
+	if (!conn) {
+		ecode = BT_ATT_ERROR_UNLIKELY;
+		goto done;
+	}
+
 	if (!value || len != 2) {
 		ecode = BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN;
 		goto done;
@@ -257,15 +366,14 @@ static void gatt_svc_chngd_ccc_write_cb(struct gatt_db_attribute *attrib,
 		goto done;
 	}
 
-	if (value[0] == 0x00)
-		server->svc_chngd_enabled = false;
-	else if (value[0] == 0x02)
-		server->svc_chngd_enabled = true;
-	else
+	/* Accepted values are recorded by bt_gatt_server once written */
+	if (value[0] != 0x00 && value[0] != 0x02) {
 		ecode = 0x80;
+		goto done;
+	}
 
-	PRLOG("Service Changed Enabled: %s\n",
-				server->svc_chngd_enabled ? "true" : "false");
+	PRLOG("Connection %u: Service Changed Enabled: %s\n", conn->id,
+					value[0] ? "true" : "false");
 
 done:
 	gatt_db_attribute_write_result(attrib, id, ecode);
@@ -276,11 +384,18 @@ static void hr_msrmt_ccc_read_cb(struct gatt_db_attribute *attrib,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data)
 {
-	struct server *server = user_data;
+	struct conn *conn = conn_from_att(user_data, att);
 	uint8_t value[2];
 
-	value[0] = server->hr_msrmt_enabled ? 0x01 : 0x00;
-	value[1] = 0x00;
+	if (!conn) {
+		gatt_db_attribute_read_result(attrib, id,
+						BT_ATT_ERROR_UNLIKELY, NULL, 0);
+		return;
+	}
+
+	put_le16(bt_gatt_server_get_ccc(conn->gatt,
+					gatt_db_attribute_get_handle(attrib)),
+					value);
 
 	gatt_db_attribute_read_result(attrib, id, 0, value, 2);
 }
@@ -302,10 +417,12 @@ static bool hr_msrmt_cb(void *user_data)
 		len += 2;
 	}
 
-	bt_gatt_server_send_notification(server->gatt,
-						server->hr_msrmt_handle,
-						pdu, len);
-
+	/* One measurement goes out to every subscribed client */
+	if (!bt_gatt_server_notify_all(server->db, server->hr_msrmt_handle,
+								pdu, len)) {
+		server->hr_timeout_id = 0;
+		return false;
+	}
 
 	cur_ee = server->hr_energy_expended;
 	server->hr_energy_expended = MIN(UINT16_MAX, cur_ee + 10);
@@ -316,12 +433,16 @@ static bool hr_msrmt_cb(void *user_data)
 
 static void update_hr_msrmt_simulation(struct server *server)
 {
-	if (!server->hr_msrmt_enabled || !server->hr_visible) {
+	if (!server->hr_visible) {
 		timeout_remove(server->hr_timeout_id);
+		server->hr_timeout_id = 0;
 		return;
 	}
 
-	server->hr_timeout_id = timeout_add(1000, hr_msrmt_cb, server, NULL);
+	/* Stops by itself once nobody is subscribed anymore */
+	if (!server->hr_timeout_id)
+		server->hr_timeout_id = timeout_add(1000, hr_msrmt_cb, server,
+									NULL);
 }
 
 static void hr_msrmt_ccc_write_cb(struct gatt_db_attribute *attrib,
@@ -330,9 +451,14 @@ static void hr_msrmt_ccc_write_cb(struct gatt_db_attribute *attrib,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data)
 {
-	struct server *server = user_data;
+	struct conn *conn = conn_from_att(user_data, att);
 	uint8_t ecode = 0;
 
+	if (!conn) {
+		ecode = BT_ATT_ERROR_UNLIKELY;
+		goto done;
+	}
+
 	if (!value || len != 2) {
 		ecode = BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN;
 		goto done;
@@ -343,22 +469,22 @@ static void hr_msrmt_ccc_write_cb(struct gatt_db_attribute *attrib,
 		goto done;
 	}
 
-	if (value[0] == 0x00)
-		server->hr_msrmt_enabled = false;
-	else if (value[0] == 0x01) {
-		if (server->hr_msrmt_enabled) {
-			PRLOG("HR Measurement Already Enabled\n");
-			goto done;
-		}
-
-		server->hr_msrmt_enabled = true;
-	} else
+	if (value[0] != 0x00 && value[0] != 0x01) {
 		ecode = 0x80;
+		goto done;
+	}
+
+	if (value[0] && bt_gatt_server_get_ccc(conn->gatt,
+					gatt_db_attribute_get_handle(attrib))) {
+		PRLOG("HR Measurement Already Enabled\n");
+		goto done;
+	}
 
-	PRLOG("HR: Measurement Enabled: %s\n",
-				server->hr_msrmt_enabled ? "true" : "false");
+	PRLOG("Connection %u: HR Measurement Enabled: %s\n", conn->id,
+					value[0] ? "true" : "false");
 
-	update_hr_msrmt_simulation(server);
+	if (value[0])
+		update_hr_msrmt_simulation(conn->server);
 
 done:
 	gatt_db_attribute_write_result(attrib, id, ecode);
@@ -392,153 +518,99 @@ done:
 	gatt_db_attribute_write_result(attrib, id, ecode);
 }
 
-static void confirm_write(struct gatt_db_attribute *attr, int err,
-							void *user_data)
-{
-	if (!err)
-		return;
+/* Values kept in the database, copied only if a client writes them */
+static const uint8_t gap_appearance[] = { 0x80, 0x00 };
+/* Stored so that it is part of the Database Hash */
+static const uint8_t gap_device_name_ext_prop[] = {
+	BT_GATT_CHRC_EXT_PROP_RELIABLE_WRITE, 0x00
+};
+static const uint8_t hr_body_loc[] = { 0x01 };	/* "Chest" */
 
-	fprintf(stderr, "Error caching attribute %p - err: %d\n", attr, err);
-	exit(1);
-}
+/*
+ * The database is a constant table used in place: only the values written
+ * at runtime get allocated. Reads and writes of the dynamic values go
+ * through the callbacks, which all get the server as user data.
+ */
+static const struct gatt_db_attr_def server_db[] = {
+	GATT_DB_PRIMARY_SERVICE(HANDLE_GAP_SVC, UUID_GAP, 6),
+	/* Device Name is longer than the MTU and writable */
+	GATT_DB_CHARACTERISTIC(GATT_CHARAC_DEVICE_NAME,
+				BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+				BT_GATT_CHRC_PROP_READ |
+				BT_GATT_CHRC_PROP_EXT_PROP,
+				gap_device_name_read_cb,
+				gap_device_name_write_cb),
+	GATT_DB_DESCRIPTOR_VALUE(GATT_CHARAC_EXT_PROPER_UUID,
+				BT_ATT_PERM_READ, gap_device_name_ext_prop),
+	GATT_DB_CHARACTERISTIC_VALUE(GATT_CHARAC_APPEARANCE,
+				BT_ATT_PERM_READ, BT_GATT_CHRC_PROP_READ,
+				gap_appearance),
+
+	GATT_DB_PRIMARY_SERVICE(HANDLE_GATT_SVC, UUID_GATT, 6),
+	GATT_DB_CHARACTERISTIC(GATT_CHARAC_SERVICE_CHANGED, BT_ATT_PERM_READ,
+				BT_GATT_CHRC_PROP_READ |
+				BT_GATT_CHRC_PROP_INDICATE,
+				gatt_service_changed_cb, NULL),
+	GATT_DB_DESCRIPTOR(GATT_CLIENT_CHARAC_CFG_UUID,
+				BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+				gatt_svc_chngd_ccc_read_cb,
+				gatt_svc_chngd_ccc_write_cb),
+	/* Lets clients with a cache skip discovery when nothing changed */
+	GATT_DB_CHARACTERISTIC(GATT_CHARAC_DB_HASH, BT_ATT_PERM_READ,
+				BT_GATT_CHRC_PROP_READ,
+				gatt_db_hash_read_cb, NULL),
+
+	GATT_DB_PRIMARY_SERVICE(HANDLE_HR_SVC, UUID_HEART_RATE, 8),
+	GATT_DB_CHARACTERISTIC(UUID_HEART_RATE_MSRMT, BT_ATT_PERM_NONE,
+				BT_GATT_CHRC_PROP_NOTIFY, NULL, NULL),
+	GATT_DB_DESCRIPTOR(GATT_CLIENT_CHARAC_CFG_UUID,
+				BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+				hr_msrmt_ccc_read_cb,
+				hr_msrmt_ccc_write_cb),
+	GATT_DB_CHARACTERISTIC_VALUE(UUID_HEART_RATE_BODY, BT_ATT_PERM_READ,
+				BT_GATT_CHRC_PROP_READ, hr_body_loc),
+	GATT_DB_CHARACTERISTIC(UUID_HEART_RATE_CTRL, BT_ATT_PERM_WRITE,
+				BT_GATT_CHRC_PROP_WRITE,
+				NULL, hr_control_point_write_cb),
+};
 
-static void populate_gap_service(struct server *server)
+static bool populate_db(struct server *server)
 {
-	bt_uuid_t uuid;
-	struct gatt_db_attribute *service, *tmp;
-	uint16_t appearance;
-
-	/* Add the GAP service */
-	bt_uuid16_create(&uuid, UUID_GAP);
-	service = gatt_db_add_service(server->db, &uuid, true, 6);
+	struct gatt_db_attribute *attr;
 
-	/*
-	 * Device Name characteristic. Make the value dynamically read and
-	 * written via callbacks.
-	 */
-	bt_uuid16_create(&uuid, GATT_CHARAC_DEVICE_NAME);
-	gatt_db_service_add_characteristic(service, &uuid,
-					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-					BT_GATT_CHRC_PROP_READ |
-					BT_GATT_CHRC_PROP_EXT_PROP,
-					gap_device_name_read_cb,
-					gap_device_name_write_cb,
-					server);
-
-	bt_uuid16_create(&uuid, GATT_CHARAC_EXT_PROPER_UUID);
-	gatt_db_service_add_descriptor(service, &uuid, BT_ATT_PERM_READ,
-					gap_device_name_ext_prop_read_cb,
-					NULL, server);
+	if (!gatt_db_insert_table(server->db, server_db,
+				sizeof(server_db) / sizeof(server_db[0]),
+				server))
+		return false;
 
-	/*
-	 * Appearance characteristic. Reads and writes should obtain the value
-	 * from the database.
-	 */
-	bt_uuid16_create(&uuid, GATT_CHARAC_APPEARANCE);
-	tmp = gatt_db_service_add_characteristic(service, &uuid,
-							BT_ATT_PERM_READ,
-							BT_GATT_CHRC_PROP_READ,
-							NULL, NULL, server);
+	server->gatt_svc_chngd_handle = HANDLE_SVC_CHNGD;
+	server->gatt_svc_chngd_ccc_handle = HANDLE_SVC_CHNGD_CCC;
+	server->hr_handle = HANDLE_HR_SVC;
+	server->hr_msrmt_handle = HANDLE_HR_MSRMT;
+	server->hr_msrmt_ccc_handle = HANDLE_HR_MSRMT_CCC;
 
 	/*
-	 * Write the appearance value to the database, since we're not using a
-	 * callback.
+	 * Have a long read of the name fetch it from the callback once.
+	 * Writes to it drop the snapshot.
 	 */
-	put_le16(128, &appearance);
-	gatt_db_attribute_write(tmp, 0, (void *) &appearance,
-							sizeof(appearance),
-							BT_ATT_OP_WRITE_REQ,
-							NULL, confirm_write,
-							NULL);
-
-	gatt_db_service_set_active(service, true);
-}
-
-static void populate_gatt_service(struct server *server)
-{
-	bt_uuid_t uuid;
-	struct gatt_db_attribute *service, *svc_chngd;
-
-	/* Add the GATT service */
-	bt_uuid16_create(&uuid, UUID_GATT);
-	service = gatt_db_add_service(server->db, &uuid, true, 4);
-
-	bt_uuid16_create(&uuid, GATT_CHARAC_SERVICE_CHANGED);
-	svc_chngd = gatt_db_service_add_characteristic(service, &uuid,
-			BT_ATT_PERM_READ,
-			BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_INDICATE,
-			gatt_service_changed_cb,
-			NULL, server);
-	server->gatt_svc_chngd_handle = gatt_db_attribute_get_handle(svc_chngd);
-
-	bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
-	gatt_db_service_add_descriptor(service, &uuid,
-				BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-				gatt_svc_chngd_ccc_read_cb,
-				gatt_svc_chngd_ccc_write_cb, server);
-
-	gatt_db_service_set_active(service, true);
-}
+	attr = gatt_db_get_attribute(server->db, HANDLE_DEVICE_NAME);
+	gatt_db_attribute_set_cache(attr, true, 0);
 
-static void populate_hr_service(struct server *server)
-{
-	bt_uuid_t uuid;
-	struct gatt_db_attribute *service, *hr_msrmt, *body;
-	uint8_t body_loc = 1;  /* "Chest" */
-
-	/* Add Heart Rate Service */
-	bt_uuid16_create(&uuid, UUID_HEART_RATE);
-	service = gatt_db_add_service(server->db, &uuid, true, 8);
-	server->hr_handle = gatt_db_attribute_get_handle(service);
-
-	/* HR Measurement Characteristic */
-	bt_uuid16_create(&uuid, UUID_HEART_RATE_MSRMT);
-	hr_msrmt = gatt_db_service_add_characteristic(service, &uuid,
-						BT_ATT_PERM_NONE,
-						BT_GATT_CHRC_PROP_NOTIFY,
-						NULL, NULL, NULL);
-	server->hr_msrmt_handle = gatt_db_attribute_get_handle(hr_msrmt);
-
-	bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
-	gatt_db_service_add_descriptor(service, &uuid,
-					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-					hr_msrmt_ccc_read_cb,
-					hr_msrmt_ccc_write_cb, server);
+	attr = gatt_db_get_attribute(server->db, HANDLE_GAP_SVC);
+	gatt_db_service_set_active(attr, true);
 
-	/*
-	 * Body Sensor Location Characteristic. Make reads obtain the value from
-	 * the database.
-	 */
-	bt_uuid16_create(&uuid, UUID_HEART_RATE_BODY);
-	body = gatt_db_service_add_characteristic(service, &uuid,
-						BT_ATT_PERM_READ,
-						BT_GATT_CHRC_PROP_READ,
-						NULL, NULL, server);
-	gatt_db_attribute_write(body, 0, (void *) &body_loc, sizeof(body_loc),
-							BT_ATT_OP_WRITE_REQ,
-							NULL, confirm_write,
-							NULL);
-
-	/* HR Control Point Characteristic */
-	bt_uuid16_create(&uuid, UUID_HEART_RATE_CTRL);
-	gatt_db_service_add_characteristic(service, &uuid,
-						BT_ATT_PERM_WRITE,
-						BT_GATT_CHRC_PROP_WRITE,
-						NULL, hr_control_point_write_cb,
-						server);
+	attr = gatt_db_get_attribute(server->db, HANDLE_GATT_SVC);
+	gatt_db_service_set_active(attr, true);
 
-	if (server->hr_visible)
-		gatt_db_service_set_active(service, true);
-}
+	if (server->hr_visible) {
+		attr = gatt_db_get_attribute(server->db, HANDLE_HR_SVC);
+		gatt_db_service_set_active(attr, true);
+	}
 
-static void populate_db(struct server *server)
-{
-	populate_gap_service(server);
-	populate_gatt_service(server);
-	populate_hr_service(server);
+	return true;
 }
 
-static struct server *server_create(int fd, uint16_t mtu, bool hr_visible)
+static struct server *server_create(uint16_t mtu, bool hr_visible)
 {
 	struct server *server;
 	size_t name_len = strlen(test_device_name);
@@ -549,22 +621,9 @@ static struct server *server_create(int fd, uint16_t mtu, bool hr_visible)
 		return NULL;
 	}
 
-	server->att = bt_att_new(fd, false);
-	if (!server->att) {
-		fprintf(stderr, "Failed to initialze ATT transport layer\n");
-		goto fail;
-	}
-
-	if (!bt_att_set_close_on_unref(server->att, true)) {
-		fprintf(stderr, "Failed to set up ATT transport layer\n");
-		goto fail;
-	}
-
-	if (!bt_att_register_disconnect(server->att, att_disconnect_cb, NULL,
-									NULL)) {
-		fprintf(stderr, "Failed to set ATT disconnect handler\n");
-		goto fail;
-	}
+	server->listen_fd = -1;
+	server->mtu = mtu;
+	server->conns = queue_new();
 
 	server->name_len = name_len + 1;
 	server->device_name = malloc(name_len + 1);
@@ -576,49 +635,126 @@ static struct server *server_create(int fd, uint16_t mtu, bool hr_visible)
 	memcpy(server->device_name, test_device_name, name_len);
 	server->device_name[name_len] = '\0';
 
-	server->fd = fd;
 	server->db = gatt_db_new();
 	if (!server->db) {
 		fprintf(stderr, "Failed to create GATT database\n");
 		goto fail;
 	}
 
-	server->gatt = bt_gatt_server_new(server->db, server->att, mtu, 0);
-	if (!server->gatt) {
-		fprintf(stderr, "Failed to create GATT server\n");
-		goto fail;
-	}
-
 	server->hr_visible = hr_visible;
 
-	if (verbose) {
-		bt_att_set_debug(server->att, att_debug_cb, "att: ", NULL);
-		bt_gatt_server_set_debug(server->gatt, gatt_debug_cb,
-							"server: ", NULL);
-	}
-
 	/* Random seed for generating fake Heart Rate measurements */
 	srand(time(NULL));
 
-	/* bt_gatt_server already holds a reference */
-	populate_db(server);
+	if (!populate_db(server)) {
+		fprintf(stderr, "Failed to populate GATT database\n");
+		goto fail;
+	}
 
 	return server;
 
 fail:
 	gatt_db_unref(server->db);
+	queue_destroy(server->conns, NULL);
 	free(server->device_name);
-	bt_att_unref(server->att);
 	free(server);
 
 	return NULL;
 }
 
+static bool remote_counter(uint32_t *sign_cnt, void *user_data);
+
+static struct conn *conn_create(struct server *server, int fd,
+						const bdaddr_t *bdaddr)
+{
+	struct conn *conn;
+
+	conn = new0(struct conn, 1);
+	conn->server = server;
+	conn->id = ++server->next_conn_id;
+
+	if (bdaddr) {
+		bacpy(&conn->bdaddr, bdaddr);
+		ba2str(bdaddr, conn->addr);
+	} else
+		strcpy(conn->addr, "local");
+
+	conn->att = bt_att_new(fd, false);
+	if (!conn->att) {
+		fprintf(stderr, "Failed to initialze ATT transport layer\n");
+		close(fd);
+		goto fail;
+	}
+
+	if (!bt_att_set_close_on_unref(conn->att, true)) {
+		fprintf(stderr, "Failed to set up ATT transport layer\n");
+		close(fd);
+		goto fail;
+	}
+
+	if (trace_path && !bt_att_set_trace(conn->att, TRACE_MAX_PDUS, 0))
+		fprintf(stderr, "Failed to enable PDU capture\n");
+
+	if (!bt_att_register_disconnect(conn->att, att_disconnect_cb, conn,
+									NULL)) {
+		fprintf(stderr, "Failed to set ATT disconnect handler\n");
+		goto fail;
+	}
+
+	if (server->has_sign_key)
+		bt_att_set_remote_key(conn->att, server->sign_key,
+							remote_counter, conn);
+
+	/* Every connection is served from the shared database */
+	conn->gatt = bt_gatt_server_new(server->db, conn->att, server->mtu, 0);
+	if (!conn->gatt) {
+		fprintf(stderr, "Failed to create GATT server\n");
+		goto fail;
+	}
+
+	if (verbose) {
+		bt_att_set_debug(conn->att, att_debug_cb, "att: ", NULL);
+		bt_gatt_server_set_debug(conn->gatt, gatt_debug_cb,
+							"server: ", NULL);
+	}
+
+	return conn;
+
+fail:
+	bt_att_unref(conn->att);
+	free(conn);
+
+	return NULL;
+}
+
+static void conn_destroy(void *data)
+{
+	struct conn *conn = data;
+
+	if (conn->server->hci) {
+		bt_hci_unregister(conn->server->hci, conn->data_length_id);
+		bt_hci_unregister(conn->server->hci, conn->phy_id);
+		bt_hci_unregister(conn->server->hci, conn->conn_params_id);
+	}
+
+	bt_gatt_server_unref(conn->gatt);
+	bt_att_unref(conn->att);
+	free(conn);
+}
+
 static void server_destroy(struct server *server)
 {
+	if (server->listen_fd >= 0) {
+		mainloop_remove_fd(server->listen_fd);
+		close(server->listen_fd);
+	}
+
 	timeout_remove(server->hr_timeout_id);
-	bt_gatt_server_unref(server->gatt);
+	queue_destroy(server->conns, conn_destroy);
+	bt_hci_unref(server->hci);
 	gatt_db_unref(server->db);
+	free(server->device_name);
+	free(server);
 }
 
 static void usage(void)
@@ -634,6 +770,15 @@ static void usage(void)
 		"\t-t, --type [random|public] \t The source address type\n"
 		"\t-v, --verbose\t\t\tEnable extra logging\n"
 		"\t-r, --heart-rate\t\tEnable Heart Rate service\n"
+		"\t-e, --eatt\t\t\tAccept Enhanced ATT channels\n"
+		"\t-P, --throughput\t\tTune each link for throughput:\n"
+		"\t\t\t\t\tlargest MTU and data length, 2M\n"
+		"\t\t\t\t\tPHY, short connection interval\n"
+		"\t-U, --unix <path>\t\tListen on a local socket instead\n"
+		"\t\t\t\t\tof L2CAP, for testing\n"
+		"\t-T, --trace <file>\t\tCapture PDUs, saved in btsnoop\n"
+		"\t\t\t\t\tformat as <file>.<connection> on\n"
+		"\t\t\t\t\tSIGUSR1 and on disconnect\n"
 		"\t-h, --help\t\t\tDisplay help\n");
 }
 
@@ -644,20 +789,22 @@ static struct option main_options[] = {
 	{ "type",		1, 0, 't' },
 	{ "verbose",		0, 0, 'v' },
 	{ "heart-rate",		0, 0, 'r' },
+	{ "eatt",		0, 0, 'e' },
+	{ "throughput",		0, 0, 'P' },
+	{ "unix",		1, 0, 'U' },
+	{ "trace",		1, 0, 'T' },
 	{ "help",		0, 0, 'h' },
 	{ }
 };
 
-static int l2cap_le_att_listen_and_accept(bdaddr_t *src, int sec,
-							uint8_t src_type)
+static int l2cap_le_att_listen(bdaddr_t *src, int sec, uint8_t src_type)
 {
-	int sk, nsk;
-	struct sockaddr_l2 srcaddr, addr;
-	socklen_t optlen;
+	int sk;
+	struct sockaddr_l2 srcaddr;
 	struct bt_security btsec;
-	char ba[18];
 
-	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK |
+						SOCK_CLOEXEC, BTPROTO_L2CAP);
 	if (sk < 0) {
 		perror("Failed to create L2CAP socket");
 		return -1;
@@ -675,7 +822,7 @@ static int l2cap_le_att_listen_and_accept(bdaddr_t *src, int sec,
 		goto fail;
 	}
 
-	/* Set the security level */
+	/* Set the security level, inherited by every accepted socket */
 	memset(&btsec, 0, sizeof(btsec));
 	btsec.level = sec;
 	if (setsockopt(sk, SOL_BLUETOOTH, BT_SECURITY, &btsec,
@@ -684,43 +831,351 @@ static int l2cap_le_att_listen_and_accept(bdaddr_t *src, int sec,
 		goto fail;
 	}
 
-	if (listen(sk, 10) < 0) {
+	if (listen(sk, LISTEN_BACKLOG) < 0) {
 		perror("Listening on socket failed");
 		goto fail;
 	}
 
 	printf("Started listening on ATT channel. Waiting for connections\n");
 
+	return sk;
+
+fail:
+	close(sk);
+	return -1;
+}
+
+static int unix_listen(const char *path)
+{
+	int sk;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk < 0) {
+		perror("Failed to create local socket");
+		return -1;
+	}
+
 	memset(&addr, 0, sizeof(addr));
-	optlen = sizeof(addr);
-	nsk = accept(sk, (struct sockaddr *) &addr, &optlen);
-	if (nsk < 0) {
-		perror("Accept failed");
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Failed to bind local socket");
 		goto fail;
 	}
 
-	ba2str(&addr.l2_bdaddr, ba);
-	printf("Connect from %s\n", ba);
+	if (listen(sk, LISTEN_BACKLOG) < 0) {
+		perror("Listening on socket failed");
+		goto fail;
+	}
+
+	printf("Started listening on %s. Waiting for connections\n", path);
+
+	return sk;
+
+fail:
 	close(sk);
+	return -1;
+}
 
-	return nsk;
+static const char *phy_to_str(uint8_t phy)
+{
+	switch (phy) {
+	case LE_PHY_1M:
+		return "1M";
+	case LE_PHY_2M:
+		return "2M";
+	case LE_PHY_CODED:
+		return "Coded";
+	default:
+		return "unknown";
+	}
+}
+
+static void data_length_cb(uint8_t status, uint16_t tx_octets,
+					uint16_t tx_time, uint16_t rx_octets,
+					uint16_t rx_time, void *user_data)
+{
+	struct conn *conn = user_data;
+
+	conn->data_length_id = 0;
+
+	if (status) {
+		PRLOG("Connection %u: data length update failed: 0x%02x\n",
+							conn->id, status);
+		return;
+	}
+
+	if (!tx_octets) {
+		PRLOG("Connection %u: data length unchanged\n", conn->id);
+		return;
+	}
+
+	conn->tx_octets = tx_octets;
+	conn->rx_octets = rx_octets;
+
+	PRLOG("Connection %u: data length tx %u octets/%u us, "
+					"rx %u octets/%u us\n", conn->id,
+					tx_octets, tx_time, rx_octets, rx_time);
+}
+
+static void phy_cb(uint8_t status, uint8_t tx_phy, uint8_t rx_phy,
+							void *user_data)
+{
+	struct conn *conn = user_data;
+
+	conn->phy_id = 0;
+
+	if (status) {
+		PRLOG("Connection %u: PHY update failed: 0x%02x\n", conn->id,
+									status);
+		return;
+	}
+
+	conn->tx_phy = tx_phy;
+	conn->rx_phy = rx_phy;
+
+	PRLOG("Connection %u: PHY tx %s, rx %s\n", conn->id,
+				phy_to_str(tx_phy), phy_to_str(rx_phy));
+}
+
+static void conn_params_cb(uint8_t status, uint16_t interval,
+					uint16_t latency, uint16_t supv_timeout,
+					void *user_data)
+{
+	struct conn *conn = user_data;
+
+	conn->conn_params_id = 0;
+
+	if (status) {
+		PRLOG("Connection %u: connection update failed: 0x%02x\n",
+							conn->id, status);
+		return;
+	}
+
+	if (!interval) {
+		PRLOG("Connection %u: connection parameters unchanged\n",
+								conn->id);
+		return;
+	}
+
+	conn->interval = interval;
+
+	PRLOG("Connection %u: interval %u.%02u ms, latency %u, "
+				"supervision timeout %u ms\n", conn->id,
+				interval * 125 / 100, interval * 125 % 100,
+				latency, supv_timeout * 10);
+}
+
+/*
+ * Ask for the largest link layer PDUs, the 2M PHY and a short connection
+ * interval, so that a large ATT MTU is not split into 27 octet fragments
+ * sent a few per interval. As peripheral the connection update goes
+ * through the Connection Parameters Request procedure.
+ */
+static void apply_throughput(struct conn *conn, int fd)
+{
+	struct bt_hci *hci = conn->server->hci;
+	struct l2cap_conninfo info;
+	socklen_t len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, SOL_L2CAP, L2CAP_CONNINFO, &info, &len) < 0) {
+		perror("Failed to get connection handle");
+		return;
+	}
+
+	conn->handle = info.hci_handle;
+
+	conn->data_length_id = bt_hci_le_set_data_length(hci, conn->handle,
+					THROUGHPUT_TX_OCTETS, THROUGHPUT_TX_TIME,
+					data_length_cb, conn, NULL);
+	conn->phy_id = bt_hci_le_set_phy(hci, conn->handle, 0, LE_PHYS_2M,
+					LE_PHYS_2M, 0, phy_cb, conn, NULL);
+	conn->conn_params_id = bt_hci_le_update_conn(hci, conn->handle,
+					THROUGHPUT_MIN_INTERVAL,
+					THROUGHPUT_MAX_INTERVAL,
+					THROUGHPUT_LATENCY,
+					THROUGHPUT_SUPV_TIMEOUT,
+					conn_params_cb, conn, NULL);
+
+	if (!conn->data_length_id || !conn->phy_id || !conn->conn_params_id)
+		fprintf(stderr, "Failed to request link tuning\n");
+}
+
+static void accept_cb(int fd, uint32_t events, void *user_data)
+{
+	struct server *server = user_data;
+	struct sockaddr_l2 addr;
+	socklen_t optlen;
+	struct conn *conn;
+	int nsk;
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		fprintf(stderr, "Listening socket failed\n");
+		mainloop_quit();
+		return;
+	}
+
+	/* Drain the backlog so a burst of connects costs one wakeup */
+	while (1) {
+		memset(&addr, 0, sizeof(addr));
+		optlen = sizeof(addr);
+		nsk = accept4(fd, (struct sockaddr *) &addr, &optlen,
+								SOCK_CLOEXEC);
+		if (nsk < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+							errno != EINTR)
+				perror("Accept failed");
+			return;
+		}
+
+		conn = conn_create(server, nsk,
+				addr.l2_family == AF_BLUETOOTH ?
+						&addr.l2_bdaddr : NULL);
+		if (!conn)
+			continue;
+
+		queue_push_tail(server->conns, conn);
+
+		PRLOG("Connection %u from %s, %u connection(s)\n", conn->id,
+					conn->addr, queue_length(server->conns));
+
+		if (server->hci && addr.l2_family == AF_BLUETOOTH)
+			apply_throughput(conn, nsk);
+	}
+}
+
+static int l2cap_le_eatt_listen(bdaddr_t *src, int sec, uint8_t src_type)
+{
+	int sk;
+	struct sockaddr_l2 srcaddr;
+	struct bt_security btsec;
+	uint8_t mode = BT_MODE_EXT_FLOWCTL;
+
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK,
+								BTPROTO_L2CAP);
+	if (sk < 0) {
+		perror("Failed to create EATT socket");
+		return -1;
+	}
+
+	memset(&srcaddr, 0, sizeof(srcaddr));
+	srcaddr.l2_family = AF_BLUETOOTH;
+	srcaddr.l2_psm = htobs(BT_ATT_EATT_PSM);
+	srcaddr.l2_bdaddr_type = src_type;
+	bacpy(&srcaddr.l2_bdaddr, src);
+
+	if (bind(sk, (struct sockaddr *) &srcaddr, sizeof(srcaddr)) < 0) {
+		perror("Failed to bind EATT socket");
+		goto fail;
+	}
+
+	memset(&btsec, 0, sizeof(btsec));
+	btsec.level = sec;
+	if (setsockopt(sk, SOL_BLUETOOTH, BT_SECURITY, &btsec,
+							sizeof(btsec)) != 0) {
+		fprintf(stderr, "Failed to set EATT security level\n");
+		goto fail;
+	}
+
+	if (setsockopt(sk, SOL_BLUETOOTH, BT_MODE, &mode, sizeof(mode)) != 0) {
+		perror("Failed to enable enhanced credit based mode");
+		goto fail;
+	}
+
+	if (listen(sk, 10) < 0) {
+		perror("Listening on EATT socket failed");
+		goto fail;
+	}
+
+	return sk;
 
 fail:
 	close(sk);
 	return -1;
 }
 
+static bool match_conn_bdaddr(const void *a, const void *b)
+{
+	const struct conn *conn = a;
+
+	return !bacmp(&conn->bdaddr, b);
+}
+
+static void eatt_accept_cb(int fd, uint32_t events, void *user_data)
+{
+	struct server *server = user_data;
+	struct sockaddr_l2 addr;
+	socklen_t optlen;
+	struct conn *conn;
+	int nsk;
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		mainloop_remove_fd(fd);
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	optlen = sizeof(addr);
+	nsk = accept(fd, (struct sockaddr *) &addr, &optlen);
+	if (nsk < 0)
+		return;
+
+	/* Enhanced channels join the bearer of the same peer */
+	conn = queue_find(server->conns, match_conn_bdaddr, &addr.l2_bdaddr);
+	if (!conn || !bt_att_attach_fd(conn->att, nsk)) {
+		fprintf(stderr, "Failed to attach EATT channel\n");
+		close(nsk);
+		return;
+	}
+
+	if (verbose)
+		printf("Connection %u: EATT channel attached, %u bearer(s)\n",
+					conn->id, bt_att_get_channels(conn->att));
+}
+
+static struct conn *find_conn(struct server *server, const char *str)
+{
+	struct conn *conn;
+	char *endptr = NULL;
+	unsigned long id;
+
+	id = strtoul(str, &endptr, 0);
+	if (!endptr || *endptr != '\0' || !id) {
+		printf("Invalid connection: %s\n", str);
+		return NULL;
+	}
+
+	conn = queue_find(server->conns, match_conn_id, UINT_TO_PTR(id));
+	if (!conn)
+		printf("No connection %lu\n", id);
+
+	return conn;
+}
+
 static void notify_usage(void)
 {
 	printf("Usage: notify [options] <value_handle> <value>\n"
-					"Options:\n"
-					"\t -i, --indicate\tSend indication\n"
-					"e.g.:\n"
-					"\tnotify 0x0001 00 01 00\n");
+				"Options:\n"
+				"\t -i, --indicate\tSend indication\n"
+				"\t -c, --conn <id>\tOnly to this connection,\n"
+				"\t\t\t\tdefault is all of them\n"
+				"e.g.:\n"
+				"\tnotify 0x0001 00 01 00\n");
 }
 
 static struct option notify_options[] = {
 	{ "indicate",	0, 0, 'i' },
+	{ "conn",	1, 0, 'c' },
 	{ }
 };
 
@@ -758,6 +1213,8 @@ static void cmd_notify(struct server *server, char *cmd_str)
 	int length;
 	uint8_t *value = NULL;
 	bool indicate = false;
+	struct conn *only = NULL;
+	const struct queue_entry *entry;
 
 	if (!parse_args(cmd_str, 514, argv + 1, &argc)) {
 		printf("Too many arguments\n");
@@ -767,12 +1224,17 @@ static void cmd_notify(struct server *server, char *cmd_str)
 
 	optind = 0;
 	argv[0] = "notify";
-	while ((opt = getopt_long(argc, argv, "+i", notify_options,
+	while ((opt = getopt_long(argc, argv, "+ic:", notify_options,
 								NULL)) != -1) {
 		switch (opt) {
 		case 'i':
 			indicate = true;
 			break;
+		case 'c':
+			only = find_conn(server, optarg);
+			if (!only)
+				return;
+			break;
 		default:
 			notify_usage();
 			return;
@@ -824,14 +1286,24 @@ static void cmd_notify(struct server *server, char *cmd_str)
 		}
 	}
 
-	if (indicate) {
-		if (!bt_gatt_server_send_indication(server->gatt, handle,
+	for (entry = queue_get_entries(server->conns); entry;
+							entry = entry->next) {
+		struct conn *conn = entry->data;
+
+		if (only && conn != only)
+			continue;
+
+		if (indicate) {
+			if (!bt_gatt_server_send_indication(conn->gatt, handle,
 							value, length,
 							conf_cb, NULL, NULL))
-			printf("Failed to initiate indication\n");
-	} else if (!bt_gatt_server_send_notification(server->gatt, handle,
-								value, length))
-		printf("Failed to initiate notification\n");
+				printf("Connection %u: Failed to initiate "
+						"indication\n", conn->id);
+		} else if (!bt_gatt_server_send_notification(conn->gatt,
+							handle, value, length))
+			printf("Connection %u: Failed to initiate "
+						"notification\n", conn->id);
+	}
 
 done:
 	free(value);
@@ -847,6 +1319,7 @@ static void cmd_heart_rate(struct server *server, char *cmd_str)
 	bool enable;
 	uint8_t pdu[4];
 	struct gatt_db_attribute *attr;
+	unsigned int count;
 
 	if (!cmd_str) {
 		heart_rate_usage();
@@ -871,20 +1344,18 @@ static void cmd_heart_rate(struct server *server, char *cmd_str)
 	server->hr_visible = enable;
 	attr = gatt_db_get_attribute(server->db, server->hr_handle);
 	gatt_db_service_set_active(attr, server->hr_visible);
-	update_hr_msrmt_simulation(server);
 
-	if (!server->svc_chngd_enabled)
-		return;
+	update_hr_msrmt_simulation(server);
 
 	put_le16(server->hr_handle, pdu);
 	put_le16(server->hr_handle + 7, pdu + 2);
 
-	server->hr_msrmt_enabled = false;
-	update_hr_msrmt_simulation(server);
-
-	bt_gatt_server_send_indication(server->gatt,
+	/* The database is shared, so every client sees the change */
+	count = bt_gatt_server_notify_all(server->db,
 						server->gatt_svc_chngd_handle,
-						pdu, 4, conf_cb, NULL, NULL);
+						pdu, 4);
+
+	printf("Service Changed indicated to %u client(s)\n", count);
 }
 
 static void print_uuid(const bt_uuid_t *uuid)
@@ -1005,16 +1476,23 @@ static void set_sign_key_usage(void)
 
 static bool remote_counter(uint32_t *sign_cnt, void *user_data)
 {
-	static uint32_t cnt = 0;
+	struct conn *conn = user_data;
 
-	if (*sign_cnt < cnt)
+	if (*sign_cnt < conn->sign_cnt)
 		return false;
 
-	cnt = *sign_cnt;
+	conn->sign_cnt = *sign_cnt;
 
 	return true;
 }
 
+static void set_remote_key(void *data, void *user_data)
+{
+	struct conn *conn = data;
+
+	bt_att_set_remote_key(conn->att, user_data, remote_counter, conn);
+}
+
 static void cmd_set_sign_key(struct server *server, char *cmd_str)
 {
 	char *argv[3];
@@ -1034,13 +1512,119 @@ static void cmd_set_sign_key(struct server *server, char *cmd_str)
 	}
 
 	if (!strcmp(argv[0], "-c") || !strcmp(argv[0], "--sign-key")) {
-		if (convert_sign_key(argv[1], key))
-			bt_att_set_remote_key(server->att, key, remote_counter,
-									server);
+		if (!convert_sign_key(argv[1], key))
+			return;
+
+		/* Used for current connections and for later ones */
+		memcpy(server->sign_key, key, 16);
+		server->has_sign_key = true;
+		queue_foreach(server->conns, set_remote_key, server->sign_key);
 	} else
 		set_sign_key_usage();
 }
 
+static void stats_usage(void)
+{
+	printf("Usage: stats [-r] [connection]\nOptions:\n"
+		"\t -r, --reset\tReset the counters after printing\n");
+}
+
+static void print_stats_line(const char *str, void *user_data)
+{
+	printf("%s\n", str);
+}
+
+static void print_conn_stats(struct conn *conn, bool reset)
+{
+	printf("ATT statistics for connection %u (%s):\n", conn->id,
+								conn->addr);
+
+	if (!bt_att_print_stats(conn->att, print_stats_line, NULL)) {
+		printf("Failed to get ATT statistics\n");
+		return;
+	}
+
+	if (reset)
+		bt_att_reset_stats(conn->att);
+}
+
+static void cmd_stats(struct server *server, char *cmd_str)
+{
+	char *argv[3];
+	int argc = 0;
+	const struct queue_entry *entry;
+	struct conn *only = NULL;
+	bool reset = false;
+	int i;
+
+	if (!parse_args(cmd_str, 2, argv, &argc)) {
+		stats_usage();
+		return;
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--reset"))
+			reset = true;
+		else if (!only) {
+			only = find_conn(server, argv[i]);
+			if (!only)
+				return;
+		} else {
+			stats_usage();
+			return;
+		}
+	}
+
+	if (only) {
+		print_conn_stats(only, reset);
+		return;
+	}
+
+	for (entry = queue_get_entries(server->conns); entry;
+							entry = entry->next)
+		print_conn_stats(entry->data, reset);
+}
+
+static void print_conn(void *data, void *user_data)
+{
+	struct conn *conn = data;
+	struct server *server = conn->server;
+	uint8_t enc_size = 0;
+	uint16_t svc_chngd, hr_msrmt;
+	int sec;
+
+	sec = bt_att_get_security(conn->att, &enc_size);
+	svc_chngd = bt_gatt_server_get_ccc(conn->gatt,
+					server->gatt_svc_chngd_ccc_handle);
+	hr_msrmt = bt_gatt_server_get_ccc(conn->gatt,
+					server->hr_msrmt_ccc_handle);
+
+	printf("\t%u\t%s\tmtu %u\tsecurity %d\tbearers %u%s%s\n",
+					conn->id, conn->addr,
+					bt_att_get_mtu(conn->att), sec,
+					bt_att_get_channels(conn->att),
+					svc_chngd ? "\tsvc-chngd" : "",
+					hr_msrmt ? "\thr-msrmt" : "");
+
+	if (conn->tx_octets)
+		printf("\t\tdata length tx %u rx %u octets\n",
+					conn->tx_octets, conn->rx_octets);
+
+	if (conn->tx_phy)
+		printf("\t\tPHY tx %s rx %s\n", phy_to_str(conn->tx_phy),
+						phy_to_str(conn->rx_phy));
+
+	if (conn->interval)
+		printf("\t\tinterval %u.%02u ms\n", conn->interval * 125 / 100,
+						conn->interval * 125 % 100);
+}
+
+static void cmd_connections(struct server *server, char *cmd_str)
+{
+	printf("%u connection(s)\n", queue_length(server->conns));
+	queue_foreach(server->conns, print_conn, NULL);
+}
+
 static void cmd_help(struct server *server, char *cmd_str);
 
 typedef void (*command_func_t)(struct server *server, char *cmd_str);
@@ -1056,6 +1640,8 @@ static struct {
 	{ "services", cmd_services, "\tEnumerate all services" },
 	{ "set-sign-key", cmd_set_sign_key,
 			"\tSet remote signing key for signed write command"},
+	{ "stats", cmd_stats, "\tShow ATT statistics and latencies" },
+	{ "connections", cmd_connections, "List connected clients" },
 	{ }
 };
 
@@ -1118,13 +1704,38 @@ failed:
 	free(line);
 }
 
+static void dump_trace(struct conn *conn)
+{
+	char path[PATH_MAX];
+
+	if (!trace_path)
+		return;
+
+	snprintf(path, sizeof(path), "%s.%u", trace_path, conn->id);
+
+	if (bt_att_dump_trace_file(conn->att, path))
+		printf("Trace written to %s\n", path);
+	else
+		fprintf(stderr, "Failed to write trace to %s\n", path);
+}
+
+static void dump_conn_trace(void *data, void *user_data)
+{
+	dump_trace(data);
+}
+
 static void signal_cb(int signum, void *user_data)
 {
+	struct server *server = user_data;
+
 	switch (signum) {
 	case SIGINT:
 	case SIGTERM:
 		mainloop_quit();
 		break;
+	case SIGUSR1:
+		queue_foreach(server->conns, dump_conn_trace, NULL);
+		break;
 	default:
 		break;
 	}
@@ -1135,15 +1746,18 @@ int main(int argc, char *argv[])
 	int opt;
 	bdaddr_t src_addr;
 	int dev_id = -1;
-	int fd;
+	const char *unix_path = NULL;
 	int sec = BT_SECURITY_LOW;
 	uint8_t src_type = BDADDR_LE_PUBLIC;
 	uint16_t mtu = 0;
 	sigset_t mask;
 	bool hr_visible = false;
+	bool eatt = false;
+	bool throughput = false;
+	int eatt_sk = -1;
 	struct server *server;
 
-	while ((opt = getopt_long(argc, argv, "+hvrs:t:m:i:",
+	while ((opt = getopt_long(argc, argv, "+hvrs:t:m:i:ePU:T:",
 						main_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
@@ -1152,9 +1766,21 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose = true;
 			break;
+		case 'T':
+			trace_path = optarg;
+			break;
 		case 'r':
 			hr_visible = true;
 			break;
+		case 'e':
+			eatt = true;
+			break;
+		case 'P':
+			throughput = true;
+			break;
+		case 'U':
+			unix_path = optarg;
+			break;
 		case 's':
 			if (strcmp(optarg, "low") == 0)
 				sec = BT_SECURITY_LOW;
@@ -1225,17 +1851,37 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	fd = l2cap_le_att_listen_and_accept(&src_addr, sec, src_type);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to accept L2CAP ATT connection\n");
+	if (throughput && !mtu)
+		mtu = BT_ATT_MAX_LE_MTU;
+
+	mainloop_init();
+
+	server = server_create(mtu, hr_visible);
+	if (!server)
 		return EXIT_FAILURE;
+
+	if (throughput && !unix_path) {
+		if (dev_id < 0)
+			dev_id = hci_get_route(NULL);
+
+		server->hci = dev_id < 0 ? NULL :
+					bt_hci_new_raw_device(dev_id);
+		if (!server->hci)
+			perror("Link tuning not available");
 	}
 
-	mainloop_init();
+	if (unix_path)
+		server->listen_fd = unix_listen(unix_path);
+	else
+		server->listen_fd = l2cap_le_att_listen(&src_addr, sec,
+								src_type);
+
+	if (server->listen_fd < 0 || mainloop_add_fd(server->listen_fd,
+						EPOLLIN, accept_cb, server,
+						NULL) < 0) {
+		fprintf(stderr, "Failed to listen for ATT connections\n");
+		server_destroy(server);
 
-	server = server_create(fd, mtu, hr_visible);
-	if (!server) {
-		close(fd);
 		return EXIT_FAILURE;
 	}
 
@@ -1248,13 +1894,22 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (eatt && !unix_path) {
+		eatt_sk = l2cap_le_eatt_listen(&src_addr, sec, src_type);
+		if (eatt_sk < 0 || mainloop_add_fd(eatt_sk, EPOLLIN,
+						eatt_accept_cb, server,
+						NULL) < 0)
+			fprintf(stderr, "Enhanced ATT not available\n");
+	}
+
 	printf("Running GATT server\n");
 
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
 
-	mainloop_set_signal(&mask, signal_cb, NULL, NULL);
+	mainloop_set_signal(&mask, signal_cb, server, NULL);
 
 	print_prompt();
 
@@ -1262,7 +1917,17 @@ int main(int argc, char *argv[])
 
 	printf("\n\nShutting down...\n");
 
+	queue_foreach(server->conns, dump_conn_trace, NULL);
+
+	if (eatt_sk >= 0) {
+		mainloop_remove_fd(eatt_sk);
+		close(eatt_sk);
+	}
+
 	server_destroy(server);
 
+	if (unix_path)
+		unlink(unix_path);
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,880 @@
+/*
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+
+#include "src/shared/mainloop.h"
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-server.h"
+#include "src/shared/gatt-client.h"
+
+#define DEFAULT_ITERATIONS	10000
+#define DEFAULT_NOTIFICATIONS	200000
+#define DEFAULT_NUM_SERVICES	200
+#define DEFAULT_NUM_CHRCS	10
+
+#define NOTIFY_WINDOW		64
+#define NOTIFY_HIGH_WATERMARK	32
+#define NOTIFY_LOW_WATERMARK	8
+#define LONG_VALUE_LEN		512
+#define LONG_WRITE_WINDOW	4
+
+#define UUID_BENCH_SERVICE	0xfff0
+#define UUID_BENCH_VALUE	0xfff1
+#define UUID_BENCH_LONG		0xfff2
+#define UUID_BENCH_NOTIFY	0xfff3
+#define UUID_BENCH_INDICATE	0xfff4
+
+static const uint16_t long_mtus[] = { 23, 185, 247, 517 };
+
+typedef void (*bench_func_t)(void);
+
+struct bench_conn {
+	struct mainloop *loop;
+	bench_func_t start;		/* Workload to run once discovered */
+	uint64_t start_ns;
+	uint64_t discovery_ns;
+	uint64_t work_ns;
+	uint64_t end_ns;
+	struct bt_att *server_att;
+	struct bt_att *client_att;
+	struct bt_gatt_server *server;
+	struct bt_gatt_client *client;
+	struct gatt_db *client_db;
+	bool ready;
+};
+
+static struct bench_conn conn;
+
+static uint16_t value_handle;
+static uint16_t long_handle;
+static uint16_t notify_handle;
+static uint16_t indicate_handle;
+
+static uint8_t long_value[LONG_VALUE_LEN];
+static uint8_t read_buf[LONG_VALUE_LEN];
+static int long_fd = -1;
+
+/* State of the workload being run */
+static unsigned int iterations;
+static unsigned int completed;
+static unsigned int sent;
+static bool failed;
+static bool flow_control;
+
+static void usage(void)
+{
+	printf("gatt-bench\n");
+	printf("Usage:\n\tgatt-bench [options]\n");
+
+	printf("Options:\n"
+		"\t-n, --iterations <count>\tOperations per test "
+							"(default: %d)\n"
+		"\t-N, --notifications <count>\tNotifications to send "
+							"(default: %d)\n"
+		"\t-s, --services <count>\tServices in the discovery test "
+							"(default: %d)\n"
+		"\t-c, --chrcs <count>\tCharacteristics per service "
+							"(default: %d)\n"
+		"\t-h, --help\t\tDisplay help\n",
+		DEFAULT_ITERATIONS, DEFAULT_NOTIFICATIONS,
+		DEFAULT_NUM_SERVICES, DEFAULT_NUM_CHRCS);
+}
+
+static struct option main_options[] = {
+	{ "iterations",		1, 0, 'n' },
+	{ "notifications",	1, 0, 'N' },
+	{ "services",		1, 0, 's' },
+	{ "chrcs",		1, 0, 'c' },
+	{ "help",		0, 0, 'h' },
+	{ }
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_done(void)
+{
+	conn.end_ns = now_nsec();
+	mainloop_loop_quit(conn.loop);
+}
+
+static void bench_fail(const char *what, uint8_t ecode)
+{
+	fprintf(stderr, "%s failed: 0x%02x\n", what, ecode);
+	failed = true;
+	bench_done();
+}
+
+static void write_cb(struct gatt_db_attribute *attrib, int err,
+							void *user_data)
+{
+}
+
+static struct gatt_db_attribute *add_chrc(struct gatt_db_attribute *service,
+						uint16_t uuid16, uint8_t props,
+						const uint8_t *value,
+						size_t len)
+{
+	struct gatt_db_attribute *attrib;
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, uuid16);
+	attrib = gatt_db_service_add_characteristic(service, &uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					props, NULL, NULL, NULL);
+	if (attrib && len)
+		gatt_db_attribute_write(attrib, 0, value, len, 0, NULL,
+							write_cb, NULL);
+
+	return attrib;
+}
+
+static void add_ccc(struct gatt_db_attribute *service)
+{
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+	gatt_db_service_add_descriptor(service, &uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					NULL, NULL, NULL);
+}
+
+static struct gatt_db *create_bench_db(void)
+{
+	struct gatt_db *db;
+	struct gatt_db_attribute *service, *attrib;
+	uint8_t value[4] = { 0 };
+	bt_uuid_t uuid;
+
+	db = gatt_db_new();
+
+	bt_uuid16_create(&uuid, UUID_BENCH_SERVICE);
+	service = gatt_db_add_service(db, &uuid, true, 11);
+
+	attrib = add_chrc(service, UUID_BENCH_VALUE,
+					BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_WRITE,
+					value, sizeof(value));
+	value_handle = gatt_db_attribute_get_handle(attrib);
+
+	attrib = add_chrc(service, UUID_BENCH_LONG,
+					BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_WRITE,
+					long_value, sizeof(long_value));
+	long_handle = gatt_db_attribute_get_handle(attrib);
+
+	attrib = add_chrc(service, UUID_BENCH_NOTIFY,
+					BT_GATT_CHRC_PROP_NOTIFY, NULL, 0);
+	notify_handle = gatt_db_attribute_get_handle(attrib);
+	add_ccc(service);
+
+	attrib = add_chrc(service, UUID_BENCH_INDICATE,
+					BT_GATT_CHRC_PROP_INDICATE, NULL, 0);
+	indicate_handle = gatt_db_attribute_get_handle(attrib);
+	add_ccc(service);
+
+	gatt_db_service_set_active(service, true);
+
+	return db;
+}
+
+static struct gatt_db *create_large_db(int num_services, int num_chrcs)
+{
+	struct gatt_db *db;
+	struct gatt_db_attribute *service;
+	bt_uuid_t uuid;
+	int i, j;
+
+	db = gatt_db_new();
+
+	for (i = 0; i < num_services; i++) {
+		bt_uuid16_create(&uuid, 0x1800 + i);
+
+		/* Declaration, plus value and CCC for every characteristic */
+		service = gatt_db_add_service(db, &uuid, true,
+							1 + num_chrcs * 3);
+		if (!service)
+			break;
+
+		for (j = 0; j < num_chrcs; j++) {
+			add_chrc(service, 0x2a00 + j, BT_GATT_CHRC_PROP_READ |
+						BT_GATT_CHRC_PROP_NOTIFY,
+						NULL, 0);
+			add_ccc(service);
+		}
+
+		gatt_db_service_set_active(service, true);
+	}
+
+	return db;
+}
+
+static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	if (!success) {
+		bench_fail("Discovery", att_ecode);
+		return;
+	}
+
+	conn.ready = true;
+	conn.discovery_ns = now_nsec() - conn.start_ns;
+
+	if (conn.start)
+		conn.start();
+	else
+		bench_done();
+}
+
+static void conn_close(void)
+{
+	bt_gatt_client_unref(conn.client);
+	bt_gatt_server_unref(conn.server);
+	bt_att_unref(conn.client_att);
+	bt_att_unref(conn.server_att);
+	gatt_db_unref(conn.client_db);
+
+	mainloop_set_current(mainloop_get_default());
+	mainloop_free(conn.loop);
+
+	memset(&conn, 0, sizeof(conn));
+}
+
+/*
+ * Connects a new client to db and runs its loop. Once discovery is done
+ * start is called to kick off the workload, which ends the run through
+ * bench_done(). Loops can only be run once, so each test gets its own
+ * connection. The connection is left for conn_close() to clean up.
+ */
+static bool conn_run(struct gatt_db *db, uint16_t mtu, bench_func_t start)
+{
+	int sv[2];
+
+	failed = false;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("Failed to create socket pair");
+		return false;
+	}
+
+	conn.loop = mainloop_new();
+	mainloop_set_current(conn.loop);
+	conn.start = start;
+
+	conn.server_att = bt_att_new(sv[0], false);
+	if (!conn.server_att) {
+		close(sv[0]);
+		close(sv[1]);
+		goto fail;
+	}
+
+	bt_att_set_close_on_unref(conn.server_att, true);
+
+	conn.client_att = bt_att_new(sv[1], false);
+	if (!conn.client_att) {
+		close(sv[1]);
+		goto fail;
+	}
+
+	bt_att_set_close_on_unref(conn.client_att, true);
+
+	conn.server = bt_gatt_server_new(db, conn.server_att, mtu, 0);
+	if (!conn.server)
+		goto fail;
+
+	conn.start_ns = now_nsec();
+
+	conn.client_db = gatt_db_new();
+	conn.client = bt_gatt_client_new(conn.client_db, conn.client_att,
+									mtu);
+	if (!conn.client)
+		goto fail;
+
+	bt_gatt_client_ready_register(conn.client, ready_cb, NULL, NULL);
+
+	mainloop_loop_run(conn.loop);
+
+	return conn.ready && !failed;
+
+fail:
+	fprintf(stderr, "Failed to set up connection\n");
+
+	return false;
+}
+
+static void bench_start(unsigned int count)
+{
+	iterations = count;
+	completed = 0;
+	sent = 0;
+}
+
+static void print_rate(const char *name, unsigned int count)
+{
+	uint64_t elapsed = conn.end_ns - conn.work_ns;
+
+	printf("%s: mtu=%u count=%u total_ns=%llu ns_per_op=%.1f "
+				"ops_per_sec=%.0f\n", name,
+				bt_att_get_mtu(conn.client_att), count,
+				(unsigned long long) elapsed,
+				(double) elapsed / count,
+				count * 1e9 / elapsed);
+}
+
+static void print_throughput(const char *name, unsigned int count)
+{
+	uint64_t elapsed = conn.end_ns - conn.work_ns;
+	uint64_t bytes = (uint64_t) count * LONG_VALUE_LEN;
+
+	printf("%s: mtu=%u count=%u bytes=%llu total_ns=%llu "
+				"bytes_per_sec=%.0f\n", name,
+				bt_att_get_mtu(conn.client_att), count,
+				(unsigned long long) bytes,
+				(unsigned long long) elapsed,
+				bytes * 1e9 / elapsed);
+}
+
+static void send_notifications(void)
+{
+	uint8_t value[4];
+
+	/* Keep a bounded number of notifications in flight */
+	while (sent < iterations && sent - completed < NOTIFY_WINDOW) {
+		put_le32(sent, value);
+
+		if (!bt_gatt_server_send_notification(conn.server,
+							notify_handle, value,
+							sizeof(value))) {
+			bench_fail("Notification", 0);
+			return;
+		}
+
+		sent++;
+	}
+}
+
+/* Send until att pushes back, then wait to be called again from ready_cb */
+static void send_notifications_flow(void *user_data)
+{
+	uint8_t value[4];
+
+	while (sent < iterations) {
+		put_le32(sent, value);
+
+		if (!bt_gatt_server_send_notification(conn.server,
+							notify_handle, value,
+							sizeof(value)))
+			return;
+
+		sent++;
+	}
+}
+
+static void notify_cb(uint16_t value_handle, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	/* Indications are counted when confirmed instead */
+	if (value_handle != notify_handle)
+		return;
+
+	if (++completed == iterations) {
+		bench_done();
+		return;
+	}
+
+	if (!flow_control)
+		send_notifications();
+}
+
+static void send_indication(void);
+
+static void conf_cb(void *user_data)
+{
+	if (++completed == iterations) {
+		bench_done();
+		return;
+	}
+
+	send_indication();
+}
+
+static void send_indication(void)
+{
+	uint8_t value[4];
+
+	put_le32(completed, value);
+
+	if (!bt_gatt_server_send_indication(conn.server, indicate_handle,
+						value, sizeof(value), conf_cb,
+						NULL, NULL))
+		bench_fail("Indication", 0);
+}
+
+static void register_cb(uint16_t att_ecode, void *user_data)
+{
+	uint16_t handle = PTR_TO_UINT(user_data);
+
+	if (att_ecode) {
+		bench_fail("Register notify", att_ecode);
+		return;
+	}
+
+	conn.work_ns = now_nsec();
+
+	if (handle == notify_handle && flow_control) {
+		bt_att_set_write_watermarks(conn.server_att,
+						NOTIFY_HIGH_WATERMARK,
+						NOTIFY_LOW_WATERMARK,
+						send_notifications_flow, NULL,
+						NULL);
+		send_notifications_flow(NULL);
+	} else if (handle == notify_handle)
+		send_notifications();
+	else
+		send_indication();
+}
+
+static void subscribe(uint16_t handle)
+{
+	if (!bt_gatt_client_register_notify(conn.client, handle, register_cb,
+						notify_cb, UINT_TO_PTR(handle),
+						NULL))
+		bench_fail("Register notify request", 0);
+}
+
+static void start_notify(void)
+{
+	flow_control = false;
+	subscribe(notify_handle);
+}
+
+static void start_notify_flow(void)
+{
+	flow_control = true;
+	subscribe(notify_handle);
+}
+
+static void start_indicate(void)
+{
+	subscribe(indicate_handle);
+}
+
+static void read_next(uint16_t handle);
+
+static void read_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	uint16_t handle = PTR_TO_UINT(user_data);
+
+	if (!success) {
+		bench_fail("Read", att_ecode);
+		return;
+	}
+
+	if (handle == long_handle && length != LONG_VALUE_LEN) {
+		bench_fail("Long read length", 0);
+		return;
+	}
+
+	if (++completed == iterations) {
+		bench_done();
+		return;
+	}
+
+	read_next(handle);
+}
+
+static void read_next(uint16_t handle)
+{
+	unsigned int id;
+
+	if (handle == long_handle)
+		id = bt_gatt_client_read_long_value(conn.client, handle, 0,
+						read_cb, UINT_TO_PTR(handle),
+						NULL);
+	else
+		id = bt_gatt_client_read_value(conn.client, handle, read_cb,
+						UINT_TO_PTR(handle), NULL);
+
+	if (!id)
+		bench_fail("Read request", 0);
+}
+
+static void read_chunk_cb(uint16_t offset, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	if (memcmp(long_value + offset, value, length))
+		bench_fail("Streamed chunk", 0);
+}
+
+static void read_stream_next(void);
+
+static void read_stream_cb(bool success, uint8_t att_ecode,
+					const uint8_t *value, uint16_t length,
+					void *user_data)
+{
+	if (!success) {
+		bench_fail("Streamed read", att_ecode);
+		return;
+	}
+
+	if (value != read_buf || length != LONG_VALUE_LEN) {
+		bench_fail("Streamed read length", 0);
+		return;
+	}
+
+	if (++completed == iterations) {
+		bench_done();
+		return;
+	}
+
+	read_stream_next();
+}
+
+static void read_stream_next(void)
+{
+	/* Assembled in place in a buffer of the known size */
+	if (!bt_gatt_client_read_long_value_stream(conn.client, long_handle,
+						0, read_buf, sizeof(read_buf),
+						read_chunk_cb, read_stream_cb,
+						NULL, NULL))
+		bench_fail("Streamed read request", 0);
+}
+
+static void write_next(uint16_t handle);
+static void write_stream_cb(bool success, bool reliable_error,
+					uint8_t att_ecode, void *user_data);
+
+static void write_cb_done(bool success, uint8_t att_ecode, void *user_data)
+{
+	if (!success) {
+		bench_fail("Write", att_ecode);
+		return;
+	}
+
+	if (++completed == iterations) {
+		bench_done();
+		return;
+	}
+
+	write_next(PTR_TO_UINT(user_data));
+}
+
+static void write_long_cb(bool success, bool reliable_error,
+					uint8_t att_ecode, void *user_data)
+{
+	write_cb_done(success, att_ecode, user_data);
+}
+
+static void write_next(uint16_t handle)
+{
+	uint8_t value[4];
+	unsigned int id;
+
+	if (handle == long_handle) {
+		id = bt_gatt_client_write_long_value(conn.client, false,
+						handle, 0, long_value,
+						sizeof(long_value),
+						write_long_cb,
+						UINT_TO_PTR(handle), NULL);
+	} else {
+		put_le32(completed, value);
+		id = bt_gatt_client_write_value(conn.client, handle, value,
+						sizeof(value), write_cb_done,
+						UINT_TO_PTR(handle), NULL);
+	}
+
+	if (!id)
+		bench_fail("Write request", 0);
+}
+
+static bool write_source(uint16_t offset, uint8_t *buf, uint16_t length,
+							void *user_data)
+{
+	memcpy(buf, long_value + offset, length);
+
+	return true;
+}
+
+static void write_stream_next(void)
+{
+	/* Unverified, with Prepare Writes queued ahead */
+	if (!bt_gatt_client_write_long_value_stream(conn.client, false,
+						long_handle, 0,
+						sizeof(long_value),
+						LONG_WRITE_WINDOW,
+						write_source, write_stream_cb,
+						NULL, NULL))
+		bench_fail("Streamed write request", 0);
+}
+
+static void write_fd_next(void)
+{
+	if (!bt_gatt_client_write_long_value_fd(conn.client, true,
+						long_handle, 0, long_fd, 0,
+						sizeof(long_value),
+						LONG_WRITE_WINDOW,
+						write_stream_cb,
+						UINT_TO_PTR(1), NULL))
+		bench_fail("File write request", 0);
+}
+
+static void write_stream_cb(bool success, bool reliable_error,
+					uint8_t att_ecode, void *user_data)
+{
+	if (!success) {
+		bench_fail("Streamed write", att_ecode);
+		return;
+	}
+
+	if (++completed == iterations) {
+		bench_done();
+		return;
+	}
+
+	if (user_data)
+		write_fd_next();
+	else
+		write_stream_next();
+}
+
+static void start_read(void)
+{
+	conn.work_ns = now_nsec();
+	read_next(value_handle);
+}
+
+static void start_write(void)
+{
+	conn.work_ns = now_nsec();
+	write_next(value_handle);
+}
+
+static void start_long_read(void)
+{
+	conn.work_ns = now_nsec();
+	read_next(long_handle);
+}
+
+static void start_long_read_stream(void)
+{
+	conn.work_ns = now_nsec();
+	read_stream_next();
+}
+
+static void start_long_write(void)
+{
+	conn.work_ns = now_nsec();
+	write_next(long_handle);
+}
+
+static void start_long_write_stream(void)
+{
+	conn.work_ns = now_nsec();
+	write_stream_next();
+}
+
+static void start_long_write_fd(void)
+{
+	conn.work_ns = now_nsec();
+	write_fd_next();
+}
+
+static bool run_test(struct gatt_db *db, const char *name, uint16_t mtu,
+				bench_func_t start, unsigned int count,
+				bool throughput)
+{
+	bool ret;
+
+	bench_start(count);
+
+	ret = conn_run(db, mtu, start);
+	if (ret) {
+		if (throughput)
+			print_throughput(name, count);
+		else
+			print_rate(name, count);
+	}
+
+	conn_close();
+
+	return ret;
+}
+
+static bool bench_discovery(int num_services, int num_chrcs)
+{
+	struct gatt_db *db;
+	const char *pass[] = { "cold", "warm" };
+	struct bt_gatt_server_cache_stats stats;
+	uint64_t hits = 0, misses = 0, discovery_ns;
+	unsigned int i;
+	bool ret = true;
+
+	db = create_large_db(num_services, num_chrcs);
+
+	/* The cache outlives the servers, its counters add up over passes */
+	for (i = 0; i < 2 && ret; i++) {
+		ret = conn_run(db, 0, NULL) &&
+			bt_gatt_server_get_cache_stats(conn.server, &stats);
+		discovery_ns = conn.discovery_ns;
+		conn_close();
+
+		if (!ret)
+			break;
+
+		printf("discovery: pass=%s services=%d chrcs_per_service=%d "
+				"total_ns=%llu cache_hits=%llu "
+				"cache_misses=%llu cache_evictions=%llu\n",
+				pass[i], num_services, num_chrcs,
+				(unsigned long long) discovery_ns,
+				(unsigned long long) (stats.hits - hits),
+				(unsigned long long) (stats.misses - misses),
+				(unsigned long long) stats.evictions);
+
+		/* The second client is served what the first one discovered */
+		if (i && (stats.misses != misses || stats.hits == hits)) {
+			fprintf(stderr, "Discovery response cache missed\n");
+			ret = false;
+		}
+
+		hits = stats.hits;
+		misses = stats.misses;
+	}
+
+	gatt_db_unref(db);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	unsigned int count = DEFAULT_ITERATIONS;
+	unsigned int notifications = DEFAULT_NOTIFICATIONS;
+	int num_services = DEFAULT_NUM_SERVICES;
+	int num_chrcs = DEFAULT_NUM_CHRCS;
+	struct gatt_db *db;
+	unsigned int i;
+	bool ok;
+
+	while ((opt = getopt_long(argc, argv, "+hn:N:s:c:",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			notifications = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			num_services = atoi(optarg);
+			break;
+		case 'c':
+			num_chrcs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Invalid option: %c\n", opt);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!count || !notifications) {
+		fprintf(stderr, "Invalid iteration count\n");
+		return EXIT_FAILURE;
+	}
+
+	if (num_services <= 0 || num_chrcs < 0 ||
+			(long) num_services * (1 + num_chrcs * 3) > UINT16_MAX) {
+		fprintf(stderr, "Invalid database size\n");
+		return EXIT_FAILURE;
+	}
+
+	mainloop_init();
+
+	for (i = 0; i < sizeof(long_value); i++)
+		long_value[i] = i;
+
+	long_fd = memfd_create("gatt-bench", MFD_CLOEXEC);
+	if (long_fd < 0 || write(long_fd, long_value, sizeof(long_value)) !=
+							sizeof(long_value)) {
+		perror("Failed to create value file");
+		return EXIT_FAILURE;
+	}
+
+	db = create_bench_db();
+
+	ok = run_test(db, "notify", 0, start_notify, notifications, false) &&
+		run_test(db, "notify_flow", 0, start_notify_flow,
+						notifications, false) &&
+		run_test(db, "indicate", 0, start_indicate, count, false) &&
+		run_test(db, "read", 0, start_read, count, false) &&
+		run_test(db, "write", 0, start_write, count, false);
+
+	/* Long values take several round trips each, do fewer */
+	for (i = 0; ok && i < sizeof(long_mtus) / sizeof(long_mtus[0]); i++)
+		ok = run_test(db, "long_read", long_mtus[i], start_long_read,
+						count / 10 + 1, true) &&
+			run_test(db, "long_read_stream", long_mtus[i],
+						start_long_read_stream,
+						count / 10 + 1, true) &&
+			run_test(db, "long_write", long_mtus[i],
+						start_long_write,
+						count / 10 + 1, true) &&
+			run_test(db, "long_write_stream", long_mtus[i],
+						start_long_write_stream,
+						count / 10 + 1, true) &&
+			run_test(db, "long_write_fd", long_mtus[i],
+						start_long_write_fd,
+						count / 10 + 1, true);
+
+	gatt_db_unref(db);
+	close(long_fd);
+
+	if (ok)
+		ok = bench_discovery(num_services, num_chrcs);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,329 @@
+/*
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <malloc.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+
+#define DEFAULT_NUM_SERVICES	200
+#define DEFAULT_NUM_CHRCS	10
+#define DEFAULT_ITERATIONS	1000000
+#define DEFAULT_RANGE_ITERATIONS	1000
+
+static void usage(void)
+{
+	printf("gatt-db-bench\n");
+	printf("Usage:\n\tgatt-db-bench [options]\n");
+
+	printf("Options:\n"
+		"\t-s, --services <count>\tNumber of services (default: %d)\n"
+		"\t-c, --chrcs <count>\tCharacteristics per service "
+							"(default: %d)\n"
+		"\t-n, --iterations <count>\tLookups per test (default: %d)\n"
+		"\t-r, --range-iterations <count>\tRange queries per test "
+							"(default: %d)\n"
+		"\t-h, --help\t\tDisplay help\n",
+		DEFAULT_NUM_SERVICES, DEFAULT_NUM_CHRCS, DEFAULT_ITERATIONS,
+		DEFAULT_RANGE_ITERATIONS);
+}
+
+static struct option main_options[] = {
+	{ "services",		1, 0, 's' },
+	{ "chrcs",		1, 0, 'c' },
+	{ "iterations",		1, 0, 'n' },
+	{ "range-iterations",	1, 0, 'r' },
+	{ "help",		0, 0, 'h' },
+	{ }
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t heap_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
+
+static struct gatt_db *populate_db(int num_services, int num_chrcs)
+{
+	struct gatt_db *db;
+	struct gatt_db_attribute *service;
+	uint16_t num_handles = 1 + num_chrcs * 3;
+	bt_uuid_t uuid;
+	int i, j;
+
+	db = gatt_db_new();
+
+	for (i = 0; i < num_services; i++) {
+		bt_uuid16_create(&uuid, 0x1800 + i);
+
+		/*
+		 * Declaration, plus value and CCC for every characteristic.
+		 * Services are placed right after each other, as a server
+		 * loading a stored database would.
+		 */
+		service = gatt_db_insert_service(db, 1 + i * num_handles,
+							&uuid, true,
+							num_handles);
+		if (!service)
+			break;
+
+		for (j = 0; j < num_chrcs; j++) {
+			bt_uuid16_create(&uuid, 0x2a00 + j);
+			gatt_db_service_add_characteristic(service, &uuid,
+						BT_ATT_PERM_READ,
+						BT_GATT_CHRC_PROP_READ |
+						BT_GATT_CHRC_PROP_NOTIFY,
+						NULL, NULL, NULL);
+
+			bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+			gatt_db_service_add_descriptor(service, &uuid,
+						BT_ATT_PERM_READ |
+						BT_ATT_PERM_WRITE,
+						NULL, NULL, NULL);
+		}
+
+		gatt_db_service_set_active(service, true);
+	}
+
+	return db;
+}
+
+static void run_lookup(struct gatt_db *db, const char *name,
+			struct gatt_db_attribute *(*lookup)(struct gatt_db *,
+								uint16_t),
+			uint16_t max_handle, unsigned int iterations)
+{
+	unsigned int i, found = 0;
+	uint32_t handle = 1;
+	uint64_t start, elapsed;
+
+	start = now_nsec();
+
+	for (i = 0; i < iterations; i++) {
+		if (lookup(db, handle))
+			found++;
+
+		/* Stride through the handle space to defeat locality */
+		handle = (handle + 7919) % max_handle + 1;
+	}
+
+	elapsed = now_nsec() - start;
+
+	printf("%s: iterations=%u found=%u total_ns=%llu ns_per_op=%.1f\n",
+				name, iterations, found,
+				(unsigned long long) elapsed,
+				(double) elapsed / iterations);
+}
+
+struct range {
+	const char *name;
+	uint16_t start;
+	uint16_t end;
+};
+
+enum query {
+	QUERY_READ_BY_GROUP_TYPE,
+	QUERY_FIND_BY_TYPE,
+	QUERY_READ_BY_TYPE,
+	QUERY_FIND_INFORMATION,
+};
+
+static const char *query_names[] = {
+	"read_by_group_type",
+	"find_by_type",
+	"read_by_type",
+	"find_information",
+};
+
+static void count_attr(struct gatt_db_attribute *attrib, void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+}
+
+static void run_range(struct gatt_db *db, enum query query,
+				const struct range *range,
+				unsigned int iterations)
+{
+	struct queue *q;
+	bt_uuid_t type;
+	unsigned int i, found = 0;
+	uint64_t start, elapsed;
+
+	q = queue_new();
+
+	if (query == QUERY_READ_BY_GROUP_TYPE)
+		bt_uuid16_create(&type, GATT_PRIM_SVC_UUID);
+	else
+		bt_uuid16_create(&type, GATT_CHARAC_UUID);
+
+	start = now_nsec();
+
+	for (i = 0; i < iterations; i++) {
+		switch (query) {
+		case QUERY_READ_BY_GROUP_TYPE:
+			gatt_db_read_by_group_type(db, range->start,
+							range->end, type, q);
+			break;
+		case QUERY_FIND_BY_TYPE:
+			gatt_db_find_by_type(db, range->start, range->end,
+						&type, count_attr, &found);
+			break;
+		case QUERY_READ_BY_TYPE:
+			gatt_db_read_by_type(db, range->start, range->end,
+								type, q);
+			break;
+		case QUERY_FIND_INFORMATION:
+			gatt_db_find_information(db, range->start, range->end,
+									q);
+			break;
+		}
+
+		found += queue_length(q);
+		queue_remove_all(q, NULL, NULL, NULL);
+	}
+
+	elapsed = now_nsec() - start;
+
+	printf("%s: range=%s start=0x%04x end=0x%04x iterations=%u "
+				"results=%u total_ns=%llu ns_per_op=%.1f\n",
+				query_names[query], range->name, range->start,
+				range->end, iterations, found / iterations,
+				(unsigned long long) elapsed,
+				(double) elapsed / iterations);
+
+	queue_destroy(q, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int num_services = DEFAULT_NUM_SERVICES;
+	int num_chrcs = DEFAULT_NUM_CHRCS;
+	unsigned int iterations = DEFAULT_ITERATIONS;
+	unsigned int range_iterations = DEFAULT_RANGE_ITERATIONS;
+	struct gatt_db *db;
+	uint16_t max_handle, num_handles;
+	struct range ranges[4];
+	size_t heap;
+	uint64_t start;
+	unsigned int i;
+	int q;
+
+	while ((opt = getopt_long(argc, argv, "+hs:c:n:r:",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 's':
+			num_services = atoi(optarg);
+			break;
+		case 'c':
+			num_chrcs = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			range_iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Invalid option: %c\n", opt);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (num_services <= 0 || num_chrcs < 0 || !iterations ||
+			!range_iterations ||
+			(long) num_services * (1 + num_chrcs * 3) > UINT16_MAX) {
+		fprintf(stderr, "Invalid database size\n");
+		return EXIT_FAILURE;
+	}
+
+	num_handles = 1 + num_chrcs * 3;
+	max_handle = num_services * num_handles;
+
+	heap = heap_in_use();
+	start = now_nsec();
+	db = populate_db(num_services, num_chrcs);
+	start = now_nsec() - start;
+	heap = heap_in_use() - heap;
+
+	printf("build: services=%d chrcs_per_service=%d attributes=%u "
+				"total_ns=%llu ns_per_attr=%.1f heap_bytes=%zu "
+				"bytes_per_attr=%.1f\n",
+				num_services, num_chrcs, max_handle,
+				(unsigned long long) start,
+				(double) start / max_handle, heap,
+				(double) heap / max_handle);
+
+	run_lookup(db, "get_attribute", gatt_db_get_attribute, max_handle,
+								iterations);
+	run_lookup(db, "get_service", gatt_db_get_service, max_handle,
+								iterations);
+
+	/*
+	 * Whole database as a client discovering everything would ask for,
+	 * then the first, middle and last service alone to show how the
+	 * cost depends on where the range sits rather than on its size.
+	 */
+	ranges[0] = (struct range) { "all", 0x0001, 0xffff };
+	ranges[1] = (struct range) { "first", 1, num_handles };
+	ranges[2] = (struct range) { "middle",
+				1 + (num_services / 2) * num_handles,
+				(num_services / 2 + 1) * num_handles };
+	ranges[3] = (struct range) { "last", max_handle - num_handles + 1,
+							max_handle };
+
+	for (q = QUERY_READ_BY_GROUP_TYPE; q <= QUERY_FIND_INFORMATION; q++)
+		for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+			run_range(db, q, &ranges[i], range_iterations);
+
+	gatt_db_unref(db);
+
+	return EXIT_SUCCESS;
+}
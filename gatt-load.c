@@ -0,0 +1,438 @@
+/*
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+
+#include "src/shared/mainloop.h"
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-client.h"
+
+#define DEFAULT_SOCKET_PATH	"/tmp/btgatt-server.sock"
+#define DEFAULT_NUM_CLIENTS	100
+#define DEFAULT_NUM_READS	100
+
+#define UUID_HEART_RATE_MSRMT	0x2a37
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/*
+ * Load generator for btgatt-server started with --unix: connects many
+ * clients at once, lets each of them discover the database and read the
+ * device name repeatedly, optionally waits for Heart Rate Measurement
+ * notifications and Service Changed indications, then disconnects them all.
+ * Service Changed goes out each time the Heart Rate Service is hidden or
+ * shown with the heart-rate command of btgatt-server.
+ */
+struct client {
+	unsigned int id;
+	struct bt_att *att;
+	struct bt_gatt_client *gatt;
+	struct gatt_db *db;
+	uint16_t name_handle;
+	uint16_t hr_handle;
+	unsigned int reads;
+	unsigned int notifications;
+	unsigned int svc_changed;
+	bool reads_done;
+	uint64_t start_ns;
+	uint64_t discovery_ns;
+	bool done;
+};
+
+static struct queue *clients;
+static unsigned int num_reads = DEFAULT_NUM_READS;
+static unsigned int num_notifications;
+static unsigned int num_svc_changed;
+static unsigned int finished;
+static unsigned int failures;
+static uint64_t start_ns;
+
+static void usage(void)
+{
+	printf("gatt-load\n");
+	printf("Usage:\n\tgatt-load [options]\n");
+
+	printf("Options:\n"
+		"\t-U, --unix <path>\tServer socket (default: %s)\n"
+		"\t-n, --clients <count>\tClients to connect (default: %d)\n"
+		"\t-r, --reads <count>\tReads per client (default: %d)\n"
+		"\t-N, --notifications <count>\tHeart Rate Measurements to\n"
+		"\t\t\t\twait for per client (default: 0)\n"
+		"\t-S, --service-changed <count>\tService Changed indications\n"
+		"\t\t\t\tto wait for per client (default: 0)\n"
+		"\t-h, --help\t\tDisplay help\n",
+		DEFAULT_SOCKET_PATH, DEFAULT_NUM_CLIENTS, DEFAULT_NUM_READS);
+}
+
+static struct option main_options[] = {
+	{ "unix",		1, 0, 'U' },
+	{ "clients",		1, 0, 'n' },
+	{ "reads",		1, 0, 'r' },
+	{ "notifications",	1, 0, 'N' },
+	{ "service-changed",	1, 0, 'S' },
+	{ "help",		0, 0, 'h' },
+	{ }
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void client_finish(struct client *client, bool success)
+{
+	if (client->done)
+		return;
+
+	client->done = true;
+
+	if (!success)
+		failures++;
+
+	if (++finished == queue_length(clients))
+		mainloop_quit();
+}
+
+static void client_check(struct client *client)
+{
+	if (client->reads_done &&
+			client->notifications >= num_notifications &&
+			client->svc_changed >= num_svc_changed)
+		client_finish(client, true);
+}
+
+static void notify_cb(uint16_t value_handle, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct client *client = user_data;
+
+	client->notifications++;
+	client_check(client);
+}
+
+static void service_changed_cb(uint16_t start_handle, uint16_t end_handle,
+							void *user_data)
+{
+	struct client *client = user_data;
+
+	client->svc_changed++;
+	client_check(client);
+}
+
+static void register_cb(uint16_t att_ecode, void *user_data)
+{
+	struct client *client = user_data;
+
+	if (att_ecode) {
+		fprintf(stderr, "Client %u: subscribing failed: 0x%02x\n",
+						client->id, att_ecode);
+		client_finish(client, false);
+	}
+}
+
+static void reads_done(struct client *client)
+{
+	client->reads_done = true;
+
+	if (!num_notifications) {
+		client_check(client);
+		return;
+	}
+
+	if (!client->hr_handle || !bt_gatt_client_register_notify(client->gatt,
+						client->hr_handle, register_cb,
+						notify_cb, client, NULL)) {
+		fprintf(stderr, "Client %u: no Heart Rate Measurement\n",
+								client->id);
+		client_finish(client, false);
+	}
+}
+
+static void read_cb(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct client *client = user_data;
+
+	if (!success) {
+		fprintf(stderr, "Client %u: read failed: 0x%02x\n",
+						client->id, att_ecode);
+		client_finish(client, false);
+		return;
+	}
+
+	if (++client->reads == num_reads) {
+		reads_done(client);
+		return;
+	}
+
+	if (!bt_gatt_client_read_value(client->gatt, client->name_handle,
+						read_cb, client, NULL))
+		client_finish(client, false);
+}
+
+static void find_handle(struct gatt_db_attribute *attrib, void *user_data)
+{
+	uint16_t *handle = user_data;
+
+	*handle = gatt_db_attribute_get_handle(attrib);
+}
+
+static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct client *client = user_data;
+	bt_uuid_t uuid;
+
+	client->discovery_ns = now_nsec() - client->start_ns;
+
+	if (!success) {
+		fprintf(stderr, "Client %u: discovery failed: 0x%02x\n",
+						client->id, att_ecode);
+		client_finish(client, false);
+		return;
+	}
+
+	bt_uuid16_create(&uuid, GATT_CHARAC_DEVICE_NAME);
+	gatt_db_find_by_type(client->db, 0x0001, 0xffff, &uuid, find_handle,
+							&client->name_handle);
+
+	bt_uuid16_create(&uuid, UUID_HEART_RATE_MSRMT);
+	gatt_db_find_by_type(client->db, 0x0001, 0xffff, &uuid, find_handle,
+							&client->hr_handle);
+
+	if (!client->name_handle) {
+		fprintf(stderr, "Client %u: no device name\n", client->id);
+		client_finish(client, false);
+		return;
+	}
+
+	if (!num_reads) {
+		reads_done(client);
+		return;
+	}
+
+	if (!bt_gatt_client_read_value(client->gatt, client->name_handle,
+						read_cb, client, NULL))
+		client_finish(client, false);
+}
+
+static void disconnect_cb(int err, void *user_data)
+{
+	struct client *client = user_data;
+
+	if (!client->done)
+		fprintf(stderr, "Client %u: disconnected: %s\n", client->id,
+								strerror(err));
+
+	client_finish(client, false);
+}
+
+static struct client *client_connect(const char *path, unsigned int id)
+{
+	struct client *client;
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Failed to create socket");
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Failed to connect");
+		close(fd);
+		return NULL;
+	}
+
+	client = new0(struct client, 1);
+	client->id = id;
+	client->start_ns = now_nsec();
+
+	client->att = bt_att_new(fd, false);
+	if (!client->att) {
+		close(fd);
+		free(client);
+		return NULL;
+	}
+
+	bt_att_set_close_on_unref(client->att, true);
+	bt_att_register_disconnect(client->att, disconnect_cb, client, NULL);
+
+	client->db = gatt_db_new();
+	client->gatt = bt_gatt_client_new(client->db, client->att, 0);
+	if (!client->gatt) {
+		gatt_db_unref(client->db);
+		bt_att_unref(client->att);
+		free(client);
+		return NULL;
+	}
+
+	bt_gatt_client_ready_register(client->gatt, ready_cb, client, NULL);
+	bt_gatt_client_set_service_changed(client->gatt, service_changed_cb,
+								client, NULL);
+
+	return client;
+}
+
+static void client_free(void *data)
+{
+	struct client *client = data;
+
+	bt_gatt_client_unref(client->gatt);
+	bt_att_unref(client->att);
+	gatt_db_unref(client->db);
+	free(client);
+}
+
+static void print_results(uint64_t total_ns)
+{
+	const struct queue_entry *entry;
+	uint64_t min = UINT64_MAX, max = 0, sum = 0;
+	unsigned long long reads = 0, notifications = 0, svc_changed = 0;
+	unsigned int count = 0;
+
+	for (entry = queue_get_entries(clients); entry; entry = entry->next) {
+		struct client *client = entry->data;
+
+		reads += client->reads;
+		notifications += client->notifications;
+		svc_changed += client->svc_changed;
+
+		if (!client->discovery_ns)
+			continue;
+
+		min = MIN(min, client->discovery_ns);
+		max = MAX(max, client->discovery_ns);
+		sum += client->discovery_ns;
+		count++;
+	}
+
+	printf("clients: connected=%u failed=%u\n", queue_length(clients),
+								failures);
+
+	if (count)
+		printf("discovery: min_ns=%llu avg_ns=%llu max_ns=%llu\n",
+					(unsigned long long) min,
+					(unsigned long long) (sum / count),
+					(unsigned long long) max);
+
+	printf("reads: total=%llu total_ns=%llu ops_per_sec=%.0f\n", reads,
+					(unsigned long long) total_ns,
+					total_ns ? reads * 1e9 / total_ns : 0);
+
+	if (num_notifications)
+		printf("notifications: total=%llu\n", notifications);
+
+	if (num_svc_changed)
+		printf("service changed: total=%llu\n", svc_changed);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	const char *path = DEFAULT_SOCKET_PATH;
+	unsigned int num_clients = DEFAULT_NUM_CLIENTS;
+	struct client *client;
+	unsigned int i;
+
+	while ((opt = getopt_long(argc, argv, "+hU:n:r:N:S:",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'U':
+			path = optarg;
+			break;
+		case 'n':
+			num_clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			num_reads = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			num_notifications = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			num_svc_changed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Invalid option: %c\n", opt);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!num_clients) {
+		fprintf(stderr, "Invalid number of clients\n");
+		return EXIT_FAILURE;
+	}
+
+	mainloop_init();
+
+	clients = queue_new();
+	start_ns = now_nsec();
+
+	for (i = 0; i < num_clients; i++) {
+		client = client_connect(path, i + 1);
+		if (!client)
+			break;
+
+		queue_push_tail(clients, client);
+	}
+
+	if (queue_isempty(clients)) {
+		queue_destroy(clients, NULL);
+		return EXIT_FAILURE;
+	}
+
+	mainloop_run();
+
+	print_results(now_nsec() - start_ns);
+
+	queue_destroy(clients, client_free);
+
+	return failures || i < num_clients ? EXIT_FAILURE : EXIT_SUCCESS;
+}
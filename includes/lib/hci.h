@@ -151,6 +151,7 @@ enum {
 #define ACL_PTYPE_MASK	(HCI_DM1 | HCI_DH1 | HCI_DM3 | HCI_DH3 | HCI_DM5 | HCI_DH5)
 
 /* HCI Error codes */
+#define HCI_SUCCESS				0x00
 #define HCI_UNKNOWN_COMMAND			0x01
 #define HCI_NO_CONNECTION			0x02
 #define HCI_HARDWARE_FAILURE			0x03
@@ -1710,6 +1711,19 @@ typedef struct {
 } __attribute__ ((packed)) le_test_end_rp;
 #define LE_TEST_END_RP_SIZE 3
 
+#define OCF_LE_SET_DATA_LENGTH			0x0022
+typedef struct {
+	uint16_t	handle;
+	uint16_t	tx_octets;
+	uint16_t	tx_time;
+} __attribute__ ((packed)) le_set_data_length_cp;
+#define LE_SET_DATA_LENGTH_CP_SIZE 6
+typedef struct {
+	uint8_t		status;
+	uint16_t	handle;
+} __attribute__ ((packed)) le_set_data_length_rp;
+#define LE_SET_DATA_LENGTH_RP_SIZE 3
+
 #define OCF_LE_ADD_DEVICE_TO_RESOLV_LIST	0x0027
 typedef struct {
 	uint8_t		bdaddr_type;
@@ -1741,6 +1755,42 @@ typedef struct {
 } __attribute__ ((packed)) le_set_address_resolution_enable_cp;
 #define LE_SET_ADDRESS_RESOLUTION_ENABLE_CP_SIZE 1
 
+#define LE_PHY_1M		0x01
+#define LE_PHY_2M		0x02
+#define LE_PHY_CODED		0x03
+
+#define OCF_LE_READ_PHY				0x0030
+typedef struct {
+	uint16_t	handle;
+} __attribute__ ((packed)) le_read_phy_cp;
+#define LE_READ_PHY_CP_SIZE 2
+typedef struct {
+	uint8_t		status;
+	uint16_t	handle;
+	uint8_t		tx_phy;
+	uint8_t		rx_phy;
+} __attribute__ ((packed)) le_read_phy_rp;
+#define LE_READ_PHY_RP_SIZE 5
+
+/* Bits of tx_phys and rx_phys */
+#define LE_PHYS_1M		0x01
+#define LE_PHYS_2M		0x02
+#define LE_PHYS_CODED		0x04
+
+/* Bits of all_phys */
+#define LE_ALL_PHYS_TX		0x01
+#define LE_ALL_PHYS_RX		0x02
+
+#define OCF_LE_SET_PHY				0x0032
+typedef struct {
+	uint16_t	handle;
+	uint8_t		all_phys;
+	uint8_t		tx_phys;
+	uint8_t		rx_phys;
+	uint16_t	phy_opts;
+} __attribute__ ((packed)) le_set_phy_cp;
+#define LE_SET_PHY_CP_SIZE 7
+
 /* Vendor specific commands */
 #define OGF_VENDOR_CMD		0x3f
 
@@ -2200,6 +2250,25 @@ typedef struct {
 } __attribute__ ((packed)) evt_le_long_term_key_request;
 #define EVT_LE_LTK_REQUEST_SIZE 12
 
+#define EVT_LE_DATA_LENGTH_CHANGE	0x07
+typedef struct {
+	uint16_t	handle;
+	uint16_t	max_tx_octets;
+	uint16_t	max_tx_time;
+	uint16_t	max_rx_octets;
+	uint16_t	max_rx_time;
+} __attribute__ ((packed)) evt_le_data_length_change;
+#define EVT_LE_DATA_LENGTH_CHANGE_SIZE 10
+
+#define EVT_LE_PHY_UPDATE_COMPLETE	0x0C
+typedef struct {
+	uint8_t		status;
+	uint16_t	handle;
+	uint8_t		tx_phy;
+	uint8_t		rx_phy;
+} __attribute__ ((packed)) evt_le_phy_update_complete;
+#define EVT_LE_PHY_UPDATE_COMPLETE_SIZE 5
+
 #define EVT_PHYSICAL_LINK_COMPLETE		0x40
 typedef struct {
 	uint8_t		status;
@@ -0,0 +1,55 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Userspace AES-128 encryption and AES-CMAC (RFC 4493). Data is handled in
+ * the byte order AES itself uses, i.e. the caller does any conversion from
+ * the little endian order of the Bluetooth specification.
+ *
+ * The block function uses AES-NI or the ARMv8 Cryptography Extensions when
+ * the CPU supports them and a portable implementation otherwise.
+ */
+
+struct bt_aes_key {
+	uint8_t rk[11][16];
+};
+
+struct bt_aes_cmac_key {
+	struct bt_aes_key aes;
+	uint8_t k1[16];
+	uint8_t k2[16];
+};
+
+const char *bt_aes_get_impl(void);
+
+void bt_aes_set_key(struct bt_aes_key *key, const uint8_t k[16]);
+void bt_aes_encrypt(const struct bt_aes_key *key, const uint8_t in[16],
+							uint8_t out[16]);
+
+void bt_aes_cmac_set_key(struct bt_aes_cmac_key *key, const uint8_t k[16]);
+void bt_aes_cmac(const struct bt_aes_cmac_key *key, const uint8_t *msg,
+					size_t msg_len, uint8_t mac[16]);
@@ -37,6 +37,10 @@
 #define BT_ATT_MAX_LE_MTU	517
 #define BT_ATT_MAX_VALUE_LEN	512
 
+/* Enhanced ATT bearers run over their own dynamic PSM */
+#define BT_ATT_EATT_PSM		0x0027
+#define BT_ATT_EATT_MIN_MTU	64
+
 #define BT_ATT_LINK_BREDR	0x00
 #define BT_ATT_LINK_LE		0x01
 #define BT_ATT_LINK_LOCAL	0xff
@@ -70,6 +74,9 @@
 #define BT_ATT_OP_HANDLE_VAL_NOT		0x1B
 #define BT_ATT_OP_HANDLE_VAL_IND		0x1D
 #define BT_ATT_OP_HANDLE_VAL_CONF		0x1E
+#define BT_ATT_OP_READ_MULT_VL_REQ		0x20
+#define BT_ATT_OP_READ_MULT_VL_RSP		0x21
+#define BT_ATT_OP_HANDLE_VAL_MULT_NOT		0x23
 
 /* Packed struct definitions for ATT protocol PDUs */
 /* TODO: Complete these definitions for all opcodes */
@@ -28,7 +28,11 @@
 
 struct bt_att;
 
+struct mainloop;
+
 struct bt_att *bt_att_new(int fd, bool ext_signed);
+struct bt_att *bt_att_new_with_loop(int fd, bool ext_signed,
+							struct mainloop *loop);
 
 struct bt_att *bt_att_ref(struct bt_att *att);
 void bt_att_unref(struct bt_att *att);
@@ -37,6 +41,16 @@ bool bt_att_set_close_on_unref(struct bt_att *att, bool do_close);
 
 int bt_att_get_fd(struct bt_att *att);
 
+/*
+ * Enhanced ATT: attach an additional connected L2CAP enhanced credit based
+ * channel to the same logical bearer. Outgoing requests are spread over idle
+ * channels, while notifications, indications, MTU exchange and prepared
+ * writes stay on the fd given to bt_att_new(). The fd is owned by att from
+ * here on and closed when the channel goes away.
+ */
+bool bt_att_attach_fd(struct bt_att *att, int fd);
+unsigned int bt_att_get_channels(struct bt_att *att);
+
 typedef void (*bt_att_response_func_t)(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data);
 typedef void (*bt_att_notify_func_t)(uint8_t opcode, const void *pdu,
@@ -47,11 +61,17 @@ typedef void (*bt_att_timeout_func_t)(unsigned int id, uint8_t opcode,
 							void *user_data);
 typedef void (*bt_att_disconnect_func_t)(int err, void *user_data);
 typedef bool (*bt_att_counter_func_t)(uint32_t *sign_cnt, void *user_data);
+typedef void (*bt_att_ready_func_t)(void *user_data);
 
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy);
 
+/* Loop the bearer is served by, att may only be used from there */
+struct mainloop *bt_att_get_loop(struct bt_att *att);
+
 uint16_t bt_att_get_mtu(struct bt_att *att);
+/* MTU to size the response to the incoming request being served with */
+uint16_t bt_att_get_req_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 uint8_t bt_att_get_link_type(struct bt_att *att);
 
@@ -64,6 +84,21 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 					bt_att_response_func_t callback,
 					void *user_data,
 					bt_att_destroy_func_t destroy);
+
+/*
+ * Zero-copy send: bt_att_pdu_alloc() returns a buffer for up to *max_len
+ * bytes of PDU parameters (the opcode is filled in). The buffer is consumed
+ * by bt_att_send_prepared(), even on failure, or released with
+ * bt_att_pdu_free().
+ */
+void *bt_att_pdu_alloc(struct bt_att *att, uint8_t opcode, uint16_t *max_len);
+void bt_att_pdu_free(struct bt_att *att, void *payload);
+unsigned int bt_att_send_prepared(struct bt_att *att, void *payload,
+					uint16_t length,
+					bt_att_response_func_t callback,
+					void *user_data,
+					bt_att_destroy_func_t destroy);
+
 bool bt_att_cancel(struct bt_att *att, unsigned int id);
 bool bt_att_cancel_all(struct bt_att *att);
 
@@ -93,3 +128,75 @@ bool bt_att_set_local_key(struct bt_att *att, uint8_t sign_key[16],
 bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
 			bt_att_counter_func_t func, void *user_data);
 bool bt_att_has_crypto(struct bt_att *att);
+
+bool bt_att_set_tx_batch(struct bt_att *att, bool enable);
+bool bt_att_set_rx_batch(struct bt_att *att, unsigned int max_pdus);
+bool bt_att_get_tx_stats(struct bt_att *att, uint64_t *wakeups,
+							uint64_t *pdus);
+
+/*
+ * Flow control for commands and notifications: once high PDUs are waiting
+ * to be written, sending more of them fails right away. callback is called
+ * when the queue has drained to low PDUs after that, so the producer can
+ * go on. Responses and confirmations are never refused. high 0 removes the
+ * limit.
+ */
+bool bt_att_set_write_watermarks(struct bt_att *att, unsigned int high,
+					unsigned int low,
+					bt_att_ready_func_t callback,
+					void *user_data,
+					bt_att_destroy_func_t destroy);
+
+/*
+ * Counters over all bearers of att. Queue depths are the current ones and
+ * the highest seen. Request and indication round trip times are kept per
+ * opcode in log2 buckets: latency[i] counts operations that completed in
+ * [2^i, 2^(i+1)) microseconds, the last bucket everything slower.
+ */
+#define BT_ATT_STATS_LATENCY_BUCKETS	26
+
+struct bt_att_stats {
+	uint64_t tx_pdus;
+	uint64_t tx_bytes;
+	uint64_t rx_pdus;
+	uint64_t rx_bytes;
+	uint64_t tx_wakeups;
+	uint64_t timeouts;
+	unsigned int req_queue;
+	unsigned int ind_queue;
+	unsigned int write_queue;
+	unsigned int req_queue_max;
+	unsigned int ind_queue_max;
+	unsigned int write_queue_max;
+};
+
+struct bt_att_op_stats {
+	uint64_t count;			/* Completed, including errors */
+	uint64_t errors;		/* Completed by an Error Response */
+	uint64_t timeouts;
+	uint64_t total_usec;
+	uint64_t min_usec;
+	uint64_t max_usec;
+	uint64_t latency[BT_ATT_STATS_LATENCY_BUCKETS];
+};
+
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats);
+bool bt_att_get_op_stats(struct bt_att *att, uint8_t opcode,
+					struct bt_att_op_stats *stats);
+bool bt_att_reset_stats(struct bt_att *att);
+
+/* Formats the counters and every opcode seen, one line per call */
+bool bt_att_print_stats(struct bt_att *att, bt_att_debug_func_t callback,
+							void *user_data);
+
+/*
+ * Binary capture of the most recent max_pdus PDUs sent or received on any
+ * bearer, each truncated to snaplen bytes (0 for no truncation). Passing
+ * max_pdus 0 stops capturing. The ring can be written out in btsnoop
+ * format at any time; ATT PDUs are wrapped into ACL frames on CID 0x0004
+ * with the bearer number (0 for the primary one) as connection handle.
+ */
+bool bt_att_set_trace(struct bt_att *att, unsigned int max_pdus,
+							uint16_t snaplen);
+bool bt_att_dump_trace(struct bt_att *att, int fd);
+bool bt_att_dump_trace_file(struct bt_att *att, const char *path);
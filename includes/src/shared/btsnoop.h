@@ -0,0 +1,45 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Minimal btsnoop file writer. Records use the HCI UART (H4) datalink so
+ * that ATT PDUs can be wrapped into ACL/L2CAP frames and decoded by the
+ * usual tools.
+ */
+
+#define BTSNOOP_FORMAT_UART		1002
+
+#define BTSNOOP_FLAG_RECEIVED		0x01
+#define BTSNOOP_FLAG_CMD_EVT		0x02
+
+bool btsnoop_write_header(int fd, uint32_t format);
+bool btsnoop_write_record(int fd, uint64_t usec, uint32_t flags,
+					uint32_t drops, const void *data,
+					uint32_t size, uint32_t orig_size);
+bool btsnoop_write_l2cap(int fd, uint64_t usec, bool received,
+					uint32_t drops, uint16_t handle,
+					uint16_t cid, const void *data,
+					uint16_t size, uint16_t orig_size);
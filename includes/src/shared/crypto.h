@@ -22,15 +22,33 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct bt_crypto;
+struct bt_crypto_cmac_key;
+
+/*
+ * The userspace backend uses AES-NI or the ARMv8 Cryptography Extensions
+ * when available, the kernel backend goes through AF_ALG sockets. AUTO
+ * currently selects the userspace backend.
+ */
+enum bt_crypto_backend {
+	BT_CRYPTO_BACKEND_AUTO,
+	BT_CRYPTO_BACKEND_KERNEL,
+	BT_CRYPTO_BACKEND_USER,
+};
+
+bool bt_crypto_set_default_backend(enum bt_crypto_backend backend);
 
 struct bt_crypto *bt_crypto_new(void);
+struct bt_crypto *bt_crypto_new_with_backend(enum bt_crypto_backend backend);
 
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto);
 void bt_crypto_unref(struct bt_crypto *crypto);
 
+const char *bt_crypto_get_backend_name(struct bt_crypto *crypto);
+
 bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 					void *buf, uint8_t num_bytes);
 
@@ -61,3 +79,16 @@ bool bt_crypto_h6(struct bt_crypto *crypto, const uint8_t w[16],
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12]);
+
+/* Database Hash: AES-CMAC with an all zero key over m */
+bool bt_crypto_gatt_hash(struct bt_crypto *crypto, const uint8_t *m,
+					size_t m_len, uint8_t res[16]);
+
+/* Signing with a key whose CMAC state is set up once and reused */
+struct bt_crypto_cmac_key *bt_crypto_cmac_key_new(struct bt_crypto *crypto,
+							const uint8_t key[16]);
+void bt_crypto_cmac_key_free(struct bt_crypto_cmac_key *ckey);
+bool bt_crypto_sign_att_key(struct bt_crypto *crypto,
+				const struct bt_crypto_cmac_key *ckey,
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12]);
@@ -0,0 +1,36 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * On-disk cache of a discovered remote GATT database, stored as one file per
+ * peer address in a caller supplied directory. The Database Hash read from
+ * the peer can be stored along with it to validate the cache later on.
+ */
+
+bool gatt_cache_store(struct gatt_db *db, const char *dir,
+					const bdaddr_t *bdaddr,
+					const uint8_t *hash);
+bool gatt_cache_load(struct gatt_db *db, const char *dir,
+					const bdaddr_t *bdaddr,
+					uint8_t hash[16], bool *has_hash);
+bool gatt_cache_remove(const char *dir, const bdaddr_t *bdaddr);
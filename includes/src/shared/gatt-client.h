@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #define BT_GATT_UUID_SIZE 16
 
@@ -32,6 +33,10 @@ struct bt_gatt_client;
 struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 							struct bt_att *att,
 							uint16_t mtu);
+struct bt_gatt_client *bt_gatt_client_new_cached(struct gatt_db *db,
+							struct bt_att *att,
+							uint16_t mtu,
+							const uint8_t *hash);
 struct bt_gatt_client *bt_gatt_client_clone(struct bt_gatt_client *client);
 
 struct bt_gatt_client *bt_gatt_client_ref(struct bt_gatt_client *client);
@@ -44,9 +49,19 @@ typedef void (*bt_gatt_client_debug_func_t)(const char *str, void *user_data);
 typedef void (*bt_gatt_client_read_callback_t)(bool success, uint8_t att_ecode,
 					const uint8_t *value, uint16_t length,
 					void *user_data);
+typedef void (*bt_gatt_client_read_chunk_callback_t)(uint16_t offset,
+					const uint8_t *value, uint16_t length,
+					void *user_data);
+typedef void (*bt_gatt_client_read_multiple_vl_callback_t)(
+					uint16_t value_handle,
+					const uint8_t *value, uint16_t length,
+					bool truncated, void *user_data);
 typedef void (*bt_gatt_client_write_long_callback_t)(bool success,
 					bool reliable_error, uint8_t att_ecode,
 					void *user_data);
+typedef bool (*bt_gatt_client_write_source_func_t)(uint16_t offset,
+					uint8_t *buf, uint16_t length,
+					void *user_data);
 typedef void (*bt_gatt_client_notify_callback_t)(uint16_t value_handle,
 					const uint8_t *value, uint16_t length,
 					void *user_data);
@@ -74,6 +89,8 @@ bool bt_gatt_client_set_debug(struct bt_gatt_client *client,
 
 uint16_t bt_gatt_client_get_mtu(struct bt_gatt_client *client);
 struct gatt_db *bt_gatt_client_get_db(struct bt_gatt_client *client);
+bool bt_gatt_client_get_db_hash(struct bt_gatt_client *client,
+							uint8_t hash[16]);
 
 bool bt_gatt_client_cancel(struct bt_gatt_client *client, unsigned int id);
 bool bt_gatt_client_cancel_all(struct bt_gatt_client *client);
@@ -88,12 +105,42 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 					bt_gatt_client_read_callback_t callback,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy);
+
+/*
+ * Long read that hands each Read Blob response to chunk_cb, with the value
+ * offset it belongs at, as soon as it arrives. If buf is given the value is
+ * assembled into it and reading stops once size bytes are in. Otherwise
+ * size is a hint for the internal buffer; with chunk_cb and no hint nothing
+ * is kept and callback gets a NULL value with the total length read.
+ */
+unsigned int bt_gatt_client_read_long_value_stream(
+				struct bt_gatt_client *client,
+				uint16_t value_handle, uint16_t offset,
+				uint8_t *buf, uint16_t size,
+				bt_gatt_client_read_chunk_callback_t chunk_cb,
+				bt_gatt_client_read_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy);
+
 unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 					uint16_t *handles, uint8_t num_handles,
 					bt_gatt_client_read_callback_t callback,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy);
 
+/*
+ * Read Multiple Variable Length: value_cb is called for each value in the
+ * response, in request order, then callback once with the outcome. Values
+ * that did not fit the MTU are left out, and the last one reported may be
+ * truncated.
+ */
+unsigned int bt_gatt_client_read_multiple_vl(struct bt_gatt_client *client,
+				uint16_t *handles, uint8_t num_handles,
+				bt_gatt_client_read_multiple_vl_callback_t value_cb,
+				bt_gatt_client_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy);
+
 unsigned int bt_gatt_client_write_without_response(
 					struct bt_gatt_client *client,
 					uint16_t value_handle,
@@ -112,6 +159,36 @@ unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
 				bt_gatt_client_write_long_callback_t callback,
 				void *user_data,
 				bt_gatt_client_destroy_func_t destroy);
+
+/*
+ * Long writes that fill every Prepare Write straight from the source, either
+ * a callback asked for length bytes at a value offset or the given range of
+ * a file, which is mapped when possible. Up to window Prepare Writes are
+ * queued ahead of the response to the previous one. Echoed values are only
+ * checked if reliable is set.
+ */
+unsigned int bt_gatt_client_write_long_value_stream(
+				struct bt_gatt_client *client,
+				bool reliable,
+				uint16_t value_handle, uint16_t offset,
+				uint16_t length, unsigned int window,
+				bt_gatt_client_write_source_func_t source,
+				bt_gatt_client_write_long_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy);
+/*
+ * fd must be seekable, pipes and sockets are refused. A regular file has to
+ * hold the whole range and must not shrink meanwhile.
+ */
+unsigned int bt_gatt_client_write_long_value_fd(struct bt_gatt_client *client,
+				bool reliable,
+				uint16_t value_handle, uint16_t offset,
+				int fd, off_t fd_offset, uint16_t length,
+				unsigned int window,
+				bt_gatt_client_write_long_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy);
+
 unsigned int bt_gatt_client_prepare_write(struct bt_gatt_client *client,
 				unsigned int id,
 				uint16_t value_handle, uint16_t offset,
@@ -124,6 +124,74 @@ gatt_db_service_insert_included(struct gatt_db_attribute *attrib,
 				uint16_t handle,
 				struct gatt_db_attribute *include);
 
+/*
+ * Constant database tables. A table is a run of services, each entry
+ * followed by the characteristics and descriptors it holds; handles are
+ * given out in table order from the handle of the service. The table is
+ * used in place and has to outlive the database: each service takes a
+ * single allocation for its attributes and declarations, and a value in
+ * the table is only copied once it gets written.
+ */
+enum gatt_db_def_kind {
+	GATT_DB_DEF_PRIMARY,
+	GATT_DB_DEF_SECONDARY,
+	GATT_DB_DEF_CHRC,
+	GATT_DB_DEF_DESC,
+};
+
+struct gatt_db_attr_def {
+	uint8_t kind;
+	uint8_t properties;		/* Characteristics only */
+	uint16_t handle;		/* Services only, 0 for the next free */
+	uint16_t num_handles;		/* Services only */
+	uint16_t value_len;
+	const void *value;
+	uint32_t permissions;
+	bt_uuid_t uuid;
+	gatt_db_read_t read_func;
+	gatt_db_write_t write_func;
+};
+
+#define GATT_DB_UUID16(_uuid) { .type = BT_UUID16, .value.u16 = (_uuid) }
+
+#define GATT_DB_PRIMARY_SERVICE(_handle, _uuid, _num_handles)		\
+	{ .kind = GATT_DB_DEF_PRIMARY, .handle = (_handle),		\
+		.num_handles = (_num_handles), .uuid = GATT_DB_UUID16(_uuid) }
+
+#define GATT_DB_SECONDARY_SERVICE(_handle, _uuid, _num_handles)		\
+	{ .kind = GATT_DB_DEF_SECONDARY, .handle = (_handle),		\
+		.num_handles = (_num_handles), .uuid = GATT_DB_UUID16(_uuid) }
+
+#define GATT_DB_CHARACTERISTIC(_uuid, _perm, _props, _read, _write)	\
+	{ .kind = GATT_DB_DEF_CHRC, .uuid = GATT_DB_UUID16(_uuid),	\
+		.permissions = (_perm), .properties = (_props),		\
+		.read_func = (_read), .write_func = (_write) }
+
+/* _value has to be an array, its size is the initial value length */
+#define GATT_DB_CHARACTERISTIC_VALUE(_uuid, _perm, _props, _value)	\
+	{ .kind = GATT_DB_DEF_CHRC, .uuid = GATT_DB_UUID16(_uuid),	\
+		.permissions = (_perm), .properties = (_props),		\
+		.value = (_value), .value_len = sizeof(_value) }
+
+#define GATT_DB_DESCRIPTOR(_uuid, _perm, _read, _write)			\
+	{ .kind = GATT_DB_DEF_DESC, .uuid = GATT_DB_UUID16(_uuid),	\
+		.permissions = (_perm), .read_func = (_read),		\
+		.write_func = (_write) }
+
+#define GATT_DB_DESCRIPTOR_VALUE(_uuid, _perm, _value)			\
+	{ .kind = GATT_DB_DEF_DESC, .uuid = GATT_DB_UUID16(_uuid),	\
+		.permissions = (_perm), .value = (_value),		\
+		.value_len = sizeof(_value) }
+
+/*
+ * Services are inserted inactive, user_data is passed to all callbacks of
+ * the table. Fails without touching the database when the table is
+ * malformed; services ahead of one that does not fit stay inserted.
+ */
+bool gatt_db_insert_table(struct gatt_db *db,
+				const struct gatt_db_attr_def *table,
+				unsigned int count, void *user_data);
+
 bool gatt_db_service_set_active(struct gatt_db_attribute *attrib, bool active);
 bool gatt_db_service_get_active(struct gatt_db_attribute *attrib);
 
@@ -131,6 +199,40 @@ bool gatt_db_service_set_claimed(struct gatt_db_attribute *attrib,
 								bool claimed);
 bool gatt_db_service_get_claimed(struct gatt_db_attribute *attrib);
 
+/*
+ * Database Hash over the active services, computed when first asked for
+ * after a service was added, removed, activated or deactivated. Extended
+ * Properties are hashed from their stored value: one served by a read
+ * callback only contributes its handle and type.
+ */
+bool gatt_db_get_hash(struct gatt_db *db, uint8_t hash[16]);
+
+/*
+ * In snapshot mode every change publishes a copy of the lookup structures,
+ * so lookups may run on other threads while the owning thread modifies the
+ * database. Changes still come from a single thread, and each one copies
+ * the whole index: enable it once the database is populated.
+ */
+bool gatt_db_set_snapshots(struct gatt_db *db, bool enable);
+
+/*
+ * Advances on every attribute insertion or removal and whenever a service is
+ * activated or deactivated, and is odd while such a change is being published.
+ * Something derived from the database under an even generation is current as
+ * long as the generation does not move.
+ */
+unsigned int gatt_db_get_generation(struct gatt_db *db);
+
+/*
+ * Attributes found by another thread stay valid until the matching
+ * gatt_db_read_end(), even if their service is removed meanwhile. The
+ * last reader to leave frees whatever was retired while it was inside.
+ * Reads and writes of attribute values, and their results, may come from
+ * any thread.
+ */
+void gatt_db_read_begin(struct gatt_db *db);
+void gatt_db_read_end(struct gatt_db *db);
+
 typedef void (*gatt_db_attribute_cb_t)(struct gatt_db_attribute *attrib,
 							void *user_data);
 
@@ -248,6 +350,12 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 				uint8_t opcode, struct bt_att *att,
 				gatt_db_attribute_read_t func, void *user_data);
 
+/*
+ * Results of reads and writes may come from any thread. Unless it is the
+ * one that started the operation, the callback runs later on the loop that
+ * thread was running. Returns false if the result could not be queued to
+ * that loop: the operation stays pending and times out there.
+ */
 bool gatt_db_attribute_read_result(struct gatt_db_attribute *attrib,
 					unsigned int id, int err,
 					const uint8_t *value, size_t length);
@@ -266,4 +374,23 @@ bool gatt_db_attribute_write_result(struct gatt_db_attribute *attrib,
 
 bool gatt_db_attribute_reset(struct gatt_db_attribute *attrib);
 
+/*
+ * Opt-in snapshot of attributes with a read callback: the value is fetched
+ * once and further reads, at any offset, are served from it until ttl ms
+ * have passed (0 for no expiry) or it is invalidated. Reads arriving while
+ * the value is being fetched share that fetch. Writes through
+ * gatt_db_attribute_write() invalidate the snapshot.
+ *
+ * Every connection is served the same snapshot, fetched with the bt_att of
+ * whichever read came first. Only enable it for values that do not depend
+ * on the connection; it is refused for configuration descriptors.
+ */
+bool gatt_db_attribute_set_cache(struct gatt_db_attribute *attrib, bool enable,
+							unsigned int ttl);
+bool gatt_db_attribute_invalidate_cache(struct gatt_db_attribute *attrib);
+
 void *gatt_db_attribute_get_user_data(struct gatt_db_attribute *attrib);
+
+bool gatt_db_attribute_get_stored_value(const struct gatt_db_attribute *attrib,
+						const uint8_t **value,
+						size_t *length);
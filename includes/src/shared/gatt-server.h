@@ -37,6 +37,14 @@ typedef void (*bt_gatt_server_destroy_func_t)(void *user_data);
 typedef void (*bt_gatt_server_debug_func_t)(const char *str, void *user_data);
 typedef void (*bt_gatt_server_conf_func_t)(void *user_data);
 
+/*
+ * Bytes of queued Prepare Write values accepted before further requests
+ * are refused with Prepare Queue Full. Can only be changed while nothing
+ * is queued.
+ */
+bool bt_gatt_server_set_max_prep_size(struct bt_gatt_server *server,
+							unsigned int size);
+
 bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 					bt_gatt_server_debug_func_t callback,
 					void *user_data,
@@ -46,9 +54,59 @@ bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length);
 
+struct bt_gatt_server_notify_value {
+	uint16_t handle;
+	const uint8_t *value;
+	uint16_t length;
+};
+
+/*
+ * Packs the values into as few Multiple Handle Value Notifications as the
+ * MTU allows. Values that end up alone in a PDU are sent as regular
+ * notifications; the peer must support the multiple variant otherwise.
+ */
+bool bt_gatt_server_send_multi_notification(struct bt_gatt_server *server,
+				const struct bt_gatt_server_notify_value *values,
+				unsigned int count);
+
 bool bt_gatt_server_send_indication(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length,
 					bt_gatt_server_conf_func_t callback,
 					void *user_data,
 					bt_gatt_server_destroy_func_t destroy);
+
+/*
+ * Client Characteristic Configuration the client of server last wrote
+ * successfully to the descriptor at ccc_handle, 0 if never written.
+ */
+uint16_t bt_gatt_server_get_ccc(struct bt_gatt_server *server,
+							uint16_t ccc_handle);
+
+/*
+ * Counters of the discovery response cache, which server shares with every
+ * other server on the same database. Lookups only count requests the cache
+ * can answer: Read By Type, Read By Group Type, Find Information and Find
+ * By Type Value.
+ */
+struct bt_gatt_server_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	unsigned int entries;
+	unsigned int max_entries;
+};
+
+bool bt_gatt_server_get_cache_stats(struct bt_gatt_server *server,
+				struct bt_gatt_server_cache_stats *stats);
+
+/*
+ * Sends the characteristic value to every client, over all servers using
+ * db, whose CCC for it is set: as a notification if enabled, otherwise as
+ * an indication. Nothing is sent while the service is hidden. May be called
+ * from any thread: clients served by another mainloop get theirs queued to
+ * that loop. Returns the number of clients it was queued for.
+ */
+unsigned int bt_gatt_server_notify_all(struct gatt_db *db,
+					uint16_t value_handle,
+					const uint8_t *value, uint16_t length);
@@ -0,0 +1,214 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/bluetooth.h"
+
+/*
+ * Non-blocking HCI command engine, the mainloop counterpart of
+ * hci_send_req(). Commands are queued and written as the controller hands
+ * out Num_HCI_Command_Packets credits, so several can be in flight at once.
+ */
+struct bt_hci;
+
+struct mainloop;
+
+struct bt_hci *bt_hci_new(int fd);
+struct bt_hci *bt_hci_new_with_loop(int fd, struct mainloop *loop);
+struct bt_hci *bt_hci_new_raw_device(uint16_t index);
+
+struct bt_hci *bt_hci_ref(struct bt_hci *hci);
+void bt_hci_unref(struct bt_hci *hci);
+
+bool bt_hci_set_close_on_unref(struct bt_hci *hci, bool do_close);
+
+typedef void (*bt_hci_destroy_func_t)(void *user_data);
+
+/*
+ * Called with the return parameters of Command Complete, or with the status
+ * octet of Command Status. data is NULL and size 0 when the controller did
+ * not answer within the command timeout.
+ */
+typedef void (*bt_hci_callback_func_t)(const void *data, uint8_t size,
+							void *user_data);
+
+unsigned int bt_hci_send(struct bt_hci *hci, uint16_t opcode,
+				const void *data, uint8_t size,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy);
+bool bt_hci_cancel(struct bt_hci *hci, unsigned int id);
+bool bt_hci_flush(struct bt_hci *hci);
+
+unsigned int bt_hci_register(struct bt_hci *hci, uint8_t event,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy);
+/* LE Meta events of one subevent, called with what follows the subevent */
+unsigned int bt_hci_register_le(struct bt_hci *hci, uint8_t subevent,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy);
+bool bt_hci_unregister(struct bt_hci *hci, unsigned int id);
+
+/*
+ * Asynchronous versions of the hci_le_* helpers. The callback gets the HCI
+ * status, HCI_UNSPECIFIED_ERROR if the controller never answered. Commands
+ * that finish later with an LE Meta event (connection creation and update,
+ * remote features) report the Command Status; register for the subevent to
+ * learn the outcome.
+ */
+typedef void (*bt_hci_status_func_t)(uint8_t status, void *user_data);
+typedef void (*bt_hci_size_func_t)(uint8_t status, uint8_t size,
+							void *user_data);
+
+unsigned int bt_hci_le_set_scan_enable(struct bt_hci *hci, uint8_t enable,
+					uint8_t filter_dup,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_set_scan_parameters(struct bt_hci *hci, uint8_t type,
+					uint16_t interval, uint16_t window,
+					uint8_t own_type, uint8_t filter,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_set_advertise_enable(struct bt_hci *hci,
+					uint8_t enable,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_create_conn(struct bt_hci *hci, uint16_t interval,
+					uint16_t window, uint8_t initiator_filter,
+					uint8_t peer_bdaddr_type,
+					const bdaddr_t *peer_bdaddr,
+					uint8_t own_bdaddr_type,
+					uint16_t min_interval,
+					uint16_t max_interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					uint16_t min_ce_length,
+					uint16_t max_ce_length,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_conn_update(struct bt_hci *hci, uint16_t handle,
+					uint16_t min_interval,
+					uint16_t max_interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_add_white_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_rm_white_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_read_white_list_size(struct bt_hci *hci,
+					bt_hci_size_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_clear_white_list(struct bt_hci *hci,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_add_resolving_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					const uint8_t peer_irk[16],
+					const uint8_t local_irk[16],
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_rm_resolving_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_clear_resolving_list(struct bt_hci *hci,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_read_resolving_list_size(struct bt_hci *hci,
+					bt_hci_size_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_set_address_resolution_enable(struct bt_hci *hci,
+					uint8_t enable,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_read_remote_features(struct bt_hci *hci,
+					uint16_t handle,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+
+typedef void (*bt_hci_phy_func_t)(uint8_t status, uint8_t tx_phy,
+					uint8_t rx_phy, void *user_data);
+
+unsigned int bt_hci_le_read_phy(struct bt_hci *hci, uint16_t handle,
+					bt_hci_phy_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+
+/*
+ * Link tuning procedures. Each sends its command and then waits for the
+ * controller to report what was actually agreed with the peer, which may
+ * be less than asked for. If the link kept its current Data Length or
+ * connection parameters no event follows; after a few seconds the callback
+ * gets HCI_SUCCESS with all values zero. An unanswered PHY update falls
+ * back to reading the PHYs in use. bt_hci_unregister() with the returned
+ * id abandons the procedure.
+ */
+typedef void (*bt_hci_data_length_func_t)(uint8_t status, uint16_t tx_octets,
+					uint16_t tx_time, uint16_t rx_octets,
+					uint16_t rx_time, void *user_data);
+typedef void (*bt_hci_conn_params_func_t)(uint8_t status, uint16_t interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					void *user_data);
+
+unsigned int bt_hci_le_set_data_length(struct bt_hci *hci, uint16_t handle,
+					uint16_t tx_octets, uint16_t tx_time,
+					bt_hci_data_length_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_set_phy(struct bt_hci *hci, uint16_t handle,
+					uint8_t all_phys, uint8_t tx_phys,
+					uint8_t rx_phys, uint16_t phy_opts,
+					bt_hci_phy_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+unsigned int bt_hci_le_update_conn(struct bt_hci *hci, uint16_t handle,
+					uint16_t min_interval,
+					uint16_t max_interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					bt_hci_conn_params_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
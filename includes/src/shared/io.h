@@ -27,14 +27,19 @@
 typedef void (*io_destroy_func_t)(void *data);
 
 struct io;
+struct mainloop;
 
 struct io *io_new(int fd);
+struct io *io_new_with_loop(int fd, struct mainloop *loop);
 void io_destroy(struct io *io);
 
+struct mainloop *io_get_loop(struct io *io);
+
 int io_get_fd(struct io *io);
 bool io_set_close_on_destroy(struct io *io, bool do_close);
 
 ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt);
+int io_send_batch(struct io *io, const struct iovec *iov, int iovcnt);
 bool io_shutdown(struct io *io);
 
 typedef bool (*io_callback_func_t)(struct io *io, void *user_data);
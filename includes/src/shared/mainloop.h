@@ -25,11 +25,14 @@
 #include <signal.h>
 #include <sys/epoll.h>
 
+struct mainloop;
+
 typedef void (*mainloop_destroy_func) (void *user_data);
 
 typedef void (*mainloop_event_func) (int fd, uint32_t events, void *user_data);
 typedef void (*mainloop_timeout_func) (int id, void *user_data);
 typedef void (*mainloop_signal_func) (int signum, void *user_data);
+typedef void (*mainloop_post_func) (void *user_data);
 
 void mainloop_init(void);
 void mainloop_quit(void);
@@ -37,6 +40,10 @@ void mainloop_exit_success(void);
 void mainloop_exit_failure(void);
 int mainloop_run(void);
 
+void mainloop_set_max_events(unsigned int max_events);
+unsigned int mainloop_get_fd_count(void);
+unsigned int mainloop_get_timeout_count(void);
+
 int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 				void *user_data, mainloop_destroy_func destroy);
 int mainloop_modify_fd(int fd, uint32_t events);
@@ -49,3 +56,52 @@ int mainloop_remove_timeout(int id);
 
 int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
 				void *user_data, mainloop_destroy_func destroy);
+
+/*
+ * Explicit loop contexts. Each loop may be run by its own thread; objects
+ * bound to a loop must only be used from the thread running it. The calls
+ * above operate on the loop run by the calling thread, or on the default
+ * loop when the thread is not running one.
+ */
+struct mainloop *mainloop_new(void);
+void mainloop_free(struct mainloop *loop);
+
+struct mainloop *mainloop_get_default(void);
+struct mainloop *mainloop_get_current(void);
+void mainloop_set_current(struct mainloop *loop);
+
+/*
+ * A loop is torn down when its run returns and cannot be run again: all
+ * its entries are gone and further runs fail right away.
+ */
+int mainloop_loop_run(struct mainloop *loop);
+void mainloop_loop_quit(struct mainloop *loop);
+
+/*
+ * May be called from any thread: callback runs on the thread running loop.
+ * Calls still queued when the loop stops only get their destroy.
+ */
+int mainloop_loop_post(struct mainloop *loop, mainloop_post_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+
+void mainloop_loop_set_max_events(struct mainloop *loop,
+						unsigned int max_events);
+unsigned int mainloop_loop_get_fd_count(struct mainloop *loop);
+unsigned int mainloop_loop_get_timeout_count(struct mainloop *loop);
+
+int mainloop_loop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+int mainloop_loop_modify_fd(struct mainloop *loop, int fd, uint32_t events);
+int mainloop_loop_remove_fd(struct mainloop *loop, int fd);
+
+int mainloop_loop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+int mainloop_loop_modify_timeout(struct mainloop *loop, int id,
+							unsigned int msec);
+int mainloop_loop_remove_timeout(struct mainloop *loop, int id);
+
+/* Per loop state owned by the timeout implementation */
+void *mainloop_loop_get_timeout_data(struct mainloop *loop);
+void mainloop_loop_set_timeout_data(struct mainloop *loop, void *data);
@@ -30,6 +30,7 @@ struct queue;
 struct queue_entry {
 	void *data;
 	struct queue_entry *next;
+	struct queue_entry *prev;
 };
 
 struct queue *queue_new(void);
@@ -39,6 +40,15 @@ bool queue_push_tail(struct queue *queue, void *data);
 bool queue_push_head(struct queue *queue, void *data);
 bool queue_push_after(struct queue *queue, void *entry, void *data);
 void *queue_pop_head(struct queue *queue);
+
+/*
+ * Like queue_push_tail and queue_push_head, returning the entry so that the
+ * data can later be taken out in constant time. The entry is only valid
+ * until the data leaves the queue, by whatever means.
+ */
+struct queue_entry *queue_push_tail_entry(struct queue *queue, void *data);
+struct queue_entry *queue_push_head_entry(struct queue *queue, void *data);
+bool queue_remove_entry(struct queue *queue, struct queue_entry *entry);
 void *queue_peek_head(struct queue *queue);
 void *queue_peek_tail(struct queue *queue);
 
@@ -0,0 +1,120 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/bluetooth.h"
+#include "src/shared/hci.h"
+
+/*
+ * LE scanner: reads LE Advertising Report events in batches, parses them
+ * into fixed size reports and drops the ones already seen.
+ */
+struct bt_scan;
+
+#define BT_SCAN_AD_MAX		31
+#define BT_SCAN_TX_POWER_NONE	127
+
+/*
+ * One advertising report. The AD fields found are given as offset and
+ * length into data, an offset of 0 meaning absent; manufacturer data
+ * starts after the company id, service data with its 16-bit UUID.
+ */
+struct bt_scan_report {
+	bdaddr_t addr;
+	uint8_t addr_type;
+	uint8_t evt_type;
+	int8_t rssi;
+	int8_t tx_power;
+	uint8_t flags;
+	uint8_t data_len;
+	uint16_t appearance;
+	uint16_t company_id;
+	uint8_t name_offset;
+	uint8_t name_len;
+	uint8_t mfr_offset;
+	uint8_t mfr_len;
+	uint8_t uuid16_offset;
+	uint8_t uuid16_len;
+	uint8_t svc_data_offset;
+	uint8_t svc_data_len;
+	uint8_t data[BT_SCAN_AD_MAX];
+};
+
+/* reports is only valid during the call */
+typedef void (*bt_scan_report_func_t)(const struct bt_scan_report *reports,
+					unsigned int count, void *user_data);
+typedef void (*bt_scan_destroy_func_t)(void *user_data);
+
+/*
+ * Commands go through hci, events are read from fd, which should carry
+ * nothing but LE Meta events at high report rates.
+ */
+struct bt_scan *bt_scan_new(struct bt_hci *hci, int fd);
+struct bt_scan *bt_scan_new_raw_device(uint16_t index);
+
+struct bt_scan *bt_scan_ref(struct bt_scan *scan);
+void bt_scan_unref(struct bt_scan *scan);
+
+bool bt_scan_set_close_on_unref(struct bt_scan *scan, bool do_close);
+
+bool bt_scan_set_report_handler(struct bt_scan *scan,
+					bt_scan_report_func_t callback,
+					void *user_data,
+					bt_scan_destroy_func_t destroy);
+
+/*
+ * Reports with the same address, type and payload as one delivered less
+ * than window_ms ago are dropped; window_ms 0 drops them for as long as
+ * they stay in the table. entries is rounded up to a power of two, 0
+ * turns deduplication off.
+ */
+bool bt_scan_set_dedup(struct bt_scan *scan, unsigned int entries,
+						unsigned int window_ms);
+
+/*
+ * Duplicate filtering in the controller stays off: it goes by address
+ * only and would hide payload changes.
+ */
+bool bt_scan_start(struct bt_scan *scan, uint8_t type, uint16_t interval,
+					uint16_t window, uint8_t own_type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy);
+bool bt_scan_stop(struct bt_scan *scan);
+
+struct bt_scan_stats {
+	uint64_t events;		/* LE Advertising Report events */
+	uint64_t reports;		/* Reports in them */
+	uint64_t delivered;
+	uint64_t batches;
+	uint64_t duplicates;		/* Dropped by deduplication */
+	uint64_t malformed;		/* Dropped for bad lengths */
+	uint64_t evictions;		/* Dedup entries reused early */
+	unsigned int reports_per_sec;	/* Over the last full second */
+	unsigned int delivered_per_sec;
+};
+
+bool bt_scan_get_stats(struct bt_scan *scan, struct bt_scan_stats *stats);
+bool bt_scan_reset_stats(struct bt_scan *scan);
@@ -25,3 +25,12 @@ typedef void (*timeout_destroy_func_t)(void *user_data);
 unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
 			void *user_data, timeout_destroy_func_t destroy);
 void timeout_remove(unsigned int id);
+unsigned int timeout_get_count(void);
+
+struct mainloop;
+
+unsigned int timeout_loop_add(struct mainloop *loop, unsigned int timeout,
+				timeout_func_t func, void *user_data,
+				timeout_destroy_func_t destroy);
+void timeout_loop_remove(struct mainloop *loop, unsigned int id);
+unsigned int timeout_loop_get_count(struct mainloop *loop);
@@ -36,8 +36,8 @@
 #include <string.h>
 #include <sys/socket.h>
 
-#include "bluetooth.h"
-#include "hci.h"
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
 
 void baswap(bdaddr_t *dst, const bdaddr_t *src)
 {
@@ -0,0 +1,318 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "src/shared/aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define HAVE_AES_NI
+#elif defined(__aarch64__) && \
+		(defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#include <sys/auxv.h>
+#include <arm_neon.h>
+#define HAVE_AES_CE
+#ifndef HWCAP_AES
+#define HWCAP_AES	(1 << 3)
+#endif
+#endif
+
+#define AES_ROUNDS	10
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline uint8_t xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0x00);
+}
+
+static inline void xor_block(uint8_t *dst, const uint8_t *src)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		dst[i] ^= src[i];
+}
+
+static void aes_encrypt_generic(const struct bt_aes_key *key,
+					const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t s[16], t[16];
+	int round, c, r;
+
+	memcpy(s, in, 16);
+	xor_block(s, key->rk[0]);
+
+	for (round = 1; round <= AES_ROUNDS; round++) {
+		/* SubBytes and ShiftRows, the state is stored column major */
+		for (c = 0; c < 4; c++)
+			for (r = 0; r < 4; r++)
+				t[c * 4 + r] = sbox[s[((c + r) & 3) * 4 + r]];
+
+		if (round == AES_ROUNDS) {
+			memcpy(s, t, 16);
+		} else {
+			/* MixColumns */
+			for (c = 0; c < 4; c++) {
+				uint8_t *a = t + c * 4;
+				uint8_t all = a[0] ^ a[1] ^ a[2] ^ a[3];
+
+				s[c * 4 + 0] = a[0] ^ all ^ xtime(a[0] ^ a[1]);
+				s[c * 4 + 1] = a[1] ^ all ^ xtime(a[1] ^ a[2]);
+				s[c * 4 + 2] = a[2] ^ all ^ xtime(a[2] ^ a[3]);
+				s[c * 4 + 3] = a[3] ^ all ^ xtime(a[3] ^ a[0]);
+			}
+		}
+
+		xor_block(s, key->rk[round]);
+	}
+
+	memcpy(out, s, 16);
+}
+
+#ifdef HAVE_AES_NI
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_ni(const struct bt_aes_key *key,
+					const uint8_t in[16], uint8_t out[16])
+{
+	__m128i s;
+	int round;
+
+	s = _mm_loadu_si128((const __m128i *) in);
+	s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *) key->rk[0]));
+
+	for (round = 1; round < AES_ROUNDS; round++)
+		s = _mm_aesenc_si128(s,
+			_mm_loadu_si128((const __m128i *) key->rk[round]));
+
+	s = _mm_aesenclast_si128(s,
+			_mm_loadu_si128((const __m128i *) key->rk[AES_ROUNDS]));
+
+	_mm_storeu_si128((__m128i *) out, s);
+}
+
+static bool cpu_has_aes(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ecx & bit_AES;
+}
+#endif
+
+#ifdef HAVE_AES_CE
+static void aes_encrypt_ce(const struct bt_aes_key *key,
+					const uint8_t in[16], uint8_t out[16])
+{
+	uint8x16_t s;
+	int round;
+
+	s = vld1q_u8(in);
+
+	/* AESE does AddRoundKey before SubBytes and ShiftRows */
+	for (round = 0; round < AES_ROUNDS - 1; round++)
+		s = vaesmcq_u8(vaeseq_u8(s, vld1q_u8(key->rk[round])));
+
+	s = vaeseq_u8(s, vld1q_u8(key->rk[AES_ROUNDS - 1]));
+	s = veorq_u8(s, vld1q_u8(key->rk[AES_ROUNDS]));
+
+	vst1q_u8(out, s);
+}
+
+static bool cpu_has_aes(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_AES;
+}
+#endif
+
+typedef void (*aes_encrypt_func_t)(const struct bt_aes_key *key,
+					const uint8_t in[16], uint8_t out[16]);
+
+static aes_encrypt_func_t aes_encrypt_impl;
+static const char *aes_impl_name;
+
+static void aes_select_impl(void)
+{
+	if (aes_encrypt_impl)
+		return;
+
+#if defined(HAVE_AES_NI)
+	if (cpu_has_aes()) {
+		aes_impl_name = "aes-ni";
+		aes_encrypt_impl = aes_encrypt_ni;
+		return;
+	}
+#elif defined(HAVE_AES_CE)
+	if (cpu_has_aes()) {
+		aes_impl_name = "armv8-ce";
+		aes_encrypt_impl = aes_encrypt_ce;
+		return;
+	}
+#endif
+
+	aes_impl_name = "generic";
+	aes_encrypt_impl = aes_encrypt_generic;
+}
+
+const char *bt_aes_get_impl(void)
+{
+	aes_select_impl();
+
+	return aes_impl_name;
+}
+
+void bt_aes_set_key(struct bt_aes_key *key, const uint8_t k[16])
+{
+	uint8_t rcon = 0x01;
+	int i;
+
+	memcpy(key->rk[0], k, 16);
+
+	for (i = 1; i <= AES_ROUNDS; i++) {
+		const uint8_t *prev = key->rk[i - 1];
+		uint8_t *rk = key->rk[i];
+		int j;
+
+		/* RotWord, SubWord and Rcon on the last word of the previous key */
+		rk[0] = prev[0] ^ sbox[prev[13]] ^ rcon;
+		rk[1] = prev[1] ^ sbox[prev[14]];
+		rk[2] = prev[2] ^ sbox[prev[15]];
+		rk[3] = prev[3] ^ sbox[prev[12]];
+
+		for (j = 4; j < 16; j++)
+			rk[j] = prev[j] ^ rk[j - 4];
+
+		rcon = xtime(rcon);
+	}
+}
+
+void bt_aes_encrypt(const struct bt_aes_key *key, const uint8_t in[16],
+							uint8_t out[16])
+{
+	aes_select_impl();
+
+	aes_encrypt_impl(key, in, out);
+}
+
+static void cmac_subkey(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t msb = in[0] & 0x80;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+
+	out[15] = in[15] << 1;
+
+	if (msb)
+		out[15] ^= 0x87;
+}
+
+void bt_aes_cmac_set_key(struct bt_aes_cmac_key *key, const uint8_t k[16])
+{
+	uint8_t l[16];
+
+	bt_aes_set_key(&key->aes, k);
+
+	memset(l, 0, sizeof(l));
+	bt_aes_encrypt(&key->aes, l, l);
+
+	cmac_subkey(l, key->k1);
+	cmac_subkey(key->k1, key->k2);
+}
+
+void bt_aes_cmac(const struct bt_aes_cmac_key *key, const uint8_t *msg,
+					size_t msg_len, uint8_t mac[16])
+{
+	uint8_t x[16];
+
+	aes_select_impl();
+
+	memset(x, 0, sizeof(x));
+
+	/* All blocks but the last one are plain CBC-MAC */
+	while (msg_len > 16) {
+		xor_block(x, msg);
+		aes_encrypt_impl(&key->aes, x, x);
+
+		msg += 16;
+		msg_len -= 16;
+	}
+
+	if (msg_len == 16) {
+		xor_block(x, msg);
+		xor_block(x, key->k1);
+	} else {
+		uint8_t last[16];
+
+		memset(last, 0, sizeof(last));
+		memcpy(last, msg, msg_len);
+		last[msg_len] = 0x80;
+
+		xor_block(x, last);
+		xor_block(x, key->k2);
+	}
+
+	aes_encrypt_impl(&key->aes, x, mac);
+}
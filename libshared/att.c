@@ -26,9 +26,14 @@
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
 
+#include "src/shared/mainloop.h"
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
 #include "src/shared/util.h"
@@ -38,20 +43,49 @@
 #include "lib/uuid.h"
 #include "src/shared/att.h"
 #include "src/shared/crypto.h"
+#include "src/shared/btsnoop.h"
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
 
 #define ATT_MIN_PDU_LEN			1  /* At least 1 byte for the opcode. */
 #define ATT_OP_CMD_MASK			0x40
 #define ATT_OP_SIGNED_MASK		0x80
 #define ATT_TIMEOUT_INTERVAL		30000  /* 30000 ms */
+#define ATT_TX_BATCH_MAX		32  /* PDUs per batched write */
+#define ATT_OP_POOL_MAX			16  /* Cached ops per bearer */
+#define ATT_TRACE_CID			0x0004
+#define ATT_NUM_OPCODES			256
+#define ATT_ID_BUCKETS			64  /* Of each id table */
 
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
 
 struct att_send_op;
+struct att_chan;
+struct att_trace;
+
+/*
+ * Ops and registrations are looked up by the id handed out for them. Ids
+ * are sequential, so they spread evenly over the buckets, and each object
+ * unlinks itself in constant time.
+ */
+struct att_id_link {
+	unsigned int id;
+	void *data;
+	struct att_id_link *next;
+	struct att_id_link **pprev;	/* NULL while not in a table */
+};
 
 struct bt_att {
 	int ref_count;
 	int fd;
+	struct mainloop *loop;
 	struct io *io;
 	bool io_on_l2cap;
 	int io_sec_level;		/* Only used for non-L2CAP */
@@ -64,14 +98,62 @@ struct bt_att {
 	struct queue *write_queue;	/* Queue of PDUs ready to send */
 	bool writer_active;
 
+	/*
+	 * Commands and notifications are refused while write_queue holds
+	 * write_high PDUs; write_ready runs once it is down to write_low.
+	 */
+	unsigned int write_high;	/* 0 for no limit */
+	unsigned int write_low;
+	bool write_full;
+	bt_att_ready_func_t write_ready;
+	bt_att_destroy_func_t write_ready_destroy;
+	void *write_ready_data;
+
+	struct att_id_link *op_ids[ATT_ID_BUCKETS];	/* Ops sent, by id */
+	struct att_send_op *op_pool;	/* Free ops with inline PDU storage */
+	unsigned int op_pool_len;
+	bool tx_batch;			/* Send queued PDUs with sendmmsg */
+
+	uint64_t tx_wakeups;		/* Writable wakeups that sent data */
+	uint64_t tx_pdus;		/* PDUs sent over all wakeups */
+
+	struct bt_att_stats stats;	/* Traffic over all bearers */
+	struct bt_att_op_stats *op_stats[ATT_NUM_OPCODES];	/* By opcode */
+
 	struct queue *notify_list;	/* List of registered callbacks */
+	struct queue *notify_table[ATT_NUM_OPCODES];	/* By opcode */
+	struct att_id_link *notify_ids[ATT_ID_BUCKETS];
+	struct queue *notify_removed;	/* Waiting for purge_notify() */
+	unsigned int notify_depth;	/* Nested handle_notify calls */
+	bool notify_purge;		/* Unregistered during dispatch */
 	struct queue *disconn_list;	/* List of disconnect handlers */
+	struct att_id_link *disconn_ids[ATT_ID_BUCKETS];
 
 	bool in_req;			/* There's a pending incoming request */
 
+	/*
+	 * Enhanced ATT channels. Incoming requests are served one at a time
+	 * across all bearers; req_chan is where the response has to go.
+	 */
+	struct queue *chans;
+	struct queue *deferred_reqs;	/* Requests waiting for serving */
+	bool serving;			/* An incoming request is being served */
+	bool req_orphaned;		/* Its channel went away meanwhile */
+	struct att_chan *req_chan;	/* NULL for the primary bearer */
+	struct att_chan *ind_chan;	/* Channel owed a confirmation */
+	unsigned int deferred_id;	/* Timeout dispatching deferred_reqs */
+
 	uint8_t *buf;
 	uint16_t mtu;
 
+	/* Optional recvmmsg receive ring, rx_count MTU sized buffers */
+	unsigned int rx_count;
+	uint8_t *rx_bufs;
+	struct iovec *rx_iov;
+	struct mmsghdr *rx_msgs;
+	bool rx_dispatching;		/* PDUs in the ring are being handled */
+	bool rx_resize;			/* MTU changed while dispatching */
+
 	unsigned int next_send_id;	/* IDs for "send" ops */
 	unsigned int next_reg_id;	/* IDs for registered callbacks */
 
@@ -87,10 +169,59 @@ struct bt_att {
 
 	struct sign_info *local_sign;
 	struct sign_info *remote_sign;
+
+	struct att_trace *trace;	/* Optional capture of raw PDUs */
+	unsigned int next_chan_id;
+};
+
+struct att_chan {
+	struct bt_att *att;
+	unsigned int id;		/* Bearer number in traces */
+	int fd;
+	struct io *io;
+	uint16_t mtu;
+	uint8_t *buf;
+	struct queue *queue;		/* Responses and confirmations */
+	struct att_send_op *pending_req;
+	bool in_req;
+	bool writer_active;
+};
+
+/*
+ * Fixed size ring of the most recent PDUs. There is a single writer, the
+ * loop serving this bt_att. Each record carries a sequence number that is
+ * cleared while it is being overwritten, so a reader can take consistent
+ * copies without locking even while capture goes on.
+ */
+struct att_trace_rec {
+	unsigned int seq;		/* Record index + 1, 0 while written */
+	uint16_t bearer;
+	uint16_t len;
+	uint16_t orig_len;
+	bool received;
+	uint64_t usec;			/* Wall clock time of capture */
+	uint8_t data[];
+};
+
+struct att_trace {
+	unsigned int count;
+	uint16_t snaplen;
+	size_t rec_size;
+	unsigned int head;		/* Records written so far */
+	uint8_t *recs;
 };
 
+struct att_deferred {
+	struct att_chan *chan;
+	uint16_t len;
+	uint8_t pdu[];
+};
+
+static void req_done(struct bt_att *att);
+
 struct sign_info {
 	uint8_t key[16];
+	struct bt_crypto_cmac_key *cmac;
 	bt_att_counter_func_t counter;
 	void *user_data;
 };
@@ -137,6 +268,9 @@ static const struct {
 	{ BT_ATT_OP_HANDLE_VAL_NOT,		ATT_OP_TYPE_NOT },
 	{ BT_ATT_OP_HANDLE_VAL_IND,		ATT_OP_TYPE_IND },
 	{ BT_ATT_OP_HANDLE_VAL_CONF,		ATT_OP_TYPE_CONF },
+	{ BT_ATT_OP_READ_MULT_VL_REQ,		ATT_OP_TYPE_REQ },
+	{ BT_ATT_OP_READ_MULT_VL_RSP,		ATT_OP_TYPE_RSP },
+	{ BT_ATT_OP_HANDLE_VAL_MULT_NOT,	ATT_OP_TYPE_NOT },
 	{ }
 };
 
@@ -170,6 +304,7 @@ static const struct {
 	{ BT_ATT_OP_WRITE_REQ,			BT_ATT_OP_WRITE_RSP },
 	{ BT_ATT_OP_PREP_WRITE_REQ,		BT_ATT_OP_PREP_WRITE_RSP },
 	{ BT_ATT_OP_EXEC_WRITE_REQ,		BT_ATT_OP_EXEC_WRITE_RSP },
+	{ BT_ATT_OP_READ_MULT_VL_REQ,		BT_ATT_OP_READ_MULT_VL_RSP },
 	{ }
 };
 
@@ -186,6 +321,7 @@ static uint8_t get_req_opcode(uint8_t rsp_opcode)
 }
 
 struct att_send_op {
+	struct bt_att *att;
 	unsigned int id;
 	unsigned int timeout_id;
 	enum att_op_type type;
@@ -195,20 +331,128 @@ struct att_send_op {
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	uint64_t sent_usec;		/* When it became pending */
+
+	struct att_id_link link;	/* In op_ids once it has an id */
+	struct queue *queue;		/* Where it waits to be written */
+	struct queue_entry *entry;	/* Its entry there */
+
+	struct att_send_op *next_free;
+	uint16_t size;			/* Size of the inline PDU storage */
+	uint8_t data[];
 };
 
+static void id_link_add(struct att_id_link **table, struct att_id_link *link,
+						unsigned int id, void *data)
+{
+	struct att_id_link **head = &table[id % ATT_ID_BUCKETS];
+
+	link->id = id;
+	link->data = data;
+	link->next = *head;
+	link->pprev = head;
+
+	if (*head)
+		(*head)->pprev = &link->next;
+
+	*head = link;
+}
+
+static void id_link_remove(struct att_id_link *link)
+{
+	if (!link->pprev)
+		return;
+
+	*link->pprev = link->next;
+
+	if (link->next)
+		link->next->pprev = link->pprev;
+
+	link->next = NULL;
+	link->pprev = NULL;
+}
+
+static void *id_link_find(struct att_id_link **table, unsigned int id)
+{
+	struct att_id_link *link;
+
+	for (link = table[id % ATT_ID_BUCKETS]; link; link = link->next) {
+		if (link->id == id)
+			return link->data;
+	}
+
+	return NULL;
+}
+
+static struct att_send_op *att_send_op_get(struct bt_att *att, uint16_t size)
+{
+	struct att_send_op *op = att->op_pool;
+	uint16_t capacity;
+
+	if (op && op->size >= size) {
+		att->op_pool = op->next_free;
+		att->op_pool_len--;
+		capacity = op->size;
+	} else {
+		/* Size new ops for the MTU so they can be recycled */
+		capacity = MAX(size, att->mtu);
+
+		op = malloc(sizeof(*op) + capacity);
+		if (!op)
+			return NULL;
+	}
+
+	memset(op, 0, sizeof(*op));
+	op->att = att;
+	op->size = capacity;
+	op->pdu = op->data;
+
+	return op;
+}
+
+static void att_send_op_put(struct att_send_op *op)
+{
+	struct bt_att *att = op->att;
+
+	id_link_remove(&op->link);
+
+	/* Ops too small for the current MTU are not worth keeping */
+	if (att->op_pool_len >= ATT_OP_POOL_MAX || op->size < att->mtu) {
+		free(op);
+		return;
+	}
+
+	op->next_free = att->op_pool;
+	att->op_pool = op;
+	att->op_pool_len++;
+}
+
+static void op_pool_free(struct bt_att *att)
+{
+	struct att_send_op *op;
+
+	while ((op = att->op_pool)) {
+		att->op_pool = op->next_free;
+		free(op);
+	}
+
+	att->op_pool_len = 0;
+}
+
 static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
+	bt_att_destroy_func_t destroy = op->destroy;
+	void *user_data = op->user_data;
 
 	if (op->timeout_id)
-		timeout_remove(op->timeout_id);
+		timeout_loop_remove(op->att->loop, op->timeout_id);
 
-	if (op->destroy)
-		op->destroy(op->user_data);
+	/* Recycle first, the destroy callback may drop the last reference */
+	att_send_op_put(op);
 
-	free(op->pdu);
-	free(op);
+	if (destroy)
+		destroy(user_data);
 }
 
 static void cancel_att_send_op(struct att_send_op *op)
@@ -221,9 +465,45 @@ static void cancel_att_send_op(struct att_send_op *op)
 	op->destroy = NULL;
 }
 
+static bool op_push_tail(struct queue *queue, struct att_send_op *op)
+{
+	op->entry = queue_push_tail_entry(queue, op);
+	op->queue = op->entry ? queue : NULL;
+
+	return op->entry != NULL;
+}
+
+static bool op_push_head(struct queue *queue, struct att_send_op *op)
+{
+	op->entry = queue_push_head_entry(queue, op);
+	op->queue = op->entry ? queue : NULL;
+
+	return op->entry != NULL;
+}
+
+/* For ops taken out of their queue by any other means than their entry */
+static struct att_send_op *op_dequeued(struct att_send_op *op)
+{
+	if (op) {
+		op->queue = NULL;
+		op->entry = NULL;
+	}
+
+	return op;
+}
+
+static struct att_send_op *op_pop_head(struct queue *queue)
+{
+	return op_dequeued(queue_pop_head(queue));
+}
+
 struct att_notify {
 	unsigned int id;
 	uint16_t opcode;
+	bool removed;
+	struct att_id_link link;		/* In notify_ids */
+	struct queue_entry *list_entry;		/* In notify_list */
+	struct queue_entry *table_entry;	/* In notify_table[opcode] */
 	bt_att_notify_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
@@ -233,23 +513,54 @@ static void destroy_att_notify(void *data)
 {
 	struct att_notify *notify = data;
 
+	id_link_remove(&notify->link);
+
 	if (notify->destroy)
 		notify->destroy(notify->user_data);
 
 	free(notify);
 }
 
-static bool match_notify_id(const void *a, const void *b)
+static void mark_notify_removed(void *data, void *user_data)
 {
-	const struct att_notify *notify = a;
-	unsigned int id = PTR_TO_UINT(b);
+	struct att_notify *notify = data;
+	struct bt_att *att = user_data;
+
+	if (notify->removed)
+		return;
+
+	notify->removed = true;
+	queue_push_tail(att->notify_removed, notify);
+}
+
+/*
+ * Handlers unregistered while a PDU is being dispatched are only marked as
+ * removed, since handle_notify may still be walking their table entry.
+ */
+static void purge_notify(struct bt_att *att)
+{
+	struct att_notify *notify;
+
+	if (att->notify_depth) {
+		att->notify_purge = true;
+		return;
+	}
 
-	return notify->id == id;
+	att->notify_purge = false;
+
+	while ((notify = queue_pop_head(att->notify_removed))) {
+		queue_remove_entry(att->notify_list, notify->list_entry);
+		queue_remove_entry(att->notify_table[notify->opcode],
+							notify->table_entry);
+		destroy_att_notify(notify);
+	}
 }
 
 struct att_disconn {
 	unsigned int id;
 	bool removed;
+	struct att_id_link link;	/* In disconn_ids */
+	struct queue_entry *entry;	/* In disconn_list */
 	bt_att_disconnect_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
@@ -259,63 +570,84 @@ static void destroy_att_disconn(void *data)
 {
 	struct att_disconn *disconn = data;
 
+	id_link_remove(&disconn->link);
+
 	if (disconn->destroy)
 		disconn->destroy(disconn->user_data);
 
 	free(disconn);
 }
 
-static bool match_disconn_id(const void *a, const void *b)
+static uint16_t signature_len(struct bt_att *att, uint8_t opcode)
 {
-	const struct att_disconn *disconn = a;
-	unsigned int id = PTR_TO_UINT(b);
+	if (att->local_sign && (opcode & ATT_OP_SIGNED_MASK))
+		return BT_ATT_SIGNATURE_LEN;
 
-	return disconn->id == id;
+	return 0;
 }
 
-static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
-					const void *pdu, uint16_t length)
+static bool sign_att(struct bt_att *att, struct sign_info *sign,
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12])
 {
-	uint16_t pdu_len = 1;
-	struct sign_info *sign = att->local_sign;
-	uint32_t sign_cnt;
-
-	if (sign && (op->opcode & ATT_OP_SIGNED_MASK))
-		pdu_len += BT_ATT_SIGNATURE_LEN;
-
-	if (length && pdu)
-		pdu_len += length;
-
-	if (pdu_len > att->mtu)
-		return false;
+	if (sign->cmac)
+		return bt_crypto_sign_att_key(att->crypto, sign->cmac, m, m_len,
+							sign_cnt, signature);
 
-	op->len = pdu_len;
-	op->pdu = malloc(op->len);
-	if (!op->pdu)
-		return false;
+	return bt_crypto_sign_att(att->crypto, sign->key, m, m_len, sign_cnt,
+								signature);
+}
 
-	((uint8_t *) op->pdu)[0] = op->opcode;
-	if (pdu_len > 1)
-		memcpy(op->pdu + 1, pdu, length);
+static bool sign_pdu(struct bt_att *att, struct att_send_op *op,
+							uint16_t length)
+{
+	struct sign_info *sign = att->local_sign;
+	uint32_t sign_cnt;
 
 	if (!sign || !(op->opcode & ATT_OP_SIGNED_MASK) || !att->crypto)
 		return true;
 
 	if (!sign->counter(&sign_cnt, sign->user_data))
-		goto fail;
+		return false;
 
-	if ((bt_crypto_sign_att(att->crypto, sign->key, op->pdu, 1 + length,
-				sign_cnt, &((uint8_t *) op->pdu)[1 + length])))
+	if (sign_att(att, sign, op->pdu, 1 + length, sign_cnt,
+					&((uint8_t *) op->pdu)[1 + length]))
 		return true;
 
 	util_debug(att->debug_callback, att->debug_data,
 					"ATT unable to generate signature");
 
-fail:
-	free(op->pdu);
 	return false;
 }
 
+static bool check_op_callback(enum att_op_type type,
+					bt_att_response_func_t callback)
+{
+	/* If the opcode corresponds to an operation type that does not elicit a
+	 * response from the remote end, then no callback should have been
+	 * provided, since it will never be called.
+	 */
+	if (callback && type != ATT_OP_TYPE_REQ && type != ATT_OP_TYPE_IND)
+		return false;
+
+	/* Similarly, if the operation does elicit a response then a callback
+	 * must be provided.
+	 */
+	if (!callback && (type == ATT_OP_TYPE_REQ || type == ATT_OP_TYPE_IND))
+		return false;
+
+	return true;
+}
+
+static uint16_t op_mtu(struct bt_att *att, enum att_op_type type)
+{
+	/* Responses go out on the bearer the request arrived on */
+	if (type == ATT_OP_TYPE_RSP && att->req_chan)
+		return att->req_chan->mtu;
+
+	return att->mtu;
+}
+
 static struct att_send_op *create_att_send_op(struct bt_att *att,
 						uint8_t opcode,
 						const void *pdu,
@@ -326,6 +658,7 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 {
 	struct att_send_op *op;
 	enum att_op_type type;
+	uint16_t pdu_len;
 
 	if (length && !pdu)
 		return NULL;
@@ -334,31 +667,37 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	if (type == ATT_OP_TYPE_UNKNOWN)
 		return NULL;
 
-	/* If the opcode corresponds to an operation type that does not elicit a
-	 * response from the remote end, then no callback should have been
-	 * provided, since it will never be called.
-	 */
-	if (callback && type != ATT_OP_TYPE_REQ && type != ATT_OP_TYPE_IND)
+	if (!check_op_callback(type, callback))
 		return NULL;
 
-	/* Similarly, if the operation does elicit a response then a callback
-	 * must be provided.
-	 */
-	if (!callback && (type == ATT_OP_TYPE_REQ || type == ATT_OP_TYPE_IND))
+	if (!pdu)
+		length = 0;
+
+	pdu_len = 1 + length + signature_len(att, opcode);
+	if (pdu_len > op_mtu(att, type))
+		return NULL;
+
+	op = att_send_op_get(att, pdu_len);
+	if (!op)
 		return NULL;
 
-	op = new0(struct att_send_op, 1);
 	op->type = type;
 	op->opcode = opcode;
-	op->callback = callback;
-	op->destroy = destroy;
-	op->user_data = user_data;
+	op->len = pdu_len;
 
-	if (!encode_pdu(att, op, pdu, length)) {
-		free(op);
+	op->data[0] = opcode;
+	if (length)
+		memcpy(op->data + 1, pdu, length);
+
+	if (!sign_pdu(att, op, length)) {
+		att_send_op_put(op);
 		return NULL;
 	}
 
+	op->callback = callback;
+	op->destroy = destroy;
+	op->user_data = user_data;
+
 	return op;
 }
 
@@ -367,7 +706,7 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	struct att_send_op *op;
 
 	/* See if any operations are already in the write queue */
-	op = queue_pop_head(att->write_queue);
+	op = op_pop_head(att->write_queue);
 	if (op)
 		return op;
 
@@ -375,7 +714,7 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	 * request queue.
 	 */
 	if (!att->pending_req) {
-		op = queue_pop_head(att->req_queue);
+		op = op_pop_head(att->req_queue);
 		if (op)
 			return op;
 	}
@@ -384,7 +723,7 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	 * no pending indication, pick an operation from the indication queue.
 	 */
 	if (!att->pending_ind) {
-		op = queue_pop_head(att->ind_queue);
+		op = op_pop_head(att->ind_queue);
 		if (op)
 			return op;
 	}
@@ -397,11 +736,109 @@ struct timeout_data {
 	unsigned int id;
 };
 
+static bool match_chan_pending_id(const void *a, const void *b)
+{
+	const struct att_chan *chan = a;
+	unsigned int id = PTR_TO_UINT(b);
+
+	return chan->pending_req && chan->pending_req->id == id;
+}
+
+static void trace_pdu(struct bt_att *att, struct att_chan *chan,
+					bool received, const uint8_t *pdu,
+					size_t len);
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct bt_att_op_stats *get_op_stats(struct bt_att *att,
+							uint8_t opcode)
+{
+	struct bt_att_op_stats *stats = att->op_stats[opcode];
+
+	if (!stats) {
+		stats = new0(struct bt_att_op_stats, 1);
+		stats->min_usec = UINT64_MAX;
+		att->op_stats[opcode] = stats;
+	}
+
+	return stats;
+}
+
+/* Bucket i counts latencies in [2^i, 2^(i+1)) microseconds */
+static unsigned int latency_bucket(uint64_t usec)
+{
+	unsigned int bucket;
+
+	if (!usec)
+		return 0;
+
+	bucket = 63 - __builtin_clzll(usec);
+
+	return MIN(bucket, BT_ATT_STATS_LATENCY_BUCKETS - 1);
+}
+
+static void op_completed(struct bt_att *att, struct att_send_op *op,
+								bool error)
+{
+	struct bt_att_op_stats *stats;
+	uint64_t usec;
+
+	if (!op->sent_usec)
+		return;
+
+	stats = get_op_stats(att, op->opcode);
+	usec = now_usec() - op->sent_usec;
+
+	stats->count++;
+	if (error)
+		stats->errors++;
+
+	stats->total_usec += usec;
+	stats->min_usec = MIN(stats->min_usec, usec);
+	stats->max_usec = MAX(stats->max_usec, usec);
+	stats->latency[latency_bucket(usec)]++;
+}
+
+static void update_queue_stats(struct bt_att *att)
+{
+	struct bt_att_stats *stats = &att->stats;
+
+	stats->req_queue_max = MAX(stats->req_queue_max,
+					queue_length(att->req_queue));
+	stats->ind_queue_max = MAX(stats->ind_queue_max,
+					queue_length(att->ind_queue));
+	stats->write_queue_max = MAX(stats->write_queue_max,
+					queue_length(att->write_queue));
+}
+
+static void account_pdu(struct bt_att *att, struct att_chan *chan,
+					bool received, const uint8_t *pdu,
+					size_t len)
+{
+	if (received) {
+		att->stats.rx_pdus++;
+		att->stats.rx_bytes += len;
+	} else {
+		att->stats.tx_pdus++;
+		att->stats.tx_bytes += len;
+	}
+
+	trace_pdu(att, chan, received, pdu, len);
+}
+
 static bool timeout_cb(void *user_data)
 {
 	struct timeout_data *timeout = user_data;
 	struct bt_att *att = timeout->att;
 	struct att_send_op *op = NULL;
+	struct att_chan *chan = NULL;
 
 	if (att->pending_req && att->pending_req->id == timeout->id) {
 		op = att->pending_req;
@@ -409,6 +846,13 @@ static bool timeout_cb(void *user_data)
 	} else if (att->pending_ind && att->pending_ind->id == timeout->id) {
 		op = att->pending_ind;
 		att->pending_ind = NULL;
+	} else {
+		chan = queue_find(att->chans, match_chan_pending_id,
+						UINT_TO_PTR(timeout->id));
+		if (chan) {
+			op = chan->pending_req;
+			chan->pending_req = NULL;
+		}
 	}
 
 	if (!op)
@@ -417,6 +861,9 @@ static bool timeout_cb(void *user_data)
 	util_debug(att->debug_callback, att->debug_data,
 				"Operation timed out: 0x%02x", op->opcode);
 
+	att->stats.timeouts++;
+	get_op_stats(att, op->opcode)->timeouts++;
+
 	if (att->timeout_callback)
 		att->timeout_callback(op->id, op->opcode, att->timeout_data);
 
@@ -426,9 +873,10 @@ static bool timeout_cb(void *user_data)
 	/*
 	 * Directly terminate the connection as required by the ATT protocol.
 	 * This should trigger an io disconnect event which will clean up the
-	 * io and notify the upper layer.
+	 * io and notify the upper layer. A timed out enhanced channel only
+	 * takes itself down.
 	 */
-	io_shutdown(att->io);
+	io_shutdown(chan ? chan->io : att->io);
 
 	return false;
 }
@@ -440,37 +888,66 @@ static void write_watch_destroy(void *user_data)
 	att->writer_active = false;
 }
 
-static bool can_write_data(struct io *io, void *user_data)
+static void start_op_timeout(struct bt_att *att, struct att_send_op *op)
 {
-	struct bt_att *att = user_data;
-	struct att_send_op *op;
 	struct timeout_data *timeout;
-	ssize_t ret;
-	struct iovec iov;
 
-	op = pick_next_send_op(att);
-	if (!op)
-		return false;
+	timeout = new0(struct timeout_data, 1);
+	timeout->att = att;
+	timeout->id = op->id;
+	op->timeout_id = timeout_loop_add(att->loop, ATT_TIMEOUT_INTERVAL,
+						timeout_cb, timeout, free);
+}
 
-	iov.iov_base = op->pdu;
-	iov.iov_len = op->len;
+static struct att_trace_rec *trace_rec(struct att_trace *trace,
+							unsigned int idx)
+{
+	return (void *) (trace->recs + (idx % trace->count) * trace->rec_size);
+}
 
-	ret = io_send(io, &iov, 1);
-	if (ret < 0) {
-		util_debug(att->debug_callback, att->debug_data,
-					"write failed: %s", strerror(-ret));
-		if (op->callback)
-			op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
-							op->user_data);
+static void trace_pdu(struct bt_att *att, struct att_chan *chan,
+					bool received, const uint8_t *pdu,
+					size_t len)
+{
+	struct att_trace *trace = att->trace;
+	struct att_trace_rec *rec;
+	struct timespec ts;
+	unsigned int idx;
 
-		destroy_att_send_op(op);
-		return true;
-	}
+	if (!trace)
+		return;
 
-	util_debug(att->debug_callback, att->debug_data,
-					"ATT op 0x%02x", op->opcode);
+	idx = trace->head;
+	rec = trace_rec(trace, idx);
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	rec->bearer = chan ? chan->id : 0;
+	rec->received = received;
+	rec->orig_len = len;
+	rec->len = MIN(len, trace->snaplen);
+	rec->usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	memcpy(rec->data, pdu, rec->len);
+
+	__atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&trace->head, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void write_op_sent(struct bt_att *att, struct att_chan *chan,
+					struct att_send_op *op, ssize_t len)
+{
+	if (chan)
+		util_debug(att->debug_callback, att->debug_data,
+				"ATT op 0x%02x (fd %d)", op->opcode, chan->fd);
+	else
+		util_debug(att->debug_callback, att->debug_data,
+				"ATT op 0x%02x", op->opcode);
 
-	util_hexdump('<', op->pdu, ret, att->debug_callback, att->debug_data);
+	util_hexdump('<', op->pdu, len, att->debug_callback, att->debug_data);
+	account_pdu(att, chan, false, op->pdu, len);
 
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
@@ -478,14 +955,24 @@ static bool can_write_data(struct io *io, void *user_data)
 	 */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
-		att->pending_req = op;
+		if (chan)
+			chan->pending_req = op;
+		else
+			att->pending_req = op;
+		op->sent_usec = now_usec();
 		break;
 	case ATT_OP_TYPE_IND:
 		att->pending_ind = op;
+		op->sent_usec = now_usec();
 		break;
 	case ATT_OP_TYPE_RSP:
 		/* Set in_req to false to indicate that no request is pending */
-		att->in_req = false;
+		if (chan)
+			chan->in_req = false;
+		else
+			att->in_req = false;
+
+		req_done(att);
 		/* fall through */
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
@@ -493,21 +980,233 @@ static bool can_write_data(struct io *io, void *user_data)
 	case ATT_OP_TYPE_UNKNOWN:
 	default:
 		destroy_att_send_op(op);
+		return;
+	}
+
+	start_op_timeout(att, op);
+}
+
+static void write_op_failed(struct bt_att *att, struct att_send_op *op,
+								int err)
+{
+	util_debug(att->debug_callback, att->debug_data,
+					"write failed: %s", strerror(-err));
+
+	if (op->callback)
+		op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0, op->user_data);
+
+	destroy_att_send_op(op);
+}
+
+static void requeue_send_op(struct bt_att *att, struct att_send_op *op)
+{
+	switch (op->type) {
+	case ATT_OP_TYPE_REQ:
+		op_push_head(att->req_queue, op);
+		break;
+	case ATT_OP_TYPE_IND:
+		op_push_head(att->ind_queue, op);
+		break;
+	default:
+		op_push_head(att->write_queue, op);
+		break;
+	}
+}
+
+static void check_write_ready(struct bt_att *att)
+{
+	if (!att->write_full || queue_length(att->write_queue) > att->write_low)
+		return;
+
+	att->write_full = false;
+
+	if (!att->write_ready)
+		return;
+
+	bt_att_ref(att);
+	att->write_ready(att->write_ready_data);
+	bt_att_unref(att);
+}
+
+static bool can_write_batch(struct io *io, struct bt_att *att)
+{
+	struct att_send_op *ops[ATT_TX_BATCH_MAX];
+	struct iovec iov[ATT_TX_BATCH_MAX];
+	bool req_picked = false, ind_picked = false;
+	struct att_send_op *op;
+	int count = 0;
+	int ret, i;
+
+	/* Drain the write queue plus at most one request and one indication,
+	 * since only one of each may be outstanding at a time.
+	 */
+	while (count < ATT_TX_BATCH_MAX) {
+		op = op_pop_head(att->write_queue);
+
+		if (!op && !att->pending_req && !req_picked) {
+			op = op_pop_head(att->req_queue);
+			req_picked = !!op;
+		}
+
+		if (!op && !att->pending_ind && !ind_picked) {
+			op = op_pop_head(att->ind_queue);
+			ind_picked = !!op;
+		}
+
+		if (!op)
+			break;
+
+		ops[count] = op;
+		iov[count].iov_base = op->pdu;
+		iov[count].iov_len = op->len;
+		count++;
+	}
+
+	if (!count)
+		return false;
+
+	ret = io_send_batch(io, iov, count);
+	if (ret < 0) {
+		write_op_failed(att, ops[0], ret);
+		i = 1;
+		goto requeue;
+	}
+
+	att->tx_wakeups++;
+	att->tx_pdus += ret;
+
+	for (i = 0; i < ret; i++)
+		write_op_sent(att, NULL, ops[i], ops[i]->len);
+
+requeue:
+	/* Put back whatever did not fit, preserving the original order */
+	while (count > i)
+		requeue_send_op(att, ops[--count]);
+
+	check_write_ready(att);
+
+	/* Return true as there may be more operations ready to write. */
+	return true;
+}
+
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct bt_att *att = user_data;
+	struct att_send_op *op;
+	ssize_t ret;
+	struct iovec iov;
+
+	if (att->tx_batch)
+		return can_write_batch(io, att);
+
+	op = pick_next_send_op(att);
+	if (!op)
+		return false;
+
+	iov.iov_base = op->pdu;
+	iov.iov_len = op->len;
+
+	ret = io_send(io, &iov, 1);
+	if (ret < 0) {
+		write_op_failed(att, op, ret);
 		return true;
 	}
 
-	timeout = new0(struct timeout_data, 1);
-	timeout->att = att;
-	timeout->id = op->id;
-	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
-								timeout, free);
+	att->tx_wakeups++;
+	att->tx_pdus++;
+
+	write_op_sent(att, NULL, op, ret);
+
+	check_write_ready(att);
 
 	/* Return true as there may be more operations ready to write. */
 	return true;
 }
 
+static bool match_chan_req(const void *a, const void *b)
+{
+	const struct att_send_op *op = a;
+	const struct att_chan *chan = b;
+
+	/*
+	 * MTU exchange and prepared writes are tied to the primary bearer.
+	 * Channels smaller than the negotiated MTU are skipped so that the
+	 * upper layer can keep sizing requests and judging responses by
+	 * bt_att_get_mtu().
+	 */
+	switch (op->opcode) {
+	case BT_ATT_OP_MTU_REQ:
+	case BT_ATT_OP_PREP_WRITE_REQ:
+	case BT_ATT_OP_EXEC_WRITE_REQ:
+		return false;
+	}
+
+	return chan->mtu >= chan->att->mtu;
+}
+
+static void chan_write_watch_destroy(void *user_data)
+{
+	struct att_chan *chan = user_data;
+
+	chan->writer_active = false;
+}
+
+static bool can_write_chan(struct io *io, void *user_data)
+{
+	struct att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
+	struct att_send_op *op;
+	struct iovec iov;
+	ssize_t ret;
+
+	op = op_pop_head(chan->queue);
+	if (!op && !chan->pending_req)
+		op = op_dequeued(queue_remove_if(att->req_queue,
+							match_chan_req, chan));
+
+	if (!op)
+		return false;
+
+	iov.iov_base = op->pdu;
+	iov.iov_len = op->len;
+
+	ret = io_send(io, &iov, 1);
+	if (ret < 0) {
+		write_op_failed(att, op, ret);
+		return true;
+	}
+
+	att->tx_wakeups++;
+	att->tx_pdus++;
+
+	write_op_sent(att, chan, op, ret);
+
+	return true;
+}
+
+static void wakeup_chan_writer(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+	struct bt_att *att = chan->att;
+
+	if (chan->writer_active)
+		return;
+
+	if (queue_isempty(chan->queue) && (chan->pending_req ||
+			!queue_find(att->req_queue, match_chan_req, chan)))
+		return;
+
+	if (!io_set_write_handler(chan->io, can_write_chan, chan,
+						chan_write_watch_destroy))
+		return;
+
+	chan->writer_active = true;
+}
+
 static void wakeup_writer(struct bt_att *att)
 {
+	queue_foreach(att->chans, wakeup_chan_writer, NULL);
+
 	if (att->writer_active)
 		return;
 
@@ -549,6 +1248,77 @@ static void disc_att_send_op(void *data)
 	destroy_att_send_op(op);
 }
 
+static void chan_free(void *data)
+{
+	struct att_chan *chan = data;
+
+	if (chan->pending_req)
+		destroy_att_send_op(chan->pending_req);
+
+	queue_destroy(chan->queue, destroy_att_send_op);
+	io_destroy(chan->io);
+	free(chan->buf);
+	free(chan);
+}
+
+static void disc_chan_pending(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+
+	if (chan->pending_req) {
+		disc_att_send_op(chan->pending_req);
+		chan->pending_req = NULL;
+	}
+}
+
+static bool match_deferred_chan(const void *a, const void *b)
+{
+	const struct att_deferred *deferred = a;
+
+	return deferred->chan == b;
+}
+
+static bool chan_disconnect_cb(struct io *io, void *user_data)
+{
+	struct att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
+	struct att_send_op *op = chan->pending_req;
+
+	util_debug(att->debug_callback, att->debug_data,
+					"EATT channel disconnected: fd %d",
+					chan->fd);
+
+	queue_remove(att->chans, chan);
+
+	/* The request never got an answer; let another bearer retry it */
+	if (op) {
+		if (op->timeout_id) {
+			timeout_loop_remove(att->loop, op->timeout_id);
+			op->timeout_id = 0;
+		}
+
+		op_push_head(att->req_queue, op);
+		chan->pending_req = NULL;
+	}
+
+	queue_remove_all(att->deferred_reqs, match_deferred_chan, chan, free);
+
+	/* Whatever the upper layer answers now has nowhere to go */
+	if (att->serving && att->req_chan == chan) {
+		att->req_chan = NULL;
+		att->req_orphaned = true;
+	}
+
+	if (att->ind_chan == chan)
+		att->ind_chan = NULL;
+
+	chan_free(chan);
+
+	wakeup_writer(att);
+
+	return false;
+}
+
 static bool disconnect_cb(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
@@ -586,6 +1356,13 @@ static bool disconnect_cb(struct io *io, void *user_data)
 		att->pending_ind = NULL;
 	}
 
+	/* Enhanced channels do not outlive the link */
+	queue_foreach(att->chans, disc_chan_pending, NULL);
+	queue_remove_all(att->chans, NULL, NULL, chan_free);
+	queue_remove_all(att->deferred_reqs, NULL, NULL, free);
+	att->req_chan = NULL;
+	att->ind_chan = NULL;
+
 	bt_att_ref(att);
 
 	queue_foreach(att->disconn_list, disconn_handler, INT_TO_PTR(err));
@@ -624,11 +1401,12 @@ static bool change_security(struct bt_att *att, uint8_t ecode)
 	return bt_att_set_security(att, security);
 }
 
-static bool handle_error_rsp(struct bt_att *att, uint8_t *pdu,
-					ssize_t pdu_len, uint8_t *opcode)
+static bool handle_error_rsp(struct bt_att *att, struct att_send_op **pending,
+					uint8_t *pdu, ssize_t pdu_len,
+					uint8_t *opcode)
 {
 	const struct bt_att_pdu_error_rsp *rsp;
-	struct att_send_op *op = att->pending_req;
+	struct att_send_op *op = *pending;
 
 	if (pdu_len != sizeof(*rsp)) {
 		*opcode = 0;
@@ -645,23 +1423,25 @@ static bool handle_error_rsp(struct bt_att *att, uint8_t *pdu,
 
 	/* Remove timeout_id if outstanding */
 	if (op->timeout_id) {
-		timeout_remove(op->timeout_id);
+		timeout_loop_remove(att->loop, op->timeout_id);
 		op->timeout_id = 0;
 	}
 
 	util_debug(att->debug_callback, att->debug_data,
 						"Retrying operation %p", op);
 
-	att->pending_req = NULL;
+	*pending = NULL;
 
 	/* Push operation back to request queue */
-	return queue_push_head(att->req_queue, op);
+	return op_push_head(att->req_queue, op);
 }
 
-static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
-								ssize_t pdu_len)
+static void handle_rsp(struct bt_att *att, struct att_chan *chan,
+				uint8_t opcode, uint8_t *pdu, ssize_t pdu_len)
 {
-	struct att_send_op *op = att->pending_req;
+	struct att_send_op **pending = chan ? &chan->pending_req :
+							&att->pending_req;
+	struct att_send_op *op = *pending;
 	uint8_t req_opcode;
 	uint8_t rsp_opcode;
 	uint8_t *rsp_pdu = NULL;
@@ -674,7 +1454,7 @@ static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	if (!op) {
 		util_debug(att->debug_callback, att->debug_data,
 					"Received unexpected ATT response");
-		io_shutdown(att->io);
+		io_shutdown(chan ? chan->io : att->io);
 		return;
 	}
 
@@ -684,7 +1464,8 @@ static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	 */
 	if (opcode == BT_ATT_OP_ERROR_RSP) {
 		/* Return if error response cause a retry */
-		if (handle_error_rsp(att, pdu, pdu_len, &req_opcode)) {
+		if (handle_error_rsp(att, pending, pdu, pdu_len,
+							&req_opcode)) {
 			wakeup_writer(att);
 			return;
 		}
@@ -710,11 +1491,13 @@ fail:
 	rsp_opcode = BT_ATT_OP_ERROR_RSP;
 
 done:
+	op_completed(att, op, rsp_opcode == BT_ATT_OP_ERROR_RSP);
+
 	if (op->callback)
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
 	destroy_att_send_op(op);
-	att->pending_req = NULL;
+	*pending = NULL;
 
 	wakeup_writer(att);
 }
@@ -734,6 +1517,8 @@ static void handle_conf(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
 		return;
 	}
 
+	op_completed(att, op, false);
+
 	if (op->callback)
 		op->callback(BT_ATT_OP_HANDLE_VAL_CONF, NULL, 0, op->user_data);
 
@@ -750,17 +1535,6 @@ struct notify_data {
 	bool handler_found;
 };
 
-static bool opcode_match(uint8_t opcode, uint8_t test_opcode)
-{
-	enum att_op_type op_type = get_op_type(test_opcode);
-
-	if (opcode == BT_ATT_ALL_REQUESTS && (op_type == ATT_OP_TYPE_REQ ||
-						op_type == ATT_OP_TYPE_CMD))
-		return true;
-
-	return opcode == test_opcode;
-}
-
 static void respond_not_supported(struct bt_att *att, uint8_t opcode)
 {
 	struct bt_att_pdu_error_rsp pdu;
@@ -773,6 +1547,24 @@ static void respond_not_supported(struct bt_att *att, uint8_t opcode)
 									NULL);
 }
 
+/* The peer signed the opcode along with the parameters */
+static bool check_signature(struct bt_att *att, struct sign_info *sign,
+					uint8_t opcode, const uint8_t *pdu,
+					uint16_t len, uint32_t sign_cnt,
+					const uint8_t *signature)
+{
+	uint8_t expected[BT_ATT_SIGNATURE_LEN];
+	uint8_t m[1 + len];
+
+	m[0] = opcode;
+	memcpy(m + 1, pdu, len);
+
+	if (!sign_att(att, sign, m, 1 + len, sign_cnt, expected))
+		return false;
+
+	return !memcmp(expected, signature, BT_ATT_SIGNATURE_LEN);
+}
+
 static bool handle_signed(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
@@ -791,14 +1583,13 @@ static bool handle_signed(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	signature = pdu + (pdu_len - BT_ATT_SIGNATURE_LEN);
 	sign_cnt = get_le32(signature);
 
-	/* Validate counter */
-	if (!sign->counter(&sign_cnt, sign->user_data))
+	if (!check_signature(att, sign, opcode, pdu,
+					pdu_len - BT_ATT_SIGNATURE_LEN,
+					sign_cnt, signature))
 		goto fail;
 
-	/* Generate signature and verify it */
-	if (!bt_crypto_sign_att(att->crypto, sign->key, pdu,
-				pdu_len - BT_ATT_SIGNATURE_LEN, sign_cnt,
-				signature))
+	/* Only a genuine PDU may move the counter on */
+	if (!sign->counter(&sign_cnt, sign->user_data))
 		goto fail;
 
 	return true;
@@ -813,26 +1604,47 @@ fail:
 static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
-	const struct queue_entry *entry;
+	const struct queue_entry *entry, *all;
+	enum att_op_type op_type;
 	bool found;
 
-	if ((opcode & ATT_OP_SIGNED_MASK) && !att->crypto) {
+	if (opcode & ATT_OP_SIGNED_MASK) {
 		if (!handle_signed(att, opcode, pdu, pdu_len))
 			return;
 		pdu_len -= BT_ATT_SIGNATURE_LEN;
 	}
 
 	bt_att_ref(att);
+	att->notify_depth++;
 
 	found = false;
-	entry = queue_get_entries(att->notify_list);
-
-	while (entry) {
-		struct att_notify *notify = entry->data;
+	entry = queue_get_entries(att->notify_table[opcode]);
 
-		entry = entry->next;
+	/*
+	 * Handlers registered for BT_ATT_ALL_REQUESTS live in their own table
+	 * entry; merge them in by id to keep registration order.
+	 */
+	op_type = get_op_type(opcode);
+	if (opcode != BT_ATT_ALL_REQUESTS && (op_type == ATT_OP_TYPE_REQ ||
+						op_type == ATT_OP_TYPE_CMD))
+		all = queue_get_entries(att->notify_table[BT_ATT_ALL_REQUESTS]);
+	else
+		all = NULL;
+
+	while (entry || all) {
+		const struct att_notify *a = entry ? entry->data : NULL;
+		const struct att_notify *b = all ? all->data : NULL;
+		const struct att_notify *notify;
+
+		if (a && (!b || a->id < b->id)) {
+			notify = a;
+			entry = entry->next;
+		} else {
+			notify = b;
+			all = all->next;
+		}
 
-		if (!opcode_match(notify->opcode, opcode))
+		if (notify->removed)
 			continue;
 
 		found = true;
@@ -840,12 +1652,12 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 		if (notify->callback)
 			notify->callback(opcode, pdu, pdu_len,
 							notify->user_data);
-
-		/* callback could remove all entries from notify list */
-		if (queue_isempty(att->notify_list))
-			break;
 	}
 
+	att->notify_depth--;
+	if (att->notify_purge)
+		purge_notify(att);
+
 	/*
 	 * If this was not a command and no handler was registered for it,
 	 * respond with "Not Supported"
@@ -856,89 +1668,322 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	bt_att_unref(att);
 }
 
-static bool can_read_data(struct io *io, void *user_data)
+static bool defer_req(struct bt_att *att, struct att_chan *chan,
+						uint8_t *pdu, ssize_t pdu_len)
 {
-	struct bt_att *att = user_data;
-	uint8_t opcode;
-	uint8_t *pdu;
-	ssize_t bytes_read;
+	struct att_deferred *deferred;
 
-	bytes_read = read(att->fd, att->buf, att->mtu);
-	if (bytes_read < 0)
+	deferred = malloc(sizeof(*deferred) + pdu_len);
+	if (!deferred)
 		return false;
 
-	util_hexdump('>', att->buf, bytes_read,
-					att->debug_callback, att->debug_data);
+	deferred->chan = chan;
+	deferred->len = pdu_len;
+	memcpy(deferred->pdu, pdu, pdu_len);
 
-	if (bytes_read < ATT_MIN_PDU_LEN)
-		return true;
+	util_debug(att->debug_callback, att->debug_data,
+				"Deferring request 0x%02x", pdu[0]);
 
-	pdu = att->buf;
-	opcode = pdu[0];
+	return queue_push_tail(att->deferred_reqs, deferred);
+}
 
-	bt_att_ref(att);
+static bool handle_pdu(struct bt_att *att, struct att_chan *chan,
+						uint8_t *pdu, ssize_t pdu_len)
+{
+	struct io *io = chan ? chan->io : att->io;
+	uint8_t opcode = pdu[0];
+	bool *in_req;
 
 	/* Act on the received PDU based on the opcode type */
 	switch (get_op_type(opcode)) {
 	case ATT_OP_TYPE_RSP:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT response received: 0x%02x", opcode);
-		handle_rsp(att, opcode, pdu + 1, bytes_read - 1);
+		handle_rsp(att, chan, opcode, pdu + 1, pdu_len - 1);
 		break;
 	case ATT_OP_TYPE_CONF:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT confirmation received: 0x%02x", opcode);
-		handle_conf(att, pdu + 1, bytes_read - 1);
+
+		/* Indications are only ever sent on the primary bearer */
+		if (chan) {
+			io_shutdown(io);
+			return false;
+		}
+
+		handle_conf(att, pdu + 1, pdu_len - 1);
 		break;
 	case ATT_OP_TYPE_REQ:
+		in_req = chan ? &chan->in_req : &att->in_req;
+
 		/*
 		 * If a request is currently pending, then the sequential
 		 * protocol was violated. Disconnect the bearer, which will
 		 * promptly notify the upper layer via disconnect handlers.
 		 */
-		if (att->in_req) {
+		if (*in_req) {
 			util_debug(att->debug_callback, att->debug_data,
 					"Received request while another is "
 					"pending: 0x%02x", opcode);
-			io_shutdown(att->io);
-			bt_att_unref(att);
+			io_shutdown(io);
 
 			return false;
 		}
 
-		att->in_req = true;
+		*in_req = true;
+
+		/*
+		 * Handlers answer with a plain bt_att_send(), so only one
+		 * request is handed to the upper layer at a time and the
+		 * response is routed to the bearer it arrived on. Requests
+		 * from other bearers wait until that response is out.
+		 */
+		if (att->serving) {
+			if (!defer_req(att, chan, pdu, pdu_len)) {
+				io_shutdown(io);
+				return false;
+			}
+
+			break;
+		}
+
+		att->serving = true;
+		att->req_chan = chan;
+
+		util_debug(att->debug_callback, att->debug_data,
+					"ATT PDU received: 0x%02x", opcode);
+		handle_notify(att, opcode, pdu + 1, pdu_len - 1);
+		break;
+	case ATT_OP_TYPE_IND:
+		/* The confirmation must go back on the same bearer */
+		att->ind_chan = chan;
 		/* fall through */
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
 	case ATT_OP_TYPE_UNKNOWN:
-	case ATT_OP_TYPE_IND:
-		/* fall through */
 	default:
 		/* For all other opcodes notify the upper layer of the PDU and
 		 * let them act on it.
 		 */
 		util_debug(att->debug_callback, att->debug_data,
 					"ATT PDU received: 0x%02x", opcode);
-		handle_notify(att, opcode, pdu + 1, bytes_read - 1);
+		handle_notify(att, opcode, pdu + 1, pdu_len - 1);
+		att->ind_chan = NULL;
 		break;
 	}
 
-	bt_att_unref(att);
-
 	return true;
 }
 
-static bool is_io_l2cap_based(int fd)
+static bool deferred_cb(void *user_data)
 {
-	int domain;
-	int proto;
-	int err;
-	socklen_t len;
+	struct bt_att *att = user_data;
+	struct att_deferred *deferred;
 
-	domain = 0;
-	len = sizeof(domain);
-	err = getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
-	if (err < 0)
+	att->deferred_id = 0;
+
+	if (att->serving)
+		return false;
+
+	deferred = queue_pop_head(att->deferred_reqs);
+	if (!deferred)
+		return false;
+
+	att->serving = true;
+	att->req_chan = deferred->chan;
+
+	util_debug(att->debug_callback, att->debug_data,
+				"ATT PDU received: 0x%02x", deferred->pdu[0]);
+
+	bt_att_ref(att);
+	handle_notify(att, deferred->pdu[0], deferred->pdu + 1,
+							deferred->len - 1);
+	free(deferred);
+	bt_att_unref(att);
+
+	return false;
+}
+
+static void req_done(struct bt_att *att)
+{
+	att->serving = false;
+	att->req_orphaned = false;
+	att->req_chan = NULL;
+
+	/*
+	 * Dispatch the next deferred request from the mainloop rather than
+	 * from within the response that completed the previous one.
+	 */
+	if (!queue_isempty(att->deferred_reqs) && !att->deferred_id)
+		att->deferred_id = timeout_loop_add(att->loop, 0, deferred_cb,
+								att, NULL);
+}
+
+static void rx_ring_free(struct bt_att *att)
+{
+	free(att->rx_bufs);
+	free(att->rx_iov);
+	free(att->rx_msgs);
+
+	att->rx_bufs = NULL;
+	att->rx_iov = NULL;
+	att->rx_msgs = NULL;
+	att->rx_count = 0;
+}
+
+static bool rx_ring_alloc(struct bt_att *att, unsigned int count)
+{
+	unsigned int i;
+
+	rx_ring_free(att);
+
+	att->rx_bufs = malloc((size_t) count * att->mtu);
+	if (!att->rx_bufs)
+		return false;
+
+	att->rx_iov = new0(struct iovec, count);
+	att->rx_msgs = new0(struct mmsghdr, count);
+	att->rx_count = count;
+
+	for (i = 0; i < count; i++) {
+		att->rx_iov[i].iov_base = att->rx_bufs + (size_t) i * att->mtu;
+		att->rx_iov[i].iov_len = att->mtu;
+		att->rx_msgs[i].msg_hdr.msg_iov = &att->rx_iov[i];
+		att->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return true;
+}
+
+static bool read_pdu(struct bt_att *att)
+{
+	ssize_t bytes_read;
+	bool ret;
+
+	bytes_read = read(att->fd, att->buf, att->mtu);
+	if (bytes_read < 0)
+		return false;
+
+	util_hexdump('>', att->buf, bytes_read,
+					att->debug_callback, att->debug_data);
+	account_pdu(att, NULL, true, att->buf, bytes_read);
+
+	if (bytes_read < ATT_MIN_PDU_LEN)
+		return true;
+
+	bt_att_ref(att);
+
+	ret = handle_pdu(att, NULL, att->buf, bytes_read);
+
+	bt_att_unref(att);
+
+	return ret;
+}
+
+static bool can_read_batch(struct bt_att *att)
+{
+	bool ret = true;
+	int n, i;
+
+	n = recvmmsg(att->fd, att->rx_msgs, att->rx_count, MSG_DONTWAIT,
+									NULL);
+	if (n < 0 && errno == ENOTSOCK) {
+		/* Not a socket, fall back to reading one PDU at a time */
+		util_debug(att->debug_callback, att->debug_data,
+					"No batched receive on fd %d", att->fd);
+		rx_ring_free(att);
+		return read_pdu(att);
+	}
+
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	bt_att_ref(att);
+
+	/* Handlers may change the MTU; keep the ring until all are done */
+	att->rx_dispatching = true;
+
+	for (i = 0; i < n; i++) {
+		uint8_t *pdu = att->rx_iov[i].iov_base;
+		ssize_t len = att->rx_msgs[i].msg_len;
+
+		util_hexdump('>', pdu, len, att->debug_callback,
+							att->debug_data);
+		account_pdu(att, NULL, true, pdu, len);
+
+		if (len < ATT_MIN_PDU_LEN)
+			continue;
+
+		if (!handle_pdu(att, NULL, pdu, len)) {
+			ret = false;
+			break;
+		}
+
+		if (!att->io)
+			break;
+	}
+
+	att->rx_dispatching = false;
+
+	if (att->rx_resize) {
+		att->rx_resize = false;
+		if (!rx_ring_alloc(att, att->rx_count))
+			ret = false;
+	}
+
+	bt_att_unref(att);
+
+	return ret;
+}
+
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_att *att = user_data;
+
+	if (att->rx_count > 1)
+		return can_read_batch(att);
+
+	return read_pdu(att);
+}
+
+static bool can_read_chan(struct io *io, void *user_data)
+{
+	struct att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
+	ssize_t bytes_read;
+	bool ret;
+
+	bytes_read = read(chan->fd, chan->buf, chan->mtu);
+	if (bytes_read < 0)
+		return false;
+
+	util_hexdump('>', chan->buf, bytes_read,
+					att->debug_callback, att->debug_data);
+	account_pdu(att, chan, true, chan->buf, bytes_read);
+
+	if (bytes_read < ATT_MIN_PDU_LEN)
+		return true;
+
+	bt_att_ref(att);
+
+	ret = handle_pdu(att, chan, chan->buf, bytes_read);
+
+	bt_att_unref(att);
+
+	return ret;
+}
+
+static bool is_io_l2cap_based(int fd)
+{
+	int domain;
+	int proto;
+	int err;
+	socklen_t len;
+
+	domain = 0;
+	len = sizeof(domain);
+	err = getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+	if (err < 0)
 		return false;
 
 	if (domain != AF_BLUETOOTH)
@@ -953,14 +1998,40 @@ static bool is_io_l2cap_based(int fd)
 	return proto == BTPROTO_L2CAP;
 }
 
+static void trace_free(struct att_trace *trace)
+{
+	if (!trace)
+		return;
+
+	free(trace->recs);
+	free(trace);
+}
+
+static void sign_info_free(struct sign_info *sign)
+{
+	if (!sign)
+		return;
+
+	bt_crypto_cmac_key_free(sign->cmac);
+	free(sign);
+}
+
 static void bt_att_free(struct bt_att *att)
 {
+	unsigned int i;
+
 	if (att->pending_req)
 		destroy_att_send_op(att->pending_req);
 
 	if (att->pending_ind)
 		destroy_att_send_op(att->pending_ind);
 
+	if (att->deferred_id)
+		timeout_loop_remove(att->loop, att->deferred_id);
+
+	queue_destroy(att->chans, chan_free);
+	queue_destroy(att->deferred_reqs, free);
+
 	io_destroy(att->io);
 	bt_crypto_unref(att->crypto);
 
@@ -968,18 +2039,31 @@ static void bt_att_free(struct bt_att *att)
 	queue_destroy(att->ind_queue, NULL);
 	queue_destroy(att->write_queue, NULL);
 	queue_destroy(att->notify_list, NULL);
+	queue_destroy(att->notify_removed, NULL);
+
+	for (i = 0; i < ATT_NUM_OPCODES; i++)
+		queue_destroy(att->notify_table[i], NULL);
 	queue_destroy(att->disconn_list, NULL);
 
 	if (att->timeout_destroy)
 		att->timeout_destroy(att->timeout_data);
 
+	if (att->write_ready_destroy)
+		att->write_ready_destroy(att->write_ready_data);
+
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
-	free(att->local_sign);
-	free(att->remote_sign);
+	sign_info_free(att->local_sign);
+	sign_info_free(att->remote_sign);
 
 	free(att->buf);
+	rx_ring_free(att);
+	op_pool_free(att);
+	trace_free(att->trace);
+
+	for (i = 0; i < ATT_NUM_OPCODES; i++)
+		free(att->op_stats[i]);
 
 	free(att);
 }
@@ -996,17 +2080,36 @@ static uint16_t get_l2cap_mtu(int fd)
 	return l2o.omtu;
 }
 
-struct bt_att *bt_att_new(int fd, bool ext_signed)
+static uint16_t get_chan_mtu(int fd)
+{
+	socklen_t len;
+	uint16_t snd_mtu, rcv_mtu;
+
+	/* LE credit based channels do not support L2CAP_OPTIONS */
+	len = sizeof(snd_mtu);
+	if (getsockopt(fd, SOL_BLUETOOTH, BT_SNDMTU, &snd_mtu, &len) < 0)
+		return get_l2cap_mtu(fd);
+
+	len = sizeof(rcv_mtu);
+	if (getsockopt(fd, SOL_BLUETOOTH, BT_RCVMTU, &rcv_mtu, &len) < 0)
+		return get_l2cap_mtu(fd);
+
+	return MIN(snd_mtu, rcv_mtu);
+}
+
+struct bt_att *bt_att_new_with_loop(int fd, bool ext_signed,
+							struct mainloop *loop)
 {
 	struct bt_att *att;
 
-	if (fd < 0)
+	if (fd < 0 || !loop)
 		return NULL;
 
 	att = new0(struct bt_att, 1);
 	att->fd = fd;
+	att->loop = loop;
 
-	att->io = io_new(fd);
+	att->io = io_new_with_loop(fd, loop);
 	if (!att->io)
 		goto fail;
 
@@ -1018,7 +2121,10 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	att->ind_queue = queue_new();
 	att->write_queue = queue_new();
 	att->notify_list = queue_new();
+	att->notify_removed = queue_new();
 	att->disconn_list = queue_new();
+	att->chans = queue_new();
+	att->deferred_reqs = queue_new();
 
 	if (!io_set_read_handler(att->io, can_read_data, att, NULL))
 		goto fail;
@@ -1050,6 +2156,11 @@ fail:
 	return NULL;
 }
 
+struct bt_att *bt_att_new(int fd, bool ext_signed)
+{
+	return bt_att_new_with_loop(fd, ext_signed, mainloop_get_current());
+}
+
 struct bt_att *bt_att_ref(struct bt_att *att)
 {
 	if (!att)
@@ -1090,6 +2201,70 @@ int bt_att_get_fd(struct bt_att *att)
 	return att->fd;
 }
 
+bool bt_att_attach_fd(struct bt_att *att, int fd)
+{
+	struct att_chan *chan;
+
+	if (!att || !att->io || fd < 0)
+		return false;
+
+	chan = new0(struct att_chan, 1);
+	chan->att = att;
+	chan->id = ++att->next_chan_id;
+	chan->fd = fd;
+
+	/* Sockets other than L2CAP (e.g. for testing) get the largest MTU */
+	if (is_io_l2cap_based(fd))
+		chan->mtu = get_chan_mtu(fd);
+	else
+		chan->mtu = BT_ATT_MAX_LE_MTU;
+
+	if (chan->mtu < BT_ATT_EATT_MIN_MTU)
+		goto fail;
+
+	chan->io = io_new_with_loop(fd, att->loop);
+	if (!chan->io)
+		goto fail;
+
+	chan->buf = malloc(chan->mtu);
+	if (!chan->buf)
+		goto fail;
+
+	if (!io_set_read_handler(chan->io, can_read_chan, chan, NULL))
+		goto fail;
+
+	if (!io_set_disconnect_handler(chan->io, chan_disconnect_cb, chan,
+									NULL))
+		goto fail;
+
+	chan->queue = queue_new();
+	io_set_close_on_destroy(chan->io, true);
+	queue_push_tail(att->chans, chan);
+
+	util_debug(att->debug_callback, att->debug_data,
+				"EATT channel attached: fd %d mtu %u", fd,
+				chan->mtu);
+
+	wakeup_writer(att);
+
+	return true;
+
+fail:
+	io_destroy(chan->io);
+	free(chan->buf);
+	free(chan);
+
+	return false;
+}
+
+unsigned int bt_att_get_channels(struct bt_att *att)
+{
+	if (!att || !att->io)
+		return 0;
+
+	return 1 + queue_length(att->chans);
+}
+
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy)
 {
@@ -1106,6 +2281,14 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 	return true;
 }
 
+struct mainloop *bt_att_get_loop(struct bt_att *att)
+{
+	if (!att)
+		return NULL;
+
+	return att->loop;
+}
+
 uint16_t bt_att_get_mtu(struct bt_att *att)
 {
 	if (!att)
@@ -1114,6 +2297,14 @@ uint16_t bt_att_get_mtu(struct bt_att *att)
 	return att->mtu;
 }
 
+uint16_t bt_att_get_req_mtu(struct bt_att *att)
+{
+	if (!att)
+		return 0;
+
+	return op_mtu(att, ATT_OP_TYPE_RSP);
+}
+
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 {
 	void *buf;
@@ -1130,10 +2321,22 @@ bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 
 	free(att->buf);
 
+	/* Cached ops are sized for the old MTU */
+	if (mtu > att->mtu)
+		op_pool_free(att);
+
 	att->mtu = mtu;
 	att->buf = buf;
 
-	return true;
+	if (!att->rx_count)
+		return true;
+
+	if (att->rx_dispatching) {
+		att->rx_resize = true;
+		return true;
+	}
+
+	return rx_ring_alloc(att, att->rx_count);
 }
 
 uint8_t bt_att_get_link_type(struct bt_att *att)
@@ -1195,11 +2398,14 @@ unsigned int bt_att_register_disconnect(struct bt_att *att,
 
 	disconn->id = att->next_reg_id++;
 
-	if (!queue_push_tail(att->disconn_list, disconn)) {
+	disconn->entry = queue_push_tail_entry(att->disconn_list, disconn);
+	if (!disconn->entry) {
 		free(disconn);
 		return 0;
 	}
 
+	id_link_add(att->disconn_ids, &disconn->link, disconn->id, disconn);
+
 	return disconn->id;
 }
 
@@ -1210,82 +2416,191 @@ bool bt_att_unregister_disconnect(struct bt_att *att, unsigned int id)
 	if (!att || !id)
 		return false;
 
+	disconn = id_link_find(att->disconn_ids, id);
+	if (!disconn)
+		return false;
+
 	/* Check if disconnect is running */
 	if (!att->io) {
-		disconn = queue_find(att->disconn_list, match_disconn_id,
-							UINT_TO_PTR(id));
-		if (!disconn)
-			return false;
-
 		disconn->removed = true;
 		return true;
 	}
 
-	disconn = queue_remove_if(att->disconn_list, match_disconn_id,
-							UINT_TO_PTR(id));
-	if (!disconn)
+	/* Already being flushed by bt_att_unregister_all() */
+	if (!queue_remove_entry(att->disconn_list, disconn->entry))
 		return false;
 
 	destroy_att_disconn(disconn);
 	return true;
 }
 
-unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
-				const void *pdu, uint16_t length,
-				bt_att_response_func_t callback, void *user_data,
-				bt_att_destroy_func_t destroy)
+static unsigned int send_op(struct bt_att *att, struct att_send_op *op)
 {
-	struct att_send_op *op;
+	unsigned int op_id;
 	bool result;
 
-	if (!att || !att->io)
-		return 0;
-
-	op = create_att_send_op(att, opcode, pdu, length, callback, user_data,
-								destroy);
-	if (!op)
-		return 0;
-
 	if (att->next_send_id < 1)
 		att->next_send_id = 1;
 
-	op->id = att->next_send_id++;
+	op_id = op->id = att->next_send_id++;
+	id_link_add(att->op_ids, &op->link, op_id, op);
 
 	/* Add the op to the correct queue based on its type */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
-		result = queue_push_tail(att->req_queue, op);
+		result = op_push_tail(att->req_queue, op);
 		break;
 	case ATT_OP_TYPE_IND:
-		result = queue_push_tail(att->ind_queue, op);
+		result = op_push_tail(att->ind_queue, op);
+		break;
+	case ATT_OP_TYPE_RSP:
+		/* The channel of the request went away, drop the response */
+		if (att->req_orphaned) {
+			att_send_op_put(op);
+			req_done(att);
+			return op_id;
+		}
+
+		if (att->req_chan) {
+			result = op_push_tail(att->req_chan->queue, op);
+			break;
+		}
+
+		result = op_push_tail(att->write_queue, op);
+		break;
+	case ATT_OP_TYPE_CONF:
+		if (att->ind_chan) {
+			result = op_push_tail(att->ind_chan->queue, op);
+			break;
+		}
+
+		result = op_push_tail(att->write_queue, op);
 		break;
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
+		/* Backpressure: the producer waits for write_ready instead */
+		if (att->write_high &&
+			queue_length(att->write_queue) >= att->write_high) {
+			att->write_full = true;
+			att_send_op_put(op);
+			return 0;
+		}
+
+		/* fall through */
 	case ATT_OP_TYPE_UNKNOWN:
-	case ATT_OP_TYPE_RSP:
-	case ATT_OP_TYPE_CONF:
 	default:
-		result = queue_push_tail(att->write_queue, op);
+		result = op_push_tail(att->write_queue, op);
 		break;
 	}
 
 	if (!result) {
-		free(op->pdu);
-		free(op);
+		att_send_op_put(op);
 		return 0;
 	}
 
+	update_queue_stats(att);
 	wakeup_writer(att);
 
-	return op->id;
+	return op_id;
 }
 
-static bool match_op_id(const void *a, const void *b)
+unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
+				const void *pdu, uint16_t length,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
 {
-	const struct att_send_op *op = a;
-	unsigned int id = PTR_TO_UINT(b);
+	struct att_send_op *op;
+
+	if (!att || !att->io)
+		return 0;
+
+	op = create_att_send_op(att, opcode, pdu, length, callback, user_data,
+								destroy);
+	if (!op)
+		return 0;
 
-	return op->id == id;
+	return send_op(att, op);
+}
+
+static struct att_send_op *op_from_payload(void *payload)
+{
+	return (void *) ((uint8_t *) payload - 1 -
+					offsetof(struct att_send_op, data));
+}
+
+void *bt_att_pdu_alloc(struct bt_att *att, uint8_t opcode, uint16_t *max_len)
+{
+	struct att_send_op *op;
+	enum att_op_type type;
+
+	if (!att || !att->io || !max_len)
+		return NULL;
+
+	type = get_op_type(opcode);
+	if (type == ATT_OP_TYPE_UNKNOWN)
+		return NULL;
+
+	op = att_send_op_get(att, op_mtu(att, type));
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	op->opcode = opcode;
+	op->data[0] = opcode;
+
+	*max_len = op_mtu(att, type) - 1 - signature_len(att, opcode);
+
+	return op->data + 1;
+}
+
+void bt_att_pdu_free(struct bt_att *att, void *payload)
+{
+	if (!att || !payload)
+		return;
+
+	att_send_op_put(op_from_payload(payload));
+}
+
+unsigned int bt_att_send_prepared(struct bt_att *att, void *payload,
+				uint16_t length,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
+{
+	struct att_send_op *op;
+
+	if (!att || !payload)
+		return 0;
+
+	op = op_from_payload(payload);
+
+	if (!att->io || !check_op_callback(op->type, callback))
+		goto fail;
+
+	op->len = 1 + length + signature_len(att, op->opcode);
+	if (op->len > op_mtu(att, op->type) || op->len > op->size)
+		goto fail;
+
+	if (!sign_pdu(att, op, length))
+		goto fail;
+
+	op->callback = callback;
+	op->destroy = destroy;
+	op->user_data = user_data;
+
+	return send_op(att, op);
+
+fail:
+	att_send_op_put(op);
+	return 0;
+}
+
+
+static void cancel_chan_pending(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+
+	if (chan->pending_req)
+		cancel_att_send_op(chan->pending_req);
 }
 
 bool bt_att_cancel(struct bt_att *att, unsigned int id)
@@ -1295,34 +2610,20 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 	if (!att || !id)
 		return false;
 
-	if (att->pending_req && att->pending_req->id == id) {
-		/* Don't cancel the pending request; remove it's handlers */
-		cancel_att_send_op(att->pending_req);
-		return true;
-	}
+	op = id_link_find(att->op_ids, id);
+	if (!op)
+		return false;
 
-	if (att->pending_ind && att->pending_ind->id == id) {
-		/* Don't cancel the pending indication; remove it's handlers */
-		cancel_att_send_op(att->pending_ind);
+	/* Don't cancel a pending request or indication; remove its handlers */
+	if (!op->entry) {
+		cancel_att_send_op(op);
 		return true;
 	}
 
-	op = queue_remove_if(att->req_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_remove_if(att->ind_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_remove_if(att->write_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	if (!op)
+	/* Already being flushed from its queue */
+	if (!queue_remove_entry(op->queue, op->entry))
 		return false;
 
-done:
 	destroy_att_send_op(op);
 
 	wakeup_writer(att);
@@ -1347,6 +2648,8 @@ bool bt_att_cancel_all(struct bt_att *att)
 		/* Don't cancel the pending request; remove it's handlers */
 		cancel_att_send_op(att->pending_ind);
 
+	queue_foreach(att->chans, cancel_chan_pending, NULL);
+
 	return true;
 }
 
@@ -1420,11 +2723,19 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 
 	notify->id = att->next_reg_id++;
 
-	if (!queue_push_tail(att->notify_list, notify)) {
+	if (!att->notify_table[opcode])
+		att->notify_table[opcode] = queue_new();
+
+	notify->list_entry = queue_push_tail_entry(att->notify_list, notify);
+	if (!notify->list_entry) {
 		free(notify);
 		return 0;
 	}
 
+	notify->table_entry = queue_push_tail_entry(att->notify_table[opcode],
+									notify);
+	id_link_add(att->notify_ids, &notify->link, notify->id, notify);
+
 	return notify->id;
 }
 
@@ -1435,12 +2746,13 @@ bool bt_att_unregister(struct bt_att *att, unsigned int id)
 	if (!att || !id)
 		return false;
 
-	notify = queue_remove_if(att->notify_list, match_notify_id,
-							UINT_TO_PTR(id));
-	if (!notify)
+	notify = id_link_find(att->notify_ids, id);
+	if (!notify || notify->removed)
 		return false;
 
-	destroy_att_notify(notify);
+	mark_notify_removed(notify, att);
+	purge_notify(att);
+
 	return true;
 }
 
@@ -1449,7 +2761,9 @@ bool bt_att_unregister_all(struct bt_att *att)
 	if (!att)
 		return false;
 
-	queue_remove_all(att->notify_list, NULL, NULL, destroy_att_notify);
+	queue_foreach(att->notify_list, mark_notify_removed, att);
+	purge_notify(att);
+
 	queue_remove_all(att->disconn_list, NULL, NULL, destroy_att_disconn);
 
 	return true;
@@ -1512,8 +2826,9 @@ void bt_att_set_enc_key_size(struct bt_att *att, uint8_t enc_size)
 	att->enc_size = enc_size;
 }
 
-static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
-				bt_att_counter_func_t func, void *user_data)
+static bool sign_set_key(struct bt_att *att, struct sign_info **sign,
+				uint8_t key[16], bt_att_counter_func_t func,
+				void *user_data)
 {
 	if (!(*sign))
 		*sign = new0(struct sign_info, 1);
@@ -1522,6 +2837,10 @@ static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
 	(*sign)->user_data = user_data;
 	memcpy((*sign)->key, key, 16);
 
+	/* Set up the CMAC state once instead of on every signed PDU */
+	bt_crypto_cmac_key_free((*sign)->cmac);
+	(*sign)->cmac = bt_crypto_cmac_key_new(att->crypto, key);
+
 	return true;
 }
 
@@ -1531,7 +2850,7 @@ bool bt_att_set_local_key(struct bt_att *att, uint8_t sign_key[16],
 	if (!att)
 		return false;
 
-	return sign_set_key(&att->local_sign, sign_key, func, user_data);
+	return sign_set_key(att, &att->local_sign, sign_key, func, user_data);
 }
 
 bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
@@ -1540,7 +2859,67 @@ bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
 	if (!att)
 		return false;
 
-	return sign_set_key(&att->remote_sign, sign_key, func, user_data);
+	return sign_set_key(att, &att->remote_sign, sign_key, func, user_data);
+}
+
+bool bt_att_set_tx_batch(struct bt_att *att, bool enable)
+{
+	if (!att)
+		return false;
+
+	att->tx_batch = enable;
+
+	return true;
+}
+
+bool bt_att_set_write_watermarks(struct bt_att *att, unsigned int high,
+					unsigned int low,
+					bt_att_ready_func_t callback,
+					void *user_data,
+					bt_att_destroy_func_t destroy)
+{
+	if (!att || (high && low >= high))
+		return false;
+
+	if (att->write_ready_destroy)
+		att->write_ready_destroy(att->write_ready_data);
+
+	att->write_high = high;
+	att->write_low = low;
+	att->write_full = false;
+	att->write_ready = callback;
+	att->write_ready_destroy = destroy;
+	att->write_ready_data = user_data;
+
+	return true;
+}
+
+bool bt_att_set_rx_batch(struct bt_att *att, unsigned int max_pdus)
+{
+	if (!att || att->rx_dispatching)
+		return false;
+
+	if (max_pdus <= 1) {
+		rx_ring_free(att);
+		return true;
+	}
+
+	return rx_ring_alloc(att, max_pdus);
+}
+
+bool bt_att_get_tx_stats(struct bt_att *att, uint64_t *wakeups,
+							uint64_t *pdus)
+{
+	if (!att)
+		return false;
+
+	if (wakeups)
+		*wakeups = att->tx_wakeups;
+
+	if (pdus)
+		*pdus = att->tx_pdus;
+
+	return true;
 }
 
 bool bt_att_has_crypto(struct bt_att *att)
@@ -1550,3 +2929,226 @@ bool bt_att_has_crypto(struct bt_att *att)
 
 	return att->crypto ? true : false;
 }
+
+bool bt_att_set_trace(struct bt_att *att, unsigned int max_pdus,
+							uint16_t snaplen)
+{
+	struct att_trace *trace;
+
+	if (!att)
+		return false;
+
+	trace_free(att->trace);
+	att->trace = NULL;
+
+	if (!max_pdus)
+		return true;
+
+	trace = new0(struct att_trace, 1);
+	trace->count = max_pdus;
+	trace->snaplen = snaplen ? snaplen : BT_ATT_MAX_LE_MTU;
+	trace->rec_size = (sizeof(struct att_trace_rec) + trace->snaplen + 7) &
+									~7;
+
+	trace->recs = calloc(trace->count, trace->rec_size);
+	if (!trace->recs) {
+		free(trace);
+		return false;
+	}
+
+	att->trace = trace;
+
+	return true;
+}
+
+bool bt_att_dump_trace(struct bt_att *att, int fd)
+{
+	struct att_trace *trace;
+	struct att_trace_rec *rec, *copy;
+	unsigned int head, idx, seq;
+	unsigned int drops;
+	bool ret = true;
+
+	if (!att || !att->trace || fd < 0)
+		return false;
+
+	trace = att->trace;
+
+	copy = malloc(trace->rec_size);
+	if (!copy)
+		return false;
+
+	if (!btsnoop_write_header(fd, BTSNOOP_FORMAT_UART)) {
+		free(copy);
+		return false;
+	}
+
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	idx = head > trace->count ? head - trace->count : 0;
+	drops = idx;
+
+	for (; idx != head; idx++) {
+		rec = trace_rec(trace, idx);
+
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq != idx + 1) {
+			/* Overwritten while dumping */
+			drops++;
+			continue;
+		}
+
+		memcpy(copy, rec, trace->rec_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+			drops++;
+			continue;
+		}
+
+		if (!btsnoop_write_l2cap(fd, copy->usec, copy->received, drops,
+						copy->bearer, ATT_TRACE_CID,
+						copy->data, copy->len,
+						copy->orig_len)) {
+			ret = false;
+			break;
+		}
+	}
+
+	free(copy);
+
+	return ret;
+}
+
+bool bt_att_dump_trace_file(struct bt_att *att, const char *path)
+{
+	bool ret;
+	int fd;
+
+	if (!att || !att->trace || !path)
+		return false;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	ret = bt_att_dump_trace(att, fd);
+
+	close(fd);
+
+	return ret;
+}
+
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	*stats = att->stats;
+	stats->tx_wakeups = att->tx_wakeups;
+	stats->req_queue = queue_length(att->req_queue);
+	stats->ind_queue = queue_length(att->ind_queue);
+	stats->write_queue = queue_length(att->write_queue);
+
+	return true;
+}
+
+bool bt_att_get_op_stats(struct bt_att *att, uint8_t opcode,
+					struct bt_att_op_stats *stats)
+{
+	if (!att || !stats || !att->op_stats[opcode])
+		return false;
+
+	*stats = *att->op_stats[opcode];
+
+	/* Nothing completed yet */
+	if (!stats->count)
+		stats->min_usec = 0;
+
+	return true;
+}
+
+bool bt_att_reset_stats(struct bt_att *att)
+{
+	unsigned int i;
+
+	if (!att)
+		return false;
+
+	memset(&att->stats, 0, sizeof(att->stats));
+	att->tx_wakeups = 0;
+	att->tx_pdus = 0;
+
+	for (i = 0; i < ATT_NUM_OPCODES; i++) {
+		free(att->op_stats[i]);
+		att->op_stats[i] = NULL;
+	}
+
+	return true;
+}
+
+static void print_op_stats(uint8_t opcode, const struct bt_att_op_stats *op,
+					bt_att_debug_func_t callback,
+					void *user_data)
+{
+	unsigned int i;
+
+	util_debug(callback, user_data,
+			"  Opcode 0x%02x: %llu done, %llu errors, %llu timeouts",
+					opcode,
+					(unsigned long long) op->count,
+					(unsigned long long) op->errors,
+					(unsigned long long) op->timeouts);
+
+	if (!op->count)
+		return;
+
+	util_debug(callback, user_data,
+			"    latency us: min %llu avg %llu max %llu",
+			(unsigned long long) op->min_usec,
+			(unsigned long long) (op->total_usec / op->count),
+			(unsigned long long) op->max_usec);
+
+	for (i = 0; i < BT_ATT_STATS_LATENCY_BUCKETS; i++) {
+		if (!op->latency[i])
+			continue;
+
+		util_debug(callback, user_data, "    %10llu us+: %llu",
+				1ULL << i, (unsigned long long) op->latency[i]);
+	}
+}
+
+bool bt_att_print_stats(struct bt_att *att, bt_att_debug_func_t callback,
+							void *user_data)
+{
+	struct bt_att_stats stats;
+	struct bt_att_op_stats op;
+	unsigned int i;
+
+	if (!callback || !bt_att_get_stats(att, &stats))
+		return false;
+
+	util_debug(callback, user_data,
+				"  TX: %llu PDUs, %llu bytes, %llu wakeups",
+				(unsigned long long) stats.tx_pdus,
+				(unsigned long long) stats.tx_bytes,
+				(unsigned long long) stats.tx_wakeups);
+	util_debug(callback, user_data, "  RX: %llu PDUs, %llu bytes",
+				(unsigned long long) stats.rx_pdus,
+				(unsigned long long) stats.rx_bytes);
+	util_debug(callback, user_data, "  Timeouts: %llu",
+				(unsigned long long) stats.timeouts);
+	util_debug(callback, user_data,
+			"  Queues: req %u (max %u), ind %u (max %u), "
+					"write %u (max %u)",
+					stats.req_queue, stats.req_queue_max,
+					stats.ind_queue, stats.ind_queue_max,
+					stats.write_queue,
+					stats.write_queue_max);
+
+	for (i = 0; i < ATT_NUM_OPCODES; i++) {
+		if (bt_att_get_op_stats(att, i, &op))
+			print_op_stats(i, &op, callback, user_data);
+	}
+
+	return true;
+}
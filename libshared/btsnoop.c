@@ -0,0 +1,154 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "src/shared/util.h"
+#include "src/shared/btsnoop.h"
+
+/* Microseconds between 0000-01-01 and the Unix epoch */
+#define BTSNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ULL
+
+#define H4_ACL_PKT		0x02
+
+/* ACL header, start of an automatically flushable packet */
+#define ACL_PB_START		0x2000
+
+struct btsnoop_hdr {
+	uint8_t id[8];
+	uint32_t version;
+	uint32_t type;
+} __attribute__ ((packed));
+
+struct btsnoop_pkt {
+	uint32_t size;
+	uint32_t len;
+	uint32_t flags;
+	uint32_t drops;
+	uint64_t ts;
+} __attribute__ ((packed));
+
+static const uint8_t btsnoop_id[] = { 0x62, 0x74, 0x73, 0x6e,
+					0x6f, 0x6f, 0x70, 0x00 };
+
+static bool write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t written;
+
+	while (iovcnt) {
+		written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		while (iovcnt && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+bool btsnoop_write_header(int fd, uint32_t format)
+{
+	struct btsnoop_hdr hdr;
+	struct iovec iov;
+
+	memcpy(hdr.id, btsnoop_id, sizeof(btsnoop_id));
+	hdr.version = htobe32(1);
+	hdr.type = htobe32(format);
+
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+
+	return write_all(fd, &iov, 1);
+}
+
+static bool write_record(int fd, uint64_t usec, uint32_t flags,
+				uint32_t drops, const void *hdr,
+				uint32_t hdr_len, const void *data,
+				uint32_t size, uint32_t orig_size)
+{
+	struct btsnoop_pkt pkt;
+	struct iovec iov[3];
+
+	pkt.size = htobe32(hdr_len + orig_size);
+	pkt.len = htobe32(hdr_len + size);
+	pkt.flags = htobe32(flags);
+	pkt.drops = htobe32(drops);
+	pkt.ts = htobe64(usec + BTSNOOP_EPOCH_DELTA);
+
+	iov[0].iov_base = &pkt;
+	iov[0].iov_len = sizeof(pkt);
+	iov[1].iov_base = (void *) hdr;
+	iov[1].iov_len = hdr_len;
+	iov[2].iov_base = (void *) data;
+	iov[2].iov_len = size;
+
+	return write_all(fd, iov, 3);
+}
+
+bool btsnoop_write_record(int fd, uint64_t usec, uint32_t flags,
+					uint32_t drops, const void *data,
+					uint32_t size, uint32_t orig_size)
+{
+	return write_record(fd, usec, flags, drops, NULL, 0, data, size,
+								orig_size);
+}
+
+bool btsnoop_write_l2cap(int fd, uint64_t usec, bool received,
+					uint32_t drops, uint16_t handle,
+					uint16_t cid, const void *data,
+					uint16_t size, uint16_t orig_size)
+{
+	uint8_t hdr[9];
+
+	/* H4 packet type, ACL header and L2CAP basic header */
+	hdr[0] = H4_ACL_PKT;
+	put_le16(handle | ACL_PB_START, hdr + 1);
+	put_le16(orig_size + 4, hdr + 3);
+	put_le16(orig_size, hdr + 5);
+	put_le16(cid, hdr + 7);
+
+	return write_record(fd, usec, received ? BTSNOOP_FLAG_RECEIVED : 0,
+					drops, hdr, sizeof(hdr), data, size,
+					orig_size);
+}
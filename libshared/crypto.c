@@ -31,6 +31,7 @@
 #include <sys/socket.h>
 
 #include "src/shared/util.h"
+#include "src/shared/aes.h"
 #include "src/shared/crypto.h"
 
 #ifndef HAVE_LINUX_IF_ALG_H
@@ -77,11 +78,23 @@ struct af_alg_iv {
 
 struct bt_crypto {
 	int ref_count;
+	enum bt_crypto_backend backend;
 	int ecb_aes;
 	int urandom;
 	int cmac_aes;
 };
 
+/*
+ * CMAC key prepared for repeated use: either an AF_ALG operation socket
+ * with the key already loaded or the expanded key and subkeys.
+ */
+struct bt_crypto_cmac_key {
+	int fd;
+	struct bt_aes_cmac_key aes;
+};
+
+static enum bt_crypto_backend default_backend = BT_CRYPTO_BACKEND_AUTO;
+
 static int urandom_setup(void)
 {
 	int fd;
@@ -137,29 +150,59 @@ static int cmac_aes_setup(void)
 	return fd;
 }
 
-struct bt_crypto *bt_crypto_new(void)
+bool bt_crypto_set_default_backend(enum bt_crypto_backend backend)
+{
+	switch (backend) {
+	case BT_CRYPTO_BACKEND_AUTO:
+	case BT_CRYPTO_BACKEND_KERNEL:
+	case BT_CRYPTO_BACKEND_USER:
+		default_backend = backend;
+		return true;
+	}
+
+	return false;
+}
+
+struct bt_crypto *bt_crypto_new_with_backend(enum bt_crypto_backend backend)
 {
 	struct bt_crypto *crypto;
 
 	crypto = new0(struct bt_crypto, 1);
-
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
+	crypto->ecb_aes = -1;
+	crypto->cmac_aes = -1;
+
+	switch (backend) {
+	case BT_CRYPTO_BACKEND_AUTO:
+	case BT_CRYPTO_BACKEND_USER:
+		crypto->backend = BT_CRYPTO_BACKEND_USER;
+		break;
+	case BT_CRYPTO_BACKEND_KERNEL:
+		crypto->backend = BT_CRYPTO_BACKEND_KERNEL;
+
+		crypto->ecb_aes = ecb_aes_setup();
+		if (crypto->ecb_aes < 0) {
+			free(crypto);
+			return NULL;
+		}
+
+		crypto->cmac_aes = cmac_aes_setup();
+		if (crypto->cmac_aes < 0) {
+			close(crypto->ecb_aes);
+			free(crypto);
+			return NULL;
+		}
+		break;
+	default:
 		free(crypto);
 		return NULL;
 	}
 
 	crypto->urandom = urandom_setup();
 	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
-		free(crypto);
-		return NULL;
-	}
-
-	crypto->cmac_aes = cmac_aes_setup();
-	if (crypto->cmac_aes < 0) {
-		close(crypto->urandom);
-		close(crypto->ecb_aes);
+		if (crypto->cmac_aes >= 0)
+			close(crypto->cmac_aes);
+		if (crypto->ecb_aes >= 0)
+			close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
@@ -167,6 +210,11 @@ struct bt_crypto *bt_crypto_new(void)
 	return bt_crypto_ref(crypto);
 }
 
+struct bt_crypto *bt_crypto_new(void)
+{
+	return bt_crypto_new_with_backend(default_backend);
+}
+
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
 {
 	if (!crypto)
@@ -186,12 +234,27 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 		return;
 
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
+
+	if (crypto->ecb_aes >= 0)
+		close(crypto->ecb_aes);
+
+	if (crypto->cmac_aes >= 0)
+		close(crypto->cmac_aes);
 
 	free(crypto);
 }
 
+const char *bt_crypto_get_backend_name(struct bt_crypto *crypto)
+{
+	if (!crypto)
+		return NULL;
+
+	if (crypto->backend == BT_CRYPTO_BACKEND_KERNEL)
+		return "af_alg";
+
+	return bt_aes_get_impl();
+}
+
 bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 					void *buf, uint8_t num_bytes)
 {
@@ -263,18 +326,93 @@ static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 		dst[len - 1 - i] = src[i];
 }
 
-bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
+static bool cmac_key_init(struct bt_crypto *crypto,
+					struct bt_crypto_cmac_key *ckey,
+					const uint8_t key[16])
+{
+	uint8_t key_msb[16];
+
+	/* The most significant octet of key corresponds to key[0] */
+	swap_buf(key, key_msb, 16);
+
+	if (crypto->backend == BT_CRYPTO_BACKEND_KERNEL) {
+		ckey->fd = alg_new(crypto->cmac_aes, key_msb, 16);
+		return ckey->fd >= 0;
+	}
+
+	ckey->fd = -1;
+	bt_aes_cmac_set_key(&ckey->aes, key_msb);
+
+	return true;
+}
+
+static void cmac_key_clear(struct bt_crypto_cmac_key *ckey)
+{
+	if (ckey->fd >= 0)
+		close(ckey->fd);
+}
+
+/* CMAC of a message already in most significant octet first order */
+static bool cmac_key_digest(const struct bt_crypto_cmac_key *ckey,
+					const uint8_t *msg_msb, size_t msg_len,
+					uint8_t out[16])
+{
+	ssize_t len;
+
+	if (ckey->fd < 0) {
+		bt_aes_cmac(&ckey->aes, msg_msb, msg_len, out);
+		return true;
+	}
+
+	len = send(ckey->fd, msg_msb, msg_len, 0);
+	if (len < 0)
+		return false;
+
+	len = read(ckey->fd, out, 16);
+	if (len < 0)
+		return false;
+
+	return true;
+}
+
+struct bt_crypto_cmac_key *bt_crypto_cmac_key_new(struct bt_crypto *crypto,
+							const uint8_t key[16])
+{
+	struct bt_crypto_cmac_key *ckey;
+
+	if (!crypto)
+		return NULL;
+
+	ckey = new0(struct bt_crypto_cmac_key, 1);
+
+	if (!cmac_key_init(crypto, ckey, key)) {
+		free(ckey);
+		return NULL;
+	}
+
+	return ckey;
+}
+
+void bt_crypto_cmac_key_free(struct bt_crypto_cmac_key *ckey)
+{
+	if (!ckey)
+		return;
+
+	cmac_key_clear(ckey);
+	free(ckey);
+}
+
+bool bt_crypto_sign_att_key(struct bt_crypto *crypto,
+				const struct bt_crypto_cmac_key *ckey,
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12])
 {
-	int fd;
-	int len;
 	uint8_t tmp[16], out[16];
 	uint16_t msg_len = m_len + sizeof(uint32_t);
 	uint8_t msg[msg_len];
 	uint8_t msg_s[msg_len];
 
-	if (!crypto)
+	if (!crypto || !ckey)
 		return false;
 
 	memset(msg, 0, msg_len);
@@ -283,29 +421,11 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* Add sign_counter to the message */
 	put_le32(sign_cnt, msg + m_len);
 
-	/* The most significant octet of key corresponds to key[0] */
-	swap_buf(key, tmp, 16);
-
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
 	/* Swap msg before signing */
 	swap_buf(msg, msg_s, msg_len);
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
+	if (!cmac_key_digest(ckey, msg_s, msg_len, out))
 		return false;
-	}
-
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	close(fd);
 
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
@@ -323,6 +443,49 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 
 	return true;
 }
+
+bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12])
+{
+	struct bt_crypto_cmac_key ckey;
+	bool ret;
+
+	if (!crypto)
+		return false;
+
+	if (!cmac_key_init(crypto, &ckey, key))
+		return false;
+
+	ret = bt_crypto_sign_att_key(crypto, &ckey, m, m_len, sign_cnt,
+								signature);
+
+	cmac_key_clear(&ckey);
+
+	return ret;
+}
+
+bool bt_crypto_gatt_hash(struct bt_crypto *crypto, const uint8_t *m,
+					size_t m_len, uint8_t res[16])
+{
+	static const uint8_t key[16];
+	struct bt_crypto_cmac_key ckey;
+	bool ret;
+
+	if (!crypto)
+		return false;
+
+	if (!cmac_key_init(crypto, &ckey, key))
+		return false;
+
+	/* The message and result are used in the order they are sent */
+	ret = cmac_key_digest(&ckey, m, m_len, res);
+
+	cmac_key_clear(&ckey);
+
+	return ret;
+}
+
 /*
  * Security function e
  *
@@ -340,6 +503,7 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16])
 {
 	uint8_t tmp[16], in[16], out[16];
+	struct bt_aes_key aes;
 	int fd;
 
 	if (!crypto)
@@ -348,24 +512,30 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
+	/* Most significant octet of plaintextData corresponds to in[0] */
+	swap_buf(plaintext, in, 16);
+
+	if (crypto->backend == BT_CRYPTO_BACKEND_USER) {
+		bt_aes_set_key(&aes, tmp);
+		bt_aes_encrypt(&aes, in, out);
+		goto done;
+	}
+
 	fd = alg_new(crypto->ecb_aes, tmp, 16);
 	if (fd < 0)
 		return false;
 
-
-	/* Most significant octet of plaintextData corresponds to in[0] */
-	swap_buf(plaintext, in, 16);
-
 	if (!alg_encrypt(fd, in, 16, out, 16)) {
 		close(fd);
 		return false;
 	}
 
+	close(fd);
+
+done:
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -571,36 +741,25 @@ bool bt_crypto_s1(struct bt_crypto *crypto, const uint8_t k[16],
 static bool aes_cmac(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t *msg, size_t msg_len, uint8_t res[16])
 {
-	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
+	struct bt_crypto_cmac_key ckey;
+	uint8_t out[16], msg_msb[CMAC_MSG_MAX];
+	bool ret;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
-	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
+	if (!cmac_key_init(crypto, &ckey, key))
 		return false;
 
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	swap_buf(out, res, 16);
+	ret = cmac_key_digest(&ckey, msg_msb, msg_len, out);
+	if (ret)
+		swap_buf(out, res, 16);
 
-	close(fd);
+	cmac_key_clear(&ckey);
 
-	return true;
+	return ret;
 }
 
 bool bt_crypto_f4(struct bt_crypto *crypto, uint8_t u[32], uint8_t v[32],
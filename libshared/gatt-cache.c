@@ -0,0 +1,598 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-cache.h"
+
+/*
+ * File layout, all values little endian:
+ *
+ *   magic (4) | version (1) | flags (1) | reserved (2) | hash (16)
+ *
+ * followed by records in handle order, each starting with a type octet:
+ *
+ *   SERVICE: primary (1) | handle (2) | num_handles (2) | uuid
+ *   INCLUDE: handle (2) | included service handle (2)
+ *   CHRC:    value handle (2) | properties (1) | uuid
+ *   DESC:    handle (2) | uuid | value length (2) | value
+ *   END
+ *
+ * A uuid is a length octet (2 or 16) followed by the uuid itself.
+ */
+#define CACHE_MAGIC		0x43544147	/* "GATC" */
+#define CACHE_VERSION		1
+#define CACHE_FLAG_HASH		0x01
+#define CACHE_HEADER_LEN	24
+
+#define RECORD_END		0x00
+#define RECORD_SERVICE		0x01
+#define RECORD_INCLUDE		0x02
+#define RECORD_CHRC		0x03
+#define RECORD_DESC		0x04
+
+struct cache_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+static uint8_t *buf_reserve(struct cache_buf *buf, size_t len)
+{
+	uint8_t *ptr;
+
+	if (buf->failed)
+		return NULL;
+
+	if (buf->len + len > buf->size) {
+		size_t size = buf->size ? buf->size : 512;
+
+		while (size < buf->len + len)
+			size *= 2;
+
+		ptr = realloc(buf->data, size);
+		if (!ptr) {
+			buf->failed = true;
+			return NULL;
+		}
+
+		buf->data = ptr;
+		buf->size = size;
+	}
+
+	ptr = buf->data + buf->len;
+	buf->len += len;
+
+	return ptr;
+}
+
+static void buf_put_u8(struct cache_buf *buf, uint8_t val)
+{
+	uint8_t *ptr = buf_reserve(buf, 1);
+
+	if (ptr)
+		*ptr = val;
+}
+
+static void buf_put_le16(struct cache_buf *buf, uint16_t val)
+{
+	uint8_t *ptr = buf_reserve(buf, 2);
+
+	if (ptr)
+		put_le16(val, ptr);
+}
+
+static void buf_put_data(struct cache_buf *buf, const void *data, size_t len)
+{
+	uint8_t *ptr = buf_reserve(buf, len);
+
+	if (ptr && len)
+		memcpy(ptr, data, len);
+}
+
+static void buf_put_uuid(struct cache_buf *buf, const bt_uuid_t *uuid)
+{
+	bt_uuid_t uuid128;
+
+	if (uuid->type == BT_UUID16) {
+		buf_put_u8(buf, 2);
+		buf_put_le16(buf, uuid->value.u16);
+		return;
+	}
+
+	bt_uuid_to_uuid128(uuid, &uuid128);
+
+	buf_put_u8(buf, 16);
+	buf_put_data(buf, &uuid128.value.u128, 16);
+}
+
+struct store_data {
+	struct cache_buf *buf;
+	uint16_t value_handle;
+};
+
+static bool uuid16_match(const bt_uuid_t *uuid, uint16_t u16)
+{
+	bt_uuid_t cmp;
+
+	bt_uuid16_create(&cmp, u16);
+
+	return !bt_uuid_cmp(uuid, &cmp);
+}
+
+static void store_attribute(struct gatt_db_attribute *attrib, void *user_data)
+{
+	struct store_data *data = user_data;
+	const bt_uuid_t *type = gatt_db_attribute_get_type(attrib);
+	uint16_t handle = gatt_db_attribute_get_handle(attrib);
+	uint16_t value_handle, start;
+	const uint8_t *value;
+	uint8_t properties;
+	size_t length;
+	bt_uuid_t uuid;
+
+	if (uuid16_match(type, GATT_PRIM_SVC_UUID) ||
+				uuid16_match(type, GATT_SND_SVC_UUID))
+		return;
+
+	if (uuid16_match(type, GATT_INCLUDE_UUID)) {
+		if (!gatt_db_attribute_get_incl_data(attrib, NULL, &start,
+									NULL))
+			return;
+
+		buf_put_u8(data->buf, RECORD_INCLUDE);
+		buf_put_le16(data->buf, handle);
+		buf_put_le16(data->buf, start);
+		return;
+	}
+
+	if (uuid16_match(type, GATT_CHARAC_UUID)) {
+		if (!gatt_db_attribute_get_char_data(attrib, NULL,
+							&value_handle,
+							&properties, NULL,
+							&uuid))
+			return;
+
+		buf_put_u8(data->buf, RECORD_CHRC);
+		buf_put_le16(data->buf, value_handle);
+		buf_put_u8(data->buf, properties);
+		buf_put_uuid(data->buf, &uuid);
+
+		data->value_handle = value_handle;
+		return;
+	}
+
+	/* Characteristic values are recreated along with the declaration */
+	if (handle == data->value_handle)
+		return;
+
+	buf_put_u8(data->buf, RECORD_DESC);
+	buf_put_le16(data->buf, handle);
+	buf_put_uuid(data->buf, type);
+
+	/* Keep values cached in the db, such as Extended Properties */
+	if (!gatt_db_attribute_get_stored_value(attrib, &value, &length) ||
+							length > UINT16_MAX)
+		length = 0;
+
+	buf_put_le16(data->buf, length);
+	buf_put_data(data->buf, value, length);
+}
+
+static void store_service(struct gatt_db_attribute *attrib, void *user_data)
+{
+	struct store_data *data = user_data;
+	uint16_t start, end;
+	bool primary;
+	bt_uuid_t uuid;
+
+	if (!gatt_db_attribute_get_service_data(attrib, &start, &end, &primary,
+								&uuid))
+		return;
+
+	buf_put_u8(data->buf, RECORD_SERVICE);
+	buf_put_u8(data->buf, primary);
+	buf_put_le16(data->buf, start);
+	buf_put_le16(data->buf, end - start + 1);
+	buf_put_uuid(data->buf, &uuid);
+
+	data->value_handle = 0;
+	gatt_db_service_foreach(attrib, NULL, store_attribute, data);
+}
+
+static char *cache_path(const char *dir, const bdaddr_t *bdaddr,
+							const char *suffix)
+{
+	char addr[18];
+	char *path;
+
+	ba2str(bdaddr, addr);
+
+	if (asprintf(&path, "%s/%s%s", dir, addr, suffix) < 0)
+		return NULL;
+
+	return path;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, data, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		data += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+bool gatt_cache_store(struct gatt_db *db, const char *dir,
+					const bdaddr_t *bdaddr,
+					const uint8_t *hash)
+{
+	struct cache_buf buf;
+	struct store_data data;
+	uint8_t *header;
+	char *path, *tmp;
+	bool ret = false;
+	int fd;
+
+	if (!db || !dir || !bdaddr)
+		return false;
+
+	memset(&buf, 0, sizeof(buf));
+
+	header = buf_reserve(&buf, CACHE_HEADER_LEN);
+	if (!header)
+		return false;
+
+	memset(header, 0, CACHE_HEADER_LEN);
+	put_le32(CACHE_MAGIC, header);
+	header[4] = CACHE_VERSION;
+
+	if (hash) {
+		header[5] = CACHE_FLAG_HASH;
+		memcpy(header + 8, hash, 16);
+	}
+
+	data.buf = &buf;
+	gatt_db_foreach_service(db, NULL, store_service, &data);
+	buf_put_u8(&buf, RECORD_END);
+
+	if (buf.failed)
+		goto done;
+
+	path = cache_path(dir, bdaddr, "");
+	tmp = cache_path(dir, bdaddr, ".tmp");
+	if (!path || !tmp)
+		goto free_path;
+
+	/* Write to a temporary file so a crash never leaves a partial cache */
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto free_path;
+
+	if (!write_all(fd, buf.data, buf.len) || fsync(fd) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto free_path;
+	}
+
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto free_path;
+	}
+
+	ret = true;
+
+free_path:
+	free(path);
+	free(tmp);
+done:
+	free(buf.data);
+
+	return ret;
+}
+
+struct cache_reader {
+	const uint8_t *ptr;
+	const uint8_t *end;
+};
+
+static bool read_u8(struct cache_reader *r, uint8_t *val)
+{
+	if (r->end - r->ptr < 1)
+		return false;
+
+	*val = *r->ptr++;
+
+	return true;
+}
+
+static bool read_le16(struct cache_reader *r, uint16_t *val)
+{
+	if (r->end - r->ptr < 2)
+		return false;
+
+	*val = get_le16(r->ptr);
+	r->ptr += 2;
+
+	return true;
+}
+
+static bool read_data(struct cache_reader *r, size_t len,
+							const uint8_t **data)
+{
+	if ((size_t) (r->end - r->ptr) < len)
+		return false;
+
+	*data = r->ptr;
+	r->ptr += len;
+
+	return true;
+}
+
+static bool read_uuid(struct cache_reader *r, bt_uuid_t *uuid)
+{
+	const uint8_t *data;
+	uint128_t u128;
+	uint8_t len;
+
+	if (!read_u8(r, &len))
+		return false;
+
+	switch (len) {
+	case 2:
+		if (!read_data(r, 2, &data))
+			return false;
+
+		bt_uuid16_create(uuid, get_le16(data));
+		return true;
+	case 16:
+		if (!read_data(r, 16, &data))
+			return false;
+
+		memcpy(&u128, data, 16);
+		bt_uuid128_create(uuid, u128);
+		return true;
+	}
+
+	return false;
+}
+
+static void write_desc_cb(struct gatt_db_attribute *attrib, int err,
+							void *user_data)
+{
+	bool *success = user_data;
+
+	*success = !err;
+}
+
+/*
+ * Attributes are loaded in two passes, services first so that include
+ * declarations can point to any service regardless of its position.
+ */
+static bool load_records(struct gatt_db *db, struct cache_reader r,
+							bool services)
+{
+	struct gatt_db_attribute *attr, *incl;
+	const uint8_t *value;
+	uint16_t handle, num_handles, start, len;
+	uint8_t type, primary, properties;
+	bt_uuid_t uuid;
+	bool success;
+
+	while (read_u8(&r, &type)) {
+		switch (type) {
+		case RECORD_END:
+			return true;
+		case RECORD_SERVICE:
+			if (!read_u8(&r, &primary) ||
+					!read_le16(&r, &handle) ||
+					!read_le16(&r, &num_handles) ||
+					!read_uuid(&r, &uuid))
+				return false;
+
+			if (!services)
+				break;
+
+			if (!gatt_db_insert_service(db, handle, &uuid, primary,
+								num_handles))
+				return false;
+			break;
+		case RECORD_INCLUDE:
+			if (!read_le16(&r, &handle) || !read_le16(&r, &start))
+				return false;
+
+			if (services)
+				break;
+
+			incl = gatt_db_get_attribute(db, start);
+			if (!incl)
+				return false;
+
+			attr = gatt_db_insert_included(db, handle, incl);
+			if (!attr || gatt_db_attribute_get_handle(attr) != handle)
+				return false;
+			break;
+		case RECORD_CHRC:
+			if (!read_le16(&r, &handle) ||
+					!read_u8(&r, &properties) ||
+					!read_uuid(&r, &uuid))
+				return false;
+
+			if (services)
+				break;
+
+			attr = gatt_db_insert_characteristic(db, handle, &uuid,
+							0, properties,
+							NULL, NULL, NULL);
+			if (!attr || gatt_db_attribute_get_handle(attr) != handle)
+				return false;
+			break;
+		case RECORD_DESC:
+			if (!read_le16(&r, &handle) || !read_uuid(&r, &uuid) ||
+					!read_le16(&r, &len) ||
+					!read_data(&r, len, &value))
+				return false;
+
+			if (services)
+				break;
+
+			attr = gatt_db_insert_descriptor(db, handle, &uuid, 0,
+							NULL, NULL, NULL);
+			if (!attr || gatt_db_attribute_get_handle(attr) != handle)
+				return false;
+
+			if (!len)
+				break;
+
+			success = false;
+			if (!gatt_db_attribute_write(attr, 0, value, len, 0, NULL,
+						write_desc_cb, &success) ||
+								!success)
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	/* Truncated, the END record is missing */
+	return false;
+}
+
+static void activate_service(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	gatt_db_service_set_active(attrib, true);
+}
+
+bool gatt_cache_load(struct gatt_db *db, const char *dir,
+					const bdaddr_t *bdaddr,
+					uint8_t hash[16], bool *has_hash)
+{
+	struct cache_reader r;
+	struct stat st;
+	uint8_t *map;
+	char *path;
+	bool ret = false;
+	int fd;
+
+	if (!db || !dir || !bdaddr || !gatt_db_isempty(db))
+		return false;
+
+	path = cache_path(dir, bdaddr, "");
+	if (!path)
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < CACHE_HEADER_LEN + 1) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	if (get_le32(map) != CACHE_MAGIC || map[4] != CACHE_VERSION)
+		goto done;
+
+	r.ptr = map + CACHE_HEADER_LEN;
+	r.end = map + st.st_size;
+
+	if (!load_records(db, r, true) || !load_records(db, r, false)) {
+		gatt_db_clear(db);
+		goto done;
+	}
+
+	gatt_db_foreach_service(db, NULL, activate_service, NULL);
+
+	if (has_hash)
+		*has_hash = !!(map[5] & CACHE_FLAG_HASH);
+
+	if (hash && (map[5] & CACHE_FLAG_HASH))
+		memcpy(hash, map + 8, 16);
+
+	ret = true;
+
+done:
+	munmap(map, st.st_size);
+
+	return ret;
+}
+
+bool gatt_cache_remove(const char *dir, const bdaddr_t *bdaddr)
+{
+	char *path;
+	int err;
+
+	if (!dir || !bdaddr)
+		return false;
+
+	path = cache_path(dir, bdaddr, "");
+	if (!path)
+		return false;
+
+	err = unlink(path);
+	free(path);
+
+	return !err || errno == ENOENT;
+}
@@ -35,7 +35,12 @@
 #include "src/shared/gatt-client.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 
 #ifndef MAX
@@ -51,6 +56,8 @@
 #define GATT_SVC_UUID	0x1801
 #define SVC_CHNGD_UUID	0x2a05
 
+#define NOTIFY_TABLE_MIN_SIZE	64
+
 struct ready_cb {
 	bt_gatt_client_callback_t callback;
 	bt_gatt_client_destroy_func_t destroy;
@@ -93,8 +100,11 @@ struct bt_gatt_client {
 	/* List of registered disconnect/notification/indication callbacks */
 	struct queue *notify_list;
 	struct queue *notify_chrcs;
+	struct notify_chrc **notify_table;	/* notify_chrcs by value handle */
+	unsigned int notify_table_size;
+	unsigned int notify_chrc_count;
 	int next_reg_id;
-	unsigned int disc_id, notify_id, ind_id;
+	unsigned int disc_id, notify_id, ind_id, notify_mult_id;
 
 	/*
 	 * Handles of the GATT Service and the Service Changed characteristic
@@ -116,6 +126,17 @@ struct bt_gatt_client {
 
 	struct bt_gatt_request *discovery_req;
 	unsigned int mtu_req_id;
+
+	/*
+	 * Database Hash of the remote database, read at init time when the
+	 * client was created with bt_gatt_client_new_cached.
+	 */
+	bool check_db_hash;
+	bool has_cached_hash;
+	uint8_t cached_hash[16];
+	bool has_db_hash;
+	uint8_t db_hash[16];
+	unsigned int db_hash_req_id;
 };
 
 struct request {
@@ -123,6 +144,7 @@ struct request {
 	bool long_write;
 	bool prep_write;
 	bool removed;
+	struct queue_entry *entry;	/* In pending_requests until removed */
 	int ref_count;
 	unsigned int id;
 	unsigned int att_id;
@@ -149,7 +171,7 @@ static struct request *request_create(struct bt_gatt_client *client)
 	if (client->next_request_id < 1)
 		client->next_request_id = 1;
 
-	queue_push_tail(client->pending_requests, req);
+	req->entry = queue_push_tail_entry(client->pending_requests, req);
 	req->client = client;
 	req->id = client->next_request_id++;
 
@@ -167,17 +189,21 @@ static void request_unref(void *data)
 		req->destroy(req->data);
 
 	if (!req->removed)
-		queue_remove(req->client->pending_requests, req);
+		queue_remove_entry(req->client->pending_requests, req->entry);
 
 	free(req);
 }
 
 struct notify_chrc {
+	struct notify_chrc *hash_next;
 	uint16_t value_handle;
 	uint16_t ccc_handle;
 	uint16_t properties;
 	int notify_count;  /* Reference count of registered notify callbacks */
 
+	/* Handlers registered for value_handle, a subset of notify_list */
+	struct queue *notify_list;
+
 	/* Pending calls to register_notify are queued here so that they can be
 	 * processed after a write that modifies the CCC descriptor.
 	 */
@@ -233,6 +259,60 @@ static void find_ccc(struct gatt_db_attribute *attr, void *user_data)
 	*ccc_ptr = attr;
 }
 
+static struct notify_chrc *notify_chrc_lookup(struct bt_gatt_client *client,
+							uint16_t value_handle)
+{
+	struct notify_chrc *chrc;
+
+	if (!client->notify_table_size)
+		return NULL;
+
+	chrc = client->notify_table[value_handle &
+					(client->notify_table_size - 1)];
+	while (chrc && chrc->value_handle != value_handle)
+		chrc = chrc->hash_next;
+
+	return chrc;
+}
+
+static void notify_chrc_hash_insert(struct bt_gatt_client *client,
+						struct notify_chrc *chrc)
+{
+	unsigned int bucket;
+
+	if (client->notify_chrc_count >= client->notify_table_size) {
+		struct notify_chrc **table;
+		unsigned int size, i;
+
+		size = client->notify_table_size ?
+					client->notify_table_size * 2 :
+					NOTIFY_TABLE_MIN_SIZE;
+		table = new0(struct notify_chrc *, size);
+
+		for (i = 0; i < client->notify_table_size; i++) {
+			struct notify_chrc *entry = client->notify_table[i];
+
+			while (entry) {
+				struct notify_chrc *next = entry->hash_next;
+
+				bucket = entry->value_handle & (size - 1);
+				entry->hash_next = table[bucket];
+				table[bucket] = entry;
+				entry = next;
+			}
+		}
+
+		free(client->notify_table);
+		client->notify_table = table;
+		client->notify_table_size = size;
+	}
+
+	bucket = chrc->value_handle & (client->notify_table_size - 1);
+	chrc->hash_next = client->notify_table[bucket];
+	client->notify_table[bucket] = chrc;
+	client->notify_chrc_count++;
+}
+
 static struct notify_chrc *notify_chrc_create(struct bt_gatt_client *client,
 							uint16_t value_handle)
 {
@@ -262,6 +342,8 @@ static struct notify_chrc *notify_chrc_create(struct bt_gatt_client *client,
 		return NULL;
 	}
 
+	chrc->notify_list = queue_new();
+
 	/*
 	 * Find the CCC characteristic. Some characteristics that allow
 	 * notifications may not have a CCC descriptor. We treat these as
@@ -276,6 +358,7 @@ static struct notify_chrc *notify_chrc_create(struct bt_gatt_client *client,
 	chrc->properties = properties;
 
 	queue_push_tail(client->notify_chrcs, chrc);
+	notify_chrc_hash_insert(client, chrc);
 
 	return chrc;
 }
@@ -284,10 +367,17 @@ static void notify_chrc_free(void *data)
 {
 	struct notify_chrc *chrc = data;
 
+	queue_destroy(chrc->notify_list, NULL);
 	queue_destroy(chrc->reg_notify_queue, notify_data_unref);
 	free(chrc);
 }
 
+static void notify_data_unlink(struct notify_data *notify_data)
+{
+	queue_remove(notify_data->client->notify_list, notify_data);
+	queue_remove(notify_data->chrc->notify_list, notify_data);
+}
+
 static bool match_notify_data_id(const void *a, const void *b)
 {
 	const struct notify_data *notify_data = a;
@@ -1246,6 +1336,9 @@ static void notify_client_ready(struct bt_gatt_client *client, bool success,
 	bt_gatt_client_unref(client);
 }
 
+static bool init_discover(struct bt_gatt_client *client,
+						struct discovery_op *op);
+
 static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 {
 	struct discovery_op *op = user_data;
@@ -1279,12 +1372,7 @@ static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 					bt_att_get_mtu(client->att));
 
 discover:
-	client->discovery_req = bt_gatt_discover_all_primary_services(
-							client->att, NULL,
-							discover_primary_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
+	if (init_discover(client, op))
 		return;
 
 	util_debug(client->debug_callback, client->debug_data,
@@ -1380,7 +1468,7 @@ static void enable_ccc_callback(uint8_t opcode, const void *pdu,
 		 * the next one in the queue. If there was an error sending the
 		 * write request, then just move on to the next queued entry.
 		 */
-		queue_remove(notify_data->client->notify_list, notify_data);
+		notify_data_unlink(notify_data);
 		notify_data->callback(att_ecode, notify_data->user_data);
 
 		while ((notify_data = queue_pop_head(
@@ -1404,14 +1492,6 @@ static void enable_ccc_callback(uint8_t opcode, const void *pdu,
 	bt_gatt_client_unref(notify_data->client);
 }
 
-static bool match_notify_chrc_value_handle(const void *a, const void *b)
-{
-	const struct notify_chrc *chrc = a;
-	uint16_t value_handle = PTR_TO_UINT(b);
-
-	return chrc->value_handle == value_handle;
-}
-
 static unsigned int register_notify(struct bt_gatt_client *client,
 				uint16_t handle,
 				bt_gatt_client_register_callback_t callback,
@@ -1423,8 +1503,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 	struct notify_chrc *chrc = NULL;
 
 	/* Check if a characteristic ref count has been started already */
-	chrc = queue_find(client->notify_chrcs, match_notify_chrc_value_handle,
-						UINT_TO_PTR(handle));
+	chrc = notify_chrc_lookup(client, handle);
 
 	if (!chrc) {
 		/*
@@ -1451,6 +1530,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 
 	/* Add the handler to the bt_gatt_client's general list */
 	queue_push_tail(client->notify_list, notify_data);
+	queue_push_tail(chrc->notify_list, notify_data);
 
 	/* Assign an ID to the handler. */
 	if (client->next_reg_id < 1)
@@ -1480,7 +1560,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 
 	/* Write to the CCC descriptor */
 	if (!notify_data_write_ccc(notify_data, true, enable_ccc_callback)) {
-		queue_remove(client->notify_list, notify_data);
+		notify_data_unlink(notify_data);
 		free(notify_data);
 		return 0;
 	}
@@ -1701,6 +1781,94 @@ done:
 	notify_client_ready(client, success, att_ecode);
 }
 
+static bool discover_all_primary(struct bt_gatt_client *client,
+						struct discovery_op *op)
+{
+	client->discovery_req = bt_gatt_discover_all_primary_services(
+							client->att, NULL,
+							discover_primary_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+
+	return client->discovery_req != NULL;
+}
+
+static void db_hash_read_cb(uint8_t opcode, const void *pdu, uint16_t length,
+								void *user_data)
+{
+	struct discovery_op *op = user_data;
+	struct bt_gatt_client *client = op->client;
+	const uint8_t *data = pdu;
+
+	client->db_hash_req_id = 0;
+
+	/* Only the first attribute matters, the value is always 16 octets */
+	if (opcode == BT_ATT_OP_READ_BY_TYPE_RSP && length >= 19 &&
+							data[0] == 18) {
+		memcpy(client->db_hash, data + 3, 16);
+		client->has_db_hash = true;
+	}
+
+	if (client->has_db_hash && client->has_cached_hash &&
+			!memcmp(client->db_hash, client->cached_hash, 16) &&
+			!gatt_db_isempty(client->db)) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Database Hash matches, skipping discovery");
+
+		/* The cached services are all there is, nothing is pending */
+		gatt_db_unregister(client->db, op->db_id);
+		op->db_id = 0;
+		op->success = true;
+		op->complete_func(op, true, 0);
+		return;
+	}
+
+	if (!gatt_db_isempty(client->db)) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Database Hash mismatch, discarding cache");
+		gatt_db_clear(client->db);
+		op->last = 0;
+	}
+
+	if (discover_all_primary(client, op))
+		return;
+
+	util_debug(client->debug_callback, client->debug_data,
+			"Failed to initiate primary service discovery");
+
+	client->in_init = false;
+	notify_client_ready(client, false, 0);
+}
+
+static bool init_discover(struct bt_gatt_client *client,
+						struct discovery_op *op)
+{
+	uint8_t pdu[6];
+	bt_uuid_t uuid;
+
+	if (!client->check_db_hash)
+		return discover_all_primary(client, op);
+
+	bt_uuid16_create(&uuid, GATT_CHARAC_DB_HASH);
+
+	put_le16(0x0001, pdu);
+	put_le16(0xffff, pdu + 2);
+	bt_uuid_to_le(&uuid, pdu + 4);
+
+	client->db_hash_req_id = bt_att_send(client->att,
+						BT_ATT_OP_READ_BY_TYPE_REQ,
+						pdu, sizeof(pdu),
+						db_hash_read_cb, op,
+						discovery_op_unref);
+	if (!client->db_hash_req_id)
+		return false;
+
+	/* Responses are never delivered from within bt_att_send */
+	discovery_op_ref(op);
+
+	return true;
+}
+
 static bool gatt_client_init(struct bt_gatt_client *client, uint16_t mtu)
 {
 	struct discovery_op *op;
@@ -1744,12 +1912,7 @@ static bool gatt_client_init(struct bt_gatt_client *client, uint16_t mtu)
 	return true;
 
 discover:
-	client->discovery_req = bt_gatt_discover_all_primary_services(
-							client->att, NULL,
-							discover_primary_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (!client->discovery_req) {
+	if (!init_discover(client, op)) {
 		discovery_op_free(op);
 		return false;
 	}
@@ -1759,7 +1922,7 @@ discover:
 }
 
 struct pdu_data {
-	const void *pdu;
+	const uint8_t *value;
 	uint16_t length;
 };
 
@@ -1812,39 +1975,48 @@ static void notify_handler(void *data, void *user_data)
 {
 	struct notify_data *notify_data = data;
 	struct pdu_data *pdu_data = user_data;
-	uint16_t value_handle;
+	uint16_t value_handle = notify_data->chrc->value_handle;
 	const uint8_t *value = NULL;
 
-	value_handle = get_le16(pdu_data->pdu);
-
-	if (notify_data->chrc->value_handle != value_handle)
-		return;
-
-	if (pdu_data->length > 2)
-		value = pdu_data->pdu + 2;
+	if (pdu_data->length)
+		value = pdu_data->value;
 
 	/*
 	 * Even if the notify data has a pending ATT request to write to the
 	 * CCC, there is really no reason not to notify the handlers.
 	 */
 	if (notify_data->notify)
-		notify_data->notify(value_handle, value, pdu_data->length - 2,
+		notify_data->notify(value_handle, value, pdu_data->length,
 							notify_data->user_data);
 }
 
+static void dispatch_notify(struct bt_gatt_client *client,
+					uint16_t value_handle,
+					const uint8_t *value, uint16_t length)
+{
+	struct notify_chrc *chrc;
+	struct pdu_data pdu_data;
+
+	chrc = notify_chrc_lookup(client, value_handle);
+	if (!chrc)
+		return;
+
+	pdu_data.value = value;
+	pdu_data.length = length;
+
+	queue_foreach(chrc->notify_list, notify_handler, &pdu_data);
+}
+
 static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 								void *user_data)
 {
 	struct bt_gatt_client *client = user_data;
-	struct pdu_data pdu_data;
 
 	bt_gatt_client_ref(client);
 
-	memset(&pdu_data, 0, sizeof(pdu_data));
-	pdu_data.pdu = pdu;
-	pdu_data.length = length;
-
-	queue_foreach(client->notify_list, notify_handler, &pdu_data);
+	if (length >= 2)
+		dispatch_notify(client, get_le16(pdu), (const uint8_t *) pdu + 2,
+								length - 2);
 
 	if (opcode == BT_ATT_OP_HANDLE_VAL_IND && !client->parent)
 		bt_att_send(client->att, BT_ATT_OP_HANDLE_VAL_CONF, NULL, 0,
@@ -1853,6 +2025,32 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 	bt_gatt_client_unref(client);
 }
 
+static void notify_multiple_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct bt_gatt_client *client = user_data;
+	const uint8_t *ptr = pdu;
+	uint16_t handle, value_len;
+
+	bt_gatt_client_ref(client);
+
+	/* Handle Length Value tuples; a value cut short is still reported */
+	while (length >= 4) {
+		handle = get_le16(ptr);
+		value_len = MIN(get_le16(ptr + 2), length - 4);
+
+		ptr += 4;
+		length -= 4;
+
+		dispatch_notify(client, handle, ptr, value_len);
+
+		ptr += value_len;
+		length -= value_len;
+	}
+
+	bt_gatt_client_unref(client);
+}
+
 static void bt_gatt_client_free(struct bt_gatt_client *client)
 {
 	bt_gatt_client_cancel_all(client);
@@ -1868,6 +2066,7 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 		bt_att_unregister_disconnect(client->att, client->disc_id);
 		bt_att_unregister(client->att, client->notify_id);
 		bt_att_unregister(client->att, client->ind_id);
+		bt_att_unregister(client->att, client->notify_mult_id);
 		bt_att_unref(client->att);
 	}
 
@@ -1877,6 +2076,7 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->svc_chngd_queue, free);
 	queue_destroy(client->long_write_queue, request_unref);
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
+	free(client->notify_table);
 	queue_destroy(client->pending_requests, request_unref);
 
 	if (client->parent) {
@@ -1933,6 +2133,13 @@ static struct bt_gatt_client *gatt_client_new(struct gatt_db *db,
 	if (!client->ind_id)
 		goto fail;
 
+	client->notify_mult_id = bt_att_register(att,
+						BT_ATT_OP_HANDLE_VAL_MULT_NOT,
+						notify_multiple_cb, client,
+						NULL);
+	if (!client->notify_mult_id)
+		goto fail;
+
 	client->att = bt_att_ref(att);
 	client->db = gatt_db_ref(db);
 
@@ -1965,6 +2172,46 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 	return bt_gatt_client_ref(client);
 }
 
+struct bt_gatt_client *bt_gatt_client_new_cached(struct gatt_db *db,
+							struct bt_att *att,
+							uint16_t mtu,
+							const uint8_t *hash)
+{
+	struct bt_gatt_client *client;
+
+	if (!att || !db)
+		return NULL;
+
+	client = gatt_client_new(db, att);
+	if (!client)
+		return NULL;
+
+	client->check_db_hash = true;
+
+	if (hash) {
+		memcpy(client->cached_hash, hash, 16);
+		client->has_cached_hash = true;
+	}
+
+	if (!gatt_client_init(client, mtu)) {
+		bt_gatt_client_free(client);
+		return NULL;
+	}
+
+	return bt_gatt_client_ref(client);
+}
+
+bool bt_gatt_client_get_db_hash(struct bt_gatt_client *client,
+							uint8_t hash[16])
+{
+	if (!client || !client->has_db_hash)
+		return false;
+
+	memcpy(hash, client->db_hash, 16);
+
+	return true;
+}
+
 struct bt_gatt_client *bt_gatt_client_clone(struct bt_gatt_client *client)
 {
 	struct bt_gatt_client *clone;
@@ -2115,6 +2362,8 @@ static void cancel_long_write_cb(uint8_t opcode, const void *pdu, uint16_t len,
 		client->in_long_write = false;
 }
 
+static void cancel_long_write_chunks(struct request *req);
+
 static bool cancel_long_write_req(struct bt_gatt_client *client,
 							struct request *req)
 {
@@ -2128,6 +2377,8 @@ static bool cancel_long_write_req(struct bt_gatt_client *client,
 	if (!req->att_id)
 		return queue_remove(client->long_write_queue, req);
 
+	cancel_long_write_chunks(req);
+
 	return !!bt_att_send(client->att, BT_ATT_OP_EXEC_WRITE_REQ, &pdu,
 							sizeof(pdu),
 							cancel_long_write_cb,
@@ -2204,6 +2455,11 @@ bool bt_gatt_client_cancel_all(struct bt_gatt_client *client)
 	if (client->mtu_req_id)
 		bt_att_cancel(client->att, client->mtu_req_id);
 
+	if (client->db_hash_req_id) {
+		bt_att_cancel(client->att, client->db_hash_req_id);
+		client->db_hash_req_id = 0;
+	}
+
 	return true;
 }
 
@@ -2375,12 +2631,139 @@ unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 	return req->id;
 }
 
+struct read_multiple_vl_op {
+	uint16_t *handles;
+	uint8_t num_handles;
+	bt_gatt_client_read_multiple_vl_callback_t value_cb;
+	bt_gatt_client_callback_t callback;
+	void *user_data;
+	bt_gatt_client_destroy_func_t destroy;
+};
+
+static void destroy_read_multiple_vl_op(void *data)
+{
+	struct read_multiple_vl_op *op = data;
+
+	if (op->destroy)
+		op->destroy(op->user_data);
+
+	free(op->handles);
+	free(op);
+}
+
+static void read_multiple_vl_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct request *req = user_data;
+	struct read_multiple_vl_op *op = req->data;
+	const uint8_t *ptr = pdu;
+	uint16_t value_len, avail;
+	uint8_t i;
+
+	if (opcode != BT_ATT_OP_READ_MULT_VL_RSP || (!pdu && length)) {
+		uint8_t att_ecode = 0;
+
+		if (opcode == BT_ATT_OP_ERROR_RSP)
+			att_ecode = process_error(pdu, length);
+
+		if (op->callback)
+			op->callback(false, att_ecode, op->user_data);
+
+		return;
+	}
+
+	/*
+	 * The response is a list of Length Value tuples in request order. Only
+	 * the first MTU - 1 octets are sent, so the list may stop short and
+	 * the last value may be cut off.
+	 */
+	for (i = 0; i < op->num_handles && length >= 2; i++) {
+		value_len = get_le16(ptr);
+		ptr += 2;
+		length -= 2;
+
+		avail = MIN(value_len, length);
+
+		if (op->value_cb)
+			op->value_cb(op->handles[i], avail ? ptr : NULL, avail,
+					avail < value_len, op->user_data);
+
+		ptr += avail;
+		length -= avail;
+	}
+
+	if (op->callback)
+		op->callback(true, 0, op->user_data);
+}
+
+unsigned int bt_gatt_client_read_multiple_vl(struct bt_gatt_client *client,
+				uint16_t *handles, uint8_t num_handles,
+				bt_gatt_client_read_multiple_vl_callback_t value_cb,
+				bt_gatt_client_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
+{
+	uint8_t pdu[num_handles * 2];
+	struct request *req;
+	struct read_multiple_vl_op *op;
+	int i;
+
+	if (!client || !handles)
+		return 0;
+
+	if (num_handles < 2)
+		return 0;
+
+	if (num_handles * 2 > bt_att_get_mtu(client->att) - 1)
+		return 0;
+
+	op = new0(struct read_multiple_vl_op, 1);
+	op->handles = new0(uint16_t, num_handles);
+	memcpy(op->handles, handles, num_handles * sizeof(uint16_t));
+	op->num_handles = num_handles;
+
+	req = request_create(client);
+	if (!req) {
+		free(op->handles);
+		free(op);
+		return 0;
+	}
+
+	op->value_cb = value_cb;
+	op->callback = callback;
+	op->user_data = user_data;
+	op->destroy = destroy;
+
+	req->data = op;
+	req->destroy = destroy_read_multiple_vl_op;
+
+	for (i = 0; i < num_handles; i++)
+		put_le16(handles[i], pdu + (2 * i));
+
+	req->att_id = bt_att_send(client->att, BT_ATT_OP_READ_MULT_VL_REQ,
+							pdu, sizeof(pdu),
+							read_multiple_vl_cb, req,
+							request_unref);
+	if (!req->att_id) {
+		op->destroy = NULL;
+		request_unref(req);
+		return 0;
+	}
+
+	return req->id;
+}
+
 struct read_long_op {
 	struct bt_gatt_client *client;
 	int ref_count;
 	uint16_t value_handle;
 	uint16_t offset;
-	struct iovec iov;
+	uint8_t *buf;
+	uint16_t len;		/* Bytes read so far, stored or not */
+	uint16_t size;		/* Room in buf */
+	bool store;
+	bool own_buf;
+	bt_gatt_client_read_chunk_callback_t chunk_cb;
 	bt_gatt_client_read_callback_t callback;
 	void *user_data;
 	bt_gatt_client_destroy_func_t destroy;
@@ -2393,28 +2776,56 @@ static void destroy_read_long_op(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->iov.iov_base);
+	if (op->own_buf)
+		free(op->buf);
+
 	free(op);
 }
 
-static bool append_chunk(struct read_long_op *op, const uint8_t *data,
-								uint16_t len)
+static bool grow_buf(struct read_long_op *op, uint16_t len)
 {
+	unsigned int size = op->size ? op->size : len;
 	void *buf;
 
+	/* Double the room rather than reallocating for every chunk */
+	while (size < op->len + len)
+		size *= 2;
+
+	if (size > BT_ATT_MAX_VALUE_LEN)
+		size = BT_ATT_MAX_VALUE_LEN;
+
+	buf = realloc(op->buf, size);
+	if (!buf)
+		return false;
+
+	op->buf = buf;
+	op->size = size;
+
+	return true;
+}
+
+static bool append_chunk(struct read_long_op *op, const uint8_t *data,
+								uint16_t len)
+{
 	/* Truncate if the data would exceed maximum length */
 	if (op->offset + len > BT_ATT_MAX_VALUE_LEN)
 		len = BT_ATT_MAX_VALUE_LEN - op->offset;
 
-	buf = realloc(op->iov.iov_base, op->iov.iov_len + len);
-	if (!buf)
-		return false;
+	if (op->store && op->len + len > op->size) {
+		/* A caller provided buffer only takes what fits */
+		if (!op->own_buf)
+			len = op->size - op->len;
+		else if (!grow_buf(op, len))
+			return false;
+	}
 
-	op->iov.iov_base = buf;
+	if (op->chunk_cb)
+		op->chunk_cb(op->offset, data, len, op->user_data);
 
-	memcpy(op->iov.iov_base + op->iov.iov_len, data, len);
+	if (op->store)
+		memcpy(op->buf + op->len, data, len);
 
-	op->iov.iov_len += len;
+	op->len += len;
 	op->offset += len;
 
 	return true;
@@ -2452,6 +2863,9 @@ static void read_long_cb(uint8_t opcode, const void *pdu,
 	if (op->offset >= BT_ATT_MAX_VALUE_LEN)
 		goto success;
 
+	if (op->store && !op->own_buf && op->len == op->size)
+		goto success;
+
 	if (length >= bt_att_get_mtu(op->client->att) - 1) {
 		uint8_t pdu[4];
 
@@ -2477,15 +2891,17 @@ success:
 
 done:
 	if (op->callback)
-		op->callback(success, att_ecode, op->iov.iov_base,
-						op->iov.iov_len, op->user_data);
+		op->callback(success, att_ecode, op->store ? op->buf : NULL,
+						op->len, op->user_data);
 }
 
-unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
-					uint16_t value_handle, uint16_t offset,
-					bt_gatt_client_read_callback_t callback,
-					void *user_data,
-					bt_gatt_client_destroy_func_t destroy)
+static unsigned int read_long(struct bt_gatt_client *client,
+				uint16_t value_handle, uint16_t offset,
+				uint8_t *buf, uint16_t size,
+				bt_gatt_client_read_chunk_callback_t chunk_cb,
+				bt_gatt_client_read_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
 {
 	struct request *req;
 	struct read_long_op *op;
@@ -2507,10 +2923,27 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	op->client = client;
 	op->value_handle = value_handle;
 	op->offset = offset;
+	op->chunk_cb = chunk_cb;
 	op->callback = callback;
 	op->user_data = user_data;
 	op->destroy = destroy;
 
+	/* Only a pure stream with no buffer and no size hint goes unstored */
+	op->store = buf || size || !chunk_cb;
+
+	if (buf) {
+		op->buf = buf;
+		op->size = size;
+	} else if (op->store) {
+		op->own_buf = true;
+
+		if (size && !grow_buf(op, MIN(size, BT_ATT_MAX_VALUE_LEN))) {
+			free(op);
+			request_unref(req);
+			return 0;
+		}
+	}
+
 	req->data = op;
 	req->destroy = destroy_read_long_op;
 
@@ -2550,6 +2983,32 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	return req->id;
 }
 
+unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
+					uint16_t value_handle, uint16_t offset,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	return read_long(client, value_handle, offset, NULL, 0, NULL,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_gatt_client_read_long_value_stream(
+				struct bt_gatt_client *client,
+				uint16_t value_handle, uint16_t offset,
+				uint8_t *buf, uint16_t size,
+				bt_gatt_client_read_chunk_callback_t chunk_cb,
+				bt_gatt_client_read_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
+{
+	if (buf && !size)
+		return 0;
+
+	return read_long(client, value_handle, offset, buf, size, chunk_cb,
+					callback, user_data, destroy);
+}
+
 unsigned int bt_gatt_client_write_without_response(
 					struct bt_gatt_client *client,
 					uint16_t value_handle,
@@ -2672,6 +3131,13 @@ unsigned int bt_gatt_client_write_value(struct bt_gatt_client *client,
 	return req->id;
 }
 
+struct prep_chunk {
+	unsigned int id;
+	uint16_t offset;
+	uint16_t len;
+	uint8_t data[0];	/* Sent bytes, only kept to verify the echo */
+};
+
 struct long_write_op {
 	struct bt_gatt_client *client;
 	bool reliable;
@@ -2679,11 +3145,20 @@ struct long_write_op {
 	uint8_t att_ecode;
 	bool reliable_error;
 	uint16_t value_handle;
-	uint8_t *value;
 	uint16_t length;
 	uint16_t offset;
-	uint16_t index;
-	uint16_t cur_length;
+	uint16_t queued;	/* Bytes handed to att */
+	uint16_t done;		/* Bytes acknowledged */
+	unsigned int window;
+	struct queue *chunks;	/* Prepare Writes in flight, oldest first */
+	bt_gatt_client_write_source_func_t source;
+	void *source_data;
+	uint8_t *value;		/* Copy made by bt_gatt_client_write_long_value */
+	void *map;
+	size_t map_len;
+	size_t map_start;	/* Where the value starts in map */
+	int fd;
+	off_t fd_offset;
 	bt_gatt_client_write_long_callback_t callback;
 	void *user_data;
 	bt_gatt_client_destroy_func_t destroy;
@@ -2696,52 +3171,120 @@ static void long_write_op_free(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
+	queue_destroy(op->chunks, free);
+
+	if (op->map)
+		munmap(op->map, op->map_len);
+
+	if (op->fd >= 0)
+		close(op->fd);
+
 	free(op->value);
 	free(op);
 }
 
+static void cancel_chunk(void *data, void *user_data)
+{
+	struct prep_chunk *chunk = data;
+	struct bt_att *att = user_data;
+
+	bt_att_cancel(att, chunk->id);
+}
+
+/* Drop the Prepare Writes still waiting in att, each holds a request ref */
+static void cancel_long_write_chunks(struct request *req)
+{
+	struct long_write_op *op = req->data;
+	struct queue *chunks = op->chunks;
+
+	op->chunks = queue_new();
+	queue_foreach(chunks, cancel_chunk, op->client->att);
+	queue_destroy(chunks, free);
+}
+
 static void prepare_write_cb(uint8_t opcode, const void *pdu, uint16_t length,
 							void *user_data);
 static void complete_write_long_op(struct request *req, bool success,
 					uint8_t att_ecode, bool reliable_error);
 
-static void handle_next_prep_write(struct request *req)
+static bool send_prep_chunk(struct request *req)
 {
 	struct long_write_op *op = req->data;
-	bool success = true;
+	struct bt_att *att = op->client->att;
+	struct prep_chunk *chunk;
+	uint16_t max_len, len;
 	uint8_t *pdu;
 
-	pdu = malloc(op->cur_length + 4);
-	if (!pdu) {
-		success = false;
-		goto done;
-	}
+	/* The value is read from its source straight into the PDU */
+	pdu = bt_att_pdu_alloc(att, BT_ATT_OP_PREP_WRITE_REQ, &max_len);
+	if (!pdu)
+		return false;
+
+	len = MIN(op->length - op->queued, max_len - 4);
 
 	put_le16(op->value_handle, pdu);
-	put_le16(op->offset + op->index, pdu + 2);
-	memcpy(pdu + 4, op->value + op->index, op->cur_length);
+	put_le16(op->offset + op->queued, pdu + 2);
+
+	if (!op->source(op->offset + op->queued, pdu + 4, len,
+							op->source_data)) {
+		bt_att_pdu_free(att, pdu);
+		return false;
+	}
 
-	req->att_id = bt_att_send(op->client->att, BT_ATT_OP_PREP_WRITE_REQ,
-							pdu, op->cur_length + 4,
-							prepare_write_cb,
+	chunk = malloc(sizeof(*chunk) + (op->reliable ? len : 0));
+	if (!chunk) {
+		bt_att_pdu_free(att, pdu);
+		return false;
+	}
+
+	chunk->offset = op->offset + op->queued;
+	chunk->len = len;
+
+	if (op->reliable)
+		memcpy(chunk->data, pdu + 4, len);
+
+	chunk->id = bt_att_send_prepared(att, pdu, len + 4, prepare_write_cb,
 							request_ref(req),
 							request_unref);
-	if (!req->att_id) {
+	if (!chunk->id) {
 		request_unref(req);
-		success = false;
+		free(chunk);
+		return false;
 	}
 
-	free(pdu);
+	queue_push_tail(op->chunks, chunk);
 
-	/* If so far successful, then the operation should continue.
-	 * Otherwise, there was an error and the procedure should be
-	 * completed.
-	 */
-	if (success)
+	req->att_id = chunk->id;
+	op->queued += len;
+
+	return true;
+}
+
+/*
+ * ATT allows a single outstanding request, so the window does not put more
+ * than one Prepare Write on the air. It has the next ones pulled from the
+ * source and waiting in att though, so they go out as soon as the previous
+ * response is in.
+ */
+static bool fill_long_write_window(struct request *req)
+{
+	struct long_write_op *op = req->data;
+
+	while (op->queued < op->length &&
+				queue_length(op->chunks) < op->window) {
+		if (!send_prep_chunk(req))
+			return false;
+	}
+
+	return true;
+}
+
+static void handle_next_prep_write(struct request *req)
+{
+	if (fill_long_write_window(req))
 		return;
 
-done:
-	complete_write_long_op(req, success, 0, false);
+	complete_write_long_op(req, false, 0, false);
 }
 
 static void start_next_long_write(struct bt_gatt_client *client)
@@ -2760,8 +3303,8 @@ static void start_next_long_write(struct bt_gatt_client *client)
 	handle_next_prep_write(req);
 
 	/*
-	 * send_next_prep_write adds an extra ref. Unref here to clean up if
-	 * necessary, since we also added a ref before pushing to the queue.
+	 * Every Prepare Write sent holds its own ref. Unref here to clean up
+	 * if necessary, since we also added a ref before pushing to the queue.
 	 */
 	request_unref(req);
 }
@@ -2801,6 +3344,8 @@ static void complete_write_long_op(struct request *req, bool success,
 	op->att_ecode = att_ecode;
 	op->reliable_error = reliable_error;
 
+	cancel_long_write_chunks(req);
+
 	if (success)
 		pdu = 0x01;  /* Write */
 	else
@@ -2832,10 +3377,21 @@ static void prepare_write_cb(uint8_t opcode, const void *pdu, uint16_t length,
 {
 	struct request *req = user_data;
 	struct long_write_op *op = req->data;
+	struct prep_chunk *chunk;
 	bool success = true;
 	bool reliable_error = false;
 	uint8_t att_ecode = 0;
-	uint16_t next_index;
+
+	/* Responses come back in the order the requests were sent */
+	chunk = queue_pop_head(op->chunks);
+	if (!chunk)
+		return;
+
+	/* Cancelled, the Execute Write cancelling it is already queued */
+	if (req->removed) {
+		free(chunk);
+		return;
+	}
 
 	if (opcode == BT_ATT_OP_ERROR_RSP) {
 		success = false;
@@ -2849,93 +3405,68 @@ static void prepare_write_cb(uint8_t opcode, const void *pdu, uint16_t length,
 	}
 
 	if (op->reliable) {
-		if (!pdu || length != (op->cur_length + 4)) {
+		if (!pdu || length != (chunk->len + 4)) {
 			success = false;
 			reliable_error = true;
 			goto done;
 		}
 
 		if (get_le16(pdu) != op->value_handle ||
-				get_le16(pdu + 2) != (op->offset + op->index)) {
+				get_le16(pdu + 2) != chunk->offset) {
 			success = false;
 			reliable_error = true;
 			goto done;
 		}
 
-		if (memcmp(pdu + 4, op->value + op->index, op->cur_length)) {
+		if (memcmp(pdu + 4, chunk->data, chunk->len)) {
 			success = false;
 			reliable_error = true;
 			goto done;
 		}
 	}
 
-	next_index = op->index + op->cur_length;
-	if (next_index == op->length) {
+	op->done += chunk->len;
+	if (op->done == op->length) {
 		/* All bytes written */
 		goto done;
 	}
 
-	/* If the last written length was greater than or equal to what can fit
-	 * inside a PDU, then there is more data to send.
-	 */
-	if (op->cur_length >= bt_att_get_mtu(op->client->att) - 5) {
-		op->index = next_index;
-		op->cur_length = MIN(op->length - op->index,
-					bt_att_get_mtu(op->client->att) - 5);
-		handle_next_prep_write(req);
+	free(chunk);
+
+	if (fill_long_write_window(req))
 		return;
-	}
+
+	complete_write_long_op(req, false, 0, false);
+	return;
 
 done:
+	free(chunk);
 	complete_write_long_op(req, success, att_ecode, reliable_error);
 }
 
-unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
-				bool reliable,
+static unsigned int write_long(struct bt_gatt_client *client, bool reliable,
 				uint16_t value_handle, uint16_t offset,
-				const uint8_t *value, uint16_t length,
+				uint16_t length, unsigned int window,
+				struct long_write_op *op,
 				bt_gatt_client_write_long_callback_t callback,
 				void *user_data,
 				bt_gatt_client_destroy_func_t destroy)
 {
 	struct request *req;
-	struct long_write_op *op;
-	uint8_t *pdu;
-
-	if (!client)
-		return 0;
-
-	if ((size_t)(length + offset) > UINT16_MAX)
-		return 0;
-
-	/* Don't allow writing a 0-length value using this procedure. The
-	 * upper-layer should use bt_gatt_write_value for that instead.
-	 */
-	if (!length || !value)
-		return 0;
-
-	op = new0(struct long_write_op, 1);
-	op->value = malloc(length);
-	if (!op->value) {
-		free(op);
-		return 0;
-	}
 
 	req = request_create(client);
 	if (!req) {
-		free(op->value);
-		free(op);
+		long_write_op_free(op);
 		return 0;
 	}
 
-	memcpy(op->value, value, length);
-
 	op->client = client;
 	op->reliable = reliable;
 	op->value_handle = value_handle;
 	op->length = length;
 	op->offset = offset;
-	op->cur_length = MIN(length, bt_att_get_mtu(client->att) - 5);
+	op->window = MAX(window, 1U);
+	op->chunks = queue_new();
 	op->callback = callback;
 	op->user_data = user_data;
 	op->destroy = destroy;
@@ -2949,32 +3480,224 @@ unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
 		return req->id;
 	}
 
-	pdu = malloc(op->cur_length + 4);
-	if (!pdu) {
-		free(op->value);
-		free(op);
+	if (!fill_long_write_window(req)) {
+		unsigned int id = req->id;
+
+		if (!op->queued) {
+			op->destroy = NULL;
+			request_unref(req);
+			return 0;
+		}
+
+		/*
+		 * Prepare Writes have been handed to att already, have the
+		 * peer drop whatever part of the value made it to its queue.
+		 * The callback reports the failure.
+		 */
+		client->in_long_write = true;
+		complete_write_long_op(req, false, 0, false);
+		request_unref(req);
+
+		return id;
+	}
+
+	/* The Prepare Writes in flight keep the request alive from here */
+	request_unref(req);
+
+	client->in_long_write = true;
+
+	return req->id;
+}
+
+static bool long_write_op_check(struct bt_gatt_client *client,
+					uint16_t offset, uint16_t length)
+{
+	if (!client)
+		return false;
+
+	if ((size_t)(length + offset) > UINT16_MAX)
+		return false;
+
+	/* Don't allow writing a 0-length value using this procedure. The
+	 * upper-layer should use bt_gatt_write_value for that instead.
+	 */
+	return length > 0;
+}
+
+static struct long_write_op *long_write_op_new(void)
+{
+	struct long_write_op *op;
+
+	op = new0(struct long_write_op, 1);
+	op->fd = -1;
+
+	return op;
+}
+
+static bool copy_source(uint16_t offset, uint8_t *buf, uint16_t len,
+							void *user_data)
+{
+	struct long_write_op *op = user_data;
+
+	memcpy(buf, op->value + (offset - op->offset), len);
+
+	return true;
+}
+
+unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
+				bool reliable,
+				uint16_t value_handle, uint16_t offset,
+				const uint8_t *value, uint16_t length,
+				bt_gatt_client_write_long_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
+{
+	struct long_write_op *op;
+
+	if (!long_write_op_check(client, offset, length) || !value)
+		return 0;
+
+	op = long_write_op_new();
+	op->value = malloc(length);
+	if (!op->value) {
+		long_write_op_free(op);
 		return 0;
 	}
 
-	put_le16(value_handle, pdu);
-	put_le16(offset, pdu + 2);
-	memcpy(pdu + 4, op->value, op->cur_length);
+	memcpy(op->value, value, length);
 
-	req->att_id = bt_att_send(client->att, BT_ATT_OP_PREP_WRITE_REQ,
-							pdu, op->cur_length + 4,
-							prepare_write_cb, req,
-							request_unref);
-	free(pdu);
+	op->source = copy_source;
+	op->source_data = op;
 
-	if (!req->att_id) {
-		op->destroy = NULL;
-		request_unref(req);
+	return write_long(client, reliable, value_handle, offset, length, 1,
+					op, callback, user_data, destroy);
+}
+
+unsigned int bt_gatt_client_write_long_value_stream(
+				struct bt_gatt_client *client,
+				bool reliable,
+				uint16_t value_handle, uint16_t offset,
+				uint16_t length, unsigned int window,
+				bt_gatt_client_write_source_func_t source,
+				bt_gatt_client_write_long_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
+{
+	struct long_write_op *op;
+
+	if (!long_write_op_check(client, offset, length) || !source)
 		return 0;
+
+	op = long_write_op_new();
+	op->source = source;
+	op->source_data = user_data;
+
+	return write_long(client, reliable, value_handle, offset, length,
+					window, op, callback, user_data,
+					destroy);
+}
+
+static bool map_source(uint16_t offset, uint8_t *buf, uint16_t len,
+							void *user_data)
+{
+	struct long_write_op *op = user_data;
+
+	memcpy(buf, op->map + op->map_start + (offset - op->offset), len);
+
+	return true;
+}
+
+static bool fd_source(uint16_t offset, uint8_t *buf, uint16_t len,
+							void *user_data)
+{
+	struct long_write_op *op = user_data;
+	off_t pos = op->fd_offset + (offset - op->offset);
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(op->fd, buf, len, pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		/* The file must hold the whole range */
+		if (ret <= 0)
+			return false;
+
+		buf += ret;
+		len -= ret;
+		pos += ret;
 	}
 
-	client->in_long_write = true;
+	return true;
+}
 
-	return req->id;
+unsigned int bt_gatt_client_write_long_value_fd(struct bt_gatt_client *client,
+				bool reliable,
+				uint16_t value_handle, uint16_t offset,
+				int fd, off_t fd_offset, uint16_t length,
+				unsigned int window,
+				bt_gatt_client_write_long_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
+{
+	struct long_write_op *op;
+	struct stat st;
+	off_t start;
+	long page;
+	void *map = MAP_FAILED;
+
+	if (!long_write_op_check(client, offset, length) || fd < 0 ||
+								fd_offset < 0)
+		return 0;
+
+	if (fstat(fd, &st) < 0)
+		return 0;
+
+	/*
+	 * The range is read with pread() when it cannot be mapped, which
+	 * pipes and sockets do not support, so those are refused here
+	 * rather than failing the write once it is under way.
+	 */
+	if (lseek(fd, 0, SEEK_CUR) < 0)
+		return 0;
+
+	/*
+	 * Touching a mapping past the end of the file raises SIGBUS, so a
+	 * file too short for the range is refused up front.
+	 */
+	if (S_ISREG(st.st_mode) && st.st_size < fd_offset + length)
+		return 0;
+
+	op = long_write_op_new();
+	op->source_data = op;
+
+	page = sysconf(_SC_PAGESIZE);
+	start = fd_offset - fd_offset % page;
+
+	if (S_ISREG(st.st_mode))
+		map = mmap(NULL, fd_offset - start + length, PROT_READ,
+						MAP_SHARED, fd, start);
+
+	if (map != MAP_FAILED) {
+		op->map = map;
+		op->map_len = fd_offset - start + length;
+		op->map_start = fd_offset - start;
+		op->source = map_source;
+	} else {
+		/* Not mappable, read from a private copy of the fd instead */
+		op->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (op->fd < 0) {
+			long_write_op_free(op);
+			return 0;
+		}
+
+		op->fd_offset = fd_offset;
+		op->source = fd_source;
+	}
+
+	return write_long(client, reliable, value_handle, offset, length,
+					window, op, callback, user_data,
+					destroy);
 }
 
 struct prep_write_op {
@@ -3261,6 +3984,8 @@ bool bt_gatt_client_unregister_notify(struct bt_gatt_client *client,
 	if (!notify_data)
 		return false;
 
+	queue_remove(notify_data->chrc->notify_list, notify_data);
+
 	/* Remove data if it has been queued */
 	queue_remove(notify_data->chrc->reg_notify_queue, notify_data);
 
@@ -27,22 +27,31 @@
 
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "lib/bluetooth.h"
 #include "lib/uuid.h"
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
+#include "src/shared/mainloop.h"
 #include "src/shared/timeout.h"
 #include "src/shared/att.h"
+#include "src/shared/crypto.h"
 #include "src/shared/gatt-db.h"
 
 #ifndef MAX
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #endif
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 #define MAX_CHAR_DECL_VALUE_LEN 19
 #define MAX_INCLUDED_VALUE_LEN 6
 #define ATTRIBUTE_TIMEOUT 5000
+#define TYPE_INDEX_BUCKETS 64
 
 static const bt_uuid_t primary_service_uuid = { .type = BT_UUID16,
 					.value.u16 = GATT_PRIM_SVC_UUID };
@@ -54,14 +63,79 @@ static const bt_uuid_t included_service_uuid = { .type = BT_UUID16,
 					.value.u16 = GATT_INCLUDE_UUID };
 static const bt_uuid_t ext_desc_uuid = { .type = BT_UUID16,
 				.value.u16 = GATT_CHARAC_EXT_PROPER_UUID };
+static const bt_uuid_t ccc_uuid = { .type = BT_UUID16,
+				.value.u16 = GATT_CLIENT_CHARAC_CFG_UUID };
+static const bt_uuid_t scc_uuid = { .type = BT_UUID16,
+				.value.u16 = GATT_SERVER_CHARAC_CFG_UUID };
+
+struct handle_slot {
+	struct gatt_db_service *service;
+	struct gatt_db_attribute *attrib;
+	bool active;			/* Copy of service->active */
+};
+
+/* All attributes of one type, interned by its 128-bit form */
+struct type_index {
+	struct type_index *next;
+	uint128_t uuid;
+	struct gatt_db_attribute **attrs;	/* Sorted by handle */
+	unsigned int len;
+	unsigned int size;
+};
+
+/*
+ * The lookup structures readers go through. Either the live ones, borrowed
+ * for the duration of a call, or a published copy that is never changed
+ * and only freed once no reader is left inside the database.
+ */
+struct db_view {
+	struct db_view *next;			/* In the retired list */
+	bool published;
+	struct handle_slot *handles;
+	uint32_t handles_len;
+	struct type_index **types;
+	struct gatt_db_service **services;	/* NULL to walk db->services */
+	unsigned int num_services;
+};
 
 struct gatt_db {
 	int ref_count;
 	uint16_t next_handle;
 	struct queue *services;
 
+	/* Handle indexed lookup table, grown on demand */
+	struct handle_slot *handles;
+	uint32_t handles_len;
+
+	/* Attributes by type, for the searches by type */
+	struct type_index *types[TYPE_INDEX_BUCKETS];
+
 	struct queue *notify_list;
 	unsigned int next_notify_id;
+
+	/* Database Hash, recomputed on demand after structural changes */
+	struct bt_crypto *crypto;
+	bool hash_valid;
+	uint8_t hash[16];
+
+	/* Snapshot mode, see gatt_db_set_snapshots() */
+	bool snapshots;
+	struct db_view *view;			/* Read with __atomic */
+	struct db_view *retired;
+	struct queue *removed;			/* Removal not yet notified */
+	struct queue *retired_services;
+	unsigned int readers;
+	bool reclaim;				/* Something retired waits */
+
+	/* See gatt_db_get_generation(), read with __atomic */
+	unsigned int generation;
+
+	/*
+	 * Attribute values, caches and pending operations, which any thread
+	 * may reach through gatt_db_attribute_read() and friends. Also
+	 * serializes retiring against reclaiming.
+	 */
+	pthread_mutex_t lock;
 };
 
 struct notify {
@@ -72,18 +146,25 @@ struct notify {
 	void *user_data;
 };
 
+/* Timeouts and callbacks of an operation run on the loop it started on */
 struct pending_read {
 	struct gatt_db_attribute *attrib;
+	struct mainloop *loop;
+	pthread_t thread;
 	unsigned int id;
-	unsigned int timeout_id;
+	unsigned int timeout_id;	/* Cleared under the lock once fired */
+	bool orphaned;			/* See pending_read_park() */
 	gatt_db_attribute_read_t func;
 	void *user_data;
 };
 
 struct pending_write {
 	struct gatt_db_attribute *attrib;
+	struct mainloop *loop;
+	pthread_t thread;
 	unsigned int id;
-	unsigned int timeout_id;
+	unsigned int timeout_id;	/* Cleared under the lock once fired */
+	bool orphaned;			/* See pending_write_park() */
 	gatt_db_attribute_write_t func;
 	void *user_data;
 };
@@ -92,9 +173,13 @@ struct gatt_db_attribute {
 	struct gatt_db_service *service;
 	uint16_t handle;
 	bt_uuid_t uuid;
+	uint128_t uuid128;		/* uuid in 128-bit form */
+	struct type_index *type;	/* NULL while not in the db */
 	uint32_t permissions;
 	uint16_t value_len;
 	uint8_t *value;
+	bool value_static;		/* Points into a table, not owned */
+	bool in_block;			/* Allocated along with its service */
 
 	gatt_db_read_t read_func;
 	gatt_db_write_t write_func;
@@ -105,16 +190,275 @@ struct gatt_db_attribute {
 
 	unsigned int write_id;
 	struct queue *pending_writes;
+
+	/* Opt-in snapshot of the read_func value */
+	bool cache_enabled;
+	bool cache_valid;
+	unsigned int cache_ttl;		/* ms, 0 keeps it until invalidated */
+	unsigned int cache_gen;		/* Bumped by every invalidation */
+	uint64_t cache_expiry;
+	uint8_t *cache_value;
+	size_t cache_len;
+	struct queue *cache_fetches;	/* In flight, one per loop */
+};
+
+/* Reads from one loop sharing a fetch, so they are answered on that loop */
+struct cache_fetch {
+	struct mainloop *loop;
+	unsigned int gen;
+	struct queue *waiters;
+};
+
+struct cache_waiter {
+	uint16_t offset;
+	gatt_db_attribute_read_t func;
+	void *user_data;
 };
 
 struct gatt_db_service {
 	struct gatt_db *db;
+	struct gatt_db *owner;		/* Kept once retired, for its lock */
+	int ref_count;			/* Results posted to other loops */
 	bool active;
 	bool claimed;
 	uint16_t num_handles;
 	struct gatt_db_attribute **attributes;
+	void *block;			/* Table attributes, see insert_table */
+
+	/* This service's part of the Database Hash input, NULL when stale */
+	uint8_t *hash_data;
+	size_t hash_len;
 };
 
+static bool handle_index_grow(struct gatt_db *db, uint16_t end_handle)
+{
+	struct handle_slot *slots;
+	uint32_t len;
+
+	if (end_handle < db->handles_len)
+		return true;
+
+	len = db->handles_len ? db->handles_len : 64;
+	while (len <= end_handle)
+		len <<= 1;
+
+	slots = realloc(db->handles, len * sizeof(*slots));
+	if (!slots)
+		return false;
+
+	memset(slots + db->handles_len, 0,
+				(len - db->handles_len) * sizeof(*slots));
+
+	db->handles = slots;
+	db->handles_len = len;
+
+	return true;
+}
+
+static void uuid_normalize(const bt_uuid_t *uuid, uint128_t *u128)
+{
+	bt_uuid_t tmp;
+
+	bt_uuid_to_uuid128(uuid, &tmp);
+	*u128 = tmp.value.u128;
+}
+
+static unsigned int type_hash(const uint128_t *u128)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		hash = (hash ^ u128->data[i]) * 16777619U;
+
+	return hash % TYPE_INDEX_BUCKETS;
+}
+
+static struct type_index *type_index_find(struct type_index *const *types,
+						const uint128_t *u128)
+{
+	struct type_index *type;
+
+	for (type = types[type_hash(u128)]; type; type = type->next) {
+		if (!memcmp(&type->uuid, u128, sizeof(*u128)))
+			return type;
+	}
+
+	return NULL;
+}
+
+/* Position of the first attribute at or above handle */
+static unsigned int type_index_lower(const struct type_index *type,
+							uint16_t handle)
+{
+	unsigned int lo = 0, hi = type->len;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (type->attrs[mid]->handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void type_index_add(struct gatt_db *db,
+					struct gatt_db_attribute *attrib)
+{
+	struct type_index *type;
+	unsigned int pos;
+
+	type = type_index_find(db->types, &attrib->uuid128);
+	if (!type) {
+		unsigned int hash = type_hash(&attrib->uuid128);
+
+		type = new0(struct type_index, 1);
+		type->uuid = attrib->uuid128;
+		type->next = db->types[hash];
+		db->types[hash] = type;
+	}
+
+	if (type->len == type->size) {
+		struct gatt_db_attribute **attrs;
+		unsigned int size = type->size ? type->size * 2 : 8;
+
+		attrs = realloc(type->attrs, size * sizeof(*attrs));
+		if (!attrs)
+			return;
+
+		type->attrs = attrs;
+		type->size = size;
+	}
+
+	/* Attributes mostly come in handle order, so this is an append */
+	if (!type->len || type->attrs[type->len - 1]->handle < attrib->handle)
+		pos = type->len;
+	else
+		pos = type_index_lower(type, attrib->handle);
+
+	memmove(type->attrs + pos + 1, type->attrs + pos,
+				(type->len - pos) * sizeof(*type->attrs));
+	type->attrs[pos] = attrib;
+	type->len++;
+
+	attrib->type = type;
+}
+
+static void type_index_remove(struct gatt_db_attribute *attrib)
+{
+	struct type_index *type = attrib->type;
+	unsigned int pos;
+
+	if (!type)
+		return;
+
+	pos = type_index_lower(type, attrib->handle);
+
+	for (; pos < type->len && type->attrs[pos] != attrib; pos++)
+		;
+
+	if (pos < type->len) {
+		type->len--;
+		memmove(type->attrs + pos, type->attrs + pos + 1,
+				(type->len - pos) * sizeof(*type->attrs));
+	}
+
+	attrib->type = NULL;
+}
+
+/* Drop the whole index at once rather than attribute by attribute */
+static void type_index_clear(struct gatt_db *db)
+{
+	struct type_index *type;
+	unsigned int i, j;
+
+	for (i = 0; i < TYPE_INDEX_BUCKETS; i++) {
+		while ((type = db->types[i])) {
+			db->types[i] = type->next;
+
+			for (j = 0; j < type->len; j++)
+				type->attrs[j]->type = NULL;
+
+			free(type->attrs);
+			free(type);
+		}
+	}
+}
+
+static bool index_service(struct gatt_db *db, struct gatt_db_service *service)
+{
+	uint32_t start, end, h;
+
+	start = service->attributes[0]->handle;
+	end = start + service->num_handles - 1;
+
+	if (!handle_index_grow(db, end))
+		return false;
+
+	for (h = start; h <= end; h++) {
+		db->handles[h].service = service;
+		db->handles[h].attrib = NULL;
+		db->handles[h].active = service->active;
+	}
+
+	db->handles[start].attrib = service->attributes[0];
+	type_index_add(db, service->attributes[0]);
+
+	return true;
+}
+
+static void unindex_service(struct gatt_db *db,
+					struct gatt_db_service *service)
+{
+	uint32_t start, end, h;
+
+	if (!db->handles || !service->attributes[0])
+		return;
+
+	start = service->attributes[0]->handle;
+	end = start + service->num_handles - 1;
+
+	for (h = start; h <= end && h < db->handles_len; h++) {
+		if (db->handles[h].service != service)
+			continue;
+
+		db->handles[h].service = NULL;
+		db->handles[h].attrib = NULL;
+		db->handles[h].active = false;
+	}
+}
+
+static void index_attribute(struct gatt_db_attribute *attrib)
+{
+	struct gatt_db *db = attrib->service->db;
+
+	if (!db || attrib->handle >= db->handles_len)
+		return;
+
+	/* Only attributes within the service range can be looked up */
+	if (db->handles[attrib->handle].service != attrib->service)
+		return;
+
+	db->handles[attrib->handle].attrib = attrib;
+	type_index_add(db, attrib);
+}
+
+static void unindex_attribute(struct gatt_db_attribute *attrib)
+{
+	struct gatt_db *db = attrib->service->db;
+
+	type_index_remove(attrib);
+
+	if (!db || attrib->handle >= db->handles_len)
+		return;
+
+	if (db->handles[attrib->handle].attrib == attrib)
+		db->handles[attrib->handle].attrib = NULL;
+}
+
 static void set_attribute_data(struct gatt_db_attribute *attribute,
 						gatt_db_read_t read_func,
 						gatt_db_write_t write_func,
@@ -127,52 +471,305 @@ static void set_attribute_data(struct gatt_db_attribute *attribute,
 	attribute->user_data = user_data;
 }
 
+static void attribute_lock(const struct gatt_db_attribute *attrib)
+{
+	if (attrib->service->owner)
+		pthread_mutex_lock(&attrib->service->owner->lock);
+}
+
+static void attribute_unlock(const struct gatt_db_attribute *attrib)
+{
+	if (attrib->service->owner)
+		pthread_mutex_unlock(&attrib->service->owner->lock);
+}
+
 static void pending_read_result(struct pending_read *p, int err,
 					const uint8_t *data, size_t length)
 {
 	if (p->timeout_id > 0)
-		timeout_remove(p->timeout_id);
+		timeout_loop_remove(p->loop, p->timeout_id);
 
 	p->func(p->attrib, err, data, length, p->user_data);
 
 	free(p);
 }
 
-static void pending_read_free(void *data)
-{
-	struct pending_read *p = data;
-
-	pending_read_result(p, -ECANCELED, NULL, 0);
-}
-
 static void pending_write_result(struct pending_write *p, int err)
 {
 	if (p->timeout_id > 0)
-		timeout_remove(p->timeout_id);
+		timeout_loop_remove(p->loop, p->timeout_id);
 
 	p->func(p->attrib, err, p->user_data);
 
 	free(p);
 }
 
+static void service_free(struct gatt_db_service *service);
+
+static void service_unref(struct gatt_db_service *service)
+{
+	if (__sync_sub_and_fetch(&service->ref_count, 1))
+		return;
+
+	service_free(service);
+}
+
+/* A result that finished on another thread, on its way to the owning loop */
+struct pending_done {
+	struct gatt_db_service *service;	/* Keeps the attribute around */
+	struct gatt_db *owner;			/* Keeps the lock around */
+	struct pending_read *read;
+	struct pending_write *write;
+	int err;
+	bool delivered;
+	bool has_value;
+	size_t length;
+	uint8_t value[];
+};
+
+static void pending_done_run(void *user_data)
+{
+	struct pending_done *done = user_data;
+
+	done->delivered = true;
+
+	if (done->read)
+		pending_read_result(done->read, done->err,
+				done->has_value ? done->value : NULL,
+				done->length);
+	else
+		pending_write_result(done->write, done->err);
+}
+
+static void pending_done_free(void *user_data)
+{
+	struct pending_done *done = user_data;
+
+	/* The loop went away first, its timeouts with it */
+	if (!done->delivered) {
+		free(done->read);
+		free(done->write);
+	}
+
+	service_unref(done->service);
+	gatt_db_unref(done->owner);
+	free(done);
+}
+
+/*
+ * Timeout ids are only meaningful to the loop that handed them out, and the
+ * callbacks usually answer on a bt_att bound to that loop, so results from
+ * any thread but the one that started the operation are posted there.
+ */
+static int pending_post(struct mainloop *loop, struct gatt_db_service *service,
+				struct pending_read *read,
+				struct pending_write *write, int err,
+				const uint8_t *value, size_t length)
+{
+	struct pending_done *done;
+	int ret;
+
+	done = malloc(sizeof(*done) + length);
+	if (!done)
+		return -ENOMEM;
+
+	memset(done, 0, sizeof(*done));
+	done->read = read;
+	done->write = write;
+	done->err = err;
+	done->has_value = value != NULL;
+	done->length = length;
+
+	if (length)
+		memcpy(done->value, value, length);
+
+	__sync_fetch_and_add(&service->ref_count, 1);
+	done->service = service;
+	done->owner = gatt_db_ref(service->owner);
+
+	ret = mainloop_loop_post(loop, pending_done_run, done,
+							pending_done_free);
+	if (ret < 0) {
+		done->delivered = true;
+		pending_done_free(done);
+	}
+
+	return ret;
+}
+
+static void pending_orphan_release(struct gatt_db_service *service)
+{
+	struct gatt_db *owner = service->owner;
+
+	service_unref(service);
+	gatt_db_unref(owner);
+}
+
+/*
+ * A result that could not be posted is never delivered on the wrong thread,
+ * the operation is left to its timeout on its own loop instead. While the
+ * attribute is around it goes back to the pending list and times out from
+ * there. Once the attribute is being destroyed it is marked orphaned and
+ * holds on to the service until the timeout cancels it. Without a loop or
+ * a timeout left there is nobody to call and it is dropped.
+ */
+static void pending_read_park(struct pending_read *p, int err)
+{
+	struct gatt_db_attribute *attrib = p->attrib;
+	struct gatt_db_service *service = attrib->service;
+	bool parked = false;
+
+	attribute_lock(attrib);
+
+	if (attrib->pending_reads) {
+		queue_push_tail(attrib->pending_reads, p);
+		parked = true;
+	} else if (err != -ENOTCONN && p->timeout_id) {
+		__sync_fetch_and_add(&service->ref_count, 1);
+		gatt_db_ref(service->owner);
+		p->orphaned = true;
+		parked = true;
+	}
+
+	attribute_unlock(attrib);
+
+	if (!parked)
+		free(p);
+}
+
+static void pending_write_park(struct pending_write *p, int err)
+{
+	struct gatt_db_attribute *attrib = p->attrib;
+	struct gatt_db_service *service = attrib->service;
+	bool parked = false;
+
+	attribute_lock(attrib);
+
+	if (attrib->pending_writes) {
+		queue_push_tail(attrib->pending_writes, p);
+		parked = true;
+	} else if (err != -ENOTCONN && p->timeout_id) {
+		__sync_fetch_and_add(&service->ref_count, 1);
+		gatt_db_ref(service->owner);
+		p->orphaned = true;
+		parked = true;
+	}
+
+	attribute_unlock(attrib);
+
+	if (!parked)
+		free(p);
+}
+
+/* Returns false if the result was parked, see pending_read_park() */
+static bool pending_read_deliver(struct pending_read *p, int err,
+					const uint8_t *value, size_t length)
+{
+	int ret;
+
+	if (pthread_equal(p->thread, pthread_self())) {
+		pending_read_result(p, err, value, length);
+		return true;
+	}
+
+	ret = pending_post(p->loop, p->attrib->service, p, NULL, err, value,
+								length);
+	if (ret < 0) {
+		pending_read_park(p, ret);
+		return false;
+	}
+
+	return true;
+}
+
+static bool pending_write_deliver(struct pending_write *p, int err)
+{
+	int ret;
+
+	if (pthread_equal(p->thread, pthread_self())) {
+		pending_write_result(p, err);
+		return true;
+	}
+
+	ret = pending_post(p->loop, p->attrib->service, NULL, p, err, NULL, 0);
+	if (ret < 0) {
+		pending_write_park(p, ret);
+		return false;
+	}
+
+	return true;
+}
+
+static void pending_read_free(void *data)
+{
+	struct pending_read *p = data;
+
+	pending_read_deliver(p, -ECANCELED, NULL, 0);
+}
+
 static void pending_write_free(void *data)
 {
 	struct pending_write *p = data;
 
-	pending_write_result(p, -ECANCELED);
+	pending_write_deliver(p, -ECANCELED);
+}
+
+static void cache_fetch_free(void *data)
+{
+	struct cache_fetch *fetch = data;
+
+	queue_destroy(fetch->waiters, free);
+	free(fetch);
 }
 
 static void attribute_destroy(struct gatt_db_attribute *attribute)
 {
+	struct queue *reads, *writes;
+
 	/* Attribute was not initialized by user */
 	if (!attribute)
 		return;
 
-	queue_destroy(attribute->pending_reads, pending_read_free);
-	queue_destroy(attribute->pending_writes, pending_write_free);
+	unindex_attribute(attribute);
+
+	/* A late result from another thread must not find them anymore */
+	attribute_lock(attribute);
+	reads = attribute->pending_reads;
+	writes = attribute->pending_writes;
+	attribute->pending_reads = NULL;
+	attribute->pending_writes = NULL;
+	attribute_unlock(attribute);
 
-	free(attribute->value);
-	free(attribute);
+	/* Cancelling an outstanding cache fetch also fails its waiters */
+	queue_destroy(reads, pending_read_free);
+	queue_destroy(writes, pending_write_free);
+}
+
+/* Memory only, once no posted result can reach the attributes anymore */
+static void attribute_free(struct gatt_db_attribute *attribute)
+{
+	if (!attribute)
+		return;
+
+	queue_destroy(attribute->cache_fetches, cache_fetch_free);
+	free(attribute->cache_value);
+
+	if (!attribute->value_static)
+		free(attribute->value);
+
+	if (!attribute->in_block)
+		free(attribute);
+}
+
+static void attribute_init(struct gatt_db_attribute *attribute,
+					struct gatt_db_service *service,
+					uint16_t handle,
+					const bt_uuid_t *type)
+{
+	attribute->service = service;
+	attribute->handle = handle;
+	attribute->uuid = *type;
+	uuid_normalize(type, &attribute->uuid128);
 }
 
 static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
@@ -185,9 +782,7 @@ static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
 
 	attribute = new0(struct gatt_db_attribute, 1);
 
-	attribute->service = service;
-	attribute->handle = handle;
-	attribute->uuid = *type;
+	attribute_init(attribute, service, handle, type);
 	attribute->value_len = len;
 	if (len) {
 		attribute->value = malloc0(len);
@@ -197,13 +792,10 @@ static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
 		memcpy(attribute->value, val, len);
 	}
 
-	attribute->pending_reads = queue_new();
-	attribute->pending_writes = queue_new();
-
 	return attribute;
 
 failed:
-	attribute_destroy(attribute);
+	attribute_free(attribute);
 	return NULL;
 }
 
@@ -224,7 +816,10 @@ struct gatt_db *gatt_db_new(void)
 	db = new0(struct gatt_db, 1);
 	db->services = queue_new();
 	db->notify_list = queue_new();
+	db->removed = queue_new();
+	db->retired_services = queue_new();
 	db->next_handle = 0x0001;
+	pthread_mutex_init(&db->lock, NULL);
 
 	return gatt_db_ref(db);
 }
@@ -257,9 +852,11 @@ static void handle_notify(void *data, void *user_data)
 	struct notify *notify = data;
 	struct notify_data *notify_data = user_data;
 
-	if (notify_data->added)
-		notify->service_added(notify_data->attr, notify->user_data);
-	else
+	if (notify_data->added) {
+		if (notify->service_added)
+			notify->service_added(notify_data->attr,
+							notify->user_data);
+	} else if (notify->service_removed)
 		notify->service_removed(notify_data->attr, notify->user_data);
 }
 
@@ -282,19 +879,351 @@ static void notify_service_changed(struct gatt_db *db,
 	gatt_db_unref(db);
 }
 
+/* Extended Properties writes may come from any thread */
+static void service_hash_invalidate(struct gatt_db_service *service)
+{
+	if (service->owner)
+		pthread_mutex_lock(&service->owner->lock);
+
+	free(service->hash_data);
+	service->hash_data = NULL;
+	service->hash_len = 0;
+
+	/* Inactive services are not part of the hash */
+	if (service->db && service->active)
+		service->db->hash_valid = false;
+
+	if (service->owner)
+		pthread_mutex_unlock(&service->owner->lock);
+}
+
 static void gatt_db_service_destroy(void *data)
 {
 	struct gatt_db_service *service = data;
 	int i;
 
+	service_hash_invalidate(service);
+
+	/* Make the service unreachable before notifying its removal */
+	if (service->db)
+		unindex_service(service->db, service);
+
 	if (service->active)
 		notify_service_changed(service->db, service, false);
 
 	for (i = 0; i < service->num_handles; i++)
 		attribute_destroy(service->attributes[i]);
 
-	free(service->attributes);
-	free(service);
+	service_unref(service);
+}
+
+static void service_free(struct gatt_db_service *service)
+{
+	int i;
+
+	for (i = 0; i < service->num_handles; i++)
+		attribute_free(service->attributes[i]);
+
+	free(service->attributes);
+	free(service->block);
+	free(service);
+}
+
+static void view_free(struct db_view *view)
+{
+	struct type_index *type;
+	unsigned int i;
+
+	for (i = 0; i < TYPE_INDEX_BUCKETS; i++) {
+		while ((type = view->types[i])) {
+			view->types[i] = type->next;
+			free(type->attrs);
+			free(type);
+		}
+	}
+
+	free(view->types);
+	free(view->handles);
+	free(view->services);
+	free(view);
+}
+
+/*
+ * Everything retired before readers drained to zero is unreachable: any
+ * reader entering later loads a newer view. Run by whichever thread sees
+ * the count drop to zero, or by the one retiring something.
+ */
+static void view_reclaim(struct gatt_db *db)
+{
+	struct db_view *view, *retired;
+	struct queue *services;
+
+	if (!__atomic_load_n(&db->reclaim, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&db->lock);
+
+	if (!db->reclaim || __atomic_load_n(&db->readers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_unlock(&db->lock);
+		return;
+	}
+
+	retired = db->retired;
+	db->retired = NULL;
+
+	services = db->retired_services;
+	db->retired_services = queue_new();
+
+	__atomic_store_n(&db->reclaim, false, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&db->lock);
+
+	while ((view = retired)) {
+		retired = view->next;
+		view_free(view);
+	}
+
+	queue_destroy(services, gatt_db_service_destroy);
+}
+
+/* Called with the lock held */
+static void view_retire(struct gatt_db *db, struct db_view *view)
+{
+	if (!view)
+		return;
+
+	view->next = db->retired;
+	db->retired = view;
+
+	__atomic_store_n(&db->reclaim, true, __ATOMIC_SEQ_CST);
+}
+
+static void view_publish(struct gatt_db *db)
+{
+	const struct queue_entry *entry;
+	struct type_index *type, *copy;
+	struct db_view *view;
+	unsigned int i;
+
+	view = new0(struct db_view, 1);
+	view->published = true;
+
+	view->handles_len = db->handles_len;
+	if (db->handles_len) {
+		view->handles = new0(struct handle_slot, db->handles_len);
+		memcpy(view->handles, db->handles,
+				db->handles_len * sizeof(*view->handles));
+	}
+
+	view->types = new0(struct type_index *, TYPE_INDEX_BUCKETS);
+
+	for (i = 0; i < TYPE_INDEX_BUCKETS; i++) {
+		for (type = db->types[i]; type; type = type->next) {
+			if (!type->len)
+				continue;
+
+			copy = new0(struct type_index, 1);
+			copy->uuid = type->uuid;
+			copy->attrs = new0(struct gatt_db_attribute *,
+								type->len);
+			memcpy(copy->attrs, type->attrs,
+					type->len * sizeof(*type->attrs));
+			copy->len = type->len;
+			copy->size = type->len;
+			copy->next = view->types[i];
+			view->types[i] = copy;
+		}
+	}
+
+	view->num_services = queue_length(db->services);
+	if (view->num_services)
+		view->services = new0(struct gatt_db_service *,
+							view->num_services);
+
+	for (i = 0, entry = queue_get_entries(db->services); entry;
+						entry = entry->next, i++)
+		view->services[i] = entry->data;
+
+	/* Retiring and reclaiming must not interleave */
+	pthread_mutex_lock(&db->lock);
+	view_retire(db, __atomic_exchange_n(&db->view, view,
+							__ATOMIC_SEQ_CST));
+	pthread_mutex_unlock(&db->lock);
+}
+
+/* Taken from the lookup structures, freed once no reader can see it */
+static void service_detach(struct gatt_db_service *service)
+{
+	struct gatt_db *db = service->db;
+	int i;
+
+	service_hash_invalidate(service);
+	unindex_service(db, service);
+
+	for (i = 0; i < service->num_handles; i++) {
+		if (service->attributes[i])
+			type_index_remove(service->attributes[i]);
+	}
+
+	queue_push_tail(db->removed, service);
+}
+
+static void service_remove(void *data)
+{
+	struct gatt_db_service *service = data;
+
+	if (service->db && service->db->snapshots)
+		service_detach(service);
+	else
+		gatt_db_service_destroy(service);
+}
+
+/* Publishes a structural change to snapshot readers */
+static void db_changed(struct gatt_db *db)
+{
+	struct gatt_db_service *service;
+
+	if (!db)
+		return;
+
+	/* Odd while the change is on its way to the readers */
+	__atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+
+	if (db->snapshots)
+		view_publish(db);
+
+	__atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+
+	if (!db->snapshots)
+		return;
+
+	/* Removals are notified once the services are out of the snapshot */
+	while ((service = queue_pop_head(db->removed))) {
+		if (service->active)
+			notify_service_changed(db, service, false);
+
+		service->active = false;
+		service->db = NULL;
+
+		pthread_mutex_lock(&db->lock);
+		queue_push_tail(db->retired_services, service);
+		__atomic_store_n(&db->reclaim, true, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&db->lock);
+	}
+
+	view_reclaim(db);
+}
+
+static const struct db_view *view_get(struct gatt_db *db,
+						struct db_view *live)
+{
+	struct db_view *view;
+
+	if (__atomic_load_n(&db->snapshots, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&db->readers, 1, __ATOMIC_SEQ_CST);
+
+		view = __atomic_load_n(&db->view, __ATOMIC_SEQ_CST);
+		if (view)
+			return view;
+
+		if (!__atomic_sub_fetch(&db->readers, 1, __ATOMIC_SEQ_CST))
+			view_reclaim(db);
+	}
+
+	live->published = false;
+	live->handles = db->handles;
+	live->handles_len = db->handles_len;
+	live->types = db->types;
+	live->services = NULL;
+	live->num_services = 0;
+
+	return live;
+}
+
+static void view_put(struct gatt_db *db, const struct db_view *view)
+{
+	if (!view->published)
+		return;
+
+	if (!__atomic_sub_fetch(&db->readers, 1, __ATOMIC_SEQ_CST))
+		view_reclaim(db);
+}
+
+static bool view_active(const struct db_view *view,
+				const struct gatt_db_attribute *attrib)
+{
+	if (attrib->handle >= view->handles_len)
+		return false;
+
+	return view->handles[attrib->handle].active;
+}
+
+static void view_foreach_service(struct gatt_db *db,
+					const struct db_view *view,
+					queue_foreach_func_t func,
+					void *user_data)
+{
+	unsigned int i;
+
+	/* An empty published view has no array either */
+	if (!view->published) {
+		queue_foreach(db->services, func, user_data);
+		return;
+	}
+
+	for (i = 0; i < view->num_services; i++)
+		func(view->services[i], user_data);
+}
+
+bool gatt_db_set_snapshots(struct gatt_db *db, bool enable)
+{
+	if (!db)
+		return false;
+
+	if (db->snapshots == enable)
+		return true;
+
+	if (enable) {
+		/* The first view has to be there before readers look */
+		view_publish(db);
+		__atomic_store_n(&db->snapshots, true, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	__atomic_store_n(&db->snapshots, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&db->lock);
+	view_retire(db, __atomic_exchange_n(&db->view, NULL,
+							__ATOMIC_SEQ_CST));
+	pthread_mutex_unlock(&db->lock);
+
+	view_reclaim(db);
+
+	return true;
+}
+
+unsigned int gatt_db_get_generation(struct gatt_db *db)
+{
+	if (!db)
+		return 0;
+
+	return __atomic_load_n(&db->generation, __ATOMIC_SEQ_CST);
+}
+
+void gatt_db_read_begin(struct gatt_db *db)
+{
+	if (db)
+		__atomic_add_fetch(&db->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+void gatt_db_read_end(struct gatt_db *db)
+{
+	if (!db)
+		return;
+
+	/* The last reader out frees what was retired meanwhile */
+	if (!__atomic_sub_fetch(&db->readers, 1, __ATOMIC_SEQ_CST))
+		view_reclaim(db);
 }
 
 static void gatt_db_destroy(struct gatt_db *db)
@@ -309,7 +1238,20 @@ static void gatt_db_destroy(struct gatt_db *db)
 	queue_destroy(db->notify_list, notify_destroy);
 	db->notify_list = NULL;
 
+	type_index_clear(db);
 	queue_destroy(db->services, gatt_db_service_destroy);
+
+	/* No reader can be left once the last reference is gone */
+	view_retire(db, db->view);
+	db->view = NULL;
+	db->readers = 0;
+	view_reclaim(db);
+	queue_destroy(db->removed, gatt_db_service_destroy);
+	queue_destroy(db->retired_services, NULL);
+
+	bt_crypto_unref(db->crypto);
+	free(db->handles);
+	pthread_mutex_destroy(&db->lock);
 	free(db);
 }
 
@@ -383,6 +1325,7 @@ static struct gatt_db_service *gatt_db_service_create(const bt_uuid_t *uuid,
 		return NULL;
 
 	service = new0(struct gatt_db_service, 1);
+	service->ref_count = 1;
 	service->attributes = new0(struct gatt_db_attribute *, num_handles);
 
 	if (primary)
@@ -417,7 +1360,8 @@ bool gatt_db_remove_service(struct gatt_db *db,
 
 	queue_remove(db->services, service);
 
-	gatt_db_service_destroy(service);
+	service_remove(service);
+	db_changed(db);
 
 	return true;
 }
@@ -464,21 +1408,22 @@ bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
 
 	/* Check if it is a full clear */
 	if (start_handle == 1 && end_handle == UINT16_MAX) {
-		queue_remove_all(db->services, NULL, NULL,
-						gatt_db_service_destroy);
+		type_index_clear(db);
+		queue_remove_all(db->services, NULL, NULL, service_remove);
 		goto done;
 	}
 
 	range.start = start_handle;
 	range.end = end_handle;
 
-	queue_remove_all(db->services, match_range, &range,
-						gatt_db_service_destroy);
+	queue_remove_all(db->services, match_range, &range, service_remove);
 
 done:
 	if (gatt_db_isempty(db))
 		db->next_handle = 0;
 
+	db_changed(db);
+
 	return true;
 }
 
@@ -567,12 +1512,20 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 	}
 
 	service->db = db;
+	service->owner = db;
 	service->attributes[0]->handle = handle;
 	service->num_handles = num_handles;
 
+	if (!index_service(db, service)) {
+		queue_remove(db->services, service);
+		goto fail;
+	}
+
 	/* Fast-forward next_handle if the new service was added to the end */
 	db->next_handle = MAX(handle + num_handles, db->next_handle);
 
+	db_changed(db);
+
 	return service->attributes[0];
 
 fail:
@@ -589,6 +1542,194 @@ struct gatt_db_attribute *gatt_db_add_service(struct gatt_db *db,
 								num_handles);
 }
 
+static bool def_is_service(const struct gatt_db_attr_def *def)
+{
+	return def->kind == GATT_DB_DEF_PRIMARY ||
+					def->kind == GATT_DB_DEF_SECONDARY;
+}
+
+/* Every entry has to fit in the handle range of the service it is in */
+static bool table_check(const struct gatt_db_attr_def *table,
+							unsigned int count)
+{
+	const struct gatt_db_attr_def *service = NULL;
+	unsigned int i, used = 0;
+
+	for (i = 0; i < count; i++) {
+		const struct gatt_db_attr_def *def = &table[i];
+
+		switch (def->kind) {
+		case GATT_DB_DEF_PRIMARY:
+		case GATT_DB_DEF_SECONDARY:
+			if (!def->num_handles)
+				return false;
+
+			if (def->handle && def->handle + def->num_handles - 1 >
+								UINT16_MAX)
+				return false;
+
+			service = def;
+			used = 1;
+			break;
+		case GATT_DB_DEF_CHRC:
+			used += 2;
+			break;
+		case GATT_DB_DEF_DESC:
+			used += 1;
+			break;
+		default:
+			return false;
+		}
+
+		if (!service || used > service->num_handles)
+			return false;
+	}
+
+	return count > 0;
+}
+
+/*
+ * Inserts the service at table[0] and the count - 1 entries after it. The
+ * attributes and the declaration values share one block, other values
+ * point into the table.
+ */
+static bool table_insert_service(struct gatt_db *db,
+					const struct gatt_db_attr_def *table,
+					unsigned int count, void *user_data)
+{
+	const struct gatt_db_attr_def *def = &table[0];
+	struct gatt_db_service *service, *after;
+	struct gatt_db_attribute *attrs, *attrib;
+	unsigned int i, n, num_attrs, num_chrcs = 0;
+	uint32_t handle;
+	uint8_t *decl;
+
+	handle = def->handle ? def->handle : db->next_handle;
+	if (!handle || handle + def->num_handles - 1 > UINT16_MAX)
+		return false;
+
+	if (find_insert_loc(db, handle, handle + def->num_handles - 1, &after))
+		return false;
+
+	for (i = 1; i < count; i++) {
+		if (table[i].kind == GATT_DB_DEF_CHRC)
+			num_chrcs++;
+	}
+
+	num_attrs = count + num_chrcs;
+
+	service = new0(struct gatt_db_service, 1);
+	service->ref_count = 1;
+	service->attributes = new0(struct gatt_db_attribute *,
+							def->num_handles);
+	service->block = malloc0(num_attrs * sizeof(*attrs) + 16 +
+					num_chrcs * MAX_CHAR_DECL_VALUE_LEN);
+	if (!service->block) {
+		free(service->attributes);
+		free(service);
+		return false;
+	}
+
+	service->num_handles = def->num_handles;
+
+	attrs = service->block;
+	decl = (uint8_t *) (attrs + num_attrs);
+
+	attrib = &attrs[0];
+	attribute_init(attrib, service, handle,
+				def->kind == GATT_DB_DEF_PRIMARY ?
+						&primary_service_uuid :
+						&secondary_service_uuid);
+	attrib->value = decl;
+	attrib->value_len = uuid_to_le(&def->uuid, decl);
+	attrib->permissions = BT_ATT_PERM_READ;
+	service->attributes[0] = attrib;
+	decl += 16;
+
+	for (i = 1, n = 1; i < count; i++) {
+		def = &table[i];
+
+		if (def->kind == GATT_DB_DEF_CHRC) {
+			attrib = &attrs[n];
+			attribute_init(attrib, service, ++handle,
+							&characteristic_uuid);
+			decl[0] = def->properties;
+			put_le16(handle + 1, &decl[1]);
+			attrib->value = decl;
+			attrib->value_len = 3 + uuid_to_le(&def->uuid, &decl[3]);
+			attrib->permissions = BT_ATT_PERM_READ;
+			service->attributes[n++] = attrib;
+			decl += MAX_CHAR_DECL_VALUE_LEN;
+		}
+
+		attrib = &attrs[n];
+		attribute_init(attrib, service, ++handle, &def->uuid);
+		attrib->value = (uint8_t *) def->value;
+		attrib->value_len = def->value ? def->value_len : 0;
+		set_attribute_data(attrib, def->read_func, def->write_func,
+						def->permissions, user_data);
+		service->attributes[n++] = attrib;
+	}
+
+	for (i = 0; i < num_attrs; i++) {
+		attrs[i].value_static = true;
+		attrs[i].in_block = true;
+	}
+
+	if (after) {
+		if (!queue_push_after(db->services, after, service))
+			goto fail;
+	} else if (!queue_push_head(db->services, service)) {
+		goto fail;
+	}
+
+	service->db = db;
+	service->owner = db;
+
+	if (!index_service(db, service)) {
+		queue_remove(db->services, service);
+		goto fail;
+	}
+
+	for (i = 1; i < num_attrs; i++)
+		index_attribute(&attrs[i]);
+
+	handle = attrs[0].handle + service->num_handles;
+	db->next_handle = MAX(handle, db->next_handle);
+
+	db_changed(db);
+
+	return true;
+
+fail:
+	service->db = NULL;
+	gatt_db_service_destroy(service);
+	return false;
+}
+
+bool gatt_db_insert_table(struct gatt_db *db,
+				const struct gatt_db_attr_def *table,
+				unsigned int count, void *user_data)
+{
+	unsigned int i, start = 0;
+
+	if (!db || !table || !table_check(table, count))
+		return false;
+
+	for (i = 1; i <= count; i++) {
+		if (i < count && !def_is_service(&table[i]))
+			continue;
+
+		if (!table_insert_service(db, &table[start], i - start,
+								user_data))
+			return false;
+
+		start = i;
+	}
+
+	return true;
+}
+
 unsigned int gatt_db_register(struct gatt_db *db,
 					gatt_db_attribute_cb_t service_added,
 					gatt_db_attribute_cb_t service_removed,
@@ -664,7 +1805,10 @@ attribute_update(struct gatt_db_service *service, int index)
 	 * for service declaration, and is set in add_service()
 	 */
 	previous_handle = service->attributes[index - 1]->handle;
+
+	unindex_attribute(service->attributes[index]);
 	service->attributes[index]->handle = previous_handle + 1;
+	index_attribute(service->attributes[index]);
 
 	return service->attributes[index];
 }
@@ -721,17 +1865,23 @@ service_insert_characteristic(struct gatt_db_service *service,
 		return NULL;
 
 	set_attribute_data(service->attributes[i], NULL, NULL, BT_ATT_PERM_READ, NULL);
+	index_attribute(service->attributes[i]);
 
 	i++;
 
 	service->attributes[i] = new_attribute(service, handle, uuid, NULL, 0);
 	if (!service->attributes[i]) {
-		free(service->attributes[i - 1]);
+		attribute_destroy(service->attributes[i - 1]);
+		attribute_free(service->attributes[i - 1]);
+		service->attributes[i - 1] = NULL;
 		return NULL;
 	}
 
 	set_attribute_data(service->attributes[i], read_func, write_func,
 							permissions, user_data);
+	index_attribute(service->attributes[i]);
+	service_hash_invalidate(service);
+	db_changed(service->db);
 
 	return service->attributes[i];
 }
@@ -823,6 +1973,9 @@ service_insert_descriptor(struct gatt_db_service *service,
 
 	set_attribute_data(service->attributes[i], read_func, write_func,
 							permissions, user_data);
+	index_attribute(service->attributes[i]);
+	service_hash_invalidate(service);
+	db_changed(service->db);
 
 	return service->attributes[i];
 }
@@ -885,6 +2038,7 @@ service_insert_included(struct gatt_db_service *service, uint16_t handle,
 					struct gatt_db_attribute *include)
 {
 	struct gatt_db_service *included;
+	struct gatt_db_attribute *attrib;
 	uint8_t value[MAX_INCLUDED_VALUE_LEN];
 	uint16_t included_handle, len = 0;
 	int index;
@@ -934,8 +2088,12 @@ service_insert_included(struct gatt_db_service *service, uint16_t handle,
 	 * TODO handle permissions
 	 */
 	set_attribute_data(service->attributes[index], NULL, NULL, BT_ATT_PERM_READ, NULL);
+	index_attribute(service->attributes[index]);
+	service_hash_invalidate(service);
+	attrib = attribute_update(service, index);
+	db_changed(service->db);
 
-	return attribute_update(service, index);
+	return attrib;
 }
 
 struct gatt_db_attribute *
@@ -986,11 +2144,175 @@ bool gatt_db_service_set_active(struct gatt_db_attribute *attrib, bool active)
 
 	service->active = active;
 
+	if (service->db) {
+		struct gatt_db *db = service->db;
+		uint32_t h, start = service->attributes[0]->handle;
+
+		for (h = start; h < start + service->num_handles &&
+						h < db->handles_len; h++) {
+			if (db->handles[h].service == service)
+				db->handles[h].active = active;
+		}
+
+		db->hash_valid = false;
+		db_changed(db);
+	}
+
 	notify_service_changed(service->db, service, active);
 
 	return true;
 }
 
+/*
+ * Core Spec 5.1, Vol 3, Part G, 7.3: the Database Hash covers handle, type
+ * and value of the declarations and Extended Properties, and handle and
+ * type of the other descriptors the server defines.
+ */
+static size_t attribute_hash_data(const struct gatt_db_attribute *attrib,
+								uint8_t *dst)
+{
+	size_t len;
+
+	if (!attrib || attrib->uuid.type != BT_UUID16)
+		return 0;
+
+	switch (attrib->uuid.value.u16) {
+	case GATT_PRIM_SVC_UUID:
+	case GATT_SND_SVC_UUID:
+	case GATT_INCLUDE_UUID:
+	case GATT_CHARAC_UUID:
+	case GATT_CHARAC_EXT_PROPER_UUID:
+		len = 4 + attrib->value_len;
+		break;
+	case GATT_CHARAC_USER_DESC_UUID:
+	case GATT_CLIENT_CHARAC_CFG_UUID:
+	case GATT_SERVER_CHARAC_CFG_UUID:
+	case GATT_CHARAC_FMT_UUID:
+	case GATT_CHARAC_AGREG_FMT_UUID:
+		len = 4;
+		break;
+	default:
+		return 0;
+	}
+
+	if (!dst)
+		return len;
+
+	put_le16(attrib->handle, dst);
+	put_le16(attrib->uuid.value.u16, dst + 2);
+
+	if (len > 4)
+		memcpy(dst + 4, attrib->value, len - 4);
+
+	return len;
+}
+
+static bool service_hash_build(struct gatt_db_service *service)
+{
+	size_t len = 0;
+	int i;
+
+	if (service->hash_data)
+		return true;
+
+	for (i = 0; i < service->num_handles; i++)
+		len += attribute_hash_data(service->attributes[i], NULL);
+
+	service->hash_data = malloc(len ? len : 1);
+	if (!service->hash_data)
+		return false;
+
+	service->hash_len = 0;
+
+	for (i = 0; i < service->num_handles; i++)
+		service->hash_len += attribute_hash_data(service->attributes[i],
+					service->hash_data + service->hash_len);
+
+	return true;
+}
+
+/*
+ * Only services changed since the last call are serialized again, the CMAC
+ * itself always runs over the whole database.
+ */
+static bool hash_update(struct gatt_db *db)
+{
+	const struct queue_entry *entry;
+	struct gatt_db_service *service;
+	uint8_t *m;
+	size_t len = 0;
+	bool ret;
+
+	if (db->hash_valid)
+		return true;
+
+	if (!db->crypto) {
+		db->crypto = bt_crypto_new();
+		if (!db->crypto)
+			return false;
+	}
+
+	for (entry = queue_get_entries(db->services); entry;
+							entry = entry->next) {
+		service = entry->data;
+
+		if (!service->active)
+			continue;
+
+		if (!service_hash_build(service))
+			return false;
+
+		len += service->hash_len;
+	}
+
+	m = malloc(len ? len : 1);
+	if (!m)
+		return false;
+
+	len = 0;
+
+	/* Services are kept in handle order */
+	for (entry = queue_get_entries(db->services); entry;
+							entry = entry->next) {
+		service = entry->data;
+
+		if (!service->active)
+			continue;
+
+		memcpy(m + len, service->hash_data, service->hash_len);
+		len += service->hash_len;
+	}
+
+	ret = bt_crypto_gatt_hash(db->crypto, m, len, db->hash);
+	free(m);
+
+	if (!ret)
+		return false;
+
+	db->hash_valid = true;
+
+	return true;
+}
+
+bool gatt_db_get_hash(struct gatt_db *db, uint8_t hash[16])
+{
+	bool ret;
+
+	if (!db || !hash)
+		return false;
+
+	/* Extended Properties values may be written meanwhile */
+	pthread_mutex_lock(&db->lock);
+
+	ret = hash_update(db);
+	if (ret)
+		memcpy(hash, db->hash, 16);
+
+	pthread_mutex_unlock(&db->lock);
+
+	return ret;
+}
+
 bool gatt_db_service_get_active(struct gatt_db_attribute *attrib)
 {
 	if (!attrib)
@@ -1023,92 +2345,99 @@ void gatt_db_read_by_group_type(struct gatt_db *db, uint16_t start_handle,
 							const bt_uuid_t type,
 							struct queue *queue)
 {
-	const struct queue_entry *services_entry;
-	struct gatt_db_service *service;
-	uint16_t grp_start, grp_end, uuid_size;
+	const struct db_view *view;
+	struct db_view live;
+	struct gatt_db_attribute *attrib;
+	struct type_index *index;
+	uint128_t u128;
+	uint16_t uuid_size;
+	unsigned int i;
 
 	uuid_size = 0;
 
-	services_entry = queue_get_entries(db->services);
-
-	while (services_entry) {
-		service = services_entry->data;
+	uuid_normalize(&type, &u128);
 
-		if (!service->active)
-			goto next_service;
+	view = view_get(db, &live);
 
-		if (bt_uuid_cmp(&type, &service->attributes[0]->uuid))
-			goto next_service;
+	index = type_index_find(view->types, &u128);
+	if (!index)
+		goto done;
 
-		grp_start = service->attributes[0]->handle;
-		grp_end = grp_start + service->num_handles - 1;
+	for (i = type_index_lower(index, start_handle); i < index->len; i++) {
+		attrib = index->attrs[i];
 
-		if (grp_end < start_handle || grp_start > end_handle)
-			goto next_service;
+		if (attrib->handle > end_handle)
+			break;
 
-		if (grp_start < start_handle || grp_start > end_handle)
-			goto next_service;
+		if (!view_active(view, attrib) ||
+				attrib != attrib->service->attributes[0])
+			continue;
 
 		if (!uuid_size)
-			uuid_size = service->attributes[0]->value_len;
-		else if (uuid_size != service->attributes[0]->value_len)
-			return;
-
-		queue_push_tail(queue, service->attributes[0]);
+			uuid_size = attrib->value_len;
+		else if (uuid_size != attrib->value_len)
+			break;
 
-next_service:
-		services_entry = services_entry->next;
+		queue_push_tail(queue, attrib);
 	}
-}
 
-struct find_by_type_value_data {
-	bt_uuid_t uuid;
-	uint16_t start_handle;
-	uint16_t end_handle;
-	gatt_db_attribute_cb_t func;
-	void *user_data;
-	const void *value;
-	size_t value_len;
-	unsigned int num_of_res;
-};
+done:
+	view_put(db, view);
+}
 
-static void find_by_type(void *data, void *user_data)
+/*
+ * Walks the attributes of the given type within the range, in handle order.
+ * func may not change the database.
+ */
+static unsigned int find_by_type(struct gatt_db *db, uint16_t start_handle,
+						uint16_t end_handle,
+						const bt_uuid_t *type,
+						const void *value,
+						size_t value_len,
+						gatt_db_attribute_cb_t func,
+						void *user_data)
 {
-	struct find_by_type_value_data *search_data = user_data;
-	struct gatt_db_service *service = data;
-	struct gatt_db_attribute *attribute;
-	int i;
+	const struct db_view *view;
+	struct db_view live;
+	struct gatt_db_attribute *attrib;
+	struct type_index *index;
+	unsigned int i, num_of_res = 0;
+	uint128_t u128;
 
-	if (!service->active)
-		return;
+	uuid_normalize(type, &u128);
 
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
+	view = view_get(db, &live);
 
-		if (!attribute)
-			continue;
+	index = type_index_find(view->types, &u128);
+	if (!index)
+		goto done;
 
-		if ((attribute->handle < search_data->start_handle) ||
-				(attribute->handle > search_data->end_handle))
-			continue;
+	for (i = type_index_lower(index, start_handle); i < index->len; i++) {
+		attrib = index->attrs[i];
+
+		if (attrib->handle > end_handle)
+			break;
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
+		if (!view_active(view, attrib))
 			continue;
 
 		/* TODO: fix for read-callback based attributes */
-		if (search_data->value) {
-			if (search_data->value_len != attribute->value_len)
+		if (value) {
+			if (value_len != attrib->value_len)
 				continue;
 
-			if (memcmp(attribute->value, search_data->value,
-					search_data->value_len)) {
+			if (memcmp(attrib->value, value, value_len))
 				continue;
-			}
 		}
 
-		search_data->num_of_res++;
-		search_data->func(attribute, search_data->user_data);
+		num_of_res++;
+		func(attrib, user_data);
 	}
+
+done:
+	view_put(db, view);
+
+	return num_of_res;
 }
 
 unsigned int gatt_db_find_by_type(struct gatt_db *db, uint16_t start_handle,
@@ -1117,19 +2446,8 @@ unsigned int gatt_db_find_by_type(struct gatt_db *db, uint16_t start_handle,
 						gatt_db_attribute_cb_t func,
 						void *user_data)
 {
-	struct find_by_type_value_data data;
-
-	memset(&data, 0, sizeof(data));
-
-	data.uuid = *type;
-	data.start_handle = start_handle;
-	data.end_handle = end_handle;
-	data.func = func;
-	data.user_data = user_data;
-
-	queue_foreach(db->services, find_by_type, &data);
-
-	return data.num_of_res;
+	return find_by_type(db, start_handle, end_handle, type, NULL, 0,
+							func, user_data);
 }
 
 unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
@@ -1137,58 +2455,19 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 						uint16_t end_handle,
 						const bt_uuid_t *type,
 						const void *value,
-						size_t value_len,
-						gatt_db_attribute_cb_t func,
-						void *user_data)
-{
-	struct find_by_type_value_data data;
-
-	data.uuid = *type;
-	data.start_handle = start_handle;
-	data.end_handle = end_handle;
-	data.func = func;
-	data.user_data = user_data;
-	data.value = value;
-	data.value_len = value_len;
-
-	queue_foreach(db->services, find_by_type, &data);
-
-	return data.num_of_res;
-}
-
-struct read_by_type_data {
-	struct queue *queue;
-	bt_uuid_t uuid;
-	uint16_t start_handle;
-	uint16_t end_handle;
-};
-
-static void read_by_type(void *data, void *user_data)
-{
-	struct read_by_type_data *search_data = user_data;
-	struct gatt_db_service *service = data;
-	struct gatt_db_attribute *attribute;
-	int i;
-
-	if (!service->active)
-		return;
-
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
-		if (!attribute)
-			continue;
-
-		if (attribute->handle < search_data->start_handle)
-			continue;
-
-		if (attribute->handle > search_data->end_handle)
-			return;
+						size_t value_len,
+						gatt_db_attribute_cb_t func,
+						void *user_data)
+{
+	return find_by_type(db, start_handle, end_handle, type, value,
+						value_len, func, user_data);
+}
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
-			continue;
+static void push_attribute(struct gatt_db_attribute *attrib, void *user_data)
+{
+	struct queue *queue = user_data;
 
-		queue_push_tail(search_data->queue, attribute);
-	}
+	queue_push_tail(queue, attrib);
 }
 
 void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
@@ -1196,17 +2475,13 @@ void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
 						const bt_uuid_t type,
 						struct queue *queue)
 {
-	struct read_by_type_data data;
-	data.uuid = type;
-	data.start_handle = start_handle;
-	data.end_handle = end_handle;
-	data.queue = queue;
-
-	queue_foreach(db->services, read_by_type, &data);
+	find_by_type(db, start_handle, end_handle, &type, NULL, 0,
+						push_attribute, queue);
 }
 
 
 struct find_information_data {
+	const struct db_view *view;
 	struct queue *queue;
 	uint16_t start_handle;
 	uint16_t end_handle;
@@ -1215,30 +2490,29 @@ struct find_information_data {
 static void find_information(void *data, void *user_data)
 {
 	struct find_information_data *search_data = user_data;
+	const struct db_view *view = search_data->view;
 	struct gatt_db_service *service = data;
 	struct gatt_db_attribute *attribute;
-	int i;
+	uint32_t start, end, h;
 
-	if (!service->active)
+	if (!view_active(view, service->attributes[0]))
 		return;
 
+	start = service->attributes[0]->handle;
+	end = start + service->num_handles - 1;
+
 	/* Check if service is in range */
-	if ((service->attributes[0]->handle + service->num_handles - 1) <
-						search_data->start_handle)
+	if (end < search_data->start_handle || start > search_data->end_handle)
 		return;
 
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
-		if (!attribute)
-			continue;
-
-		if (attribute->handle < search_data->start_handle)
-			continue;
-
-		if (attribute->handle > search_data->end_handle)
-			return;
+	start = MAX(start, search_data->start_handle);
+	end = MIN(end, search_data->end_handle);
 
-		queue_push_tail(search_data->queue, attribute);
+	/* The handle table holds the attributes in handle order */
+	for (h = start; h <= end && h < view->handles_len; h++) {
+		attribute = view->handles[h].attrib;
+		if (attribute)
+			queue_push_tail(search_data->queue, attribute);
 	}
 }
 
@@ -1247,12 +2521,16 @@ void gatt_db_find_information(struct gatt_db *db, uint16_t start_handle,
 							struct queue *queue)
 {
 	struct find_information_data data;
+	struct db_view live;
 
+	data.view = view_get(db, &live);
 	data.start_handle = start_handle;
 	data.end_handle = end_handle;
 	data.queue = queue;
 
-	queue_foreach(db->services, find_information, &data);
+	view_foreach_service(db, data.view, find_information, &data);
+
+	view_put(db, data.view);
 }
 
 void gatt_db_foreach_service(struct gatt_db *db, const bt_uuid_t *uuid,
@@ -1299,6 +2577,8 @@ void gatt_db_foreach_service_in_range(struct gatt_db *db,
 						uint16_t start_handle,
 						uint16_t end_handle)
 {
+	const struct db_view *view;
+	struct db_view live;
 	struct foreach_data data;
 
 	if (!db || !func || start_handle > end_handle)
@@ -1310,7 +2590,9 @@ void gatt_db_foreach_service_in_range(struct gatt_db *db,
 	data.start = start_handle;
 	data.end = end_handle;
 
-	queue_foreach(db->services, foreach_service_in_range, &data);
+	view = view_get(db, &live);
+	view_foreach_service(db, view, foreach_service_in_range, &data);
+	view_put(db, view);
 }
 
 void gatt_db_service_foreach(struct gatt_db_attribute *attrib,
@@ -1393,55 +2675,44 @@ void gatt_db_service_foreach_incl(struct gatt_db_attribute *attrib,
 								user_data);
 }
 
-static bool find_service_for_handle(const void *data, const void *user_data)
-{
-	const struct gatt_db_service *service = data;
-	uint16_t handle = PTR_TO_UINT(user_data);
-	uint16_t start, end;
-
-	gatt_db_service_get_handles(service, &start, &end);
-
-	return (start <= handle) && (handle <= end);
-}
-
 struct gatt_db_attribute *gatt_db_get_service(struct gatt_db *db,
 							uint16_t handle)
 {
-	struct gatt_db_service *service;
+	const struct db_view *view;
+	struct db_view live;
+	struct gatt_db_service *service = NULL;
 
 	if (!db || !handle)
 		return NULL;
 
-	service = queue_find(db->services, find_service_for_handle,
-						UINT_TO_PTR(handle));
-	if (!service)
-		return NULL;
+	view = view_get(db, &live);
 
-	return service->attributes[0];
+	if (handle < view->handles_len)
+		service = view->handles[handle].service;
+
+	view_put(db, view);
+
+	return service ? service->attributes[0] : NULL;
 }
 
 struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 							uint16_t handle)
 {
-	struct gatt_db_attribute *attrib;
-	struct gatt_db_service *service;
-	int i;
+	const struct db_view *view;
+	struct db_view live;
+	struct gatt_db_attribute *attrib = NULL;
 
-	attrib = gatt_db_get_service(db, handle);
-	if (!attrib)
+	if (!db || !handle)
 		return NULL;
 
-	service = attrib->service;
+	view = view_get(db, &live);
 
-	for (i = 0; i < service->num_handles; i++) {
-		if (!service->attributes[i])
-			continue;
+	if (handle < view->handles_len)
+		attrib = view->handles[handle].attrib;
 
-		if (service->attributes[i]->handle == handle)
-			return service->attributes[i];
-	}
+	view_put(db, view);
 
-	return NULL;
+	return attrib;
 }
 
 static bool find_service_with_uuid(const void *data, const void *user_data)
@@ -1458,16 +2729,30 @@ static bool find_service_with_uuid(const void *data, const void *user_data)
 struct gatt_db_attribute *gatt_db_get_service_with_uuid(struct gatt_db *db,
 							const bt_uuid_t *uuid)
 {
-	struct gatt_db_service *service;
+	const struct db_view *view;
+	struct db_view live;
+	struct gatt_db_service *service = NULL;
+	unsigned int i;
 
 	if (!db || !uuid)
 		return NULL;
 
-	service = queue_find(db->services, find_service_with_uuid, uuid);
-	if (!service)
-		return NULL;
+	view = view_get(db, &live);
 
-	return service->attributes[0];
+	if (!view->published)
+		service = queue_find(db->services, find_service_with_uuid,
+									uuid);
+
+	for (i = 0; view->published && i < view->num_services; i++) {
+		if (find_service_with_uuid(view->services[i], uuid)) {
+			service = view->services[i];
+			break;
+		}
+	}
+
+	view_put(db, view);
+
+	return service ? service->attributes[0] : NULL;
 }
 
 const bt_uuid_t *gatt_db_attribute_get_type(
@@ -1711,53 +2996,271 @@ gatt_db_attribute_get_permissions(const struct gatt_db_attribute *attrib)
 static bool read_timeout(void *user_data)
 {
 	struct pending_read *p = user_data;
+	struct gatt_db_attribute *attrib = p->attrib;
+	struct gatt_db_service *service = attrib->service;
+	bool found, orphaned;
 
+	attribute_lock(attrib);
 	p->timeout_id = 0;
+	found = queue_remove(attrib->pending_reads, p);
+	orphaned = p->orphaned;
+	attribute_unlock(attrib);
+
+	if (orphaned) {
+		pending_read_result(p, -ECANCELED, NULL, 0);
+		pending_orphan_release(service);
+		return false;
+	}
 
-	queue_remove(p->attrib->pending_reads, p);
+	/* The result is already posted to this loop, see pending_post() */
+	if (!found)
+		return false;
 
 	pending_read_result(p, -ETIMEDOUT, NULL, 0);
 
 	return false;
 }
 
+/*
+ * Values may change as soon as the lock is dropped, so read callbacks get a
+ * copy made under it. Small values go into buf, larger ones are allocated.
+ */
+static int value_copy(const uint8_t *value, size_t len, uint16_t offset,
+				uint8_t *buf, uint8_t **out, size_t *out_len)
+{
+	*out = NULL;
+	*out_len = 0;
+
+	if (offset > len)
+		return BT_ATT_ERROR_INVALID_OFFSET;
+
+	len -= offset;
+	if (!len)
+		return 0;
+
+	*out = len <= BT_ATT_MAX_VALUE_LEN ? buf : malloc(len);
+	if (!*out)
+		return BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+
+	memcpy(*out, value + offset, len);
+	*out_len = len;
+
+	return 0;
+}
+
+static uint64_t cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool cache_is_fresh(struct gatt_db_attribute *attrib)
+{
+	if (!attrib->cache_valid)
+		return false;
+
+	if (attrib->cache_ttl && cache_now() >= attrib->cache_expiry) {
+		attrib->cache_valid = false;
+		return false;
+	}
+
+	return true;
+}
+
+static void cache_serve(struct gatt_db_attribute *attrib, int err,
+				const uint8_t *value, size_t len,
+				uint16_t offset, gatt_db_attribute_read_t func,
+				void *user_data)
+{
+	if (err) {
+		func(attrib, err, NULL, 0, user_data);
+		return;
+	}
+
+	if (offset > len) {
+		func(attrib, BT_ATT_ERROR_INVALID_OFFSET, NULL, 0, user_data);
+		return;
+	}
+
+	func(attrib, 0, offset == len ? NULL : value + offset, len - offset,
+								user_data);
+}
+
+static void cache_fetch_complete(struct gatt_db_attribute *attrib, int err,
+					const uint8_t *value, size_t length,
+					void *user_data)
+{
+	struct cache_fetch *fetch = user_data;
+	struct cache_waiter *waiter;
+	uint8_t *buf;
+
+	attribute_lock(attrib);
+
+	queue_remove(attrib->cache_fetches, fetch);
+
+	/* Do not keep a value that was invalidated while being fetched */
+	if (!err && attrib->cache_enabled && fetch->gen == attrib->cache_gen) {
+		buf = realloc(attrib->cache_value, length ? length : 1);
+		if (buf) {
+			if (length)
+				memcpy(buf, value, length);
+
+			attrib->cache_value = buf;
+			attrib->cache_len = length;
+			attrib->cache_valid = true;
+			attrib->cache_expiry = cache_now() + attrib->cache_ttl;
+		}
+	}
+
+	attribute_unlock(attrib);
+
+	while ((waiter = queue_pop_head(fetch->waiters))) {
+		cache_serve(attrib, err, value, length, waiter->offset,
+					waiter->func, waiter->user_data);
+		free(waiter);
+	}
+
+	cache_fetch_free(fetch);
+}
+
+/* Called with the lock held */
+static struct pending_read *pending_read_new(struct gatt_db_attribute *attrib,
+						gatt_db_attribute_read_t func,
+						void *user_data)
+{
+	struct pending_read *p;
+
+	p = new0(struct pending_read, 1);
+	p->attrib = attrib;
+	p->loop = mainloop_get_current();
+	p->thread = pthread_self();
+	p->id = ++attrib->read_id;
+	p->timeout_id = timeout_loop_add(p->loop, ATTRIBUTE_TIMEOUT,
+						read_timeout, p, NULL);
+	p->func = func;
+	p->user_data = user_data;
+
+	/* Most attributes never see a callback read, create on demand */
+	if (!attrib->pending_reads)
+		attrib->pending_reads = queue_new();
+
+	queue_push_tail(attrib->pending_reads, p);
+
+	return p;
+}
+
+static bool match_fetch_loop(const void *a, const void *b)
+{
+	const struct cache_fetch *fetch = a;
+
+	return fetch->loop == b;
+}
+
+/*
+ * Reads of a cached attribute are served from the snapshot while it is fresh.
+ * Otherwise the whole value is fetched once, from offset 0, and every read
+ * arriving meanwhile from the same loop waits for that same fetch.
+ */
+static void cache_read(struct gatt_db_attribute *attrib, uint16_t offset,
+				uint8_t opcode, struct bt_att *att,
+				gatt_db_attribute_read_t func, void *user_data)
+{
+	uint8_t buf[BT_ATT_MAX_VALUE_LEN];
+	struct mainloop *loop = mainloop_get_current();
+	struct cache_waiter *waiter;
+	struct cache_fetch *fetch;
+	struct pending_read *p;
+	unsigned int id;
+	uint8_t *value;
+	size_t len;
+	int err;
+
+	attribute_lock(attrib);
+
+	if (cache_is_fresh(attrib)) {
+		err = value_copy(attrib->cache_value, attrib->cache_len,
+						offset, buf, &value, &len);
+		attribute_unlock(attrib);
+
+		func(attrib, err, value, len, user_data);
+
+		if (value != buf)
+			free(value);
+
+		return;
+	}
+
+	waiter = new0(struct cache_waiter, 1);
+	waiter->offset = offset;
+	waiter->func = func;
+	waiter->user_data = user_data;
+
+	fetch = queue_find(attrib->cache_fetches, match_fetch_loop, loop);
+	if (fetch) {
+		queue_push_tail(fetch->waiters, waiter);
+		attribute_unlock(attrib);
+		return;
+	}
+
+	fetch = new0(struct cache_fetch, 1);
+	fetch->loop = loop;
+	fetch->gen = attrib->cache_gen;
+	fetch->waiters = queue_new();
+	queue_push_tail(fetch->waiters, waiter);
+	queue_push_tail(attrib->cache_fetches, fetch);
+
+	p = pending_read_new(attrib, cache_fetch_complete, fetch);
+	id = p->id;
+
+	attribute_unlock(attrib);
+
+	attrib->read_func(attrib, id, 0, opcode, att, attrib->user_data);
+}
+
 bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 				uint8_t opcode, struct bt_att *att,
 				gatt_db_attribute_read_t func, void *user_data)
 {
+	uint8_t buf[BT_ATT_MAX_VALUE_LEN];
 	uint8_t *value;
+	size_t len;
+	int err;
 
 	if (!attrib || !func)
 		return false;
 
+	if (attrib->read_func && attrib->cache_enabled) {
+		cache_read(attrib, offset, opcode, att, func, user_data);
+		return true;
+	}
+
 	if (attrib->read_func) {
 		struct pending_read *p;
+		unsigned int id;
 
-		p = new0(struct pending_read, 1);
-		p->attrib = attrib;
-		p->id = ++attrib->read_id;
-		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, read_timeout,
-								p, NULL);
-		p->func = func;
-		p->user_data = user_data;
-
-		queue_push_tail(attrib->pending_reads, p);
+		attribute_lock(attrib);
+		p = pending_read_new(attrib, func, user_data);
+		id = p->id;
+		attribute_unlock(attrib);
 
-		attrib->read_func(attrib, p->id, offset, opcode, att,
+		attrib->read_func(attrib, id, offset, opcode, att,
 							attrib->user_data);
 		return true;
 	}
 
 	/* Check boundary if value is stored in the db */
-	if (offset > attrib->value_len) {
-		func(attrib, BT_ATT_ERROR_INVALID_OFFSET, NULL, 0, user_data);
-		return true;
-	}
+	attribute_lock(attrib);
+	err = value_copy(attrib->value, attrib->value_len, offset, buf, &value,
+									&len);
+	attribute_unlock(attrib);
 
-	/* Guard against invalid access if offset equals to value length */
-	value = offset == attrib->value_len ? NULL : &attrib->value[offset];
+	func(attrib, err, value, len, user_data);
 
-	func(attrib, 0, value, attrib->value_len - offset, user_data);
+	if (value != buf)
+		free(value);
 
 	return true;
 }
@@ -1779,52 +3282,127 @@ bool gatt_db_attribute_read_result(struct gatt_db_attribute *attrib,
 	if (!attrib || !id)
 		return false;
 
+	attribute_lock(attrib);
 	p = queue_remove_if(attrib->pending_reads, find_pending,
 							UINT_TO_PTR(id));
+	attribute_unlock(attrib);
+
 	if (!p)
 		return false;
 
-	pending_read_result(p, err, value, length);
-
-	return true;
+	return pending_read_deliver(p, err, value, length);
 }
 
 static bool write_timeout(void *user_data)
 {
 	struct pending_write *p = user_data;
+	struct gatt_db_attribute *attrib = p->attrib;
+	struct gatt_db_service *service = attrib->service;
+	bool found, orphaned;
 
+	attribute_lock(attrib);
 	p->timeout_id = 0;
+	found = queue_remove(attrib->pending_writes, p);
+	orphaned = p->orphaned;
+	attribute_unlock(attrib);
+
+	if (orphaned) {
+		pending_write_result(p, -ECANCELED);
+		pending_orphan_release(service);
+		return false;
+	}
 
-	queue_remove(p->attrib->pending_writes, p);
+	/* The result is already posted to this loop, see pending_post() */
+	if (!found)
+		return false;
 
 	pending_write_result(p, -ETIMEDOUT);
 
 	return false;
 }
 
+/* Called with the lock held */
+static bool value_store(struct gatt_db_attribute *attrib, uint16_t offset,
+					const uint8_t *value, size_t len)
+{
+	/* Values from a table are copied on the first write */
+	if (attrib->value_static) {
+		uint8_t *buf = NULL;
+
+		if (attrib->value_len) {
+			buf = malloc(attrib->value_len);
+			if (!buf)
+				return false;
+
+			memcpy(buf, attrib->value, attrib->value_len);
+		}
+
+		attrib->value = buf;
+		attrib->value_static = false;
+	}
+
+	/* For values stored in db allocate on demand */
+	if (!attrib->value || offset >= attrib->value_len ||
+				len > (unsigned) (attrib->value_len - offset)) {
+		void *buf;
+
+		buf = realloc(attrib->value, len + offset);
+		if (!buf)
+			return false;
+
+		attrib->value = buf;
+
+		/* Init data in the first allocation */
+		if (!attrib->value_len)
+			memset(attrib->value, 0, offset);
+
+		attrib->value_len = len + offset;
+	}
+
+	memcpy(&attrib->value[offset], value, len);
+
+	return true;
+}
+
 bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 					const uint8_t *value, size_t len,
 					uint8_t opcode, struct bt_att *att,
 					gatt_db_attribute_write_t func,
 					void *user_data)
 {
+	bool stored;
+
 	if (!attrib || !func)
 		return false;
 
 	if (attrib->write_func) {
 		struct pending_write *p;
+		unsigned int id;
+
+		/* The application value is about to change */
+		gatt_db_attribute_invalidate_cache(attrib);
 
 		p = new0(struct pending_write, 1);
 		p->attrib = attrib;
-		p->id = ++attrib->write_id;
-		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, write_timeout,
-								p, NULL);
+		p->loop = mainloop_get_current();
+		p->thread = pthread_self();
+		p->timeout_id = timeout_loop_add(p->loop, ATTRIBUTE_TIMEOUT,
+						write_timeout, p, NULL);
 		p->func = func;
 		p->user_data = user_data;
 
+		attribute_lock(attrib);
+
+		p->id = id = ++attrib->write_id;
+
+		if (!attrib->pending_writes)
+			attrib->pending_writes = queue_new();
+
 		queue_push_tail(attrib->pending_writes, p);
 
-		attrib->write_func(attrib, p->id, offset, value, len, opcode,
+		attribute_unlock(attrib);
+
+		attrib->write_func(attrib, id, offset, value, len, opcode,
 							att, attrib->user_data);
 		return true;
 	}
@@ -1833,25 +3411,16 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 	if (len == 0)
 		goto done;
 
-	/* For values stored in db allocate on demand */
-	if (!attrib->value || offset >= attrib->value_len ||
-				len > (unsigned) (attrib->value_len - offset)) {
-		void *buf;
-
-		buf = realloc(attrib->value, len + offset);
-		if (!buf)
-			return false;
-
-		attrib->value = buf;
-
-		/* Init data in the first allocation */
-		if (!attrib->value_len)
-			memset(attrib->value, 0, offset);
+	attribute_lock(attrib);
+	stored = value_store(attrib, offset, value, len);
+	attribute_unlock(attrib);
 
-		attrib->value_len = len + offset;
-	}
+	if (!stored)
+		return false;
 
-	memcpy(&attrib->value[offset], value, len);
+	/* Extended Properties are part of the Database Hash */
+	if (!bt_uuid_cmp(&attrib->uuid, &ext_desc_uuid))
+		service_hash_invalidate(attrib->service);
 
 done:
 	func(attrib, 0, user_data);
@@ -1867,27 +3436,79 @@ bool gatt_db_attribute_write_result(struct gatt_db_attribute *attrib,
 	if (!attrib || !id)
 		return false;
 
+	attribute_lock(attrib);
 	p = queue_remove_if(attrib->pending_writes, find_pending,
 							UINT_TO_PTR(id));
+	attribute_unlock(attrib);
+
 	if (!p)
 		return false;
 
-	pending_write_result(p, err);
+	return pending_write_deliver(p, err);
+}
+
+bool gatt_db_attribute_reset(struct gatt_db_attribute *attrib)
+{
+	if (!attrib)
+		return false;
+
+	attribute_lock(attrib);
+
+	if (attrib->value && attrib->value_len) {
+		if (!attrib->value_static)
+			free(attrib->value);
+
+		attrib->value = NULL;
+		attrib->value_static = false;
+		attrib->value_len = 0;
+	}
+
+	attribute_unlock(attrib);
 
 	return true;
 }
 
-bool gatt_db_attribute_reset(struct gatt_db_attribute *attrib)
+bool gatt_db_attribute_set_cache(struct gatt_db_attribute *attrib, bool enable,
+							unsigned int ttl)
+{
+	if (!attrib || !attrib->read_func)
+		return false;
+
+	/* Configuration descriptors hold a value per connection */
+	if (enable && (!bt_uuid_cmp(&attrib->uuid, &ccc_uuid) ||
+				!bt_uuid_cmp(&attrib->uuid, &scc_uuid)))
+		return false;
+
+	attribute_lock(attrib);
+
+	attrib->cache_enabled = enable;
+	attrib->cache_ttl = ttl;
+
+	if (!attrib->cache_fetches)
+		attrib->cache_fetches = queue_new();
+
+	attribute_unlock(attrib);
+
+	return gatt_db_attribute_invalidate_cache(attrib);
+}
+
+bool gatt_db_attribute_invalidate_cache(struct gatt_db_attribute *attrib)
 {
 	if (!attrib)
 		return false;
 
-	if (!attrib->value || !attrib->value_len)
-		return true;
+	attribute_lock(attrib);
+
+	attrib->cache_gen++;
+	attrib->cache_valid = false;
+
+	if (!attrib->cache_enabled) {
+		free(attrib->cache_value);
+		attrib->cache_value = NULL;
+		attrib->cache_len = 0;
+	}
 
-	free(attrib->value);
-	attrib->value = NULL;
-	attrib->value_len = 0;
+	attribute_unlock(attrib);
 
 	return true;
 }
@@ -1899,3 +3520,20 @@ void *gatt_db_attribute_get_user_data(struct gatt_db_attribute *attrib)
 
 	return attrib->user_data;
 }
+
+bool gatt_db_attribute_get_stored_value(const struct gatt_db_attribute *attrib,
+						const uint8_t **value,
+						size_t *length)
+{
+	/* Values served by a read callback are not stored in the db */
+	if (!attrib || attrib->read_func)
+		return false;
+
+	if (value)
+		*value = attrib->value;
+
+	if (length)
+		*length = attrib->value_len;
+
+	return true;
+}
@@ -27,8 +27,10 @@
 
 #include <sys/uio.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "src/shared/att.h"
+#include "src/shared/mainloop.h"
 #include "lib/bluetooth.h"
 #include "lib/uuid.h"
 #include "src/shared/queue.h"
@@ -51,24 +53,120 @@
  */
 #define DEFAULT_MAX_PREP_QUEUE_LEN 30
 
+/*
+ * Queued prepared write values live in one buffer per connection, sized by
+ * this cap and allocated on the first Prepare Write Request. Enough for a
+ * reliable write over a handful of maximum length attributes.
+ */
+#define DEFAULT_MAX_PREP_SIZE	8192
+
+/*
+ * Discovery responses are cached per database and flushed whenever the
+ * database generation moves. The table is sized from the handles the
+ * services span at that point: a full discovery takes at most one request
+ * per attribute, so this leaves room for clients at a couple of different
+ * MTUs. Once full, the least recently used entry makes room.
+ */
+#define RSP_CACHE_ENTRIES_PER_HANDLE	2
+#define RSP_CACHE_MIN_ENTRIES		64
+
+/* Opcode, MTU and the longest request PDU we cache a response for */
+#define RSP_CACHE_MAX_KEY	(3 + 22)
+
+struct rsp_cache_entry {
+	struct rsp_cache_entry *next;		/* In the bucket */
+	struct rsp_cache_entry *lru_prev;	/* Towards the most recent */
+	struct rsp_cache_entry *lru_next;
+	uint32_t hash;
+	uint8_t rsp_opcode;
+	uint16_t ehandle;
+	uint8_t ecode;
+	uint16_t key_len;
+	uint16_t rsp_len;
+	uint8_t data[];		/* Key followed by the response parameters */
+};
+
+struct rsp_cache {
+	struct gatt_db *db;
+	pthread_mutex_t lock;		/* Servers may run on any thread */
+	unsigned int generation;	/* Of the database the entries match */
+	unsigned int num_entries;
+	unsigned int max_entries;
+	unsigned int num_buckets;	/* Power of two */
+	struct rsp_cache_entry **buckets;
+	struct rsp_cache_entry *lru_head;	/* Most recently used */
+	struct rsp_cache_entry *lru_tail;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+static struct queue *rsp_caches;
+static pthread_mutex_t rsp_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Subscriptions are tracked per database. A CCC gets a slot the first time
+ * a client writes it, and the slot lists the servers subscribed through it
+ * so fan-out only visits those. Each server also keeps the value it wrote,
+ * two bits per slot, packed CCC_SLOTS_PER_WORD to a word. Slots survive
+ * their service being hidden and are only released once it is removed.
+ */
+#define CCC_SLOTS_PER_WORD	16
+
+struct ccc_slot {
+	uint16_t value_handle;		/* 0 if the slot is unused */
+	uint16_t ccc_handle;
+	struct queue *subscribers;
+};
+
+struct ccc_registry {
+	struct gatt_db *db;
+	pthread_mutex_t lock;		/* Also covers the servers' CCC bits */
+	struct ccc_slot *slots;
+	unsigned int num_slots;
+	unsigned int *order;		/* Used slots sorted by handle */
+	unsigned int num_order;
+};
+
+static struct queue *ccc_registries;
+static pthread_mutex_t ccc_registries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A notification or indication for a bearer served by another loop */
+struct notify_all_data {
+	struct bt_att *att;
+	uint8_t opcode;
+	uint16_t length;
+	uint8_t pdu[];
+};
+
+static const bt_uuid_t ccc_uuid = { .type = BT_UUID16,
+				.value.u16 = GATT_CLIENT_CHARAC_CFG_UUID };
+
 struct async_read_op {
 	struct bt_gatt_server *server;
+	struct gatt_db *db;
 	uint8_t opcode;
 	bool done;
 	uint8_t *pdu;
 	size_t pdu_len;
 	size_t value_len;
 	struct queue *db_data;
+	uint8_t cache_key[RSP_CACHE_MAX_KEY];
+	uint16_t cache_key_len;
+	unsigned int cache_gen;
 };
 
 struct async_write_op {
 	struct bt_gatt_server *server;
+	struct gatt_db *db;
 	uint8_t opcode;
+	bool ccc;
+	uint16_t ccc_value;
 };
 
 struct prep_write_data {
 	struct bt_gatt_server *server;
-	uint8_t *value;
+	uint8_t *value;			/* Points into the server's prep_buf */
 	uint16_t handle;
 	uint16_t offset;
 	uint16_t length;
@@ -78,10 +176,21 @@ struct prep_write_data {
 
 static void prep_write_data_destroy(void *user_data)
 {
-	struct prep_write_data *data = user_data;
+	free(user_data);
+}
 
-	free(data->value);
-	free(data);
+/* Operations completing later stay readers, see server_handler_cb() */
+static struct gatt_db *op_db_hold(struct gatt_db *db)
+{
+	gatt_db_read_begin(db);
+
+	return gatt_db_ref(db);
+}
+
+static void op_db_release(struct gatt_db *db)
+{
+	gatt_db_read_end(db);
+	gatt_db_unref(db);
 }
 
 struct bt_gatt_server {
@@ -97,24 +206,768 @@ struct bt_gatt_server {
 	unsigned int find_by_type_value_id;
 	unsigned int write_id;
 	unsigned int write_cmd_id;
+	unsigned int signed_write_id;
 	unsigned int read_id;
 	unsigned int read_blob_id;
 	unsigned int read_multiple_id;
+	unsigned int read_multiple_vl_id;
 	unsigned int prep_write_id;
 	unsigned int exec_write_id;
 
-	uint8_t min_enc_size;
+	uint8_t min_enc_size;
+
+	struct queue *prep_queue;
+	unsigned int max_prep_queue_len;
+	uint8_t *prep_buf;
+	unsigned int prep_buf_size;
+	unsigned int prep_buf_used;
+
+	/* CCC value of the queued write being executed, if it is one */
+	bool exec_ccc;
+	uint16_t exec_ccc_value;
+
+	struct rsp_cache *rsp_cache;
+
+	struct ccc_registry *ccc_registry;
+	uint32_t *ccc_bits;
+	unsigned int ccc_words;
+
+	struct async_read_op *pending_read_op;
+	struct async_write_op *pending_write_op;
+
+	bt_gatt_server_debug_func_t debug_callback;
+	bt_gatt_server_destroy_func_t debug_destroy;
+	void *debug_data;
+};
+
+static void rsp_cache_clear(struct rsp_cache *cache)
+{
+	while (cache->lru_head) {
+		struct rsp_cache_entry *entry = cache->lru_head;
+
+		cache->lru_head = entry->lru_next;
+		free(entry);
+	}
+
+	if (cache->buckets)
+		memset(cache->buckets, 0,
+				cache->num_buckets * sizeof(*cache->buckets));
+
+	cache->lru_tail = NULL;
+	cache->num_entries = 0;
+}
+
+static void count_handles(struct gatt_db_attribute *attrib, void *user_data)
+{
+	unsigned int *num_handles = user_data;
+	uint16_t start, end;
+
+	if (gatt_db_attribute_get_service_handles(attrib, &start, &end))
+		*num_handles += end - start + 1;
+}
+
+/* Called with the cache lock held and the cache empty */
+static void rsp_cache_resize(struct rsp_cache *cache)
+{
+	struct rsp_cache_entry **buckets;
+	unsigned int num_handles = 0;
+	unsigned int max_entries, num_buckets = 1;
+
+	gatt_db_foreach_service(cache->db, NULL, count_handles, &num_handles);
+
+	max_entries = MAX(num_handles * RSP_CACHE_ENTRIES_PER_HANDLE,
+						RSP_CACHE_MIN_ENTRIES);
+
+	while (num_buckets < max_entries)
+		num_buckets <<= 1;
+
+	if (num_buckets != cache->num_buckets) {
+		buckets = calloc(num_buckets, sizeof(*buckets));
+		if (!buckets)
+			return;
+
+		free(cache->buckets);
+		cache->buckets = buckets;
+		cache->num_buckets = num_buckets;
+	}
+
+	cache->max_entries = max_entries;
+}
+
+/* Called with the cache lock held */
+static void rsp_cache_sync(struct rsp_cache *cache)
+{
+	unsigned int generation = gatt_db_get_generation(cache->db);
+
+	if (cache->generation == generation)
+		return;
+
+	rsp_cache_clear(cache);
+	rsp_cache_resize(cache);
+	cache->generation = generation;
+}
+
+static void rsp_cache_db_changed(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	struct rsp_cache *cache = user_data;
+
+	pthread_mutex_lock(&cache->lock);
+	rsp_cache_clear(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static bool match_rsp_cache_db(const void *a, const void *b)
+{
+	const struct rsp_cache *cache = a;
+
+	return cache->db == b;
+}
+
+static void rsp_cache_free(void *data)
+{
+	struct rsp_cache *cache = data;
+
+	pthread_mutex_lock(&rsp_caches_lock);
+
+	queue_remove(rsp_caches, cache);
+	if (queue_isempty(rsp_caches)) {
+		queue_destroy(rsp_caches, NULL);
+		rsp_caches = NULL;
+	}
+
+	pthread_mutex_unlock(&rsp_caches_lock);
+
+	rsp_cache_clear(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+/*
+ * The cache is shared by every server exported from the same database and
+ * lives as long as the database does, so clients connecting one after the
+ * other benefit from what the previous ones discovered.
+ */
+static struct rsp_cache *rsp_cache_get(struct gatt_db *db)
+{
+	struct rsp_cache *cache;
+
+	pthread_mutex_lock(&rsp_caches_lock);
+
+	cache = queue_find(rsp_caches, match_rsp_cache_db, db);
+	if (cache) {
+		pthread_mutex_unlock(&rsp_caches_lock);
+		return cache;
+	}
+
+	cache = new0(struct rsp_cache, 1);
+	cache->db = db;
+	cache->generation = gatt_db_get_generation(db);
+	pthread_mutex_init(&cache->lock, NULL);
+	rsp_cache_resize(cache);
+
+	if (!rsp_caches)
+		rsp_caches = queue_new();
+
+	queue_push_tail(rsp_caches, cache);
+
+	pthread_mutex_unlock(&rsp_caches_lock);
+
+	if (!gatt_db_register(db, rsp_cache_db_changed, rsp_cache_db_changed,
+						cache, rsp_cache_free)) {
+		rsp_cache_free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static uint16_t rsp_cache_key(uint8_t *key, uint8_t opcode, uint16_t mtu,
+					const uint8_t *pdu, uint16_t length)
+{
+	if (length > RSP_CACHE_MAX_KEY - 3)
+		return 0;
+
+	key[0] = opcode;
+	put_le16(mtu, key + 1);
+	memcpy(key + 3, pdu, length);
+
+	return length + 3;
+}
+
+static uint32_t rsp_cache_hash(const uint8_t *key, uint16_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--)
+		hash = (hash ^ *key++) * 16777619u;
+
+	return hash;
+}
+
+static void rsp_cache_lru_unlink(struct rsp_cache *cache,
+						struct rsp_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void rsp_cache_lru_push(struct rsp_cache *cache,
+						struct rsp_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+
+	cache->lru_head = entry;
+}
+
+/* Called with the cache lock held */
+static void rsp_cache_evict(struct rsp_cache *cache)
+{
+	struct rsp_cache_entry *entry = cache->lru_tail;
+	struct rsp_cache_entry **link;
+
+	link = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+	while (*link != entry)
+		link = &(*link)->next;
+
+	*link = entry->next;
+	rsp_cache_lru_unlink(cache, entry);
+	free(entry);
+
+	cache->num_entries--;
+	cache->evictions++;
+}
+
+/* Called with the cache lock held */
+static struct rsp_cache_entry *rsp_cache_lookup(struct rsp_cache *cache,
+						const uint8_t *key,
+						uint16_t key_len)
+{
+	struct rsp_cache_entry *entry;
+	uint32_t hash;
+
+	if (!cache->num_buckets)
+		return NULL;
+
+	hash = rsp_cache_hash(key, key_len);
+
+	for (entry = cache->buckets[hash & (cache->num_buckets - 1)]; entry;
+							entry = entry->next) {
+		if (entry->hash == hash && entry->key_len == key_len &&
+				!memcmp(entry->data, key, key_len))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * The response is only kept if the database did not change since the request
+ * was looked up, generation being what rsp_cache_reply() returned then.
+ */
+static void rsp_cache_store(struct rsp_cache *cache, unsigned int generation,
+					const uint8_t *key, uint16_t key_len,
+					uint8_t rsp_opcode,
+					const uint8_t *rsp, uint16_t rsp_len,
+					uint16_t ehandle, uint8_t ecode)
+{
+	struct rsp_cache_entry *entry;
+	unsigned int bucket;
+
+	if (!cache || !key_len || generation & 1)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+
+	rsp_cache_sync(cache);
+	if (cache->generation != generation || !cache->num_buckets)
+		goto done;
+
+	/* Another server sharing the cache may have answered it meanwhile */
+	if (rsp_cache_lookup(cache, key, key_len))
+		goto done;
+
+	while (cache->num_entries >= cache->max_entries)
+		rsp_cache_evict(cache);
+
+	entry = malloc(sizeof(*entry) + key_len + rsp_len);
+	if (!entry)
+		goto done;
+
+	entry->hash = rsp_cache_hash(key, key_len);
+	entry->rsp_opcode = rsp_opcode;
+	entry->ehandle = ehandle;
+	entry->ecode = ecode;
+	entry->key_len = key_len;
+	entry->rsp_len = rsp_len;
+	memcpy(entry->data, key, key_len);
+	if (rsp_len)
+		memcpy(entry->data + key_len, rsp, rsp_len);
+
+	bucket = entry->hash & (cache->num_buckets - 1);
+	entry->next = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+	rsp_cache_lru_push(cache, entry);
+	cache->num_entries++;
+
+done:
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void rsp_cache_store_error(struct rsp_cache *cache,
+					unsigned int generation,
+					const uint8_t *key, uint16_t key_len,
+					uint16_t ehandle, uint8_t ecode)
+{
+	/* Only "not found" depends on the database contents alone */
+	if (ecode != BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
+		return;
+
+	rsp_cache_store(cache, generation, key, key_len, BT_ATT_OP_ERROR_RSP,
+						NULL, 0, ehandle, ecode);
+}
+
+/*
+ * Sends the cached response to the request, if any. Otherwise generation is
+ * set to pass to rsp_cache_store() once the response is built: it is read
+ * before the request looks at the database.
+ */
+static bool rsp_cache_reply(struct bt_gatt_server *server, uint8_t opcode,
+					const uint8_t *key, uint16_t key_len,
+					unsigned int *generation)
+{
+	struct rsp_cache *cache = server->rsp_cache;
+	struct rsp_cache_entry *entry;
+	uint8_t rsp[bt_att_get_req_mtu(server->att)];
+	uint8_t rsp_opcode, ecode;
+	uint16_t rsp_len, ehandle;
+
+	*generation = 1;
+
+	if (!cache || !key_len)
+		return false;
+
+	pthread_mutex_lock(&cache->lock);
+
+	rsp_cache_sync(cache);
+	*generation = cache->generation;
+
+	entry = rsp_cache_lookup(cache, key, key_len);
+	if (!entry || entry->rsp_len > sizeof(rsp)) {
+		cache->misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return false;
+	}
+
+	cache->hits++;
+	rsp_cache_lru_unlink(cache, entry);
+	rsp_cache_lru_push(cache, entry);
+
+	/* Send a copy, the entry may be flushed as soon as the lock drops */
+	rsp_opcode = entry->rsp_opcode;
+	ehandle = entry->ehandle;
+	ecode = entry->ecode;
+	rsp_len = entry->rsp_len;
+	if (rsp_len)
+		memcpy(rsp, entry->data + entry->key_len, rsp_len);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	util_debug(server->debug_callback, server->debug_data,
+				"Cached response - opcode: 0x%02x", opcode);
+
+	if (rsp_opcode == BT_ATT_OP_ERROR_RSP)
+		bt_att_send_error_rsp(server->att, opcode, ehandle, ecode);
+	else
+		bt_att_send(server->att, rsp_opcode, rsp, rsp_len,
+							NULL, NULL, NULL);
+
+	return true;
+}
+
+static bool match_ccc_registry_db(const void *a, const void *b)
+{
+	const struct ccc_registry *reg = a;
+
+	return reg->db == b;
+}
+
+static uint16_t ccc_get(struct bt_gatt_server *server, unsigned int slot)
+{
+	unsigned int word = slot / CCC_SLOTS_PER_WORD;
+	unsigned int shift = (slot % CCC_SLOTS_PER_WORD) * 2;
+
+	if (word >= server->ccc_words)
+		return 0;
+
+	return (server->ccc_bits[word] >> shift) & 0x3;
+}
+
+static bool ccc_set(struct bt_gatt_server *server, unsigned int slot,
+							uint16_t value)
+{
+	unsigned int word = slot / CCC_SLOTS_PER_WORD;
+	unsigned int shift = (slot % CCC_SLOTS_PER_WORD) * 2;
+	uint32_t *bits;
+
+	if (word >= server->ccc_words) {
+		if (!value)
+			return true;
+
+		bits = realloc(server->ccc_bits, (word + 1) * sizeof(*bits));
+		if (!bits)
+			return false;
+
+		memset(bits + server->ccc_words, 0,
+				(word + 1 - server->ccc_words) * sizeof(*bits));
+		server->ccc_bits = bits;
+		server->ccc_words = word + 1;
+	}
+
+	server->ccc_bits[word] &= ~(0x3 << shift);
+	server->ccc_bits[word] |= (value & 0x3) << shift;
+
+	return true;
+}
+
+/* Index into reg->order of the first slot with value handle >= handle */
+static unsigned int ccc_lower(struct ccc_registry *reg, uint16_t handle)
+{
+	unsigned int lo = 0, hi = reg->num_order;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (reg->slots[reg->order[mid]].value_handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static struct ccc_slot *ccc_find_value(struct ccc_registry *reg,
+							uint16_t value_handle)
+{
+	unsigned int i = ccc_lower(reg, value_handle);
+
+	if (i == reg->num_order ||
+			reg->slots[reg->order[i]].value_handle != value_handle)
+		return NULL;
+
+	return &reg->slots[reg->order[i]];
+}
+
+/*
+ * The descriptor belongs to the closest characteristic before it, which is
+ * the one with the highest value handle below the descriptor.
+ */
+static struct ccc_slot *ccc_find(struct ccc_registry *reg,
+							uint16_t ccc_handle)
+{
+	unsigned int i = ccc_lower(reg, ccc_handle);
+
+	if (!i || reg->slots[reg->order[i - 1]].ccc_handle != ccc_handle)
+		return NULL;
+
+	return &reg->slots[reg->order[i - 1]];
+}
+
+static uint16_t ccc_value_handle(struct gatt_db *db, uint16_t ccc_handle)
+{
+	struct gatt_db_attribute *attr;
+	uint16_t handle, start, value_handle;
+
+	attr = gatt_db_get_attribute(db, ccc_handle);
+	if (!gatt_db_attribute_get_service_handles(attr, &start, NULL))
+		return 0;
+
+	for (handle = ccc_handle - 1; handle > start; handle--) {
+		attr = gatt_db_get_attribute(db, handle);
+		if (gatt_db_attribute_get_char_data(attr, NULL, &value_handle,
+							NULL, NULL, NULL))
+			return value_handle < ccc_handle ? value_handle : 0;
+	}
+
+	return 0;
+}
+
+static struct ccc_slot *ccc_slot_new(struct ccc_registry *reg,
+							uint16_t ccc_handle)
+{
+	struct ccc_slot *slot = NULL, *slots;
+	unsigned int *order;
+	uint16_t value_handle;
+	unsigned int i, n;
+
+	value_handle = ccc_value_handle(reg->db, ccc_handle);
+	if (!value_handle)
+		return NULL;
+
+	/* Servers hold bits for every slot, so unused ones are recycled */
+	for (i = 0; i < reg->num_slots; i++) {
+		if (!reg->slots[i].value_handle) {
+			slot = &reg->slots[i];
+			break;
+		}
+	}
+
+	if (!slot) {
+		slots = realloc(reg->slots, (reg->num_slots + 1) *
+							sizeof(*slots));
+		if (!slots)
+			return NULL;
+
+		reg->slots = slots;
+
+		order = realloc(reg->order, (reg->num_slots + 1) *
+							sizeof(*order));
+		if (!order)
+			return NULL;
+
+		reg->order = order;
+
+		i = reg->num_slots++;
+		slot = &reg->slots[i];
+		slot->subscribers = queue_new();
+	}
+
+	slot->value_handle = value_handle;
+	slot->ccc_handle = ccc_handle;
+
+	n = ccc_lower(reg, value_handle);
+	memmove(reg->order + n + 1, reg->order + n,
+				(reg->num_order - n) * sizeof(*reg->order));
+	reg->order[n] = i;
+	reg->num_order++;
+
+	return slot;
+}
+
+static void ccc_update(struct bt_gatt_server *server, uint16_t ccc_handle,
+							uint16_t value)
+{
+	struct ccc_registry *reg = server->ccc_registry;
+	struct ccc_slot *slot;
+	uint16_t value_handle;
+	unsigned int i;
+	uint16_t old;
+
+	if (!reg)
+		return;
+
+	pthread_mutex_lock(&reg->lock);
+
+	slot = ccc_find(reg, ccc_handle);
+	if (!slot) {
+		if (!value)
+			goto done;
+
+		slot = ccc_slot_new(reg, ccc_handle);
+		if (!slot)
+			goto done;
+	}
+
+	i = slot - reg->slots;
+	old = ccc_get(server, i);
+	value &= 0x3;
+
+	if (old == value || !ccc_set(server, i, value))
+		goto done;
+
+	if (!old)
+		queue_push_tail(slot->subscribers, server);
+	else if (!value)
+		queue_remove(slot->subscribers, server);
+
+	value_handle = slot->value_handle;
+
+	pthread_mutex_unlock(&reg->lock);
+
+	util_debug(server->debug_callback, server->debug_data,
+				"CCC 0x%04x for 0x%04x set to 0x%04x",
+				ccc_handle, value_handle, value);
+	return;
+
+done:
+	pthread_mutex_unlock(&reg->lock);
+}
+
+static void ccc_clear(void *data, void *user_data)
+{
+	struct bt_gatt_server *server = data;
+	struct ccc_slot *slot = user_data;
+
+	ccc_set(server, slot - server->ccc_registry->slots, 0);
+}
+
+/* Called with the registry lock held */
+static bool ccc_slot_stale(struct ccc_registry *reg, struct ccc_slot *slot)
+{
+	struct gatt_db_attribute *attr;
+
+	attr = gatt_db_get_attribute(reg->db, slot->ccc_handle);
+	if (!attr || bt_uuid_cmp(gatt_db_attribute_get_type(attr), &ccc_uuid))
+		return true;
+
+	return ccc_value_handle(reg->db, slot->ccc_handle) !=
+							slot->value_handle;
+}
+
+/*
+ * Forgets subscriptions to the CCCs between start and end, all of them or
+ * only those no longer matching the database.
+ */
+static void ccc_registry_release(struct ccc_registry *reg, uint16_t start,
+						uint16_t end, bool stale_only)
+{
+	unsigned int i, n;
+
+	pthread_mutex_lock(&reg->lock);
+
+	for (i = 0, n = 0; i < reg->num_order; i++) {
+		struct ccc_slot *slot = &reg->slots[reg->order[i]];
+
+		if (slot->ccc_handle < start || slot->ccc_handle > end ||
+				(stale_only && !ccc_slot_stale(reg, slot))) {
+			reg->order[n++] = reg->order[i];
+			continue;
+		}
+
+		queue_foreach(slot->subscribers, ccc_clear, slot);
+		queue_remove_all(slot->subscribers, NULL, NULL, NULL);
+		slot->value_handle = 0;
+		slot->ccc_handle = 0;
+	}
+
+	reg->num_order = n;
+
+	pthread_mutex_unlock(&reg->lock);
+}
+
+static void ccc_registry_service_added(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	uint16_t start, end;
+
+	if (!gatt_db_attribute_get_service_handles(attrib, &start, &end))
+		return;
+
+	/*
+	 * A service hidden and then removed is not notified, so whatever else
+	 * now sits at its handles must not inherit its subscriptions.
+	 */
+	ccc_registry_release(user_data, start, end, true);
+}
+
+static void ccc_registry_service_removed(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	struct ccc_registry *reg = user_data;
+	uint16_t start, end;
+
+	if (!gatt_db_attribute_get_service_handles(attrib, &start, &end))
+		return;
+
+	/* Only hidden, the clients stay subscribed for when it comes back */
+	if (gatt_db_get_attribute(reg->db, start) == attrib)
+		return;
+
+	ccc_registry_release(reg, start, end, false);
+}
+
+static void ccc_registry_free(void *data)
+{
+	struct ccc_registry *reg = data;
+	unsigned int i;
+
+	pthread_mutex_lock(&ccc_registries_lock);
+
+	queue_remove(ccc_registries, reg);
+	if (queue_isempty(ccc_registries)) {
+		queue_destroy(ccc_registries, NULL);
+		ccc_registries = NULL;
+	}
+
+	pthread_mutex_unlock(&ccc_registries_lock);
+
+	for (i = 0; i < reg->num_slots; i++)
+		queue_destroy(reg->slots[i].subscribers, NULL);
+
+	pthread_mutex_destroy(&reg->lock);
+	free(reg->slots);
+	free(reg->order);
+	free(reg);
+}
+
+/* Shared like the response cache, and kept for as long as the database */
+static struct ccc_registry *ccc_registry_get(struct gatt_db *db)
+{
+	struct ccc_registry *reg;
+
+	pthread_mutex_lock(&ccc_registries_lock);
+
+	reg = queue_find(ccc_registries, match_ccc_registry_db, db);
+	if (reg) {
+		pthread_mutex_unlock(&ccc_registries_lock);
+		return reg;
+	}
+
+	reg = new0(struct ccc_registry, 1);
+	reg->db = db;
+	pthread_mutex_init(&reg->lock, NULL);
+
+	if (!ccc_registries)
+		ccc_registries = queue_new();
+
+	queue_push_tail(ccc_registries, reg);
+
+	pthread_mutex_unlock(&ccc_registries_lock);
+
+	if (!gatt_db_register(db, ccc_registry_service_added,
+					ccc_registry_service_removed, reg,
+					ccc_registry_free)) {
+		ccc_registry_free(reg);
+		return NULL;
+	}
+
+	return reg;
+}
 
-	struct queue *prep_queue;
-	unsigned int max_prep_queue_len;
+static void ccc_registry_remove(struct bt_gatt_server *server)
+{
+	struct ccc_registry *reg = server->ccc_registry;
+	unsigned int i;
 
-	struct async_read_op *pending_read_op;
-	struct async_write_op *pending_write_op;
+	if (!reg)
+		return;
 
-	bt_gatt_server_debug_func_t debug_callback;
-	bt_gatt_server_destroy_func_t debug_destroy;
-	void *debug_data;
-};
+	pthread_mutex_lock(&reg->lock);
+
+	for (i = 0; i < reg->num_slots; i++) {
+		if (ccc_get(server, i))
+			queue_remove(reg->slots[i].subscribers, server);
+	}
+
+	pthread_mutex_unlock(&reg->lock);
+
+	free(server->ccc_bits);
+}
 
 static void bt_gatt_server_free(struct bt_gatt_server *server)
 {
@@ -128,9 +981,11 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 	bt_att_unregister(server->att, server->find_by_type_value_id);
 	bt_att_unregister(server->att, server->write_id);
 	bt_att_unregister(server->att, server->write_cmd_id);
+	bt_att_unregister(server->att, server->signed_write_id);
 	bt_att_unregister(server->att, server->read_id);
 	bt_att_unregister(server->att, server->read_blob_id);
 	bt_att_unregister(server->att, server->read_multiple_id);
+	bt_att_unregister(server->att, server->read_multiple_vl_id);
 	bt_att_unregister(server->att, server->prep_write_id);
 	bt_att_unregister(server->att, server->exec_write_id);
 
@@ -141,6 +996,9 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 		server->pending_write_op->server = NULL;
 
 	queue_destroy(server->prep_queue, prep_write_data_destroy);
+	free(server->prep_buf);
+
+	ccc_registry_remove(server);
 
 	gatt_db_unref(server->db);
 	bt_att_unref(server->att);
@@ -243,18 +1101,25 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 	uint16_t start, end;
 	bt_uuid_t type;
 	bt_uuid_t prim, snd;
-	uint16_t mtu = bt_att_get_mtu(server->att);
+	uint16_t mtu = bt_att_get_req_mtu(server->att);
 	uint8_t rsp_pdu[mtu];
 	uint16_t rsp_len;
 	uint8_t ecode = 0;
 	uint16_t ehandle = 0;
 	struct queue *q = NULL;
+	uint8_t key[RSP_CACHE_MAX_KEY];
+	uint16_t key_len;
+	unsigned int generation;
 
 	if (length != 6 && length != 20) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
+	key_len = rsp_cache_key(key, opcode, mtu, pdu, length);
+	if (rsp_cache_reply(server, opcode, key, key_len, &generation))
+		return;
+
 	q = queue_new();
 
 	start = get_le16(pdu);
@@ -294,6 +1159,8 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		rsp_cache_store_error(server->rsp_cache, generation, key,
+						key_len, ehandle, ecode);
 		goto error;
 	}
 
@@ -305,6 +1172,10 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 
 	queue_destroy(q, NULL);
 
+	rsp_cache_store(server->rsp_cache, generation, key, key_len,
+					BT_ATT_OP_READ_BY_GRP_TYPE_RSP,
+					rsp_pdu, rsp_len, 0, 0);
+
 	bt_att_send(server->att, BT_ATT_OP_READ_BY_GRP_TYPE_RSP,
 							rsp_pdu, rsp_len,
 							NULL, NULL, NULL);
@@ -321,6 +1192,7 @@ static void async_read_op_destroy(struct async_read_op *op)
 	if (op->server)
 		op->server->pending_read_op = NULL;
 
+	op_db_release(op->db);
 	queue_destroy(op->db_data, NULL);
 	free(op->pdu);
 	free(op);
@@ -342,7 +1214,7 @@ static void read_by_type_read_complete_cb(struct gatt_db_attribute *attr,
 		return;
 	}
 
-	mtu = bt_att_get_mtu(server->att);
+	mtu = bt_att_get_req_mtu(server->att);
 	handle = gatt_db_attribute_get_handle(attr);
 
 	/* Terminate the operation if there was an error */
@@ -448,6 +1320,10 @@ static void process_read_by_type(struct async_read_op *op)
 	attr = queue_pop_head(op->db_data);
 
 	if (op->done || !attr) {
+		rsp_cache_store(server->rsp_cache, op->cache_gen,
+					op->cache_key, op->cache_key_len,
+					BT_ATT_OP_READ_BY_TYPE_RSP, op->pdu,
+					op->pdu_len, 0, 0);
 		bt_att_send(server->att, BT_ATT_OP_READ_BY_TYPE_RSP, op->pdu,
 								op->pdu_len,
 								NULL, NULL,
@@ -474,6 +1350,19 @@ error:
 	async_read_op_destroy(op);
 }
 
+static bool is_declaration_type(const bt_uuid_t *type)
+{
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+	if (!bt_uuid_cmp(type, &uuid))
+		return true;
+
+	bt_uuid16_create(&uuid, GATT_INCLUDE_UUID);
+
+	return !bt_uuid_cmp(type, &uuid);
+}
+
 static void read_by_type_cb(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
@@ -484,12 +1373,20 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 	uint8_t ecode;
 	struct queue *q = NULL;
 	struct async_read_op *op;
+	uint8_t key[RSP_CACHE_MAX_KEY];
+	uint16_t key_len;
+	unsigned int generation;
 
 	if (length != 6 && length != 20) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
+	key_len = rsp_cache_key(key, opcode, bt_att_get_req_mtu(server->att),
+								pdu, length);
+	if (rsp_cache_reply(server, opcode, key, key_len, &generation))
+		return;
+
 	q = queue_new();
 
 	start = get_le16(pdu);
@@ -516,6 +1413,8 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		rsp_cache_store_error(server->rsp_cache, generation, key,
+						key_len, ehandle, ecode);
 		goto error;
 	}
 
@@ -525,7 +1424,7 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 	}
 
 	op = new0(struct async_read_op, 1);
-	op->pdu = malloc(bt_att_get_mtu(server->att));
+	op->pdu = malloc(bt_att_get_req_mtu(server->att));
 	if (!op->pdu) {
 		free(op);
 		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
@@ -534,9 +1433,22 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 
 	op->opcode = opcode;
 	op->server = server;
+	op->db = op_db_hold(server->db);
 	op->db_data = q;
 	server->pending_read_op = op;
 
+	/*
+	 * Only declarations are safe to cache: their values live in the
+	 * database and they carry no security requirements, so the response
+	 * is the same for every client. Anything else may be backed by a read
+	 * callback or be subject to the permission checks of this bearer.
+	 */
+	if (is_declaration_type(&type)) {
+		memcpy(op->cache_key, key, key_len);
+		op->cache_key_len = key_len;
+		op->cache_gen = generation;
+	}
+
 	process_read_by_type(op);
 
 	return;
@@ -605,18 +1517,25 @@ static void find_info_cb(uint8_t opcode, const void *pdu,
 {
 	struct bt_gatt_server *server = user_data;
 	uint16_t start, end;
-	uint16_t mtu = bt_att_get_mtu(server->att);
+	uint16_t mtu = bt_att_get_req_mtu(server->att);
 	uint8_t rsp_pdu[mtu];
 	uint16_t rsp_len;
 	uint8_t ecode = 0;
 	uint16_t ehandle = 0;
 	struct queue *q = NULL;
+	uint8_t key[RSP_CACHE_MAX_KEY];
+	uint16_t key_len;
+	unsigned int generation;
 
 	if (length != 4) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
+	key_len = rsp_cache_key(key, opcode, mtu, pdu, length);
+	if (rsp_cache_reply(server, opcode, key, key_len, &generation))
+		return;
+
 	q = queue_new();
 
 	start = get_le16(pdu);
@@ -642,6 +1561,8 @@ static void find_info_cb(uint8_t opcode, const void *pdu,
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		rsp_cache_store_error(server->rsp_cache, generation, key,
+						key_len, ehandle, ecode);
 		goto error;
 	}
 
@@ -650,6 +1571,10 @@ static void find_info_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
+	rsp_cache_store(server->rsp_cache, generation, key, key_len,
+					BT_ATT_OP_FIND_INFO_RSP, rsp_pdu,
+					rsp_len, 0, 0);
+
 	bt_att_send(server->att, BT_ATT_OP_FIND_INFO_RSP, rsp_pdu, rsp_len,
 							NULL, NULL, NULL);
 	queue_destroy(q, NULL);
@@ -705,16 +1630,24 @@ static void find_by_type_val_cb(uint8_t opcode, const void *pdu,
 	struct bt_gatt_server *server = user_data;
 	uint16_t start, end, uuid16;
 	struct find_by_type_val_data data;
-	uint16_t mtu = bt_att_get_mtu(server->att);
+	uint16_t mtu = bt_att_get_req_mtu(server->att);
 	uint8_t rsp_pdu[mtu];
 	uint16_t ehandle = 0;
 	bt_uuid_t uuid;
+	uint8_t key[RSP_CACHE_MAX_KEY];
+	uint16_t key_len;
+	unsigned int generation;
 
 	if (length < 6) {
 		data.ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
+	/* Requests with values longer than a 128-bit UUID are not cached */
+	key_len = rsp_cache_key(key, opcode, mtu, pdu, length);
+	if (rsp_cache_reply(server, opcode, key, key_len, &generation))
+		return;
+
 	data.pdu = rsp_pdu;
 	data.len = 0;
 	data.mtu = mtu;
@@ -739,12 +1672,19 @@ static void find_by_type_val_cb(uint8_t opcode, const void *pdu,
 							find_by_type_val_att_cb,
 							&data);
 
-	if (!data.len)
+	if (!data.len) {
 		data.ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		rsp_cache_store_error(server->rsp_cache, generation, key,
+						key_len, ehandle, data.ecode);
+	}
 
 	if (data.ecode)
 		goto error;
 
+	rsp_cache_store(server->rsp_cache, generation, key, key_len,
+					BT_ATT_OP_FIND_BY_TYPE_RSP, data.pdu,
+					data.len, 0, 0);
+
 	bt_att_send(server->att, BT_ATT_OP_FIND_BY_TYPE_RSP, data.pdu,
 						data.len, NULL, NULL, NULL);
 
@@ -759,6 +1699,7 @@ static void async_write_op_destroy(struct async_write_op *op)
 	if (op->server)
 		op->server->pending_write_op = NULL;
 
+	op_db_release(op->db);
 	free(op);
 }
 
@@ -769,13 +1710,21 @@ static void write_complete_cb(struct gatt_db_attribute *attr, int err,
 	struct bt_gatt_server *server = op->server;
 	uint16_t handle;
 
-	if (!server || op->opcode == BT_ATT_OP_WRITE_CMD) {
+	if (!server) {
 		async_write_op_destroy(op);
 		return;
 	}
 
 	handle = gatt_db_attribute_get_handle(attr);
 
+	if (!err && op->ccc)
+		ccc_update(server, handle, op->ccc_value);
+
+	if (op->opcode != BT_ATT_OP_WRITE_REQ) {
+		async_write_op_destroy(op);
+		return;
+	}
+
 	if (err)
 		bt_att_send_error_rsp(server->att, op->opcode, handle, err);
 	else
@@ -824,9 +1773,16 @@ static void write_cb(uint8_t opcode, const void *pdu,
 
 	op = new0(struct async_write_op, 1);
 	op->server = server;
+	op->db = op_db_hold(server->db);
 	op->opcode = opcode;
 	server->pending_write_op = op;
 
+	if (length == 4 && !bt_uuid_cmp(gatt_db_attribute_get_type(attr),
+								&ccc_uuid)) {
+		op->ccc = true;
+		op->ccc_value = get_le16(pdu + 2);
+	}
+
 	if (gatt_db_attribute_write(attr, 0, pdu + 2, length - 2, opcode,
 							server->att,
 							write_complete_cb, op))
@@ -837,7 +1793,7 @@ static void write_cb(uint8_t opcode, const void *pdu,
 	ecode = BT_ATT_ERROR_UNLIKELY;
 
 error:
-	if (opcode == BT_ATT_OP_WRITE_CMD)
+	if (opcode != BT_ATT_OP_WRITE_REQ)
 		return;
 
 	bt_att_send_error_rsp(server->att, opcode, handle, ecode);
@@ -881,7 +1837,7 @@ static void read_complete_cb(struct gatt_db_attribute *attr, int err,
 		return;
 	}
 
-	mtu = bt_att_get_mtu(server->att);
+	mtu = bt_att_get_req_mtu(server->att);
 	handle = gatt_db_attribute_get_handle(attr);
 
 	if (err) {
@@ -931,6 +1887,7 @@ static void handle_read_req(struct bt_gatt_server *server, uint8_t opcode,
 	op = new0(struct async_read_op, 1);
 	op->opcode = opcode;
 	op->server = server;
+	op->db = op_db_hold(server->db);
 	server->pending_read_op = op;
 
 	if (gatt_db_attribute_read(attr, offset, opcode, server->att,
@@ -983,6 +1940,8 @@ static void read_blob_cb(uint8_t opcode, const void *pdu,
 
 struct read_multiple_resp_data {
 	struct bt_gatt_server *server;
+	struct gatt_db *db;
+	uint8_t opcode;
 	uint16_t *handles;
 	size_t cur_handle;
 	size_t num_handles;
@@ -993,11 +1952,29 @@ struct read_multiple_resp_data {
 
 static void read_multiple_resp_data_free(struct read_multiple_resp_data *data)
 {
+	op_db_release(data->db);
 	free(data->handles);
 	free(data->rsp_data);
 	free(data);
 }
 
+static uint8_t get_read_multiple_rsp_opcode(uint8_t opcode)
+{
+	if (opcode == BT_ATT_OP_READ_MULT_VL_REQ)
+		return BT_ATT_OP_READ_MULT_VL_RSP;
+
+	return BT_ATT_OP_READ_MULT_RSP;
+}
+
+/* Space the next value needs to make it into the response at all */
+static size_t rsp_min_entry_len(uint8_t opcode)
+{
+	if (opcode == BT_ATT_OP_READ_MULT_VL_REQ)
+		return 2;
+
+	return 1;
+}
+
 static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 					const uint8_t *value, size_t len,
 					void *user_data)
@@ -1009,7 +1986,7 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 
 	if (err != 0) {
 		bt_att_send_error_rsp(data->server->att,
-					BT_ATT_OP_READ_MULT_REQ, handle, err);
+					data->opcode, handle, err);
 		read_multiple_resp_data_free(data);
 		return;
 	}
@@ -1019,11 +1996,17 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 						BT_ATT_PERM_READ_ENCRYPT);
 	if (ecode) {
 		bt_att_send_error_rsp(data->server->att,
-					BT_ATT_OP_READ_MULT_REQ, handle, ecode);
+					data->opcode, handle, ecode);
 		read_multiple_resp_data_free(data);
 		return;
 	}
 
+	/* Variable length values are prefixed with their full length */
+	if (data->opcode == BT_ATT_OP_READ_MULT_VL_REQ) {
+		put_le16(len, data->rsp_data + data->length);
+		data->length += 2;
+	}
+
 	len = MIN(len, data->mtu - data->length - 1);
 
 	memcpy(data->rsp_data + data->length, value, len);
@@ -1031,9 +2014,10 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 
 	data->cur_handle++;
 
-	if ((data->length >= data->mtu - 1) ||
+	if ((data->length + rsp_min_entry_len(data->opcode) > data->mtu - 1) ||
 				(data->cur_handle == data->num_handles)) {
-		bt_att_send(data->server->att, BT_ATT_OP_READ_MULT_RSP,
+		bt_att_send(data->server->att, get_read_multiple_rsp_opcode(
+								data->opcode),
 				data->rsp_data, data->length, NULL, NULL, NULL);
 		read_multiple_resp_data_free(data);
 		return;
@@ -1049,18 +2033,18 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 
 	if (!next_attr) {
 		bt_att_send_error_rsp(data->server->att,
-					BT_ATT_OP_READ_MULT_REQ,
+					data->opcode,
 					data->handles[data->cur_handle],
 					BT_ATT_ERROR_INVALID_HANDLE);
 		read_multiple_resp_data_free(data);
 		return;
 	}
 
-	if (!gatt_db_attribute_read(next_attr, 0, BT_ATT_OP_READ_MULT_REQ,
+	if (!gatt_db_attribute_read(next_attr, 0, data->opcode,
 					data->server->att,
 					read_multiple_complete_cb, data)) {
 		bt_att_send_error_rsp(data->server->att,
-						BT_ATT_OP_READ_MULT_REQ,
+						data->opcode,
 						data->handles[data->cur_handle],
 						BT_ATT_ERROR_UNLIKELY);
 		read_multiple_resp_data_free(data);
@@ -1085,9 +2069,11 @@ static void read_multiple_cb(uint8_t opcode, const void *pdu,
 	data->handles = NULL;
 	data->rsp_data = NULL;
 	data->server = server;
+	data->db = op_db_hold(server->db);
+	data->opcode = opcode;
 	data->num_handles = length / 2;
 	data->cur_handle = 0;
-	data->mtu = bt_att_get_mtu(server->att);
+	data->mtu = bt_att_get_req_mtu(server->att);
 	data->length = 0;
 	data->rsp_data = malloc(data->mtu - 1);
 
@@ -1121,27 +2107,31 @@ error:
 	bt_att_send_error_rsp(server->att, opcode, 0, ecode);
 }
 
-static bool append_prep_data(struct prep_write_data *prep_data, uint16_t handle,
-					uint16_t length, uint8_t *value)
+static void clear_prep_queue(struct bt_gatt_server *server)
 {
-	uint8_t *val;
-	uint16_t len;
-
-	if (!length)
-		return true;
+	queue_remove_all(server->prep_queue, NULL, NULL,
+						prep_write_data_destroy);
+	server->prep_buf_used = 0;
+}
 
-	len = prep_data->length + length;
+static uint8_t *alloc_prep_data(struct bt_gatt_server *server,
+							uint16_t length)
+{
+	uint8_t *data;
 
-	val = realloc(prep_data->value, len);
-	if (!val)
-		return false;
+	if (server->prep_buf_used + length > server->prep_buf_size)
+		return NULL;
 
-	memcpy(val + prep_data->length, value, length);
+	if (!server->prep_buf) {
+		server->prep_buf = malloc(server->prep_buf_size);
+		if (!server->prep_buf)
+			return NULL;
+	}
 
-	prep_data->value = val;
-	prep_data->length = len;
+	data = server->prep_buf + server->prep_buf_used;
+	server->prep_buf_used += length;
 
-	return true;
+	return data;
 }
 
 static bool is_reliable_write_supported(const struct bt_gatt_server  *server,
@@ -1166,14 +2156,17 @@ static bool prep_data_new(struct bt_gatt_server *server,
 					uint16_t length, uint8_t *value)
 {
 	struct prep_write_data *prep_data;
+	uint8_t *data;
 
-	prep_data = new0(struct prep_write_data, 1);
-
-	if (!append_prep_data(prep_data, handle, length, value)) {
-		prep_write_data_destroy(prep_data);
+	data = alloc_prep_data(server, length);
+	if (!data)
 		return false;
-	}
 
+	memcpy(data, value, length);
+
+	prep_data = new0(struct prep_write_data, 1);
+	prep_data->value = data;
+	prep_data->length = length;
 	prep_data->server = server;
 	prep_data->handle = handle;
 	prep_data->offset = offset;
@@ -1195,25 +2188,44 @@ static bool store_prep_data(struct bt_gatt_server *server,
 					uint16_t length, uint8_t *value)
 {
 	struct prep_write_data *prep_data = NULL;
+	uint8_t *data;
 
 	/*
 	 * Now lets check if prep write is a continuation of long write
-	 * If so do aggregation of data
+	 * If so do aggregation of data. The last entry always ends where
+	 * the free part of prep_buf starts, so it just grows in place.
 	 */
 	prep_data = queue_peek_tail(server->prep_queue);
-	if (prep_data && (prep_data->handle == handle) &&
-			(offset == (prep_data->length + prep_data->offset)))
-		return append_prep_data(prep_data, handle, length, value);
+	if (!prep_data || prep_data->handle != handle ||
+			offset != prep_data->length + prep_data->offset ||
+			prep_data->length + length > UINT16_MAX)
+		return prep_data_new(server, handle, offset, length, value);
+
+	data = alloc_prep_data(server, length);
+	if (!data)
+		return false;
+
+	memcpy(data, value, length);
+	prep_data->length += length;
 
-	return prep_data_new(server, handle, offset, length, value);
+	return true;
 }
 
 struct prep_write_complete_data {
 	void *pdu;
 	uint16_t length;
 	struct bt_gatt_server *server;
+	struct gatt_db *db;
 };
 
+static void prep_write_complete_data_free(
+					struct prep_write_complete_data *pwcd)
+{
+	op_db_release(pwcd->db);
+	free(pwcd->pdu);
+	free(pwcd);
+}
+
 static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 								void *user_data)
 {
@@ -1226,8 +2238,7 @@ static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 	if (err) {
 		bt_att_send_error_rsp(pwcd->server->att,
 					BT_ATT_OP_PREP_WRITE_REQ, handle, err);
-		free(pwcd->pdu);
-		free(pwcd);
+		prep_write_complete_data_free(pwcd);
 
 		return;
 	}
@@ -1237,14 +2248,14 @@ static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 	if (!store_prep_data(pwcd->server, handle, offset, pwcd->length - 4,
 						&((uint8_t *) pwcd->pdu)[4]))
 		bt_att_send_error_rsp(pwcd->server->att,
-					BT_ATT_OP_PREP_WRITE_RSP, handle,
-					BT_ATT_ERROR_INSUFFICIENT_RESOURCES);
-
-	bt_att_send(pwcd->server->att, BT_ATT_OP_PREP_WRITE_RSP, pwcd->pdu,
-						pwcd->length, NULL, NULL, NULL);
+					BT_ATT_OP_PREP_WRITE_REQ, handle,
+					BT_ATT_ERROR_PREPARE_QUEUE_FULL);
+	else
+		bt_att_send(pwcd->server->att, BT_ATT_OP_PREP_WRITE_RSP,
+					pwcd->pdu, pwcd->length, NULL, NULL,
+					NULL);
 
-	free(pwcd->pdu);
-	free(pwcd);
+	prep_write_complete_data_free(pwcd);
 }
 
 static void prep_write_cb(uint8_t opcode, const void *pdu,
@@ -1262,7 +2273,9 @@ static void prep_write_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
-	if (queue_length(server->prep_queue) >= server->max_prep_queue_len) {
+	if (queue_length(server->prep_queue) >= server->max_prep_queue_len ||
+			server->prep_buf_used + length - 4 >
+						server->prep_buf_size) {
 		ecode = BT_ATT_ERROR_PREPARE_QUEUE_FULL;
 		goto error;
 	}
@@ -1290,6 +2303,7 @@ static void prep_write_cb(uint8_t opcode, const void *pdu,
 	memcpy(pwcd->pdu, pdu, length);
 	pwcd->length = length;
 	pwcd->server = server;
+	pwcd->db = op_db_hold(server->db);
 
 	status = gatt_db_attribute_write(attr, offset, NULL, 0,
 						BT_ATT_OP_PREP_WRITE_REQ,
@@ -1299,6 +2313,8 @@ static void prep_write_cb(uint8_t opcode, const void *pdu,
 	if (status)
 		return;
 
+	prep_write_complete_data_free(pwcd);
+
 	ecode = BT_ATT_ERROR_UNLIKELY;
 
 error:
@@ -1314,7 +2330,13 @@ static void exec_write_complete_cb(struct gatt_db_attribute *attr, int err,
 	struct bt_gatt_server *server = user_data;
 	uint16_t handle = gatt_db_attribute_get_handle(attr);
 
+	if (!err && server->exec_ccc)
+		ccc_update(server, handle, server->exec_ccc_value);
+
 	exec_next_prep_write(server, handle, err);
+
+	/* Taken when the write was started */
+	gatt_db_read_end(server->db);
 }
 
 static void exec_next_prep_write(struct bt_gatt_server *server,
@@ -1329,6 +2351,7 @@ static void exec_next_prep_write(struct bt_gatt_server *server,
 
 	next = queue_pop_head(server->prep_queue);
 	if (!next) {
+		server->prep_buf_used = 0;
 		bt_att_send(server->att, BT_ATT_OP_EXEC_WRITE_RSP, NULL, 0,
 							NULL, NULL, NULL);
 		return;
@@ -1340,6 +2363,15 @@ static void exec_next_prep_write(struct bt_gatt_server *server,
 		goto error;
 	}
 
+	/* A CCC written whole is recorded as for a Write Request */
+	server->exec_ccc = !next->offset && next->length == 2 &&
+				!bt_uuid_cmp(gatt_db_attribute_get_type(attr),
+								&ccc_uuid);
+	if (server->exec_ccc)
+		server->exec_ccc_value = get_le16(next->value);
+
+	gatt_db_read_begin(server->db);
+
 	status = gatt_db_attribute_write(attr, next->offset,
 						next->value, next->length,
 						BT_ATT_OP_EXEC_WRITE_REQ,
@@ -1351,11 +2383,12 @@ static void exec_next_prep_write(struct bt_gatt_server *server,
 	if (status)
 		return;
 
+	gatt_db_read_end(server->db);
+
 	err = BT_ATT_ERROR_UNLIKELY;
 
 error:
-	queue_remove_all(server->prep_queue, NULL, NULL,
-						prep_write_data_destroy);
+	clear_prep_queue(server);
 
 	bt_att_send_error_rsp(server->att, BT_ATT_OP_EXEC_WRITE_REQ,
 								ehandle, err);
@@ -1398,8 +2431,7 @@ static void exec_write_cb(uint8_t opcode, const void *pdu,
 	}
 
 	if (!write) {
-		queue_remove_all(server->prep_queue, NULL, NULL,
-						prep_write_data_destroy);
+		clear_prep_queue(server);
 		bt_att_send(server->att, BT_ATT_OP_EXEC_WRITE_RSP, NULL, 0,
 							NULL, NULL, NULL);
 		return;
@@ -1423,8 +2455,7 @@ static void exec_write_cb(uint8_t opcode, const void *pdu,
 	return;
 
 error:
-	queue_remove_all(server->prep_queue, NULL, NULL,
-						prep_write_data_destroy);
+	clear_prep_queue(server);
 	bt_att_send_error_rsp(server->att, opcode, ehandle, ecode);
 }
 
@@ -1458,97 +2489,141 @@ static void exchange_mtu_cb(uint8_t opcode, const void *pdu,
 			"MTU exchange complete, with MTU: %u", final_mtu);
 }
 
+struct server_handler {
+	struct bt_gatt_server *server;
+	bt_att_notify_func_t func;
+};
+
+/*
+ * Each request runs as a database reader, so the attributes it finds stay
+ * valid even if another thread removes their service meanwhile.
+ */
+static void server_handler_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct server_handler *handler = user_data;
+	struct gatt_db *db = gatt_db_ref(handler->server->db);
+
+	gatt_db_read_begin(db);
+	handler->func(opcode, pdu, length, handler->server);
+	gatt_db_read_end(db);
+
+	gatt_db_unref(db);
+}
+
+static unsigned int server_register(struct bt_gatt_server *server,
+						uint8_t opcode,
+						bt_att_notify_func_t func)
+{
+	struct server_handler *handler;
+	unsigned int id;
+
+	handler = new0(struct server_handler, 1);
+	handler->server = server;
+	handler->func = func;
+
+	id = bt_att_register(server->att, opcode, server_handler_cb, handler,
+									free);
+	if (!id)
+		free(handler);
+
+	return id;
+}
+
 static bool gatt_server_register_att_handlers(struct bt_gatt_server *server)
 {
 	/* Exchange MTU */
-	server->mtu_id = bt_att_register(server->att, BT_ATT_OP_MTU_REQ,
-								exchange_mtu_cb,
-								server, NULL);
+	server->mtu_id = server_register(server, BT_ATT_OP_MTU_REQ,
+							exchange_mtu_cb);
 	if (!server->mtu_id)
 		return false;
 
 	/* Read By Group Type */
-	server->read_by_grp_type_id = bt_att_register(server->att,
+	server->read_by_grp_type_id = server_register(server,
 						BT_ATT_OP_READ_BY_GRP_TYPE_REQ,
-						read_by_grp_type_cb,
-						server, NULL);
+						read_by_grp_type_cb);
 	if (!server->read_by_grp_type_id)
 		return false;
 
 	/* Read By Type */
-	server->read_by_type_id = bt_att_register(server->att,
+	server->read_by_type_id = server_register(server,
 						BT_ATT_OP_READ_BY_TYPE_REQ,
-						read_by_type_cb,
-						server, NULL);
+						read_by_type_cb);
 	if (!server->read_by_type_id)
 		return false;
 
 	/* Find Information */
-	server->find_info_id = bt_att_register(server->att,
-							BT_ATT_OP_FIND_INFO_REQ,
-							find_info_cb,
-							server, NULL);
+	server->find_info_id = server_register(server, BT_ATT_OP_FIND_INFO_REQ,
+							find_info_cb);
 	if (!server->find_info_id)
 		return false;
 
 	/* Find By Type Value */
-	server->find_by_type_value_id = bt_att_register(server->att,
+	server->find_by_type_value_id = server_register(server,
 						BT_ATT_OP_FIND_BY_TYPE_REQ,
-						find_by_type_val_cb,
-						server, NULL);
+						find_by_type_val_cb);
 
 	if (!server->find_by_type_value_id)
 		return false;
 
 	/* Write Request */
-	server->write_id = bt_att_register(server->att, BT_ATT_OP_WRITE_REQ,
-								write_cb,
-								server, NULL);
+	server->write_id = server_register(server, BT_ATT_OP_WRITE_REQ,
+							write_cb);
 	if (!server->write_id)
 		return false;
 
 	/* Write Command */
-	server->write_cmd_id = bt_att_register(server->att, BT_ATT_OP_WRITE_CMD,
-								write_cb,
-								server, NULL);
+	server->write_cmd_id = server_register(server, BT_ATT_OP_WRITE_CMD,
+							write_cb);
 	if (!server->write_cmd_id)
 		return false;
 
+	/* Signed Write Command, its signature is checked by att */
+	server->signed_write_id = server_register(server,
+						BT_ATT_OP_SIGNED_WRITE_CMD,
+						write_cb);
+	if (!server->signed_write_id)
+		return false;
+
 	/* Read Request */
-	server->read_id = bt_att_register(server->att, BT_ATT_OP_READ_REQ,
-								read_cb,
-								server, NULL);
+	server->read_id = server_register(server, BT_ATT_OP_READ_REQ,
+							read_cb);
 	if (!server->read_id)
 		return false;
 
 	/* Read Blob Request */
-	server->read_blob_id = bt_att_register(server->att,
-							BT_ATT_OP_READ_BLOB_REQ,
-							read_blob_cb,
-							server, NULL);
+	server->read_blob_id = server_register(server, BT_ATT_OP_READ_BLOB_REQ,
+							read_blob_cb);
 	if (!server->read_blob_id)
 		return false;
 
 	/* Read Multiple Request */
-	server->read_multiple_id = bt_att_register(server->att,
-							BT_ATT_OP_READ_MULT_REQ,
-							read_multiple_cb,
-							server, NULL);
+	server->read_multiple_id = server_register(server,
+						BT_ATT_OP_READ_MULT_REQ,
+						read_multiple_cb);
 
 	if (!server->read_multiple_id)
 		return false;
 
+	/* Read Multiple Variable Length Request */
+	server->read_multiple_vl_id = server_register(server,
+						BT_ATT_OP_READ_MULT_VL_REQ,
+						read_multiple_cb);
+
+	if (!server->read_multiple_vl_id)
+		return false;
+
 	/* Prepare Write Request */
-	server->prep_write_id = bt_att_register(server->att,
+	server->prep_write_id = server_register(server,
 						BT_ATT_OP_PREP_WRITE_REQ,
-						prep_write_cb, server, NULL);
+						prep_write_cb);
 	if (!server->prep_write_id)
 		return false;
 
 	/* Execute Write Request */
-	server->exec_write_id = bt_att_register(server->att,
+	server->exec_write_id = server_register(server,
 						BT_ATT_OP_EXEC_WRITE_REQ,
-						exec_write_cb, server, NULL);
+						exec_write_cb);
 	if (!server->exec_write_id)
 		return NULL;
 
@@ -1570,7 +2645,11 @@ struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 	server->mtu = MAX(mtu, BT_ATT_DEFAULT_LE_MTU);
 	server->max_prep_queue_len = DEFAULT_MAX_PREP_QUEUE_LEN;
 	server->prep_queue = queue_new();
+	server->prep_buf_size = DEFAULT_MAX_PREP_SIZE;
 	server->min_enc_size = min_enc_size;
+	server->rsp_cache = rsp_cache_get(db);
+
+	server->ccc_registry = ccc_registry_get(db);
 
 	if (!gatt_server_register_att_handlers(server)) {
 		bt_gatt_server_free(server);
@@ -1609,6 +2688,23 @@ void bt_gatt_server_unref(struct bt_gatt_server *server)
 	bt_gatt_server_free(server);
 }
 
+bool bt_gatt_server_set_max_prep_size(struct bt_gatt_server *server,
+							unsigned int size)
+{
+	if (!server || !size)
+		return false;
+
+	/* Stored values point into the buffer */
+	if (!queue_isempty(server->prep_queue))
+		return false;
+
+	free(server->prep_buf);
+	server->prep_buf = NULL;
+	server->prep_buf_size = size;
+
+	return true;
+}
+
 bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 					bt_gatt_server_debug_func_t callback,
 					void *user_data,
@@ -1631,26 +2727,91 @@ bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length)
 {
-	uint16_t pdu_len;
+	uint16_t pdu_len, max_len;
 	uint8_t *pdu;
-	bool result;
 
 	if (!server || (length && !value))
 		return false;
 
-	pdu_len = MIN(bt_att_get_mtu(server->att) - 1, length + 2);
-	pdu = malloc(pdu_len);
+	/* Encode straight into the ATT send buffer, saving a copy */
+	pdu = bt_att_pdu_alloc(server->att, BT_ATT_OP_HANDLE_VAL_NOT,
+								&max_len);
 	if (!pdu)
 		return false;
 
+	pdu_len = MIN(max_len, length + 2);
+
 	put_le16(handle, pdu);
 	memcpy(pdu + 2, value, pdu_len - 2);
 
-	result = !!bt_att_send(server->att, BT_ATT_OP_HANDLE_VAL_NOT, pdu,
-						pdu_len, NULL, NULL, NULL);
-	free(pdu);
+	return !!bt_att_send_prepared(server->att, pdu, pdu_len, NULL, NULL,
+									NULL);
+}
 
-	return result;
+bool bt_gatt_server_send_multi_notification(struct bt_gatt_server *server,
+				const struct bt_gatt_server_notify_value *values,
+				unsigned int count)
+{
+	const struct bt_gatt_server_notify_value *v;
+	uint16_t pdu_len, max_len;
+	unsigned int i = 0, n;
+	uint8_t *pdu;
+
+	if (!server || (count && !values))
+		return false;
+
+	while (i < count) {
+		pdu = bt_att_pdu_alloc(server->att,
+						BT_ATT_OP_HANDLE_VAL_MULT_NOT,
+						&max_len);
+		if (!pdu)
+			return false;
+
+		pdu_len = 0;
+
+		for (n = 0; i < count; n++, i++) {
+			v = &values[i];
+
+			if (v->length && !v->value) {
+				bt_att_pdu_free(server->att, pdu);
+				return false;
+			}
+
+			if (pdu_len + 4 + v->length > max_len)
+				break;
+
+			put_le16(v->handle, pdu + pdu_len);
+			put_le16(v->length, pdu + pdu_len + 2);
+			if (v->length)
+				memcpy(pdu + pdu_len + 4, v->value, v->length);
+			pdu_len += 4 + v->length;
+		}
+
+		if (n >= 2) {
+			if (!bt_att_send_prepared(server->att, pdu, pdu_len,
+							NULL, NULL, NULL))
+				return false;
+
+			continue;
+		}
+
+		/*
+		 * The PDU needs at least two tuples: send a lone value, or one
+		 * too large to share a PDU, as a regular notification.
+		 */
+		bt_att_pdu_free(server->att, pdu);
+
+		if (n == 1)
+			i--;
+
+		v = &values[i++];
+
+		if (!bt_gatt_server_send_notification(server, v->handle,
+							v->value, v->length))
+			return false;
+	}
+
+	return true;
 }
 
 struct ind_data {
@@ -1685,7 +2846,7 @@ bool bt_gatt_server_send_indication(struct bt_gatt_server *server,
 					void *user_data,
 					bt_gatt_server_destroy_func_t destroy)
 {
-	uint16_t pdu_len;
+	uint16_t pdu_len, max_len;
 	uint8_t *pdu;
 	struct ind_data *data;
 	bool result;
@@ -1693,11 +2854,13 @@ bool bt_gatt_server_send_indication(struct bt_gatt_server *server,
 	if (!server || (length && !value))
 		return false;
 
-	pdu_len = MIN(bt_att_get_mtu(server->att) - 1, length + 2);
-	pdu = malloc(pdu_len);
+	pdu = bt_att_pdu_alloc(server->att, BT_ATT_OP_HANDLE_VAL_IND,
+								&max_len);
 	if (!pdu)
 		return false;
 
+	pdu_len = MIN(max_len, length + 2);
+
 	data = new0(struct ind_data, 1);
 
 	data->callback = callback;
@@ -1707,13 +2870,197 @@ bool bt_gatt_server_send_indication(struct bt_gatt_server *server,
 	put_le16(handle, pdu);
 	memcpy(pdu + 2, value, pdu_len - 2);
 
-	result = !!bt_att_send(server->att, BT_ATT_OP_HANDLE_VAL_IND, pdu,
-							pdu_len, conf_cb,
+	result = !!bt_att_send_prepared(server->att, pdu, pdu_len, conf_cb,
 							data, destroy_ind_data);
 	if (!result)
 		destroy_ind_data(data);
 
+	return result;
+}
+
+uint16_t bt_gatt_server_get_ccc(struct bt_gatt_server *server,
+							uint16_t ccc_handle)
+{
+	struct ccc_registry *reg;
+	struct ccc_slot *slot;
+	uint16_t value = 0;
+
+	if (!server || !server->ccc_registry)
+		return 0;
+
+	reg = server->ccc_registry;
+
+	pthread_mutex_lock(&reg->lock);
+
+	slot = ccc_find(reg, ccc_handle);
+	if (slot)
+		value = ccc_get(server, slot - reg->slots);
+
+	pthread_mutex_unlock(&reg->lock);
+
+	return value;
+}
+
+bool bt_gatt_server_get_cache_stats(struct bt_gatt_server *server,
+				struct bt_gatt_server_cache_stats *stats)
+{
+	struct rsp_cache *cache;
+
+	if (!server || !server->rsp_cache || !stats)
+		return false;
+
+	cache = server->rsp_cache;
+
+	pthread_mutex_lock(&cache->lock);
+
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->entries = cache->num_entries;
+	stats->max_entries = cache->max_entries;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return true;
+}
+
+/*
+ * att refuses an indication without a handler for its confirmation. Nothing
+ * waits on it here: att already holds the next indication back until the
+ * confirmation is in.
+ */
+static void notify_all_conf_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+}
+
+/* Runs on the loop serving att, each bearer takes what its MTU fits */
+static bool notify_all_send(struct bt_att *att, uint8_t opcode,
+					const uint8_t *pdu, uint16_t length)
+{
+	uint16_t len = MIN(length, bt_att_get_mtu(att) - 1);
+
+	if (opcode == BT_ATT_OP_HANDLE_VAL_IND)
+		return !!bt_att_send(att, opcode, pdu, len, notify_all_conf_cb,
+								NULL, NULL);
+
+	return !!bt_att_send(att, opcode, pdu, len, NULL, NULL, NULL);
+}
+
+static void notify_all_post_cb(void *user_data)
+{
+	struct notify_all_data *data = user_data;
+
+	notify_all_send(data->att, data->opcode, data->pdu, data->length);
+}
+
+static void notify_all_data_free(void *user_data)
+{
+	struct notify_all_data *data = user_data;
+
+	bt_att_unref(data->att);
+	free(data);
+}
+
+static bool notify_all_post(struct bt_att *att, struct mainloop *loop,
+					uint8_t opcode, const uint8_t *pdu,
+					uint16_t length)
+{
+	struct notify_all_data *data;
+
+	data = malloc(sizeof(*data) + length);
+	if (!data)
+		return false;
+
+	data->att = bt_att_ref(att);
+	data->opcode = opcode;
+	data->length = length;
+	memcpy(data->pdu, pdu, length);
+
+	if (mainloop_loop_post(loop, notify_all_post_cb, data,
+						notify_all_data_free) < 0) {
+		notify_all_data_free(data);
+		return false;
+	}
+
+	return true;
+}
+
+unsigned int bt_gatt_server_notify_all(struct gatt_db *db,
+					uint16_t value_handle,
+					const uint8_t *value, uint16_t length)
+{
+	const struct queue_entry *entry;
+	struct mainloop *current = mainloop_get_current();
+	struct ccc_registry *reg;
+	struct ccc_slot *slot;
+	unsigned int i, count = 0;
+	uint8_t *pdu;
+
+	if (!db || (length && !value))
+		return 0;
+
+	/* Nothing goes out for a hidden characteristic */
+	if (!gatt_db_service_get_active(gatt_db_get_attribute(db,
+								value_handle)))
+		return 0;
+
+	pthread_mutex_lock(&ccc_registries_lock);
+	reg = queue_find(ccc_registries, match_ccc_registry_db, db);
+	pthread_mutex_unlock(&ccc_registries_lock);
+
+	if (!reg)
+		return 0;
+
+	/* Encoded once at full length */
+	pdu = malloc(length + 2);
+	if (!pdu)
+		return 0;
+
+	put_le16(value_handle, pdu);
+	if (length)
+		memcpy(pdu + 2, value, length);
+
+	pthread_mutex_lock(&reg->lock);
+
+	slot = ccc_find_value(reg, value_handle);
+	if (!slot)
+		goto done;
+
+	i = slot - reg->slots;
+
+	/*
+	 * Subscribed servers stay alive, and so do their bearers, for as long
+	 * as the lock is held. A bearer served by another loop gets the PDU
+	 * queued to that loop rather than touched from this thread.
+	 */
+	for (entry = queue_get_entries(slot->subscribers); entry;
+							entry = entry->next) {
+		struct bt_gatt_server *server = entry->data;
+		struct mainloop *loop = bt_att_get_loop(server->att);
+		uint8_t opcode;
+		bool queued;
+
+		if (ccc_get(server, i) & 0x0001)
+			opcode = BT_ATT_OP_HANDLE_VAL_NOT;
+		else
+			opcode = BT_ATT_OP_HANDLE_VAL_IND;
+
+		if (loop == current)
+			queued = notify_all_send(server->att, opcode, pdu,
+								length + 2);
+		else
+			queued = notify_all_post(server->att, loop, opcode,
+							pdu, length + 2);
+
+		if (queued)
+			count++;
+	}
+
+done:
+	pthread_mutex_unlock(&reg->lock);
+
 	free(pdu);
 
-	return result;
+	return count;
 }
@@ -0,0 +1,1398 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
+
+#include "src/shared/mainloop.h"
+#include "src/shared/io.h"
+#include "src/shared/queue.h"
+#include "src/shared/util.h"
+#include "src/shared/timeout.h"
+#include "src/shared/hci.h"
+
+/*
+ * A command the controller neither completes nor acknowledges within this
+ * time is given up on, and its credit handed back so the queue moves on.
+ */
+#define HCI_CMD_TIMEOUT_MS	2000
+
+/*
+ * How long a link tuning procedure waits for its completion event. The
+ * link layer usually finishes within a few connection events; no event at
+ * all means the controller had nothing to change.
+ */
+#define HCI_LE_PROC_TIMEOUT_MS	5000
+
+struct bt_hci {
+	int ref_count;
+	struct io *io;
+	struct mainloop *loop;
+	bool writer_active;
+	uint8_t num_cmds;
+	unsigned int next_cmd_id;
+	unsigned int next_evt_id;
+	struct queue *cmd_queue;	/* Waiting for a credit */
+	struct queue *rsp_queue;	/* Sent, waiting for the answer */
+	struct queue *evt_list;
+	bool in_evt;
+};
+
+struct cmd {
+	struct bt_hci *hci;
+	unsigned int id;
+	uint16_t opcode;
+	uint8_t size;
+	unsigned int timeout_id;
+	bt_hci_callback_func_t callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+	uint8_t data[];
+};
+
+struct evt {
+	unsigned int id;
+	uint8_t event;
+	bool le;
+	uint8_t subevent;
+	bool removed;
+	bt_hci_callback_func_t callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+};
+
+static void cmd_free(void *data)
+{
+	struct cmd *cmd = data;
+
+	if (cmd->timeout_id)
+		timeout_loop_remove(cmd->hci->loop, cmd->timeout_id);
+
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
+
+	free(cmd);
+}
+
+static void evt_free(void *data)
+{
+	struct evt *evt = data;
+
+	if (evt->destroy)
+		evt->destroy(evt->user_data);
+
+	free(evt);
+}
+
+static bool match_cmd_id(const void *a, const void *b)
+{
+	const struct cmd *cmd = a;
+
+	return cmd->id == PTR_TO_UINT(b);
+}
+
+static bool match_cmd_opcode(const void *a, const void *b)
+{
+	const struct cmd *cmd = a;
+
+	return cmd->opcode == PTR_TO_UINT(b);
+}
+
+static bool match_evt_id(const void *a, const void *b)
+{
+	const struct evt *evt = a;
+
+	return evt->id == PTR_TO_UINT(b);
+}
+
+static bool match_evt_removed(const void *a, const void *b)
+{
+	const struct evt *evt = a;
+
+	return evt->removed;
+}
+
+static bool can_write_data(struct io *io, void *user_data);
+
+static void wakeup_writer(struct bt_hci *hci)
+{
+	if (hci->writer_active)
+		return;
+
+	if (!hci->num_cmds || queue_isempty(hci->cmd_queue))
+		return;
+
+	if (!io_set_write_handler(hci->io, can_write_data, hci, NULL))
+		return;
+
+	hci->writer_active = true;
+}
+
+/* Callers hold a reference, the callback may drop the last one of the user */
+static void complete_cmd(struct bt_hci *hci, struct cmd *cmd,
+					const void *data, uint8_t size)
+{
+	if (cmd->callback)
+		cmd->callback(data, size, cmd->user_data);
+
+	cmd_free(cmd);
+}
+
+static bool cmd_timeout(void *user_data)
+{
+	struct cmd *cmd = user_data;
+	struct bt_hci *hci = cmd->hci;
+
+	cmd->timeout_id = 0;
+
+	if (!queue_remove(hci->rsp_queue, cmd))
+		return false;
+
+	/* The credit it took is not coming back from the controller */
+	if (!hci->num_cmds)
+		hci->num_cmds = 1;
+
+	bt_hci_ref(hci);
+
+	complete_cmd(hci, cmd, NULL, 0);
+	wakeup_writer(hci);
+
+	bt_hci_unref(hci);
+
+	return false;
+}
+
+/* Write as many queued commands as there are credits for */
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+	struct cmd *cmd;
+	struct iovec iov[3];
+	uint8_t type = HCI_COMMAND_PKT;
+	hci_command_hdr hdr;
+
+	bt_hci_ref(hci);
+
+	while (hci->num_cmds) {
+		cmd = queue_pop_head(hci->cmd_queue);
+		if (!cmd)
+			break;
+
+		hdr.opcode = htobs(cmd->opcode);
+		hdr.plen = cmd->size;
+
+		iov[0].iov_base = &type;
+		iov[0].iov_len = 1;
+		iov[1].iov_base = &hdr;
+		iov[1].iov_len = HCI_COMMAND_HDR_SIZE;
+		iov[2].iov_base = cmd->data;
+		iov[2].iov_len = cmd->size;
+
+		if (io_send(io, iov, 3) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				queue_push_head(hci->cmd_queue, cmd);
+				bt_hci_unref(hci);
+				return true;
+			}
+
+			complete_cmd(hci, cmd, NULL, 0);
+			continue;
+		}
+
+		hci->num_cmds--;
+
+		cmd->timeout_id = timeout_loop_add(hci->loop,
+						HCI_CMD_TIMEOUT_MS,
+						cmd_timeout, cmd, NULL);
+		queue_push_tail(hci->rsp_queue, cmd);
+	}
+
+	hci->writer_active = false;
+
+	bt_hci_unref(hci);
+
+	return false;
+}
+
+static void process_response(struct bt_hci *hci, uint8_t ncmd,
+					uint16_t opcode, const void *data,
+					uint8_t size)
+{
+	struct cmd *cmd;
+
+	hci->num_cmds = ncmd;
+
+	/* Opcode 0x0000 only hands out credits */
+	if (opcode) {
+		cmd = queue_remove_if(hci->rsp_queue, match_cmd_opcode,
+							UINT_TO_PTR(opcode));
+		if (cmd)
+			complete_cmd(hci, cmd, data, size);
+	}
+
+	wakeup_writer(hci);
+}
+
+struct evt_data {
+	uint8_t event;
+	bool le;
+	uint8_t subevent;
+	const uint8_t *data;
+	uint8_t size;
+};
+
+static void notify_evt(void *data, void *user_data)
+{
+	struct evt *evt = data;
+	struct evt_data *d = user_data;
+
+	if (evt->removed || evt->event != d->event)
+		return;
+
+	if (evt->le) {
+		if (!d->le || evt->subevent != d->subevent)
+			return;
+
+		evt->callback(d->data + 1, d->size - 1, evt->user_data);
+		return;
+	}
+
+	evt->callback(d->data, d->size, evt->user_data);
+}
+
+static void process_event(struct bt_hci *hci, const uint8_t *data,
+								size_t len)
+{
+	const hci_event_hdr *hdr = (const void *) data;
+	const evt_cmd_complete *cc;
+	const evt_cmd_status *cs;
+	struct evt_data d;
+
+	if (len < HCI_EVENT_HDR_SIZE || len - HCI_EVENT_HDR_SIZE < hdr->plen)
+		return;
+
+	data += HCI_EVENT_HDR_SIZE;
+
+	switch (hdr->evt) {
+	case EVT_CMD_COMPLETE:
+		if (hdr->plen < EVT_CMD_COMPLETE_SIZE)
+			return;
+
+		cc = (const void *) data;
+		process_response(hci, cc->ncmd, btohs(cc->opcode),
+					data + EVT_CMD_COMPLETE_SIZE,
+					hdr->plen - EVT_CMD_COMPLETE_SIZE);
+		return;
+	case EVT_CMD_STATUS:
+		if (hdr->plen < EVT_CMD_STATUS_SIZE)
+			return;
+
+		cs = (const void *) data;
+		process_response(hci, cs->ncmd, btohs(cs->opcode),
+							&cs->status, 1);
+		return;
+	}
+
+	d.event = hdr->evt;
+	d.le = hdr->evt == EVT_LE_META_EVENT && hdr->plen;
+	d.subevent = d.le ? data[0] : 0;
+	d.data = data;
+	d.size = hdr->plen;
+
+	/* Handlers may unregister while being called, so free them after */
+	hci->in_evt = true;
+	queue_foreach(hci->evt_list, notify_evt, &d);
+	hci->in_evt = false;
+
+	queue_remove_all(hci->evt_list, match_evt_removed, NULL, evt_free);
+}
+
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+	uint8_t buf[1 + HCI_MAX_EVENT_SIZE];
+	ssize_t len;
+
+	len = read(io_get_fd(io), buf, sizeof(buf));
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (len < 1)
+		return false;
+
+	bt_hci_ref(hci);
+
+	if (buf[0] == HCI_EVENT_PKT)
+		process_event(hci, buf + 1, len - 1);
+
+	bt_hci_unref(hci);
+
+	return true;
+}
+
+struct bt_hci *bt_hci_new_with_loop(int fd, struct mainloop *loop)
+{
+	struct bt_hci *hci;
+
+	if (fd < 0)
+		return NULL;
+
+	hci = new0(struct bt_hci, 1);
+
+	hci->io = io_new_with_loop(fd, loop);
+	if (!hci->io) {
+		free(hci);
+		return NULL;
+	}
+
+	hci->loop = io_get_loop(hci->io);
+
+	/* One command may always be sent until the controller says more */
+	hci->num_cmds = 1;
+	hci->next_cmd_id = 1;
+	hci->next_evt_id = 1;
+	hci->cmd_queue = queue_new();
+	hci->rsp_queue = queue_new();
+	hci->evt_list = queue_new();
+
+	if (!io_set_read_handler(hci->io, can_read_data, hci, NULL)) {
+		queue_destroy(hci->evt_list, NULL);
+		queue_destroy(hci->rsp_queue, NULL);
+		queue_destroy(hci->cmd_queue, NULL);
+		io_destroy(hci->io);
+		free(hci);
+		return NULL;
+	}
+
+	return bt_hci_ref(hci);
+}
+
+struct bt_hci *bt_hci_new(int fd)
+{
+	return bt_hci_new_with_loop(fd, mainloop_get_current());
+}
+
+struct bt_hci *bt_hci_new_raw_device(uint16_t index)
+{
+	struct sockaddr_hci addr;
+	struct hci_filter flt;
+	struct bt_hci *hci;
+	int fd;
+
+	fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+								BTPROTO_HCI);
+	if (fd < 0)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = index;
+	addr.hci_channel = HCI_CHANNEL_RAW;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto fail;
+
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_all_events(&flt);
+
+	if (setsockopt(fd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0)
+		goto fail;
+
+	hci = bt_hci_new(fd);
+	if (!hci)
+		goto fail;
+
+	bt_hci_set_close_on_unref(hci, true);
+
+	return hci;
+
+fail:
+	close(fd);
+	return NULL;
+}
+
+struct bt_hci *bt_hci_ref(struct bt_hci *hci)
+{
+	if (!hci)
+		return NULL;
+
+	__sync_fetch_and_add(&hci->ref_count, 1);
+
+	return hci;
+}
+
+void bt_hci_unref(struct bt_hci *hci)
+{
+	if (!hci)
+		return;
+
+	if (__sync_sub_and_fetch(&hci->ref_count, 1))
+		return;
+
+	queue_destroy(hci->evt_list, evt_free);
+	queue_destroy(hci->cmd_queue, cmd_free);
+	queue_destroy(hci->rsp_queue, cmd_free);
+
+	io_destroy(hci->io);
+
+	free(hci);
+}
+
+bool bt_hci_set_close_on_unref(struct bt_hci *hci, bool do_close)
+{
+	if (!hci)
+		return false;
+
+	return io_set_close_on_destroy(hci->io, do_close);
+}
+
+unsigned int bt_hci_send(struct bt_hci *hci, uint16_t opcode,
+				const void *data, uint8_t size,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	struct cmd *cmd;
+
+	if (!hci || (size && !data))
+		return 0;
+
+	cmd = malloc(sizeof(*cmd) + size);
+	if (!cmd)
+		return 0;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->hci = hci;
+	cmd->opcode = opcode;
+	cmd->size = size;
+	if (size)
+		memcpy(cmd->data, data, size);
+
+	if (hci->next_cmd_id < 1)
+		hci->next_cmd_id = 1;
+
+	cmd->id = hci->next_cmd_id++;
+	cmd->callback = callback;
+	cmd->destroy = destroy;
+	cmd->user_data = user_data;
+
+	queue_push_tail(hci->cmd_queue, cmd);
+	wakeup_writer(hci);
+
+	return cmd->id;
+}
+
+bool bt_hci_cancel(struct bt_hci *hci, unsigned int id)
+{
+	struct cmd *cmd;
+
+	if (!hci || !id)
+		return false;
+
+	cmd = queue_remove_if(hci->cmd_queue, match_cmd_id, UINT_TO_PTR(id));
+	if (cmd) {
+		cmd_free(cmd);
+		return true;
+	}
+
+	/*
+	 * Already sent: keep it around to take the answer and its credit,
+	 * just without anybody to tell.
+	 */
+	cmd = queue_find(hci->rsp_queue, match_cmd_id, UINT_TO_PTR(id));
+	if (!cmd)
+		return false;
+
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
+
+	cmd->callback = NULL;
+	cmd->destroy = NULL;
+	cmd->user_data = NULL;
+
+	return true;
+}
+
+bool bt_hci_flush(struct bt_hci *hci)
+{
+	if (!hci)
+		return false;
+
+	if (hci->writer_active) {
+		io_set_write_handler(hci->io, NULL, NULL, NULL);
+		hci->writer_active = false;
+	}
+
+	queue_remove_all(hci->cmd_queue, NULL, NULL, cmd_free);
+	queue_remove_all(hci->rsp_queue, NULL, NULL, cmd_free);
+
+	hci->num_cmds = 1;
+
+	return true;
+}
+
+static unsigned int register_evt(struct bt_hci *hci, uint8_t event, bool le,
+				uint8_t subevent,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	struct evt *evt;
+
+	if (!hci || !callback)
+		return 0;
+
+	/* Command flow is handled here, not by event handlers */
+	if (event == EVT_CMD_COMPLETE || event == EVT_CMD_STATUS)
+		return 0;
+
+	evt = new0(struct evt, 1);
+	evt->event = event;
+	evt->le = le;
+	evt->subevent = subevent;
+
+	if (hci->next_evt_id < 1)
+		hci->next_evt_id = 1;
+
+	evt->id = hci->next_evt_id++;
+	evt->callback = callback;
+	evt->destroy = destroy;
+	evt->user_data = user_data;
+
+	queue_push_tail(hci->evt_list, evt);
+
+	return evt->id;
+}
+
+unsigned int bt_hci_register(struct bt_hci *hci, uint8_t event,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	return register_evt(hci, event, false, 0, callback, user_data,
+								destroy);
+}
+
+unsigned int bt_hci_register_le(struct bt_hci *hci, uint8_t subevent,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	return register_evt(hci, EVT_LE_META_EVENT, true, subevent, callback,
+							user_data, destroy);
+}
+
+bool bt_hci_unregister(struct bt_hci *hci, unsigned int id)
+{
+	struct evt *evt;
+
+	if (!hci || !id)
+		return false;
+
+	if (hci->in_evt) {
+		evt = queue_find(hci->evt_list, match_evt_id, UINT_TO_PTR(id));
+		if (!evt)
+			return false;
+
+		evt->removed = true;
+		return true;
+	}
+
+	evt = queue_remove_if(hci->evt_list, match_evt_id, UINT_TO_PTR(id));
+	if (!evt)
+		return false;
+
+	evt_free(evt);
+
+	return true;
+}
+
+struct le_req {
+	union {
+		bt_hci_status_func_t status;
+		bt_hci_size_func_t size;
+		bt_hci_phy_func_t phy;
+	} callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+};
+
+static void le_req_free(void *data)
+{
+	struct le_req *req = data;
+
+	if (req->destroy)
+		req->destroy(req->user_data);
+
+	free(req);
+}
+
+static void le_status_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct le_req *req = user_data;
+	const uint8_t *rp = data;
+
+	if (req->callback.status)
+		req->callback.status(size ? rp[0] : HCI_UNSPECIFIED_ERROR,
+							req->user_data);
+}
+
+static void le_size_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct le_req *req = user_data;
+	const uint8_t *rp = data;
+
+	if (!req->callback.size)
+		return;
+
+	if (size < 2) {
+		req->callback.size(size ? rp[0] : HCI_UNSPECIFIED_ERROR, 0,
+							req->user_data);
+		return;
+	}
+
+	req->callback.size(rp[0], rp[1], req->user_data);
+}
+
+static unsigned int le_send(struct bt_hci *hci, uint16_t ocf,
+					const void *cp, uint8_t len,
+					bt_hci_callback_func_t func,
+					struct le_req *req)
+{
+	unsigned int id;
+
+	id = bt_hci_send(hci, cmd_opcode_pack(OGF_LE_CTL, ocf), cp, len,
+						func, req, le_req_free);
+	if (!id)
+		free(req);
+
+	return id;
+}
+
+static unsigned int le_send_status(struct bt_hci *hci, uint16_t ocf,
+					const void *cp, uint8_t len,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	struct le_req *req;
+
+	if (!hci)
+		return 0;
+
+	req = new0(struct le_req, 1);
+	req->callback.status = callback;
+	req->destroy = destroy;
+	req->user_data = user_data;
+
+	return le_send(hci, ocf, cp, len, le_status_cb, req);
+}
+
+static unsigned int le_send_size(struct bt_hci *hci, uint16_t ocf,
+					bt_hci_size_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	struct le_req *req;
+
+	if (!hci)
+		return 0;
+
+	req = new0(struct le_req, 1);
+	req->callback.size = callback;
+	req->destroy = destroy;
+	req->user_data = user_data;
+
+	return le_send(hci, ocf, NULL, 0, le_size_cb, req);
+}
+
+unsigned int bt_hci_le_set_scan_enable(struct bt_hci *hci, uint8_t enable,
+					uint8_t filter_dup,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_set_scan_enable_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = enable;
+	cp.filter_dup = filter_dup;
+
+	return le_send_status(hci, OCF_LE_SET_SCAN_ENABLE, &cp,
+					LE_SET_SCAN_ENABLE_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_set_scan_parameters(struct bt_hci *hci, uint8_t type,
+					uint16_t interval, uint16_t window,
+					uint8_t own_type, uint8_t filter,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_set_scan_parameters_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.type = type;
+	cp.interval = htobs(interval);
+	cp.window = htobs(window);
+	cp.own_bdaddr_type = own_type;
+	cp.filter = filter;
+
+	return le_send_status(hci, OCF_LE_SET_SCAN_PARAMETERS, &cp,
+					LE_SET_SCAN_PARAMETERS_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_set_advertise_enable(struct bt_hci *hci,
+					uint8_t enable,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_set_advertise_enable_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = enable;
+
+	return le_send_status(hci, OCF_LE_SET_ADVERTISE_ENABLE, &cp,
+					LE_SET_ADVERTISE_ENABLE_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_create_conn(struct bt_hci *hci, uint16_t interval,
+					uint16_t window, uint8_t initiator_filter,
+					uint8_t peer_bdaddr_type,
+					const bdaddr_t *peer_bdaddr,
+					uint8_t own_bdaddr_type,
+					uint16_t min_interval,
+					uint16_t max_interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					uint16_t min_ce_length,
+					uint16_t max_ce_length,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_create_connection_cp cp;
+
+	if (!peer_bdaddr)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.interval = htobs(interval);
+	cp.window = htobs(window);
+	cp.initiator_filter = initiator_filter;
+	cp.peer_bdaddr_type = peer_bdaddr_type;
+	bacpy(&cp.peer_bdaddr, peer_bdaddr);
+	cp.own_bdaddr_type = own_bdaddr_type;
+	cp.min_interval = htobs(min_interval);
+	cp.max_interval = htobs(max_interval);
+	cp.latency = htobs(latency);
+	cp.supervision_timeout = htobs(supervision_timeout);
+	cp.min_ce_length = htobs(min_ce_length);
+	cp.max_ce_length = htobs(max_ce_length);
+
+	return le_send_status(hci, OCF_LE_CREATE_CONN, &cp,
+					LE_CREATE_CONN_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_conn_update(struct bt_hci *hci, uint16_t handle,
+					uint16_t min_interval,
+					uint16_t max_interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_connection_update_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+	cp.min_interval = htobs(min_interval);
+	cp.max_interval = htobs(max_interval);
+	cp.latency = htobs(latency);
+	cp.supervision_timeout = htobs(supervision_timeout);
+	cp.min_ce_length = htobs(0x0001);
+	cp.max_ce_length = htobs(0x0001);
+
+	return le_send_status(hci, OCF_LE_CONN_UPDATE, &cp,
+					LE_CONN_UPDATE_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_add_white_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_add_device_to_white_list_cp cp;
+
+	if (!bdaddr)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.bdaddr_type = type;
+	bacpy(&cp.bdaddr, bdaddr);
+
+	return le_send_status(hci, OCF_LE_ADD_DEVICE_TO_WHITE_LIST, &cp,
+					LE_ADD_DEVICE_TO_WHITE_LIST_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_rm_white_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_remove_device_from_white_list_cp cp;
+
+	if (!bdaddr)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.bdaddr_type = type;
+	bacpy(&cp.bdaddr, bdaddr);
+
+	return le_send_status(hci, OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST, &cp,
+					LE_REMOVE_DEVICE_FROM_WHITE_LIST_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_read_white_list_size(struct bt_hci *hci,
+					bt_hci_size_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	return le_send_size(hci, OCF_LE_READ_WHITE_LIST_SIZE, callback,
+							user_data, destroy);
+}
+
+unsigned int bt_hci_le_clear_white_list(struct bt_hci *hci,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	return le_send_status(hci, OCF_LE_CLEAR_WHITE_LIST, NULL, 0,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_add_resolving_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					const uint8_t peer_irk[16],
+					const uint8_t local_irk[16],
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_add_device_to_resolv_list_cp cp;
+
+	if (!bdaddr || !peer_irk || !local_irk)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.bdaddr_type = type;
+	bacpy(&cp.bdaddr, bdaddr);
+	memcpy(cp.peer_irk, peer_irk, 16);
+	memcpy(cp.local_irk, local_irk, 16);
+
+	return le_send_status(hci, OCF_LE_ADD_DEVICE_TO_RESOLV_LIST, &cp,
+					LE_ADD_DEVICE_TO_RESOLV_LIST_CP_SIZE,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_rm_resolving_list(struct bt_hci *hci,
+					const bdaddr_t *bdaddr, uint8_t type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_remove_device_from_resolv_list_cp cp;
+
+	if (!bdaddr)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.bdaddr_type = type;
+	bacpy(&cp.bdaddr, bdaddr);
+
+	return le_send_status(hci, OCF_LE_REMOVE_DEVICE_FROM_RESOLV_LIST, &cp,
+				LE_REMOVE_DEVICE_FROM_RESOLV_LIST_CP_SIZE,
+				callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_clear_resolving_list(struct bt_hci *hci,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	return le_send_status(hci, OCF_LE_CLEAR_RESOLV_LIST, NULL, 0,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_read_resolving_list_size(struct bt_hci *hci,
+					bt_hci_size_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	return le_send_size(hci, OCF_LE_READ_RESOLV_LIST_SIZE, callback,
+							user_data, destroy);
+}
+
+unsigned int bt_hci_le_set_address_resolution_enable(struct bt_hci *hci,
+					uint8_t enable,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_set_address_resolution_enable_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = enable;
+
+	return le_send_status(hci, OCF_LE_SET_ADDRESS_RESOLUTION_ENABLE, &cp,
+				LE_SET_ADDRESS_RESOLUTION_ENABLE_CP_SIZE,
+				callback, user_data, destroy);
+}
+
+unsigned int bt_hci_le_read_remote_features(struct bt_hci *hci,
+					uint16_t handle,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_read_remote_used_features_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+
+	return le_send_status(hci, OCF_LE_READ_REMOTE_USED_FEATURES, &cp,
+				LE_READ_REMOTE_USED_FEATURES_CP_SIZE,
+				callback, user_data, destroy);
+}
+
+static void le_read_phy_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct le_req *req = user_data;
+	const le_read_phy_rp *rp = data;
+
+	if (!req->callback.phy)
+		return;
+
+	if (size < LE_READ_PHY_RP_SIZE) {
+		req->callback.phy(size ? rp->status : HCI_UNSPECIFIED_ERROR,
+							0, 0, req->user_data);
+		return;
+	}
+
+	req->callback.phy(rp->status, rp->tx_phy, rp->rx_phy, req->user_data);
+}
+
+unsigned int bt_hci_le_read_phy(struct bt_hci *hci, uint16_t handle,
+					bt_hci_phy_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_read_phy_cp cp;
+	struct le_req *req;
+
+	if (!hci)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+
+	req = new0(struct le_req, 1);
+	req->callback.phy = callback;
+	req->destroy = destroy;
+	req->user_data = user_data;
+
+	return le_send(hci, OCF_LE_READ_PHY, &cp, LE_READ_PHY_CP_SIZE,
+							le_read_phy_cb, req);
+}
+
+/*
+ * A command followed by the LE Meta event telling its outcome. The event
+ * registration owns the procedure, so unregistering it or dropping the
+ * bt_hci releases everything.
+ */
+struct le_proc;
+
+/*
+ * Hands data, the event or the reply to the fallback read, to the user; a
+ * NULL data reports status alone. Returns false for an event about another
+ * connection.
+ */
+typedef bool (*le_proc_report_func_t)(struct le_proc *proc, uint8_t status,
+					const void *data, uint8_t size);
+
+struct le_proc {
+	struct bt_hci *hci;
+	uint16_t handle;
+	uint16_t read_ocf;		/* Asked on timeout, 0 for none */
+	unsigned int evt_id;
+	unsigned int cmd_id;
+	unsigned int timeout_id;
+	bool done;
+	le_proc_report_func_t report;
+	union {
+		bt_hci_data_length_func_t data_length;
+		bt_hci_phy_func_t phy;
+		bt_hci_conn_params_func_t conn_params;
+	} callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+};
+
+static void le_proc_stop(struct le_proc *proc)
+{
+	if (proc->cmd_id) {
+		bt_hci_cancel(proc->hci, proc->cmd_id);
+		proc->cmd_id = 0;
+	}
+
+	if (proc->timeout_id) {
+		timeout_loop_remove(proc->hci->loop, proc->timeout_id);
+		proc->timeout_id = 0;
+	}
+}
+
+static void le_proc_free(void *data)
+{
+	struct le_proc *proc = data;
+
+	le_proc_stop(proc);
+
+	if (proc->destroy)
+		proc->destroy(proc->user_data);
+
+	free(proc);
+}
+
+static bool le_proc_complete(struct le_proc *proc, uint8_t status,
+					const void *data, uint8_t size)
+{
+	if (proc->done)
+		return true;
+
+	if (!proc->report(proc, status, data, size))
+		return false;
+
+	proc->done = true;
+	le_proc_stop(proc);
+	bt_hci_unregister(proc->hci, proc->evt_id);
+
+	return true;
+}
+
+static void le_proc_read_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct le_proc *proc = user_data;
+	const uint8_t *rp = data;
+
+	proc->cmd_id = 0;
+
+	if (size && !rp[0] && le_proc_complete(proc, HCI_SUCCESS, data, size))
+		return;
+
+	le_proc_complete(proc, size && rp[0] ? rp[0] : HCI_UNSPECIFIED_ERROR,
+								NULL, 0);
+}
+
+static bool le_proc_timeout(void *user_data)
+{
+	struct le_proc *proc = user_data;
+	uint16_t cp;
+
+	proc->timeout_id = 0;
+
+	if (proc->read_ocf) {
+		cp = htobs(proc->handle);
+		proc->cmd_id = bt_hci_send(proc->hci,
+				cmd_opcode_pack(OGF_LE_CTL, proc->read_ocf),
+				&cp, sizeof(cp), le_proc_read_cb, proc, NULL);
+		if (proc->cmd_id)
+			return false;
+	}
+
+	le_proc_complete(proc, HCI_SUCCESS, NULL, 0);
+
+	return false;
+}
+
+static void le_proc_cmd_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct le_proc *proc = user_data;
+	const uint8_t *rp = data;
+
+	proc->cmd_id = 0;
+
+	if (!size || rp[0]) {
+		le_proc_complete(proc, size ? rp[0] : HCI_UNSPECIFIED_ERROR,
+								NULL, 0);
+		return;
+	}
+
+	proc->timeout_id = timeout_loop_add(proc->hci->loop,
+						HCI_LE_PROC_TIMEOUT_MS,
+						le_proc_timeout, proc, NULL);
+}
+
+static void le_proc_evt_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct le_proc *proc = user_data;
+
+	le_proc_complete(proc, HCI_SUCCESS, data, size);
+}
+
+static unsigned int le_proc_start(struct bt_hci *hci, uint16_t ocf,
+					const void *cp, uint8_t len,
+					uint8_t subevent, uint16_t handle,
+					le_proc_report_func_t report,
+					struct le_proc *proc)
+{
+	proc->hci = hci;
+	proc->handle = handle;
+	proc->report = report;
+
+	proc->evt_id = bt_hci_register_le(hci, subevent, le_proc_evt_cb, proc,
+								le_proc_free);
+	if (!proc->evt_id) {
+		free(proc);
+		return 0;
+	}
+
+	proc->cmd_id = bt_hci_send(hci, cmd_opcode_pack(OGF_LE_CTL, ocf), cp,
+						len, le_proc_cmd_cb, proc, NULL);
+	if (!proc->cmd_id) {
+		/* Failing calls leave user_data alone */
+		proc->destroy = NULL;
+		bt_hci_unregister(hci, proc->evt_id);
+		return 0;
+	}
+
+	return proc->evt_id;
+}
+
+static bool report_data_length(struct le_proc *proc, uint8_t status,
+					const void *data, uint8_t size)
+{
+	const evt_le_data_length_change *evt = data;
+
+	if (evt) {
+		if (size < EVT_LE_DATA_LENGTH_CHANGE_SIZE ||
+					btohs(evt->handle) != proc->handle)
+			return false;
+
+		if (proc->callback.data_length)
+			proc->callback.data_length(HCI_SUCCESS,
+						btohs(evt->max_tx_octets),
+						btohs(evt->max_tx_time),
+						btohs(evt->max_rx_octets),
+						btohs(evt->max_rx_time),
+						proc->user_data);
+		return true;
+	}
+
+	if (proc->callback.data_length)
+		proc->callback.data_length(status, 0, 0, 0, 0, proc->user_data);
+
+	return true;
+}
+
+unsigned int bt_hci_le_set_data_length(struct bt_hci *hci, uint16_t handle,
+					uint16_t tx_octets, uint16_t tx_time,
+					bt_hci_data_length_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_set_data_length_cp cp;
+	struct le_proc *proc;
+
+	if (!hci)
+		return 0;
+
+	/* Ranges of connMaxTxOctets and connMaxTxTime */
+	if (tx_octets < 27 || tx_octets > 251 ||
+					tx_time < 328 || tx_time > 17040)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+	cp.tx_octets = htobs(tx_octets);
+	cp.tx_time = htobs(tx_time);
+
+	proc = new0(struct le_proc, 1);
+	proc->callback.data_length = callback;
+	proc->destroy = destroy;
+	proc->user_data = user_data;
+
+	return le_proc_start(hci, OCF_LE_SET_DATA_LENGTH, &cp,
+					LE_SET_DATA_LENGTH_CP_SIZE,
+					EVT_LE_DATA_LENGTH_CHANGE, handle,
+					report_data_length, proc);
+}
+
+/* PHY Update Complete and the Read PHY reply share their layout */
+static bool report_phy(struct le_proc *proc, uint8_t status,
+					const void *data, uint8_t size)
+{
+	const evt_le_phy_update_complete *evt = data;
+
+	if (evt) {
+		if (size < EVT_LE_PHY_UPDATE_COMPLETE_SIZE ||
+					btohs(evt->handle) != proc->handle)
+			return false;
+
+		if (proc->callback.phy)
+			proc->callback.phy(evt->status, evt->tx_phy,
+						evt->rx_phy, proc->user_data);
+		return true;
+	}
+
+	if (proc->callback.phy)
+		proc->callback.phy(status, 0, 0, proc->user_data);
+
+	return true;
+}
+
+unsigned int bt_hci_le_set_phy(struct bt_hci *hci, uint16_t handle,
+					uint8_t all_phys, uint8_t tx_phys,
+					uint8_t rx_phys, uint16_t phy_opts,
+					bt_hci_phy_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_set_phy_cp cp;
+	struct le_proc *proc;
+
+	if (!hci)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+	cp.all_phys = all_phys;
+	cp.tx_phys = tx_phys;
+	cp.rx_phys = rx_phys;
+	cp.phy_opts = htobs(phy_opts);
+
+	proc = new0(struct le_proc, 1);
+	proc->read_ocf = OCF_LE_READ_PHY;
+	proc->callback.phy = callback;
+	proc->destroy = destroy;
+	proc->user_data = user_data;
+
+	return le_proc_start(hci, OCF_LE_SET_PHY, &cp, LE_SET_PHY_CP_SIZE,
+					EVT_LE_PHY_UPDATE_COMPLETE, handle,
+					report_phy, proc);
+}
+
+static bool report_conn_params(struct le_proc *proc, uint8_t status,
+					const void *data, uint8_t size)
+{
+	const evt_le_connection_update_complete *evt = data;
+
+	if (evt) {
+		if (size < EVT_LE_CONN_UPDATE_COMPLETE_SIZE ||
+					btohs(evt->handle) != proc->handle)
+			return false;
+
+		if (proc->callback.conn_params)
+			proc->callback.conn_params(evt->status,
+					btohs(evt->interval),
+					btohs(evt->latency),
+					btohs(evt->supervision_timeout),
+					proc->user_data);
+		return true;
+	}
+
+	if (proc->callback.conn_params)
+		proc->callback.conn_params(status, 0, 0, 0, proc->user_data);
+
+	return true;
+}
+
+unsigned int bt_hci_le_update_conn(struct bt_hci *hci, uint16_t handle,
+					uint16_t min_interval,
+					uint16_t max_interval,
+					uint16_t latency,
+					uint16_t supervision_timeout,
+					bt_hci_conn_params_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	le_connection_update_cp cp;
+	struct le_proc *proc;
+
+	if (!hci)
+		return 0;
+
+	if (min_interval < 0x0006 || min_interval > max_interval ||
+						max_interval > 0x0c80)
+		return 0;
+
+	if (latency > 0x01f3)
+		return 0;
+
+	/*
+	 * The supervision timeout (10 ms units) has to be longer than twice
+	 * the effective interval (1.25 ms units) or the peer rejects it.
+	 */
+	if (supervision_timeout < 0x000a || supervision_timeout > 0x0c80 ||
+			(uint32_t) supervision_timeout * 4 <=
+				(uint32_t) (1 + latency) * max_interval)
+		return 0;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+	cp.min_interval = htobs(min_interval);
+	cp.max_interval = htobs(max_interval);
+	cp.latency = htobs(latency);
+	cp.supervision_timeout = htobs(supervision_timeout);
+	cp.min_ce_length = htobs(0x0001);
+	cp.max_ce_length = htobs(0x0001);
+
+	proc = new0(struct le_proc, 1);
+	proc->callback.conn_params = callback;
+	proc->destroy = destroy;
+	proc->user_data = user_data;
+
+	return le_proc_start(hci, OCF_LE_CONN_UPDATE, &cp,
+					LE_CONN_UPDATE_CP_SIZE,
+					EVT_LE_CONN_UPDATE_COMPLETE, handle,
+					report_conn_params, proc);
+}
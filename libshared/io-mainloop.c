@@ -27,6 +27,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include "src/shared/mainloop.h"
@@ -35,6 +36,7 @@
 
 struct io {
 	int ref_count;
+	struct mainloop *loop;
 	int fd;
 	uint32_t events;
 	bool close_on_destroy;
@@ -100,7 +102,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 		io->write_callback = NULL;
 
 		if (!io->disconnect_callback) {
-			mainloop_remove_fd(io->fd);
+			mainloop_loop_remove_fd(io->loop, io->fd);
 			io_unref(io);
 			return;
 		}
@@ -115,7 +117,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLRDHUP;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_loop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -130,7 +132,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLIN;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_loop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -145,26 +147,27 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLOUT;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_loop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
 	io_unref(io);
 }
 
-struct io *io_new(int fd)
+struct io *io_new_with_loop(int fd, struct mainloop *loop)
 {
 	struct io *io;
 
-	if (fd < 0)
+	if (fd < 0 || !loop)
 		return NULL;
 
 	io = new0(struct io, 1);
+	io->loop = loop;
 	io->fd = fd;
 	io->events = 0;
 	io->close_on_destroy = false;
 
-	if (mainloop_add_fd(io->fd, io->events, io_callback,
+	if (mainloop_loop_add_fd(io->loop, io->fd, io->events, io_callback,
 						io, io_cleanup) < 0) {
 		free(io);
 		return NULL;
@@ -173,6 +176,19 @@ struct io *io_new(int fd)
 	return io_ref(io);
 }
 
+struct io *io_new(int fd)
+{
+	return io_new_with_loop(fd, mainloop_get_current());
+}
+
+struct mainloop *io_get_loop(struct io *io)
+{
+	if (!io)
+		return NULL;
+
+	return io->loop;
+}
+
 void io_destroy(struct io *io)
 {
 	if (!io)
@@ -182,7 +198,7 @@ void io_destroy(struct io *io)
 	io->write_callback = NULL;
 	io->disconnect_callback = NULL;
 
-	mainloop_remove_fd(io->fd);
+	mainloop_loop_remove_fd(io->loop, io->fd);
 
 	io_unref(io);
 }
@@ -228,7 +244,7 @@ bool io_set_read_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_loop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -259,7 +275,7 @@ bool io_set_write_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_loop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -290,7 +306,7 @@ bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_loop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -315,6 +331,43 @@ ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt)
 	return ret;
 }
 
+int io_send_batch(struct io *io, const struct iovec *iov, int iovcnt)
+{
+	struct mmsghdr msgs[iovcnt];
+	int i, ret;
+
+	if (!io || io->fd < 0)
+		return -ENOTCONN;
+
+	if (iovcnt <= 0)
+		return -EINVAL;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	/* Each iovec is sent as its own message to keep PDU boundaries */
+	for (i = 0; i < iovcnt; i++) {
+		msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		ret = sendmmsg(io->fd, msgs, iovcnt, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret >= 0)
+		return ret;
+
+	if (errno != ENOTSOCK)
+		return -errno;
+
+	/* Not a socket, fall back to sending a single message */
+	ret = io_send(io, iov, 1);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
 bool io_shutdown(struct io *io)
 {
 	if (!io || io->fd < 0)
@@ -27,22 +27,28 @@
 #endif
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/epoll.h>
 
 #include "mainloop.h"
 
-#define MAX_EPOLL_EVENTS 10
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define MIN_EPOLL_EVENTS 16
+#define DEFAULT_MAX_EPOLL_EVENTS 1024
 
-static int epoll_fd;
-static int epoll_terminate;
-static int exit_status = EXIT_SUCCESS;
+#define MIN_MAINLOOP_ENTRIES 128
 
 struct mainloop_data {
 	int fd;
@@ -52,12 +58,40 @@ struct mainloop_data {
 	void *user_data;
 };
 
-#define MAX_MAINLOOP_ENTRIES 128
+struct post_data {
+	struct post_data *next;
+	mainloop_post_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+struct mainloop {
+	int epoll_fd;			/* -1 once torn down */
+	int wakeup_fd;			/* Changed under post_lock */
+	int terminate;
+	int exit_status;
+
+	/* Indexed by fd, grown on demand */
+	struct mainloop_data **list;
+	unsigned int list_size;
+	unsigned int fd_count;
+	unsigned int timeout_count;
+
+	struct epoll_event *events;
+	unsigned int events_size;
+	unsigned int events_max;
 
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
+	void *timeout_data;
+
+	/* Calls posted from other threads, see mainloop_loop_post() */
+	pthread_mutex_t post_lock;
+	struct post_data *post_head;
+	struct post_data *post_tail;
+};
 
 struct timeout_data {
 	int fd;
+	struct mainloop *loop;
 	mainloop_timeout_func callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
@@ -71,35 +105,366 @@ struct signal_data {
 	void *user_data;
 };
 
+static struct mainloop default_loop = {
+	.epoll_fd = -1,
+	.wakeup_fd = -1,
+	.exit_status = EXIT_SUCCESS,
+	.events_max = DEFAULT_MAX_EPOLL_EVENTS,
+	.post_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Loop being run by the calling thread, if any */
+static __thread struct mainloop *current_loop;
+
 static struct signal_data *signal_data;
 
-void mainloop_init(void)
+static bool loop_setup(struct mainloop *loop)
+{
+	struct epoll_event ev;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0)
+		return false;
+
+	loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakeup_fd < 0)
+		goto fail;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = loop->wakeup_fd;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &ev) < 0)
+		goto fail;
+
+	if (loop->list)
+		memset(loop->list, 0, loop->list_size * sizeof(*loop->list));
+
+	loop->fd_count = 0;
+	loop->timeout_count = 0;
+	loop->terminate = 0;
+
+	return true;
+
+fail:
+	if (loop->wakeup_fd >= 0)
+		close(loop->wakeup_fd);
+
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+	loop->wakeup_fd = -1;
+
+	return false;
+}
+
+/* Detaches the posted calls, they are run or dropped by the caller */
+static struct post_data *loop_take_posts(struct mainloop *loop, bool close_fd)
+{
+	struct post_data *head;
+
+	pthread_mutex_lock(&loop->post_lock);
+
+	head = loop->post_head;
+	loop->post_head = NULL;
+	loop->post_tail = NULL;
+
+	/* No more posts are accepted once the wakeup fd is gone */
+	if (close_fd && loop->wakeup_fd >= 0) {
+		close(loop->wakeup_fd);
+		loop->wakeup_fd = -1;
+	}
+
+	pthread_mutex_unlock(&loop->post_lock);
+
+	return head;
+}
+
+static void loop_teardown(struct mainloop *loop)
 {
+	struct post_data *post;
 	unsigned int i;
 
-	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	for (i = 0; i < loop->list_size; i++) {
+		struct mainloop_data *data = loop->list[i];
+
+		loop->list[i] = NULL;
+
+		if (data) {
+			loop->fd_count--;
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd,
+									NULL);
+
+			if (data->destroy)
+				data->destroy(data->user_data);
+
+			free(data);
+		}
+	}
+
+	free(loop->events);
+	loop->events = NULL;
+	loop->events_size = 0;
+
+	/* Calls that never made it to the loop only get their destroy */
+	post = loop_take_posts(loop, true);
+
+	while (post) {
+		struct post_data *next = post->next;
+
+		if (post->destroy)
+			post->destroy(post->user_data);
+
+		free(post);
+		post = next;
+	}
+
+	if (loop->epoll_fd >= 0) {
+		close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+	}
+}
+
+void mainloop_init(void)
+{
+	loop_setup(&default_loop);
+}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+struct mainloop *mainloop_new(void)
+{
+	struct mainloop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop)
+		return NULL;
+
+	loop->epoll_fd = -1;
+	loop->wakeup_fd = -1;
+	loop->exit_status = EXIT_SUCCESS;
+	loop->events_max = DEFAULT_MAX_EPOLL_EVENTS;
+	pthread_mutex_init(&loop->post_lock, NULL);
+
+	if (!loop_setup(loop)) {
+		pthread_mutex_destroy(&loop->post_lock);
+		free(loop);
+		return NULL;
+	}
 
-	epoll_terminate = 0;
+	return loop;
+}
+
+void mainloop_free(struct mainloop *loop)
+{
+	if (!loop || loop == &default_loop)
+		return;
+
+	/* Entries left behind if the loop was never run */
+	if (loop->epoll_fd >= 0)
+		loop_teardown(loop);
+
+	pthread_mutex_destroy(&loop->post_lock);
+	free(loop->list);
+	free(loop);
+}
+
+struct mainloop *mainloop_get_default(void)
+{
+	return &default_loop;
+}
+
+struct mainloop *mainloop_get_current(void)
+{
+	return current_loop ? current_loop : &default_loop;
+}
+
+void mainloop_set_current(struct mainloop *loop)
+{
+	current_loop = loop;
+}
+
+void *mainloop_loop_get_timeout_data(struct mainloop *loop)
+{
+	return loop->timeout_data;
+}
+
+void mainloop_loop_set_timeout_data(struct mainloop *loop, void *data)
+{
+	loop->timeout_data = data;
+}
+
+static bool loop_list_grow(struct mainloop *loop, int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size;
+
+	if ((unsigned int) fd < loop->list_size)
+		return true;
+
+	size = loop->list_size ? loop->list_size : MIN_MAINLOOP_ENTRIES;
+	while (size <= (unsigned int) fd)
+		size <<= 1;
+
+	list = realloc(loop->list, size * sizeof(*list));
+	if (!list)
+		return false;
+
+	memset(list + loop->list_size, 0,
+				(size - loop->list_size) * sizeof(*list));
+
+	loop->list = list;
+	loop->list_size = size;
+
+	return true;
+}
+
+static struct mainloop_data *loop_lookup(struct mainloop *loop, int fd)
+{
+	if (fd < 0 || (unsigned int) fd >= loop->list_size)
+		return NULL;
+
+	return loop->list[fd];
+}
+
+static bool loop_events_resize(struct mainloop *loop, unsigned int size)
+{
+	struct epoll_event *events;
+
+	if (size < MIN_EPOLL_EVENTS)
+		size = MIN_EPOLL_EVENTS;
+
+	if (size == loop->events_size)
+		return true;
+
+	events = realloc(loop->events, size * sizeof(*events));
+	if (!events)
+		return false;
+
+	loop->events = events;
+	loop->events_size = size;
+
+	return true;
+}
+
+void mainloop_loop_set_max_events(struct mainloop *loop,
+						unsigned int max_events)
+{
+	if (max_events < MIN_EPOLL_EVENTS)
+		max_events = MIN_EPOLL_EVENTS;
+
+	loop->events_max = max_events;
+
+	if (loop->events_size > max_events)
+		loop_events_resize(loop, max_events);
+}
+
+void mainloop_set_max_events(unsigned int max_events)
+{
+	mainloop_loop_set_max_events(mainloop_get_current(), max_events);
+}
+
+unsigned int mainloop_loop_get_fd_count(struct mainloop *loop)
+{
+	return loop->fd_count;
+}
+
+unsigned int mainloop_get_fd_count(void)
+{
+	return mainloop_loop_get_fd_count(mainloop_get_current());
+}
+
+unsigned int mainloop_loop_get_timeout_count(struct mainloop *loop)
+{
+	return loop->timeout_count;
+}
+
+unsigned int mainloop_get_timeout_count(void)
+{
+	return mainloop_loop_get_timeout_count(mainloop_get_current());
+}
+
+static void loop_kick(struct mainloop *loop)
+{
+	uint64_t value = 1;
+
+	if (write(loop->wakeup_fd, &value, sizeof(value)) < 0)
+		return;
+}
+
+void mainloop_loop_quit(struct mainloop *loop)
+{
+	__sync_lock_test_and_set(&loop->terminate, 1);
+
+	/* Kick epoll_wait in case the loop runs on another thread */
+	pthread_mutex_lock(&loop->post_lock);
+
+	if (loop->wakeup_fd >= 0)
+		loop_kick(loop);
+
+	pthread_mutex_unlock(&loop->post_lock);
+}
+
+int mainloop_loop_post(struct mainloop *loop, mainloop_post_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct post_data *data;
+	bool kick;
+
+	if (!loop || !callback)
+		return -EINVAL;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	memset(data, 0, sizeof(*data));
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	pthread_mutex_lock(&loop->post_lock);
+
+	if (loop->wakeup_fd < 0) {
+		pthread_mutex_unlock(&loop->post_lock);
+		free(data);
+		return -ENOTCONN;
+	}
+
+	kick = !loop->post_head;
+
+	if (loop->post_tail)
+		loop->post_tail->next = data;
+	else
+		loop->post_head = data;
+
+	loop->post_tail = data;
+
+	/* A non-empty list already has a wakeup pending */
+	if (kick)
+		loop_kick(loop);
+
+	pthread_mutex_unlock(&loop->post_lock);
+
+	return 0;
 }
 
 void mainloop_quit(void)
 {
-	epoll_terminate = 1;
+	mainloop_loop_quit(mainloop_get_current());
 }
 
 void mainloop_exit_success(void)
 {
-	exit_status = EXIT_SUCCESS;
-	epoll_terminate = 1;
+	struct mainloop *loop = mainloop_get_current();
+
+	loop->exit_status = EXIT_SUCCESS;
+	mainloop_loop_quit(loop);
 }
 
 void mainloop_exit_failure(void)
 {
-	exit_status = EXIT_FAILURE;
-	epoll_terminate = 1;
+	struct mainloop *loop = mainloop_get_current();
+
+	loop->exit_status = EXIT_FAILURE;
+	mainloop_loop_quit(loop);
 }
 
 static void signal_callback(int fd, uint32_t events, void *user_data)
@@ -121,9 +486,102 @@ static void signal_callback(int fd, uint32_t events, void *user_data)
 		data->callback(si.ssi_signo, data->user_data);
 }
 
+static void loop_drain_wakeup(struct mainloop *loop)
+{
+	uint64_t value;
+
+	if (read(loop->wakeup_fd, &value, sizeof(value)) < 0)
+		return;
+}
+
+static void loop_run_posts(struct mainloop *loop)
+{
+	struct post_data *post = loop_take_posts(loop, false);
+
+	while (post) {
+		struct post_data *next = post->next;
+
+		post->callback(post->user_data);
+
+		if (post->destroy)
+			post->destroy(post->user_data);
+
+		free(post);
+		post = next;
+	}
+}
+
+static void loop_dispatch(struct mainloop *loop)
+{
+	int n, nfds;
+
+	nfds = epoll_wait(loop->epoll_fd, loop->events, loop->events_size, -1);
+	if (nfds < 0)
+		return;
+
+	for (n = 0; n < nfds; n++) {
+		struct mainloop_data *data;
+		int fd = loop->events[n].data.fd;
+
+		/* Drained first so that a post racing with us kicks again */
+		if (fd == loop->wakeup_fd) {
+			loop_drain_wakeup(loop);
+			loop_run_posts(loop);
+			continue;
+		}
+
+		/*
+		 * Look the fd up again since an earlier callback in this
+		 * batch may have removed it.
+		 */
+		data = loop_lookup(loop, fd);
+		if (!data)
+			continue;
+
+		data->callback(data->fd, loop->events[n].events,
+							data->user_data);
+	}
+
+	/*
+	 * Grow the batch while the kernel keeps filling it and shrink it
+	 * again once the load goes away.
+	 */
+	if ((unsigned int) nfds == loop->events_size &&
+					loop->events_size < loop->events_max)
+		loop_events_resize(loop, MIN(loop->events_size * 2,
+							loop->events_max));
+	else if ((unsigned int) nfds < loop->events_size / 4)
+		loop_events_resize(loop, loop->events_size / 2);
+}
+
+int mainloop_loop_run(struct mainloop *loop)
+{
+	struct mainloop *previous = current_loop;
+
+	/* Torn down by a previous run, its entries are gone */
+	if (loop->epoll_fd < 0)
+		return EXIT_FAILURE;
+
+	if (!loop->events && !loop_events_resize(loop, MIN_EPOLL_EVENTS))
+		return EXIT_FAILURE;
+
+	current_loop = loop;
+
+	while (!__atomic_load_n(&loop->terminate, __ATOMIC_ACQUIRE))
+		loop_dispatch(loop);
+
+	loop_teardown(loop);
+
+	current_loop = previous;
+
+	return loop->exit_status;
+}
+
 int mainloop_run(void)
 {
-	unsigned int i;
+	/* Not set up by mainloop_init() since the last run */
+	if (default_loop.epoll_fd < 0)
+		return EXIT_FAILURE;
 
 	if (signal_data) {
 		if (sigprocmask(SIG_BLOCK, &signal_data->mask, NULL) < 0)
@@ -134,68 +592,55 @@ int mainloop_run(void)
 		if (signal_data->fd < 0)
 			return EXIT_FAILURE;
 
-		if (mainloop_add_fd(signal_data->fd, EPOLLIN,
-				signal_callback, signal_data, NULL) < 0) {
+		if (mainloop_loop_add_fd(&default_loop, signal_data->fd,
+					EPOLLIN, signal_callback,
+					signal_data, NULL) < 0) {
 			close(signal_data->fd);
 			return EXIT_FAILURE;
 		}
 	}
 
-	while (!epoll_terminate) {
-		struct epoll_event events[MAX_EPOLL_EVENTS];
-		int n, nfds;
-
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		if (nfds < 0)
-			continue;
+	if (!default_loop.events &&
+			!loop_events_resize(&default_loop, MIN_EPOLL_EVENTS))
+		return EXIT_FAILURE;
 
-		for (n = 0; n < nfds; n++) {
-			struct mainloop_data *data = events[n].data.ptr;
+	current_loop = &default_loop;
 
-			data->callback(data->fd, events[n].events,
-							data->user_data);
-		}
-	}
+	while (!__atomic_load_n(&default_loop.terminate, __ATOMIC_ACQUIRE))
+		loop_dispatch(&default_loop);
 
 	if (signal_data) {
-		mainloop_remove_fd(signal_data->fd);
+		mainloop_loop_remove_fd(&default_loop, signal_data->fd);
 		close(signal_data->fd);
 
 		if (signal_data->destroy)
 			signal_data->destroy(signal_data->user_data);
 	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
-		struct mainloop_data *data = mainloop_list[i];
-
-		mainloop_list[i] = NULL;
-
-		if (data) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
-
-			if (data->destroy)
-				data->destroy(data->user_data);
-
-			free(data);
-		}
-	}
+	loop_teardown(&default_loop);
 
-	close(epoll_fd);
-	epoll_fd = 0;
+	current_loop = NULL;
 
-	return exit_status;
+	return default_loop.exit_status;
 }
 
-int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+int mainloop_loop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback,
 				void *user_data, mainloop_destroy_func destroy)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
+	if (!loop || fd < 0 || !callback)
 		return -EINVAL;
 
+	if (loop_lookup(loop, fd))
+		return -EEXIST;
+
+	if (!loop_list_grow(loop, fd))
+		return -ENOMEM;
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
@@ -209,37 +654,45 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
-	ev.data.ptr = data;
+	ev.data.fd = fd;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
 	if (err < 0) {
 		free(data);
 		return err;
 	}
 
-	mainloop_list[fd] = data;
+	loop->list[fd] = data;
+	loop->fd_count++;
 
 	return 0;
 }
 
-int mainloop_modify_fd(int fd, uint32_t events)
+int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_loop_add_fd(mainloop_get_current(), fd, events,
+						callback, user_data, destroy);
+}
+
+int mainloop_loop_modify_fd(struct mainloop *loop, int fd, uint32_t events)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (!loop || fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = loop_lookup(loop, fd);
 	if (!data)
 		return -ENXIO;
 
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
-	ev.data.ptr = data;
+	ev.data.fd = fd;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
 	if (err < 0)
 		return err;
 
@@ -248,21 +701,27 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	return 0;
 }
 
-int mainloop_remove_fd(int fd)
+int mainloop_modify_fd(int fd, uint32_t events)
+{
+	return mainloop_loop_modify_fd(mainloop_get_current(), fd, events);
+}
+
+int mainloop_loop_remove_fd(struct mainloop *loop, int fd)
 {
 	struct mainloop_data *data;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (!loop || fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = loop_lookup(loop, fd);
 	if (!data)
 		return -ENXIO;
 
-	mainloop_list[fd] = NULL;
+	loop->list[fd] = NULL;
+	loop->fd_count--;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
 
 	if (data->destroy)
 		data->destroy(data->user_data);
@@ -272,6 +731,11 @@ int mainloop_remove_fd(int fd)
 	return err;
 }
 
+int mainloop_remove_fd(int fd)
+{
+	return mainloop_loop_remove_fd(mainloop_get_current(), fd);
+}
+
 static void timeout_destroy(void *user_data)
 {
 	struct timeout_data *data = user_data;
@@ -279,6 +743,8 @@ static void timeout_destroy(void *user_data)
 	close(data->fd);
 	data->fd = -1;
 
+	data->loop->timeout_count--;
+
 	if (data->destroy)
 		data->destroy(data->user_data);
 
@@ -316,12 +782,13 @@ static inline int timeout_set(int fd, unsigned int msec)
 	return timerfd_settime(fd, 0, &itimer, NULL);
 }
 
-int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+int mainloop_loop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback,
 				void *user_data, mainloop_destroy_func destroy)
 {
 	struct timeout_data *data;
 
-	if (!callback)
+	if (!loop || !callback)
 		return -EINVAL;
 
 	data = malloc(sizeof(*data));
@@ -329,6 +796,7 @@ int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 		return -ENOMEM;
 
 	memset(data, 0, sizeof(*data));
+	data->loop = loop;
 	data->callback = callback;
 	data->destroy = destroy;
 	data->user_data = user_data;
@@ -347,32 +815,52 @@ int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 		}
 	}
 
-	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
+	if (mainloop_loop_add_fd(loop, data->fd, EPOLLIN | EPOLLONESHOT,
 				timeout_callback, data, timeout_destroy) < 0) {
 		close(data->fd);
 		free(data);
 		return -EIO;
 	}
 
+	loop->timeout_count++;
+
 	return data->fd;
 }
 
-int mainloop_modify_timeout(int id, unsigned int msec)
+int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_loop_add_timeout(mainloop_get_current(), msec,
+					callback, user_data, destroy);
+}
+
+int mainloop_loop_modify_timeout(struct mainloop *loop, int id,
+							unsigned int msec)
 {
 	if (msec > 0) {
 		if (timeout_set(id, msec) < 0)
 			return -EIO;
 	}
 
-	if (mainloop_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
+	if (mainloop_loop_modify_fd(loop, id, EPOLLIN | EPOLLONESHOT) < 0)
 		return -EIO;
 
 	return 0;
 }
 
+int mainloop_modify_timeout(int id, unsigned int msec)
+{
+	return mainloop_loop_modify_timeout(mainloop_get_current(), id, msec);
+}
+
+int mainloop_loop_remove_timeout(struct mainloop *loop, int id)
+{
+	return mainloop_loop_remove_fd(loop, id);
+}
+
 int mainloop_remove_timeout(int id)
 {
-	return mainloop_remove_fd(id);
+	return mainloop_loop_remove_timeout(mainloop_get_current(), id);
 }
 
 int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
@@ -28,11 +28,20 @@
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
 
+/*
+ * Entries of popped and removed data are kept for reuse, up to this many
+ * per queue, so that a queue cycling through a steady number of items does
+ * not allocate at all.
+ */
+#define QUEUE_ENTRY_CACHE_MAX	32
+
 struct queue {
 	int ref_count;
 	struct queue_entry *head;
 	struct queue_entry *tail;
 	unsigned int entries;
+	struct queue_entry *free_entries;	/* Linked through next */
+	unsigned int free_count;
 };
 
 static struct queue *queue_ref(struct queue *queue)
@@ -47,9 +56,16 @@ static struct queue *queue_ref(struct queue *queue)
 
 static void queue_unref(struct queue *queue)
 {
+	struct queue_entry *entry;
+
 	if (__sync_sub_and_fetch(&queue->ref_count, 1))
 		return;
 
+	while ((entry = queue->free_entries)) {
+		queue->free_entries = entry->next;
+		free(entry);
+	}
+
 	free(queue);
 }
 
@@ -75,16 +91,52 @@ void queue_destroy(struct queue *queue, queue_destroy_func_t destroy)
 	queue_unref(queue);
 }
 
-static struct queue_entry *queue_entry_new(void *data)
+static struct queue_entry *queue_entry_new(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
 
-	entry = new0(struct queue_entry, 1);
+	entry = queue->free_entries;
+	if (entry) {
+		queue->free_entries = entry->next;
+		queue->free_count--;
+		entry->next = NULL;
+		entry->prev = NULL;
+	} else
+		entry = new0(struct queue_entry, 1);
+
 	entry->data = data;
 
 	return entry;
 }
 
+static void queue_entry_free(struct queue *queue, struct queue_entry *entry)
+{
+	if (queue->free_count >= QUEUE_ENTRY_CACHE_MAX) {
+		free(entry);
+		return;
+	}
+
+	entry->data = NULL;
+	entry->next = queue->free_entries;
+	queue->free_entries = entry;
+	queue->free_count++;
+}
+
+static void queue_unlink(struct queue *queue, struct queue_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		queue->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		queue->tail = entry->prev;
+
+	queue->entries--;
+}
+
 bool queue_push_tail(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
@@ -92,7 +144,8 @@ bool queue_push_tail(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
+	entry->prev = queue->tail;
 
 	if (queue->tail)
 		queue->tail->next = entry;
@@ -107,6 +160,26 @@ bool queue_push_tail(struct queue *queue, void *data)
 	return true;
 }
 
+struct queue_entry *queue_push_tail_entry(struct queue *queue, void *data)
+{
+	if (!queue_push_tail(queue, data))
+		return NULL;
+
+	return queue->tail;
+}
+
+bool queue_remove_entry(struct queue *queue, struct queue_entry *entry)
+{
+	/* Taken out by queue_remove_all, whose destroy function is running */
+	if (!queue || !entry || entry->prev == entry)
+		return false;
+
+	queue_unlink(queue, entry);
+	queue_entry_free(queue, entry);
+
+	return true;
+}
+
 bool queue_push_head(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
@@ -114,10 +187,13 @@ bool queue_push_head(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 
 	entry->next = queue->head;
 
+	if (queue->head)
+		queue->head->prev = entry;
+
 	queue->head = entry;
 
 	if (!queue->tail)
@@ -147,12 +223,15 @@ bool queue_push_after(struct queue *queue, void *entry, void *data)
 	if (!qentry)
 		return false;
 
-	new_entry = queue_entry_new(data);
+	new_entry = queue_entry_new(queue, data);
 
 	new_entry->next = qentry->next;
+	new_entry->prev = qentry;
 
 	if (!qentry->next)
 		queue->tail = new_entry;
+	else
+		qentry->next->prev = new_entry;
 
 	qentry->next = new_entry;
 	queue->entries++;
@@ -160,6 +239,14 @@ bool queue_push_after(struct queue *queue, void *entry, void *data)
 	return true;
 }
 
+struct queue_entry *queue_push_head_entry(struct queue *queue, void *data)
+{
+	if (!queue_push_head(queue, data))
+		return NULL;
+
+	return queue->head;
+}
+
 void *queue_pop_head(struct queue *queue)
 {
 	struct queue_entry *entry;
@@ -170,16 +257,11 @@ void *queue_pop_head(struct queue *queue)
 
 	entry = queue->head;
 
-	if (!queue->head->next) {
-		queue->head = NULL;
-		queue->tail = NULL;
-	} else
-		queue->head = queue->head->next;
+	queue_unlink(queue, entry);
 
 	data = entry->data;
 
-	free(entry);
-	queue->entries--;
+	queue_entry_free(queue, entry);
 
 	return data;
 }
@@ -248,26 +330,17 @@ void *queue_find(struct queue *queue, queue_match_func_t function,
 
 bool queue_remove(struct queue *queue, void *data)
 {
-	struct queue_entry *entry, *prev;
+	struct queue_entry *entry;
 
 	if (!queue)
 		return false;
 
-	for (entry = queue->head, prev = NULL; entry;
-					prev = entry, entry = entry->next) {
+	for (entry = queue->head; entry; entry = entry->next) {
 		if (entry->data != data)
 			continue;
 
-		if (prev)
-			prev->next = entry->next;
-		else
-			queue->head = entry->next;
-
-		if (!entry->next)
-			queue->tail = prev;
-
-		free(entry);
-		queue->entries--;
+		queue_unlink(queue, entry);
+		queue_entry_free(queue, entry);
 
 		return true;
 	}
@@ -278,7 +351,7 @@ bool queue_remove(struct queue *queue, void *data)
 void *queue_remove_if(struct queue *queue, queue_match_func_t function,
 							void *user_data)
 {
-	struct queue_entry *entry, *prev = NULL;
+	struct queue_entry *entry;
 
 	if (!queue)
 		return NULL;
@@ -286,30 +359,18 @@ void *queue_remove_if(struct queue *queue, queue_match_func_t function,
 	if (!function)
 		function = direct_match;
 
-	entry = queue->head;
+	for (entry = queue->head; entry; entry = entry->next) {
+		void *data;
 
-	while (entry) {
-		if (function(entry->data, user_data)) {
-			void *data;
-
-			if (prev)
-				prev->next = entry->next;
-			else
-				queue->head = entry->next;
-
-			if (!entry->next)
-				queue->tail = prev;
+		if (!function(entry->data, user_data))
+			continue;
 
-			data = entry->data;
+		data = entry->data;
 
-			free(entry);
-			queue->entries--;
+		queue_unlink(queue, entry);
+		queue_entry_free(queue, entry);
 
-			return data;
-		} else {
-			prev = entry;
-			entry = entry->next;
-		}
+		return data;
 	}
 
 	return NULL;
@@ -341,19 +402,28 @@ unsigned int queue_remove_all(struct queue *queue, queue_match_func_t function,
 			count++;
 		}
 	} else {
+		struct queue_entry *tmp;
+
 		queue->head = NULL;
 		queue->tail = NULL;
 		queue->entries = 0;
 
+		/*
+		 * Mark the entries as detached first, destroy may try to take
+		 * any of them out through queue_remove_entry.
+		 */
+		for (tmp = entry; tmp; tmp = tmp->next)
+			tmp->prev = tmp;
+
 		while (entry) {
-			struct queue_entry *tmp = entry;
+			tmp = entry;
 
 			entry = entry->next;
 
 			if (destroy)
 				destroy(tmp->data);
 
-			free(tmp);
+			queue_entry_free(queue, tmp);
 			count++;
 		}
 	}
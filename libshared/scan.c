@@ -0,0 +1,759 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
+
+#include "src/shared/io.h"
+#include "src/shared/util.h"
+#include "src/shared/hci.h"
+#include "src/shared/scan.h"
+
+/* Events taken from the socket per wakeup */
+#define SCAN_RX_BATCH		64
+#define SCAN_PKT_SIZE		(1 + HCI_MAX_EVENT_SIZE)
+
+/* Reports handed to the callback at most at once */
+#define SCAN_MAX_REPORTS	256
+
+/* Room for bursts while the mainloop is busy elsewhere */
+#define SCAN_RCVBUF		(1024 * 1024)
+
+#define DEFAULT_DEDUP_ENTRIES	4096
+#define DEFAULT_DEDUP_WINDOW_MS	10000
+
+/* Slots looked at before the oldest one is reused */
+#define DEDUP_PROBES		8
+
+#define AD_TYPE_FLAGS			0x01
+#define AD_TYPE_UUID16_SOME		0x02
+#define AD_TYPE_UUID16_ALL		0x03
+#define AD_TYPE_NAME_SHORT		0x08
+#define AD_TYPE_NAME_COMPLETE		0x09
+#define AD_TYPE_TX_POWER		0x0a
+#define AD_TYPE_SERVICE_DATA16		0x16
+#define AD_TYPE_APPEARANCE		0x19
+#define AD_TYPE_MANUFACTURER_DATA	0xff
+
+struct dedup_entry {
+	uint64_t key;			/* 0 for unused */
+	uint32_t seen_ms;
+};
+
+struct bt_scan {
+	int ref_count;
+	struct bt_hci *hci;
+	struct io *io;
+
+	uint8_t *rx_bufs;
+	struct iovec rx_iov[SCAN_RX_BATCH];
+	struct mmsghdr rx_msgs[SCAN_RX_BATCH];
+
+	struct bt_scan_report *reports;
+	unsigned int num_reports;
+
+	struct dedup_entry *dedup;
+	uint64_t dedup_mask;
+	uint32_t dedup_window;
+	uint32_t now_ms;
+
+	bt_scan_report_func_t report_callback;
+	bt_scan_destroy_func_t report_destroy;
+	void *report_data;
+
+	/* Start: disable, set parameters, enable, one after the other */
+	unsigned int cmd_id;
+	uint8_t type;
+	uint16_t interval;
+	uint16_t window;
+	uint8_t own_type;
+	bt_hci_status_func_t start_callback;
+	bt_hci_destroy_func_t start_destroy;
+	void *start_data;
+
+	struct bt_scan_stats stats;
+	uint32_t rate_start_ms;
+	unsigned int rate_reports;
+	unsigned int rate_delivered;
+};
+
+static uint32_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void update_rate(struct bt_scan *scan, uint32_t now)
+{
+	uint32_t elapsed = now - scan->rate_start_ms;
+
+	if (elapsed < 1000)
+		return;
+
+	scan->stats.reports_per_sec = (uint64_t) scan->rate_reports * 1000 /
+								elapsed;
+	scan->stats.delivered_per_sec = (uint64_t) scan->rate_delivered *
+								1000 / elapsed;
+	scan->rate_reports = 0;
+	scan->rate_delivered = 0;
+	scan->rate_start_ms = now;
+}
+
+static void flush_reports(struct bt_scan *scan)
+{
+	unsigned int count = scan->num_reports;
+
+	if (!count)
+		return;
+
+	scan->num_reports = 0;
+	scan->stats.batches++;
+	scan->stats.delivered += count;
+	scan->rate_delivered += count;
+
+	if (scan->report_callback)
+		scan->report_callback(scan->reports, count, scan->report_data);
+}
+
+/* FNV-1a over what makes a report the same as an earlier one */
+static uint64_t report_key(const uint8_t *addr, uint8_t addr_type,
+					uint8_t evt_type, const uint8_t *data,
+					uint8_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	for (i = 0; i < 6; i++)
+		hash = (hash ^ addr[i]) * 0x100000001b3ULL;
+
+	hash = (hash ^ addr_type) * 0x100000001b3ULL;
+	hash = (hash ^ evt_type) * 0x100000001b3ULL;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+	return hash ? hash : 1;
+}
+
+/*
+ * Open addressing without deletion: an unused slot ends the probe, since
+ * nothing was ever stored past it.
+ */
+static bool dedup_seen(struct bt_scan *scan, uint64_t key)
+{
+	struct dedup_entry *entry, *oldest = NULL;
+	uint32_t now = scan->now_ms;
+	unsigned int i;
+
+	if (!scan->dedup)
+		return false;
+
+	for (i = 0; i < DEDUP_PROBES; i++) {
+		entry = &scan->dedup[(key + i) & scan->dedup_mask];
+
+		if (entry->key == key) {
+			if (scan->dedup_window &&
+				now - entry->seen_ms >= scan->dedup_window) {
+				entry->seen_ms = now;
+				return false;
+			}
+
+			return true;
+		}
+
+		if (!entry->key) {
+			oldest = entry;
+			break;
+		}
+
+		if (!oldest || now - entry->seen_ms > now - oldest->seen_ms)
+			oldest = entry;
+	}
+
+	if (oldest->key)
+		scan->stats.evictions++;
+
+	oldest->key = key;
+	oldest->seen_ms = now;
+
+	return false;
+}
+
+static void parse_ad(struct bt_scan_report *report)
+{
+	const uint8_t *data = report->data;
+	uint8_t i = 0, len, type, field, flen;
+
+	while (i < report->data_len) {
+		len = data[i];
+
+		/* A zero length ends the significant part */
+		if (!len || len > report->data_len - i - 1)
+			break;
+
+		type = data[i + 1];
+		field = i + 2;
+		flen = len - 1;
+
+		switch (type) {
+		case AD_TYPE_FLAGS:
+			if (flen)
+				report->flags = data[field];
+			break;
+		case AD_TYPE_UUID16_SOME:
+		case AD_TYPE_UUID16_ALL:
+			if (!report->uuid16_offset && flen) {
+				report->uuid16_offset = field;
+				report->uuid16_len = flen;
+			}
+			break;
+		case AD_TYPE_NAME_SHORT:
+		case AD_TYPE_NAME_COMPLETE:
+			if (!report->name_offset ||
+					type == AD_TYPE_NAME_COMPLETE) {
+				report->name_offset = field;
+				report->name_len = flen;
+			}
+			break;
+		case AD_TYPE_TX_POWER:
+			if (flen)
+				report->tx_power = (int8_t) data[field];
+			break;
+		case AD_TYPE_SERVICE_DATA16:
+			if (!report->svc_data_offset && flen >= 2) {
+				report->svc_data_offset = field;
+				report->svc_data_len = flen;
+			}
+			break;
+		case AD_TYPE_APPEARANCE:
+			if (flen >= 2)
+				report->appearance = get_le16(data + field);
+			break;
+		case AD_TYPE_MANUFACTURER_DATA:
+			if (!report->mfr_offset && flen >= 2) {
+				report->company_id = get_le16(data + field);
+				report->mfr_offset = field + 2;
+				report->mfr_len = flen - 2;
+			}
+			break;
+		}
+
+		i += len + 1;
+	}
+}
+
+static void add_report(struct bt_scan *scan, const le_advertising_info *info,
+								int8_t rssi)
+{
+	struct bt_scan_report *report;
+
+	if (scan->num_reports == SCAN_MAX_REPORTS)
+		flush_reports(scan);
+
+	report = &scan->reports[scan->num_reports++];
+
+	memset(report, 0, sizeof(*report));
+	bacpy(&report->addr, &info->bdaddr);
+	report->addr_type = info->bdaddr_type;
+	report->evt_type = info->evt_type;
+	report->rssi = rssi;
+	report->tx_power = BT_SCAN_TX_POWER_NONE;
+	report->data_len = info->length;
+	memcpy(report->data, info->data, info->length);
+
+	parse_ad(report);
+}
+
+/* Reports follow each other, every one ending with its RSSI */
+static void process_reports(struct bt_scan *scan, const uint8_t *data,
+								size_t len)
+{
+	const le_advertising_info *info;
+	uint8_t num, i;
+	uint64_t key;
+
+	if (!len) {
+		scan->stats.malformed++;
+		return;
+	}
+
+	num = data[0];
+	data++;
+	len--;
+
+	for (i = 0; i < num; i++) {
+		scan->stats.reports++;
+		scan->rate_reports++;
+
+		info = (const void *) data;
+
+		if (len < LE_ADVERTISING_INFO_SIZE + 1 ||
+					info->length > BT_SCAN_AD_MAX ||
+					len < LE_ADVERTISING_INFO_SIZE +
+							info->length + 1) {
+			scan->stats.malformed += num - i;
+			return;
+		}
+
+		key = report_key(info->bdaddr.b, info->bdaddr_type,
+					info->evt_type, info->data,
+					info->length);
+
+		if (dedup_seen(scan, key))
+			scan->stats.duplicates++;
+		else
+			add_report(scan, info,
+				(int8_t) data[LE_ADVERTISING_INFO_SIZE +
+								info->length]);
+
+		data += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+		len -= LE_ADVERTISING_INFO_SIZE + info->length + 1;
+	}
+}
+
+static void process_packet(struct bt_scan *scan, const uint8_t *buf,
+								size_t len)
+{
+	const hci_event_hdr *hdr = (const void *) (buf + 1);
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE ||
+						buf[0] != HCI_EVENT_PKT)
+		return;
+
+	if (hdr->evt != EVT_LE_META_EVENT ||
+			buf[1 + HCI_EVENT_HDR_SIZE] != EVT_LE_ADVERTISING_REPORT)
+		return;
+
+	scan->stats.events++;
+
+	if (hdr->plen < EVT_LE_META_EVENT_SIZE ||
+				hdr->plen > len - 1 - HCI_EVENT_HDR_SIZE) {
+		scan->stats.malformed++;
+		return;
+	}
+
+	process_reports(scan, buf + 1 + HCI_EVENT_HDR_SIZE +
+						EVT_LE_META_EVENT_SIZE,
+					hdr->plen - EVT_LE_META_EVENT_SIZE);
+}
+
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_scan *scan = user_data;
+	int n, i;
+
+	n = recvmmsg(io_get_fd(io), scan->rx_msgs, SCAN_RX_BATCH,
+							MSG_DONTWAIT, NULL);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (!n)
+		return false;
+
+	bt_scan_ref(scan);
+
+	scan->now_ms = now_ms();
+
+	for (i = 0; i < n; i++)
+		process_packet(scan, scan->rx_iov[i].iov_base,
+						scan->rx_msgs[i].msg_len);
+
+	/* One batch per wakeup, however many events it took */
+	flush_reports(scan);
+	update_rate(scan, scan->now_ms);
+
+	bt_scan_unref(scan);
+
+	return true;
+}
+
+static bool dedup_alloc(struct bt_scan *scan, unsigned int entries)
+{
+	struct dedup_entry *dedup;
+	uint64_t size = 1;
+
+	if (!entries) {
+		free(scan->dedup);
+		scan->dedup = NULL;
+		scan->dedup_mask = 0;
+		return true;
+	}
+
+	while (size < entries)
+		size <<= 1;
+
+	/* The probe sequence has to fit */
+	if (size < DEDUP_PROBES)
+		size = DEDUP_PROBES;
+
+	dedup = calloc(size, sizeof(*dedup));
+	if (!dedup)
+		return false;
+
+	free(scan->dedup);
+	scan->dedup = dedup;
+	scan->dedup_mask = size - 1;
+
+	return true;
+}
+
+static void scan_free(struct bt_scan *scan)
+{
+	if (scan->cmd_id)
+		bt_hci_cancel(scan->hci, scan->cmd_id);
+
+	if (scan->start_destroy)
+		scan->start_destroy(scan->start_data);
+
+	if (scan->report_destroy)
+		scan->report_destroy(scan->report_data);
+
+	io_destroy(scan->io);
+	bt_hci_unref(scan->hci);
+
+	free(scan->dedup);
+	free(scan->reports);
+	free(scan->rx_bufs);
+	free(scan);
+}
+
+struct bt_scan *bt_scan_new(struct bt_hci *hci, int fd)
+{
+	struct bt_scan *scan;
+	unsigned int i;
+
+	if (!hci || fd < 0)
+		return NULL;
+
+	scan = new0(struct bt_scan, 1);
+
+	scan->rx_bufs = malloc(SCAN_RX_BATCH * SCAN_PKT_SIZE);
+	scan->reports = malloc(SCAN_MAX_REPORTS * sizeof(*scan->reports));
+	if (!scan->rx_bufs || !scan->reports)
+		goto fail;
+
+	for (i = 0; i < SCAN_RX_BATCH; i++) {
+		scan->rx_iov[i].iov_base = scan->rx_bufs + i * SCAN_PKT_SIZE;
+		scan->rx_iov[i].iov_len = SCAN_PKT_SIZE;
+		scan->rx_msgs[i].msg_hdr.msg_iov = &scan->rx_iov[i];
+		scan->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	scan->dedup_window = DEFAULT_DEDUP_WINDOW_MS;
+	if (!dedup_alloc(scan, DEFAULT_DEDUP_ENTRIES))
+		goto fail;
+
+	scan->io = io_new(fd);
+	if (!scan->io)
+		goto fail;
+
+	if (!io_set_read_handler(scan->io, can_read_data, scan, NULL)) {
+		io_destroy(scan->io);
+		goto fail;
+	}
+
+	scan->hci = bt_hci_ref(hci);
+	scan->rate_start_ms = now_ms();
+
+	return bt_scan_ref(scan);
+
+fail:
+	free(scan->dedup);
+	free(scan->reports);
+	free(scan->rx_bufs);
+	free(scan);
+
+	return NULL;
+}
+
+static int raw_socket(uint16_t index, const struct hci_filter *flt)
+{
+	struct sockaddr_hci addr;
+	int fd;
+
+	fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+								BTPROTO_HCI);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = index;
+	addr.hci_channel = HCI_CHANNEL_RAW;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			setsockopt(fd, SOL_HCI, HCI_FILTER, flt,
+							sizeof(*flt)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Two sockets, so that the command side never has to wade through
+ * advertising reports and the report side never sees anything else.
+ */
+struct bt_scan *bt_scan_new_raw_device(uint16_t index)
+{
+	struct hci_filter flt;
+	struct bt_hci *hci;
+	struct bt_scan *scan;
+	int cmd_fd, evt_fd, size = SCAN_RCVBUF;
+
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+	hci_filter_set_event(EVT_CMD_STATUS, &flt);
+
+	cmd_fd = raw_socket(index, &flt);
+	if (cmd_fd < 0)
+		return NULL;
+
+	hci = bt_hci_new(cmd_fd);
+	if (!hci) {
+		close(cmd_fd);
+		return NULL;
+	}
+
+	bt_hci_set_close_on_unref(hci, true);
+
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_event(EVT_LE_META_EVENT, &flt);
+
+	evt_fd = raw_socket(index, &flt);
+	if (evt_fd < 0) {
+		bt_hci_unref(hci);
+		return NULL;
+	}
+
+	setsockopt(evt_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	scan = bt_scan_new(hci, evt_fd);
+	bt_hci_unref(hci);
+
+	if (!scan) {
+		close(evt_fd);
+		return NULL;
+	}
+
+	bt_scan_set_close_on_unref(scan, true);
+
+	return scan;
+}
+
+struct bt_scan *bt_scan_ref(struct bt_scan *scan)
+{
+	if (!scan)
+		return NULL;
+
+	__sync_fetch_and_add(&scan->ref_count, 1);
+
+	return scan;
+}
+
+void bt_scan_unref(struct bt_scan *scan)
+{
+	if (!scan)
+		return;
+
+	if (__sync_sub_and_fetch(&scan->ref_count, 1))
+		return;
+
+	scan_free(scan);
+}
+
+bool bt_scan_set_close_on_unref(struct bt_scan *scan, bool do_close)
+{
+	if (!scan)
+		return false;
+
+	return io_set_close_on_destroy(scan->io, do_close);
+}
+
+bool bt_scan_set_report_handler(struct bt_scan *scan,
+					bt_scan_report_func_t callback,
+					void *user_data,
+					bt_scan_destroy_func_t destroy)
+{
+	if (!scan)
+		return false;
+
+	if (scan->report_destroy)
+		scan->report_destroy(scan->report_data);
+
+	scan->report_callback = callback;
+	scan->report_destroy = destroy;
+	scan->report_data = user_data;
+
+	return true;
+}
+
+bool bt_scan_set_dedup(struct bt_scan *scan, unsigned int entries,
+						unsigned int window_ms)
+{
+	if (!scan)
+		return false;
+
+	if (!dedup_alloc(scan, entries))
+		return false;
+
+	scan->dedup_window = window_ms;
+
+	return true;
+}
+
+static void start_complete(struct bt_scan *scan, uint8_t status)
+{
+	bt_hci_status_func_t callback = scan->start_callback;
+	bt_hci_destroy_func_t destroy = scan->start_destroy;
+	void *user_data = scan->start_data;
+
+	scan->cmd_id = 0;
+	scan->start_callback = NULL;
+	scan->start_destroy = NULL;
+	scan->start_data = NULL;
+
+	if (callback)
+		callback(status, user_data);
+
+	if (destroy)
+		destroy(user_data);
+}
+
+static void start_enable_cb(uint8_t status, void *user_data)
+{
+	start_complete(user_data, status);
+}
+
+static void start_params_cb(uint8_t status, void *user_data)
+{
+	struct bt_scan *scan = user_data;
+
+	if (status) {
+		start_complete(scan, status);
+		return;
+	}
+
+	scan->cmd_id = bt_hci_le_set_scan_enable(scan->hci, 0x01, 0x00,
+						start_enable_cb, scan, NULL);
+	if (!scan->cmd_id)
+		start_complete(scan, HCI_UNSPECIFIED_ERROR);
+}
+
+/* Parameters cannot change while scanning, so any status is fine here */
+static void start_disable_cb(uint8_t status, void *user_data)
+{
+	struct bt_scan *scan = user_data;
+
+	scan->cmd_id = bt_hci_le_set_scan_parameters(scan->hci, scan->type,
+						scan->interval, scan->window,
+						scan->own_type, 0x00,
+						start_params_cb, scan, NULL);
+	if (!scan->cmd_id)
+		start_complete(scan, HCI_UNSPECIFIED_ERROR);
+}
+
+bool bt_scan_start(struct bt_scan *scan, uint8_t type, uint16_t interval,
+					uint16_t window, uint8_t own_type,
+					bt_hci_status_func_t callback,
+					void *user_data,
+					bt_hci_destroy_func_t destroy)
+{
+	if (!scan || scan->cmd_id)
+		return false;
+
+	scan->cmd_id = bt_hci_le_set_scan_enable(scan->hci, 0x00, 0x00,
+						start_disable_cb, scan, NULL);
+	if (!scan->cmd_id)
+		return false;
+
+	scan->type = type;
+	scan->interval = interval;
+	scan->window = window;
+	scan->own_type = own_type;
+	scan->start_callback = callback;
+	scan->start_destroy = destroy;
+	scan->start_data = user_data;
+
+	return true;
+}
+
+bool bt_scan_stop(struct bt_scan *scan)
+{
+	if (!scan)
+		return false;
+
+	/* A start still under way is abandoned */
+	if (scan->cmd_id) {
+		bt_hci_cancel(scan->hci, scan->cmd_id);
+		scan->start_callback = NULL;
+		start_complete(scan, 0);
+	}
+
+	return bt_hci_le_set_scan_enable(scan->hci, 0x00, 0x00, NULL, NULL,
+								NULL) != 0;
+}
+
+bool bt_scan_get_stats(struct bt_scan *scan, struct bt_scan_stats *stats)
+{
+	if (!scan || !stats)
+		return false;
+
+	update_rate(scan, now_ms());
+
+	*stats = scan->stats;
+
+	return true;
+}
+
+bool bt_scan_reset_stats(struct bt_scan *scan)
+{
+	if (!scan)
+		return false;
+
+	memset(&scan->stats, 0, sizeof(scan->stats));
+	scan->rate_reports = 0;
+	scan->rate_delivered = 0;
+	scan->rate_start_ms = now_ms();
+
+	return true;
+}
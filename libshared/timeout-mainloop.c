@@ -18,65 +18,512 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
 #include "mainloop.h"
 #include "util.h"
 #include "timeout.h"
 
+/*
+ * All timeouts of a mainloop share one timerfd driving a hashed timer wheel
+ * with a 1 ms tick. Adding and removing a timeout only touches the wheel;
+ * the timerfd is re-armed only when a new timeout expires earlier than the
+ * armed one.
+ */
+#define WHEEL_BITS	12
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_WORDS	(WHEEL_SIZE / 64)
+
+#define HASH_MIN_SIZE	64
+
+struct timeout_list {
+	struct timeout_list *prev;
+	struct timeout_list *next;
+};
+
 struct timeout_data {
-	int id;
+	struct timeout_list link;	/* Must be first */
+	struct timeout_data *hash_next;
+	unsigned int id;
 	timeout_func_t func;
 	timeout_destroy_func_t destroy;
 	unsigned int timeout;
 	void *user_data;
+	uint64_t expiry;		/* Absolute, in ticks */
+	bool running;
+	bool removed;
 };
 
-static void timeout_callback(int id, void *user_data)
+struct timeout_wheel {
+	struct mainloop *loop;
+	int fd;
+	bool armed;
+	uint64_t armed_expiry;
+	uint64_t current;		/* Next tick to be processed */
+	struct timeout_list slots[WHEEL_SIZE];
+	uint64_t busy[WHEEL_WORDS];	/* Bitmap of non-empty slots */
+
+	struct timeout_data **hash;
+	unsigned int hash_size;
+	unsigned int count;
+	unsigned int next_id;
+};
+
+static inline void list_init(struct timeout_list *list)
+{
+	list->prev = list;
+	list->next = list;
+}
+
+static inline bool list_empty(const struct timeout_list *list)
+{
+	return list->next == list;
+}
+
+static inline void list_add_tail(struct timeout_list *list,
+						struct timeout_list *entry)
+{
+	entry->prev = list->prev;
+	entry->next = list;
+	list->prev->next = entry;
+	list->prev = entry;
+}
+
+static inline void list_del(struct timeout_list *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	list_init(entry);
+}
+
+static uint64_t now_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_arm(struct timeout_wheel *wheel, uint64_t expiry)
 {
-	struct timeout_data *data = user_data;
+	struct itimerspec itimer;
 
-	if (data->func(data->user_data) &&
-			!mainloop_modify_timeout(data->id, data->timeout))
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_value.tv_sec = expiry / 1000;
+	itimer.it_value.tv_nsec = (expiry % 1000) * 1000 * 1000;
+
+	/* A zero it_value would disarm the timer */
+	if (!itimer.it_value.tv_sec && !itimer.it_value.tv_nsec)
+		itimer.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &itimer, NULL) < 0)
 		return;
 
-	mainloop_remove_timeout(data->id);
+	wheel->armed = true;
+	wheel->armed_expiry = expiry;
+}
+
+static void wheel_disarm(struct timeout_wheel *wheel)
+{
+	struct itimerspec itimer;
+
+	memset(&itimer, 0, sizeof(itimer));
+	timerfd_settime(wheel->fd, 0, &itimer, NULL);
+
+	wheel->armed = false;
 }
 
-static void timeout_destroy(void *user_data)
+static void wheel_insert(struct timeout_wheel *wheel,
+						struct timeout_data *data)
 {
-	struct timeout_data *data = user_data;
+	unsigned int slot;
+
+	/* Never schedule into a tick that has already been processed */
+	if (data->expiry < wheel->current)
+		data->expiry = wheel->current;
+
+	slot = data->expiry & WHEEL_MASK;
+
+	list_add_tail(&wheel->slots[slot], &data->link);
+	wheel->busy[slot / 64] |= 1ULL << (slot % 64);
+
+	if (!wheel->armed || data->expiry < wheel->armed_expiry)
+		wheel_arm(wheel, data->expiry);
+}
+
+static void wheel_unlink(struct timeout_wheel *wheel,
+						struct timeout_data *data)
+{
+	unsigned int slot = data->expiry & WHEEL_MASK;
+
+	list_del(&data->link);
+
+	if (list_empty(&wheel->slots[slot]))
+		wheel->busy[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+static bool hash_resize(struct timeout_wheel *wheel, unsigned int size)
+{
+	struct timeout_data **hash;
+	unsigned int i;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return false;
 
+	for (i = 0; i < wheel->hash_size; i++) {
+		struct timeout_data *data = wheel->hash[i];
+
+		while (data) {
+			struct timeout_data *next = data->hash_next;
+			unsigned int bucket = data->id & (size - 1);
+
+			data->hash_next = hash[bucket];
+			hash[bucket] = data;
+			data = next;
+		}
+	}
+
+	free(wheel->hash);
+	wheel->hash = hash;
+	wheel->hash_size = size;
+
+	return true;
+}
+
+static struct timeout_data *hash_lookup(struct timeout_wheel *wheel,
+							unsigned int id)
+{
+	struct timeout_data *data;
+
+	if (!wheel->hash_size)
+		return NULL;
+
+	data = wheel->hash[id & (wheel->hash_size - 1)];
+	while (data && data->id != id)
+		data = data->hash_next;
+
+	return data;
+}
+
+static bool hash_insert(struct timeout_wheel *wheel,
+						struct timeout_data *data)
+{
+	unsigned int bucket;
+
+	if (wheel->count >= wheel->hash_size &&
+			!hash_resize(wheel, wheel->hash_size ?
+					wheel->hash_size * 2 : HASH_MIN_SIZE))
+		return false;
+
+	bucket = data->id & (wheel->hash_size - 1);
+	data->hash_next = wheel->hash[bucket];
+	wheel->hash[bucket] = data;
+	wheel->count++;
+
+	return true;
+}
+
+static void hash_remove(struct timeout_wheel *wheel,
+						struct timeout_data *data)
+{
+	struct timeout_data **p;
+
+	p = &wheel->hash[data->id & (wheel->hash_size - 1)];
+	while (*p && *p != data)
+		p = &(*p)->hash_next;
+
+	if (!*p)
+		return;
+
+	*p = data->hash_next;
+	wheel->count--;
+}
+
+static void timeout_free(struct timeout_data *data)
+{
 	if (data->destroy)
 		data->destroy(data->user_data);
 
 	free(data);
 }
 
-unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
-			void *user_data, timeout_destroy_func_t destroy)
+static void timeout_expire(struct timeout_wheel *wheel,
+				struct timeout_data *data, uint64_t now)
+{
+	bool rearm;
+
+	data->running = true;
+	rearm = data->func(data->user_data);
+	data->running = false;
+
+	if (rearm && !data->removed) {
+		data->expiry = now + data->timeout;
+		wheel_insert(wheel, data);
+		return;
+	}
+
+	if (!data->removed)
+		hash_remove(wheel, data);
+
+	timeout_free(data);
+}
+
+static int next_busy_slot(struct timeout_wheel *wheel, unsigned int from)
 {
+	unsigned int i, word, slot;
+	uint64_t bits;
+
+	/* Look at the full wheel once, starting with the slot after from */
+	for (i = 0; i <= WHEEL_WORDS; i++) {
+		word = ((from / 64) + i) % WHEEL_WORDS;
+		bits = wheel->busy[word];
+
+		if (i == 0)
+			bits &= ~0ULL << (from % 64);
+		else if (i == WHEEL_WORDS)
+			bits &= ~(~0ULL << (from % 64));
+
+		if (bits) {
+			slot = word * 64 + __builtin_ctzll(bits);
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+static void wheel_run(struct timeout_wheel *wheel, uint64_t now)
+{
+	struct timeout_list expired;
+	uint64_t tick, end;
+	int slot;
+
+	list_init(&expired);
+
+	/* Collect everything that is due, at most one full revolution */
+	end = now + 1;
+	if (end - wheel->current > WHEEL_SIZE)
+		wheel->current = end - WHEEL_SIZE;
+
+	for (tick = wheel->current; tick < end; tick++) {
+		struct timeout_list *list, *entry, *next;
+
+		slot = next_busy_slot(wheel, tick & WHEEL_MASK);
+		if (slot < 0)
+			break;
+
+		/* Skip ahead to the next non-empty slot */
+		tick += ((unsigned int) slot - (tick & WHEEL_MASK)) &
+								WHEEL_MASK;
+		if (tick >= end)
+			break;
+
+		list = &wheel->slots[slot];
+
+		for (entry = list->next; entry != list; entry = next) {
+			struct timeout_data *data = (void *) entry;
+
+			next = entry->next;
+
+			if (data->expiry > now)
+				continue;
+
+			wheel_unlink(wheel, data);
+			list_add_tail(&expired, &data->link);
+		}
+	}
+
+	wheel->current = end;
+
+	while (!list_empty(&expired)) {
+		struct timeout_data *data = (void *) expired.next;
+
+		list_del(&data->link);
+		timeout_expire(wheel, data, now);
+	}
+
+	/* Re-arm for the nearest non-empty slot */
+	slot = next_busy_slot(wheel, wheel->current & WHEEL_MASK);
+	if (slot < 0) {
+		wheel_disarm(wheel);
+		return;
+	}
+
+	wheel_arm(wheel, wheel->current + (((unsigned int) slot -
+				(wheel->current & WHEEL_MASK)) & WHEEL_MASK));
+}
+
+static void wheel_callback(int fd, uint32_t events, void *user_data)
+{
+	struct timeout_wheel *wheel = user_data;
+	uint64_t expired;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	if (read(fd, &expired, sizeof(expired)) < 0)
+		return;
+
+	wheel->armed = false;
+
+	wheel_run(wheel, now_ticks());
+}
+
+static void wheel_destroy(void *user_data)
+{
+	struct timeout_wheel *wheel = user_data;
+	unsigned int i;
+
+	close(wheel->fd);
+
+	mainloop_loop_set_timeout_data(wheel->loop, NULL);
+
+	/* The mainloop is going away, release all pending timeouts */
+	for (i = 0; i < wheel->hash_size; i++) {
+		while (wheel->hash[i]) {
+			struct timeout_data *data = wheel->hash[i];
+
+			wheel->hash[i] = data->hash_next;
+			timeout_free(data);
+		}
+	}
+
+	free(wheel->hash);
+	free(wheel);
+}
+
+static struct timeout_wheel *wheel_get(struct mainloop *loop, bool create)
+{
+	struct timeout_wheel *wheel;
+	unsigned int i;
+
+	if (!loop)
+		return NULL;
+
+	wheel = mainloop_loop_get_timeout_data(loop);
+	if (wheel || !create)
+		return wheel;
+
+	wheel = new0(struct timeout_wheel, 1);
+	wheel->loop = loop;
+
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->fd < 0) {
+		free(wheel);
+		return NULL;
+	}
+
+	for (i = 0; i < WHEEL_SIZE; i++)
+		list_init(&wheel->slots[i]);
+
+	wheel->current = now_ticks();
+
+	if (mainloop_loop_add_fd(loop, wheel->fd, EPOLLIN, wheel_callback,
+						wheel, wheel_destroy) < 0) {
+		close(wheel->fd);
+		free(wheel);
+		return NULL;
+	}
+
+	mainloop_loop_set_timeout_data(loop, wheel);
+
+	return wheel;
+}
+
+unsigned int timeout_loop_add(struct mainloop *loop, unsigned int timeout,
+				timeout_func_t func, void *user_data,
+				timeout_destroy_func_t destroy)
+{
+	struct timeout_wheel *wheel;
 	struct timeout_data *data;
 
+	if (!func)
+		return 0;
+
+	wheel = wheel_get(loop, true);
+	if (!wheel)
+		return 0;
+
+	/* Nothing pending, so the wheel may be far behind */
+	if (!wheel->count)
+		wheel->current = now_ticks();
+
 	data = new0(struct timeout_data, 1);
 	data->func = func;
 	data->user_data = user_data;
 	data->timeout = timeout;
 	data->destroy = destroy;
 
-	data->id = mainloop_add_timeout(timeout, timeout_callback, data,
-							timeout_destroy);
-	if (data->id < 0) {
+	do {
+		data->id = ++wheel->next_id;
+	} while (!data->id || hash_lookup(wheel, data->id));
+
+	if (!hash_insert(wheel, data)) {
 		free(data);
 		return 0;
 	}
 
-	return (unsigned int) data->id;
+	data->expiry = now_ticks() + timeout;
+	wheel_insert(wheel, data);
+
+	return data->id;
 }
 
-void timeout_remove(unsigned int id)
+unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
+			void *user_data, timeout_destroy_func_t destroy)
 {
+	return timeout_loop_add(mainloop_get_current(), timeout, func,
+							user_data, destroy);
+}
+
+void timeout_loop_remove(struct mainloop *loop, unsigned int id)
+{
+	struct timeout_wheel *wheel;
+	struct timeout_data *data;
+
 	if (!id)
 		return;
 
-	mainloop_remove_timeout((int) id);
+	wheel = wheel_get(loop, false);
+	if (!wheel)
+		return;
+
+	data = hash_lookup(wheel, id);
+	if (!data)
+		return;
+
+	hash_remove(wheel, data);
+
+	/* Freed once its callback returns */
+	if (data->running) {
+		data->removed = true;
+		return;
+	}
+
+	wheel_unlink(wheel, data);
+	timeout_free(data);
+}
+
+void timeout_remove(unsigned int id)
+{
+	timeout_loop_remove(mainloop_get_current(), id);
+}
+
+unsigned int timeout_loop_get_count(struct mainloop *loop)
+{
+	struct timeout_wheel *wheel = wheel_get(loop, false);
+
+	return wheel ? wheel->count : 0;
+}
+
+unsigned int timeout_get_count(void)
+{
+	return timeout_loop_get_count(mainloop_get_current());
 }
@@ -0,0 +1,289 @@
+/*
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  The bluez-gatt contributors
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+
+#include "src/shared/mainloop.h"
+#include "src/shared/util.h"
+#include "src/shared/timeout.h"
+#include "src/shared/hci.h"
+#include "src/shared/scan.h"
+
+#define DEFAULT_NUM_ADVERTISERS	1000
+#define DEFAULT_NUM_EVENTS	1000000
+#define DEFAULT_CHANGE_EVERY	10
+
+#define POLL_INTERVAL_MS	10
+
+/*
+ * Feeds LE Advertising Report events for a set of simulated advertisers
+ * through a socket pair into bt_scan, the way a busy controller would, and
+ * measures how fast they are parsed and deduplicated. Each advertiser
+ * changes its payload every few reports, so only those changes should be
+ * delivered.
+ */
+static unsigned int num_advertisers = DEFAULT_NUM_ADVERTISERS;
+static unsigned int num_events = DEFAULT_NUM_EVENTS;
+static unsigned int change_every = DEFAULT_CHANGE_EVERY;
+static unsigned int events_sent;
+static uint64_t delivered_names;
+static int ctl_fd;
+static struct bt_scan *scan;
+
+static void usage(void)
+{
+	printf("scan-bench\n");
+	printf("Usage:\n\tscan-bench [options]\n");
+
+	printf("Options:\n"
+		"\t-a, --advertisers <count>\tSimulated advertisers "
+							"(default: %d)\n"
+		"\t-n, --events <count>\tReport events to feed (default: %d)\n"
+		"\t-c, --change <count>\tReports between payload changes of\n"
+		"\t\t\t\tan advertiser (default: %d)\n"
+		"\t-d, --dedup <entries>\tDedup table size, 0 for none\n"
+		"\t-h, --help\t\tDisplay help\n",
+		DEFAULT_NUM_ADVERTISERS, DEFAULT_NUM_EVENTS,
+		DEFAULT_CHANGE_EVERY);
+}
+
+static struct option main_options[] = {
+	{ "advertisers",	1, 0, 'a' },
+	{ "events",		1, 0, 'n' },
+	{ "change",		1, 0, 'c' },
+	{ "dedup",		1, 0, 'd' },
+	{ "help",		0, 0, 'h' },
+	{ }
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Flags, a name and manufacturer data carrying a sequence number */
+static size_t build_event(uint8_t *buf, unsigned int n)
+{
+	unsigned int adv = n % num_advertisers;
+	unsigned int seq = n / num_advertisers / change_every;
+	uint8_t *data;
+	size_t len;
+
+	buf[0] = HCI_EVENT_PKT;
+	buf[1] = EVT_LE_META_EVENT;
+	buf[3] = EVT_LE_ADVERTISING_REPORT;
+	buf[4] = 1;
+	buf[5] = 0x00;				/* ADV_IND */
+	buf[6] = LE_RANDOM_ADDRESS;
+	put_le32(adv, buf + 7);
+	buf[11] = 0x01;
+	buf[12] = 0xc0;
+
+	data = buf + 14;
+	len = 0;
+
+	data[len++] = 2;
+	data[len++] = 0x01;
+	data[len++] = 0x06;
+
+	data[len++] = 12;
+	data[len++] = 0x09;
+	snprintf((char *) data + len, 12, "bench-%05u", adv % 100000);
+	len += 11;
+
+	data[len++] = 7;
+	data[len++] = 0xff;
+	put_le16(0x05f1, data + len);
+	put_le32(seq, data + len + 2);
+	len += 6;
+
+	buf[13] = len;
+	buf[14 + len] = (uint8_t) -60;		/* RSSI */
+	buf[2] = 14 + len + 1 - 3;
+
+	return 14 + len + 1;
+}
+
+static void ctl_write_cb(int fd, uint32_t events, void *user_data)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE + 1];
+	size_t len;
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		mainloop_quit();
+		return;
+	}
+
+	while (events_sent < num_events) {
+		len = build_event(buf, events_sent);
+
+		if (write(fd, buf, len) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("Failed to write event");
+				mainloop_quit();
+			}
+
+			return;
+		}
+
+		events_sent++;
+	}
+
+	mainloop_remove_fd(fd);
+}
+
+static void report_cb(const struct bt_scan_report *reports,
+					unsigned int count, void *user_data)
+{
+	unsigned int i;
+
+	/* Touch what a consumer would look at */
+	for (i = 0; i < count; i++)
+		if (reports[i].name_offset && reports[i].mfr_len == 4)
+			delivered_names++;
+}
+
+static bool poll_done(void *user_data)
+{
+	struct bt_scan_stats stats;
+
+	bt_scan_get_stats(scan, &stats);
+
+	if (stats.events < num_events)
+		return true;
+
+	mainloop_quit();
+
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int dedup = -1;
+	int sv[2], hci_sv[2];
+	struct bt_hci *hci;
+	struct bt_scan_stats stats;
+	uint64_t start, elapsed;
+
+	while ((opt = getopt_long(argc, argv, "+ha:n:c:d:",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'a':
+			num_advertisers = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_events = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			change_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dedup = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Invalid option: %c\n", opt);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!num_advertisers || !change_every) {
+		fprintf(stderr, "Invalid advertiser settings\n");
+		return EXIT_FAILURE;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+							0, sv) < 0 ||
+			socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC,
+							0, hci_sv) < 0) {
+		perror("Failed to create sockets");
+		return EXIT_FAILURE;
+	}
+
+	mainloop_init();
+
+	/* Commands are never sent, the controller end stays silent */
+	hci = bt_hci_new(hci_sv[0]);
+	scan = bt_scan_new(hci, sv[0]);
+	bt_hci_unref(hci);
+
+	if (!scan) {
+		fprintf(stderr, "Failed to create scanner\n");
+		return EXIT_FAILURE;
+	}
+
+	if (dedup >= 0)
+		bt_scan_set_dedup(scan, dedup, 0);
+
+	bt_scan_set_report_handler(scan, report_cb, NULL, NULL);
+
+	ctl_fd = sv[1];
+	mainloop_add_fd(ctl_fd, EPOLLOUT, ctl_write_cb, NULL, NULL);
+	timeout_add(POLL_INTERVAL_MS, poll_done, NULL, NULL);
+
+	start = now_nsec();
+	mainloop_run();
+	elapsed = now_nsec() - start;
+
+	bt_scan_get_stats(scan, &stats);
+
+	printf("events: total=%llu reports=%llu malformed=%llu\n",
+					(unsigned long long) stats.events,
+					(unsigned long long) stats.reports,
+					(unsigned long long) stats.malformed);
+	printf("dedup: delivered=%llu duplicates=%llu evictions=%llu\n",
+					(unsigned long long) stats.delivered,
+					(unsigned long long) stats.duplicates,
+					(unsigned long long) stats.evictions);
+	printf("batches: count=%llu avg_reports=%.1f\n",
+				(unsigned long long) stats.batches,
+				stats.batches ?
+				(double) stats.delivered / stats.batches : 0);
+	printf("rate: total_ns=%llu reports_per_sec=%.0f\n",
+				(unsigned long long) elapsed,
+				elapsed ? stats.reports * 1e9 / elapsed : 0);
+
+	bt_scan_unref(scan);
+	close(sv[1]);
+	close(hci_sv[1]);
+
+	return delivered_names == stats.delivered ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,10 +2,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
 
 #include "lib/bluetooth.h"
 #include "lib/hci.h"
@@ -17,6 +22,7 @@
 #include "src/shared/util.h"
 #include "src/shared/att.h"
 #include "src/shared/queue.h"
+#include "src/shared/timeout.h"
 #include "src/shared/gatt-db.h"
 #include "src/shared/gatt-client.h"
 
@@ -26,8 +32,16 @@
 #define THINGY_SENSOR_PRESSURE      1
 #define THINGY_SENSOR_HUMIDITY      2
 #define THINGY_SENSOR_GAS           3
+#define THINGY_NUM_SENSORS          4
 
-#define PRLOG(...) printf(__VA_ARGS__);
+#define THINGY_NAME_LEN             32
+
+#define SINK_BUFFER_SIZE            (64 * 1024)
+#define SINK_FLUSH_INTERVAL_MS      1000
+#define DEFAULT_RATE_INTERVAL       5
+#define RECONNECT_DELAY_MS          5000
+
+#define PRLOG(...) fprintf(stderr, __VA_ARGS__);
 
 #define COLOR_OFF       "\x1B[0m"
 #define COLOR_RED       "\x1B[0;91m"
@@ -38,123 +52,305 @@
 #define COLOR_BOLDGRAY  "\x1B[1;30m"
 #define COLOR_BOLDWHITE "\x1B[1;37m"
 
-static int thingy_sensor = THINGY_SENSOR_TEMPERATURE;
+/* Characteristics of the Thingy:52 Environment service, EF680200-... */
+static const struct {
+    const char *name;
+    const char *uuid;
+    uint16_t min_len;
+} sensors[THINGY_NUM_SENSORS] = {
+    [THINGY_SENSOR_TEMPERATURE] = { "temperature",
+                "ef680201-9b35-4933-9b10-52ffa9740042", 2 },
+    [THINGY_SENSOR_PRESSURE] = { "pressure",
+                "ef680202-9b35-4933-9b10-52ffa9740042", 5 },
+    [THINGY_SENSOR_HUMIDITY] = { "humidity",
+                "ef680203-9b35-4933-9b10-52ffa9740042", 1 },
+    [THINGY_SENSOR_GAS] = { "gas",
+                "ef680204-9b35-4933-9b10-52ffa9740042", 4 },
+};
+
+static unsigned int sensor_mask = 1 << THINGY_SENSOR_TEMPERATURE;
 static bool verbose = false;
 
-struct client {
+enum device_state {
+    DEVICE_WAITING,
+    DEVICE_CONNECTING,
+    DEVICE_DISCOVERING,
+    DEVICE_STREAMING,
+};
+
+static const char *state_str[] = {
+    [DEVICE_WAITING] = "waiting",
+    [DEVICE_CONNECTING] = "connecting",
+    [DEVICE_DISCOVERING] = "discovering",
+    [DEVICE_STREAMING] = "streaming",
+};
+
+/* One Thingy, with its own ATT bearer and GATT client on the mainloop */
+struct device {
+    bdaddr_t addr;
+    uint8_t addr_type;
+    char addr_str[18];
+    char name[THINGY_NAME_LEN];
+    enum device_state state;
+
     int fd;
     struct bt_att *att;
     struct gatt_db *db;
     struct bt_gatt_client *gatt;
 
-    unsigned int reliable_session_id;
+    uint16_t value_handles[THINGY_NUM_SENSORS];
+    unsigned int notify_ids[THINGY_NUM_SENSORS];
+    unsigned int reconnect_id;
+
+    uint64_t samples;
+    uint64_t rate_samples;
+    uint64_t malformed;
 };
 
+/*
+ * Samples are appended to a buffer and written out when it fills up or
+ * once a second, so a busy collector makes a few large writes instead of
+ * one per notification. Binary records are little endian: 64-bit
+ * timestamp in usec, 6 byte address, sensor, value length, raw value.
+ */
+#define SINK_RECORD_HDR_LEN         16
+
+enum sink_format {
+    SINK_FORMAT_CSV,
+    SINK_FORMAT_BINARY,
+};
 
-static bool parse_args(char *str, int expected_argc,  char **argv, int *argc)
+static struct {
+    int fd;
+    enum sink_format format;
+    uint8_t buf[SINK_BUFFER_SIZE];
+    size_t len;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t flushes;
+    bool failed;
+} sink;
+
+static struct queue *devices;
+static struct queue *pending;
+static struct device *connecting;
+static bdaddr_t src_addr;
+static int sec = BT_SECURITY_LOW;
+static uint16_t mtu = 0;
+static unsigned int rate_interval = DEFAULT_RATE_INTERVAL;
+
+static void connect_next(void);
+
+static uint64_t now_usec(void)
 {
-    char **ap;
+    struct timespec ts;
 
-    for (ap = argv; (*ap = strsep(&str, " \t")) != NULL;) {
-        if (**ap == '\0')
-            continue;
+    clock_gettime(CLOCK_REALTIME, &ts);
 
-        (*argc)++;
-        ap++;
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static bool sink_flush(void)
+{
+    size_t done = 0;
+    ssize_t n;
 
-        if (*argc > expected_argc)
+    if (sink.failed) {
+        sink.len = 0;
+        return false;
+    }
+
+    while (done < sink.len) {
+        n = write(sink.fd, sink.buf + done, sink.len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to write samples");
+            sink.failed = true;
+            sink.len = 0;
+            mainloop_quit();
             return false;
+        }
+
+        done += n;
+    }
+
+    if (sink.len) {
+        sink.bytes += sink.len;
+        sink.flushes++;
     }
 
+    sink.len = 0;
+
     return true;
 }
 
-/* functions for register notification */
-static void notify_cb(uint16_t value_handle, const uint8_t *value,
-        uint16_t length, void *user_data)
+static void sink_write(const void *data, size_t len)
 {
-    if (value_handle == 0x001f) /* temperature */
-        printf("Notification: Temp received:  %d.%d degCelcius\n", (int)value[0], (int)value[1]);
-    else if (value_handle == 0x0022) { /* pressure */
-        int hpa = ((int)value[3] << 24) | ((int)value[2] << 16) | ((int)value[1] << 8) | ((int)value[0]);
-        printf("Notification: Pressure received: %d.%d hPa\n", hpa, (int)value[4]);
-    }
-    else if (value_handle == 0x0025) /* humidity */
-        printf("Notification: Humidity received: %d %\n", (int)value[0]);
-    else if (value_handle == 0x0028) { /* gas */
-        int eco2 = ((int)value[1] << 8) | ((int)value[0]);
-        int tvoc = ((int)value[3] << 8) | ((int)value[2]);
-        printf("Notification: Gas received: eCO2 ppm: %d, TVOC ppb: %d %\n", eco2, tvoc);
-    }
-    else {
-        int i;
+    if (sink.len + len > sizeof(sink.buf))
+        sink_flush();
 
-        printf("\n\tHandle Value Not/Ind: 0x%04x - ", value_handle);
+    memcpy(sink.buf + sink.len, data, len);
+    sink.len += len;
+}
 
-        if (length == 0) {
-            PRLOG("(0 bytes)\n");
-            return;
-        }
+static bool sink_flush_cb(void *user_data)
+{
+    sink_flush();
 
-        printf("(%u bytes): ", length);
+    return true;
+}
 
-        for (i = 0; i < length; i++)
-            printf("%02x ", value[i]);
+static void sink_csv_header(void)
+{
+    static const char header[] = "timestamp_us,address,sensor,value,value2\n";
 
-        PRLOG("\n");
-    }
+    sink_write(header, sizeof(header) - 1);
 }
 
-static void register_notify_cb(uint16_t att_ecode, void *user_data)
+static void sink_sample(struct device *dev, int sensor, uint64_t timestamp,
+        const uint8_t *value, uint16_t length)
 {
-    if (att_ecode) {
-        PRLOG("Failed to register notify handler "
-                "- error code: 0x%02x\n", att_ecode);
+    uint8_t hdr[SINK_RECORD_HDR_LEN];
+    char line[128];
+    int len;
+
+    sink.records++;
+
+    if (sink.format == SINK_FORMAT_BINARY) {
+        if (length > UINT8_MAX)
+            length = UINT8_MAX;
+
+        put_le64(timestamp, hdr);
+        memcpy(hdr + 8, &dev->addr, 6);
+        hdr[14] = sensor;
+        hdr[15] = length;
+
+        sink_write(hdr, sizeof(hdr));
+        sink_write(value, length);
         return;
     }
+
+    len = snprintf(line, sizeof(line), "%" PRIu64 ",%s,%s,", timestamp,
+            dev->addr_str, sensors[sensor].name);
+
+    switch (sensor) {
+        case THINGY_SENSOR_TEMPERATURE:
+            len += snprintf(line + len, sizeof(line) - len, "%d.%02u,\n",
+                    (int8_t) value[0], value[1]);
+            break;
+        case THINGY_SENSOR_PRESSURE:
+            len += snprintf(line + len, sizeof(line) - len, "%d.%02u,\n",
+                    (int32_t) get_le32(value), value[4]);
+            break;
+        case THINGY_SENSOR_HUMIDITY:
+            len += snprintf(line + len, sizeof(line) - len, "%u,\n",
+                    value[0]);
+            break;
+        case THINGY_SENSOR_GAS:
+            /* eCO2 in ppm, TVOC in ppb */
+            len += snprintf(line + len, sizeof(line) - len, "%u,%u\n",
+                    get_le16(value), get_le16(value + 2));
+            break;
+    }
+
+    sink_write(line, len);
 }
 
-static void cmd_register_notify(struct client *cli, char *cmd_str)
+static void notify_cb(uint16_t value_handle, const uint8_t *value,
+        uint16_t length, void *user_data)
 {
-    char *argv[2];
-    int argc = 0;
-    uint16_t value_handle;
-    unsigned int id;
-    char *endptr = NULL;
+    struct device *dev = user_data;
+    int i;
 
-    if (!bt_gatt_client_is_ready(cli->gatt)) {
-        printf("GATT client not initialized\n");
-        return;
+    for (i = 0; i < THINGY_NUM_SENSORS; i++) {
+        if (dev->value_handles[i] == value_handle)
+            break;
     }
 
-    if (!parse_args(cmd_str, 1, argv, &argc) || argc != 1) {
-        printf("parse error: %s\n", cmd_str);
+    if (i == THINGY_NUM_SENSORS)
         return;
-    }
 
-    value_handle = strtol(argv[0], &endptr, 0);
-    if (!endptr || *endptr != '\0' || !value_handle) {
-        printf("Invalid value handle: %s\n", argv[0]);
+    if (length < sensors[i].min_len) {
+        dev->malformed++;
         return;
     }
 
-    id = bt_gatt_client_register_notify(cli->gatt, value_handle,
-            register_notify_cb,
-            notify_cb, NULL, NULL);
-    if (!id) {
-        printf("Failed to register notify handler\n");
+    dev->samples++;
+    sink_sample(dev, i, now_usec(), value, length);
+}
+
+static void register_notify_cb(uint16_t att_ecode, void *user_data)
+{
+    struct device *dev = user_data;
+
+    if (att_ecode) {
+        PRLOG("%s: Failed to register notify handler "
+                "- error code: 0x%02x\n", dev->addr_str, att_ecode);
         return;
     }
 }
 
-/* END of functions for register notification */
+static void find_value_handle(struct gatt_db_attribute *attrib,
+        void *user_data)
+{
+    uint16_t *handle = user_data;
 
-/* functions used in client_create() */
-static void att_disconnect_cb(int err, void *user_data)
+    if (!*handle)
+        *handle = gatt_db_attribute_get_handle(attrib);
+}
+
+static void unsubscribe(struct device *dev)
+{
+    int i;
+
+    for (i = 0; i < THINGY_NUM_SENSORS; i++) {
+        if (dev->notify_ids[i])
+            bt_gatt_client_unregister_notify(dev->gatt,
+                    dev->notify_ids[i]);
+
+        dev->notify_ids[i] = 0;
+        dev->value_handles[i] = 0;
+    }
+}
+
+/* Look the sensor characteristics up by UUID, handles vary by firmware */
+static void subscribe(struct device *dev)
 {
-    printf("Device disconnected: %s\n", strerror(err));
+    bt_uuid_t uuid;
+    int i;
+
+    unsubscribe(dev);
+
+    for (i = 0; i < THINGY_NUM_SENSORS; i++) {
+        if (!(sensor_mask & (1 << i)))
+            continue;
+
+        bt_string_to_uuid(&uuid, sensors[i].uuid);
+        gatt_db_find_by_type(dev->db, 0x0001, 0xffff, &uuid,
+                find_value_handle, &dev->value_handles[i]);
+
+        if (!dev->value_handles[i]) {
+            PRLOG("%s: No %s characteristic\n", dev->addr_str,
+                    sensors[i].name);
+            continue;
+        }
+
+        dev->notify_ids[i] = bt_gatt_client_register_notify(dev->gatt,
+                dev->value_handles[i], register_notify_cb, notify_cb,
+                dev, NULL);
+        if (!dev->notify_ids[i]) {
+            PRLOG("%s: Failed to register %s notify handler\n",
+                    dev->addr_str, sensors[i].name);
+            continue;
+        }
 
-    mainloop_quit();
+        if (verbose) {
+            PRLOG("%s: %s at handle 0x%04x\n", dev->addr_str,
+                    sensors[i].name, dev->value_handles[i]);
+        }
+    }
 }
 
 static void log_service_event(struct gatt_db_attribute *attr, const char *str)
@@ -163,6 +359,9 @@ static void log_service_event(struct gatt_db_attribute *attr, const char *str)
     bt_uuid_t uuid;
     uint16_t start, end;
 
+    if (!verbose)
+        return;
+
     gatt_db_attribute_get_service_uuid(attr, &uuid);
     bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
 
@@ -196,222 +395,141 @@ static void gatt_debug_cb(const char *str, void *user_data)
     PRLOG(COLOR_GREEN "%s%s\n" COLOR_OFF, prefix, str);
 }
 
-static void print_uuid(const bt_uuid_t *uuid)
-{
-    char uuid_str[MAX_LEN_UUID_STR];
-    bt_uuid_t uuid128;
-
-    bt_uuid_to_uuid128(uuid, &uuid128);
-    bt_uuid_to_string(&uuid128, uuid_str, sizeof(uuid_str));
-
-    printf("%s\n", uuid_str);
-}
-
-static void print_incl(struct gatt_db_attribute *attr, void *user_data)
+static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
 {
-    struct client *cli = user_data;
-    uint16_t handle, start, end;
-    struct gatt_db_attribute *service;
-    bt_uuid_t uuid;
-
-    if (!gatt_db_attribute_get_incl_data(attr, &handle, &start, &end))
-        return;
+    struct device *dev = user_data;
 
-    service = gatt_db_get_attribute(cli->db, start);
-    if (!service)
+    if (!success) {
+        PRLOG("%s: GATT discovery procedures failed - error code: 0x%02x\n",
+                dev->addr_str, att_ecode);
+
+        /*
+         * Take the link down rather than the client we are called from,
+         * att_disconnect_cb() then detaches and reconnects as usual.
+         */
+        shutdown(dev->fd, SHUT_RDWR);
         return;
+    }
 
-    gatt_db_attribute_get_service_uuid(service, &uuid);
-
-    printf("\t  " COLOR_GREEN "include" COLOR_OFF " - handle: "
-            "0x%04x, - start: 0x%04x, end: 0x%04x,"
-            "uuid: ", handle, start, end);
-    print_uuid(&uuid);
-}
+    PRLOG("%s: GATT discovery procedures complete\n", dev->addr_str);
 
-static void print_desc(struct gatt_db_attribute *attr, void *user_data)
-{
-    printf("\t\t  " COLOR_MAGENTA "descr" COLOR_OFF
-            " - handle: 0x%04x, uuid: ",
-            gatt_db_attribute_get_handle(attr));
-    print_uuid(gatt_db_attribute_get_type(attr));
+    dev->state = DEVICE_STREAMING;
+    subscribe(dev);
 }
 
-static void print_chrc(struct gatt_db_attribute *attr, void *user_data)
+static void service_changed_cb(uint16_t start_handle, uint16_t end_handle,
+        void *user_data)
 {
-    uint16_t handle, value_handle;
-    uint8_t properties;
-    uint16_t ext_prop;
-    bt_uuid_t uuid;
+    struct device *dev = user_data;
 
-    if (!gatt_db_attribute_get_char_data(attr, &handle,
-                &value_handle,
-                &properties,
-                &ext_prop,
-                &uuid))
-        return;
-
-    printf("\t  " COLOR_YELLOW "charac" COLOR_OFF
-            " - start: 0x%04x, value: 0x%04x, "
-            "props: 0x%02x, ext_props: 0x%04x, uuid: ",
-            handle, value_handle, properties, ext_prop);
-    print_uuid(&uuid);
+    PRLOG("%s: Service Changed handled - start: 0x%04x end: 0x%04x\n",
+            dev->addr_str, start_handle, end_handle);
 
-    gatt_db_service_foreach_desc(attr, print_desc, NULL);
+    subscribe(dev);
 }
 
-static void print_service(struct gatt_db_attribute *attr, void *user_data)
+static void device_detach(struct device *dev)
 {
-    struct client *cli = user_data;
-    uint16_t start, end;
-    bool primary;
-    bt_uuid_t uuid;
+    unsubscribe(dev);
 
-    if (!gatt_db_attribute_get_service_data(attr, &start, &end, &primary,
-                &uuid))
-        return;
-
-    printf(COLOR_RED "service" COLOR_OFF " - start: 0x%04x, "
-            "end: 0x%04x, type: %s, uuid: ",
-            start, end, primary ? "primary" : "secondary");
-    print_uuid(&uuid);
+    bt_gatt_client_unref(dev->gatt);
+    gatt_db_unref(dev->db);
+    bt_att_unref(dev->att);
 
-    gatt_db_service_foreach_incl(attr, print_incl, cli);
-    gatt_db_service_foreach_char(attr, print_chrc, NULL);
-
-    printf("\n");
+    dev->gatt = NULL;
+    dev->db = NULL;
+    dev->att = NULL;
+    dev->fd = -1;
 }
 
-static void print_services(struct client *cli)
+static bool reconnect_cb(void *user_data)
 {
-    printf("\n");
+    struct device *dev = user_data;
+
+    dev->reconnect_id = 0;
+    queue_push_tail(pending, dev);
+    connect_next();
 
-    gatt_db_foreach_service(cli->db, NULL, print_service, cli);
+    return false;
 }
 
-static void ready_cb(bool success, uint8_t att_ecode, void *user_data)
+static void schedule_reconnect(struct device *dev)
 {
-    struct client *cli = user_data;
-    char temp_chrc_hnd[32] = "0x001f\0";
-    char pressure_chrc_hnd[32] = "0x0022\0";
-    char humidity_chrc_hnd[32] = "0x0025\0";
-    char gas_chrc_hnd[32] = "0x0028\0";
-
-    if (!success) {
-        PRLOG("GATT discovery procedures failed - error code: 0x%02x\n",
-                att_ecode);
-        return;
-    }
-
-    PRLOG("GATT discovery procedures complete\n");
-
-
-    //print_services(cli);
-    if (thingy_sensor == THINGY_SENSOR_TEMPERATURE)
-        cmd_register_notify(cli, temp_chrc_hnd);
-    else if (thingy_sensor == THINGY_SENSOR_PRESSURE)
-        cmd_register_notify(cli, pressure_chrc_hnd);
-    else if (thingy_sensor == THINGY_SENSOR_HUMIDITY)
-        cmd_register_notify(cli, humidity_chrc_hnd);
-    else if (thingy_sensor == THINGY_SENSOR_GAS)
-        cmd_register_notify(cli, gas_chrc_hnd);
-    else
-        cmd_register_notify(cli, temp_chrc_hnd);
+    dev->state = DEVICE_WAITING;
+    dev->reconnect_id = timeout_add(RECONNECT_DELAY_MS, reconnect_cb, dev,
+            NULL);
 }
 
-
-static void service_changed_cb(uint16_t start_handle, uint16_t end_handle,
-        void *user_data)
+static void att_disconnect_cb(int err, void *user_data)
 {
-    struct client *cli = user_data;
+    struct device *dev = user_data;
 
-    printf("\nService Changed handled - start: 0x%04x end: 0x%04x\n",
-            start_handle, end_handle);
+    PRLOG("%s: Device disconnected: %s\n", dev->addr_str, strerror(err));
 
-    gatt_db_foreach_service_in_range(cli->db, NULL, print_service, cli,
-            start_handle, end_handle);
+    device_detach(dev);
+    schedule_reconnect(dev);
 }
-/* END of functions used in client_create() */
 
-static struct client *client_create(int fd, uint16_t mtu)
+static bool device_attach(struct device *dev, int fd)
 {
-    struct client *cli;
-
-    cli = new0(struct client, 1);
-    if (!cli) {
-        fprintf(stderr, "Failed to allocate memory for client\n");
-        return NULL;
-    }
-
-    cli->att = bt_att_new(fd, false);
-    if (!cli->att) {
+    dev->att = bt_att_new(fd, false);
+    if (!dev->att) {
         fprintf(stderr, "Failed to initialze ATT transport layer\n");
-        bt_att_unref(cli->att);
-        free(cli);
-        return NULL;
+        return false;
     }
 
-    if (!bt_att_set_close_on_unref(cli->att, true)) {
+    if (!bt_att_set_close_on_unref(dev->att, true)) {
         fprintf(stderr, "Failed to set up ATT transport layer\n");
-        bt_att_unref(cli->att);
-        free(cli);
-        return NULL;
+        goto fail;
     }
 
-    if (!bt_att_register_disconnect(cli->att, att_disconnect_cb, NULL,
+    if (!bt_att_register_disconnect(dev->att, att_disconnect_cb, dev,
                 NULL)) {
         fprintf(stderr, "Failed to set ATT disconnect handler\n");
-        bt_att_unref(cli->att);
-        free(cli);
-        return NULL;
+        goto fail;
     }
 
-    cli->fd = fd;
-    cli->db = gatt_db_new();
-    if (!cli->db) {
+    dev->fd = fd;
+    dev->db = gatt_db_new();
+    if (!dev->db) {
         fprintf(stderr, "Failed to create GATT database\n");
-        bt_att_unref(cli->att);
-        free(cli);
-        return NULL;
+        goto fail;
     }
 
-    cli->gatt = bt_gatt_client_new(cli->db, cli->att, mtu);
-    if (!cli->gatt) {
+    dev->gatt = bt_gatt_client_new(dev->db, dev->att, mtu);
+    if (!dev->gatt) {
         fprintf(stderr, "Failed to create GATT client\n");
-        gatt_db_unref(cli->db);
-        bt_att_unref(cli->att);
-        free(cli);
-        return NULL;
+        gatt_db_unref(dev->db);
+        dev->db = NULL;
+        goto fail;
     }
 
-    gatt_db_register(cli->db, service_added_cb, service_removed_cb,
+    gatt_db_register(dev->db, service_added_cb, service_removed_cb,
             NULL, NULL);
 
     if (verbose) {
-        bt_att_set_debug(cli->att, att_debug_cb, "att: ", NULL);
-        bt_gatt_client_set_debug(cli->gatt, gatt_debug_cb, "gatt: ",
+        bt_att_set_debug(dev->att, att_debug_cb, "att: ", NULL);
+        bt_gatt_client_set_debug(dev->gatt, gatt_debug_cb, "gatt: ",
                 NULL);
     }
 
-    bt_gatt_client_ready_register(cli->gatt, ready_cb, cli, NULL);
-    bt_gatt_client_set_service_changed(cli->gatt, service_changed_cb, cli,
+    bt_gatt_client_ready_register(dev->gatt, ready_cb, dev, NULL);
+    bt_gatt_client_set_service_changed(dev->gatt, service_changed_cb, dev,
             NULL);
 
-    /* bt_gatt_client already holds a reference */
-    gatt_db_unref(cli->db);
-
-    return cli;
-}
-
-static void client_destroy(struct client *cli)
-{
-    bt_gatt_client_unref(cli->gatt);
-    bt_att_unref(cli->att);
-    free(cli);
-}
+    dev->state = DEVICE_DISCOVERING;
 
+    return true;
 
+fail:
+    /* The caller still owns fd */
+    bt_att_set_close_on_unref(dev->att, false);
+    bt_att_unref(dev->att);
+    dev->att = NULL;
+    dev->fd = -1;
 
+    return false;
+}
 
 static void signal_cb(int signum, void *user_data)
 {
@@ -425,7 +543,7 @@ static void signal_cb(int signum, void *user_data)
     }
 }
 
-
+/* Starts a non-blocking connect, completion is signalled by EPOLLOUT */
 static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
         int sec)
 {
@@ -439,12 +557,13 @@ static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
         ba2str(src, srcaddr_str);
         ba2str(dst, dstaddr_str);
 
-        printf("btgatt-client: Opening L2CAP LE connection on ATT "
+        PRLOG("thingy: Opening L2CAP LE connection on ATT "
                 "channel:\n\t src: %s\n\tdest: %s\n",
                 srcaddr_str, dstaddr_str);
     }
 
-    sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            BTPROTO_L2CAP);
     if (sock < 0) {
         perror("Failed to create L2CAP socket");
         return -1;
@@ -480,20 +599,215 @@ static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst, uint8_t dst_type,
     dstaddr.l2_bdaddr_type = dst_type;
     bacpy(&dstaddr.l2_bdaddr, dst);
 
-    printf("Connecting to device...");
-    fflush(stdout);
-
-    if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0) {
-        perror(" Failed to connect");
+    if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0 &&
+            errno != EINPROGRESS) {
+        perror("Failed to connect");
         close(sock);
         return -1;
     }
 
-    printf(" Done\n");
-
     return sock;
 }
 
+static void connect_cb(int fd, uint32_t events, void *user_data)
+{
+    struct device *dev = user_data;
+    socklen_t len;
+    int err = 0;
+
+    mainloop_remove_fd(fd);
+    connecting = NULL;
+
+    len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+    if (!err && (events & (EPOLLERR | EPOLLHUP)))
+        err = ECONNREFUSED;
+
+    if (err) {
+        PRLOG("%s: Failed to connect: %s\n", dev->addr_str, strerror(err));
+        dev->fd = -1;
+        close(fd);
+        schedule_reconnect(dev);
+    } else if (!device_attach(dev, fd)) {
+        dev->fd = -1;
+        close(fd);
+        schedule_reconnect(dev);
+    } else {
+        PRLOG("%s: Connected\n", dev->addr_str);
+    }
+
+    connect_next();
+}
+
+/*
+ * Controllers handle one LE connection attempt at a time, so devices are
+ * connected in turn while the ones already up keep streaming.
+ */
+static void connect_next(void)
+{
+    struct device *dev;
+    int fd;
+
+    while (!connecting && (dev = queue_pop_head(pending))) {
+        PRLOG("%s: Connecting\n", dev->addr_str);
+
+        fd = l2cap_le_att_connect(&src_addr, &dev->addr, dev->addr_type,
+                sec);
+        if (fd < 0) {
+            schedule_reconnect(dev);
+            continue;
+        }
+
+        if (mainloop_add_fd(fd, EPOLLOUT, connect_cb, dev, NULL) < 0) {
+            close(fd);
+            schedule_reconnect(dev);
+            continue;
+        }
+
+        dev->fd = fd;
+        dev->state = DEVICE_CONNECTING;
+        connecting = dev;
+    }
+}
+
+static void print_rate(void *data, void *user_data)
+{
+    struct device *dev = data;
+    double rate;
+
+    rate = (double) (dev->samples - dev->rate_samples) / rate_interval;
+    dev->rate_samples = dev->samples;
+
+    PRLOG("%s %-16s %8.1f samples/s %10" PRIu64 " total %6" PRIu64
+            " malformed %s\n", dev->addr_str, dev->name, rate,
+            dev->samples, dev->malformed, state_str[dev->state]);
+}
+
+static bool rate_cb(void *user_data)
+{
+    queue_foreach(devices, print_rate, NULL);
+
+    PRLOG("sink: %" PRIu64 " records, %" PRIu64 " bytes in %" PRIu64
+            " writes\n", sink.records, sink.bytes, sink.flushes);
+
+    return true;
+}
+
+static void push_pending(void *data, void *user_data)
+{
+    queue_push_tail(pending, data);
+}
+
+static bool add_device(const char *addr, const char *type, const char *name)
+{
+    struct device *dev;
+
+    dev = new0(struct device, 1);
+
+    if (str2ba(addr, &dev->addr) < 0) {
+        fprintf(stderr, "Invalid remote address: %s\n", addr);
+        free(dev);
+        return false;
+    }
+
+    if (!type || !strcmp(type, "random")) {
+        dev->addr_type = BDADDR_LE_RANDOM;
+    } else if (!strcmp(type, "public")) {
+        dev->addr_type = BDADDR_LE_PUBLIC;
+    } else {
+        fprintf(stderr, "Invalid address type: %s\n", type);
+        free(dev);
+        return false;
+    }
+
+    ba2str(&dev->addr, dev->addr_str);
+    snprintf(dev->name, sizeof(dev->name), "%s", name ? name : "-");
+    dev->fd = -1;
+
+    queue_push_tail(devices, dev);
+
+    return true;
+}
+
+static void device_free(void *data)
+{
+    struct device *dev = data;
+
+    if (dev->reconnect_id)
+        timeout_remove(dev->reconnect_id);
+
+    if (dev->att)
+        device_detach(dev);
+
+    free(dev);
+}
+
+/* One device per line: <address> [random|public] [name], # for comments */
+static bool load_config(const char *path)
+{
+    char line[256];
+    char *addr, *type, *name, *saveptr;
+    unsigned int lineno = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror("Failed to open device list");
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        addr = strtok_r(line, " \t\r\n", &saveptr);
+        if (!addr || addr[0] == '#')
+            continue;
+
+        type = strtok_r(NULL, " \t\r\n", &saveptr);
+        name = strtok_r(NULL, "\r\n", &saveptr);
+
+        if (!add_device(addr, type, name)) {
+            fprintf(stderr, "%s:%u: invalid device entry\n", path, lineno);
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+static bool parse_sensors(char *str)
+{
+    char *tok, *saveptr;
+    int i;
+
+    sensor_mask = 0;
+
+    for (tok = strtok_r(str, ",", &saveptr); tok;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+        if (!strcmp(tok, "all")) {
+            sensor_mask = (1 << THINGY_NUM_SENSORS) - 1;
+            continue;
+        }
+
+        for (i = 0; i < THINGY_NUM_SENSORS; i++) {
+            if (!strcmp(tok, sensors[i].name))
+                break;
+        }
+
+        if (i == THINGY_NUM_SENSORS)
+            return false;
+
+        sensor_mask |= 1 << i;
+    }
+
+    return sensor_mask != 0;
+}
+
 static void usage(void)
 {
     printf("thingy\n");
@@ -501,38 +815,52 @@ static void usage(void)
 
     printf("Options:\n"
             "\t-i, --index <id>\t\tSpecify adapter index, e.g. hci0\n"
-            "\t-d, --dest <addr>\t\tSpecify the destination address\n"
-            "\t-s, --sensor <type>\t\tSpecify sensor type (temperature|"
-            "pressure|humidity|gas)\n"
+            "\t-d, --dest <addr>\t\tAdd a destination address, may be "
+            "repeated\n"
+            "\t-c, --config <file>\t\tRead devices from a file, one\n"
+            "\t\t\t\t\t\"<addr> [random|public] [name]\" per line\n"
+            "\t-t, --type <random|public>\tAddress type of the following\n"
+            "\t\t\t\t\t--dest options (default: random)\n"
+            "\t-s, --sensor <list>\t\tComma separated sensors (temperature,"
+            "\n\t\t\t\t\tpressure,humidity,gas) or all\n"
+            "\t-o, --output <file>\t\tWrite samples to file "
+            "(default: stdout)\n"
+            "\t-f, --format <csv|binary>\tSample format (default: csv)\n"
+            "\t-r, --rate <sec>\t\tRate line interval, 0 to disable "
+            "(default: %d)\n"
             "\t-v, --verbose\t\t\tEnable extra logging\n"
-            "\t-h, --help\t\t\tDisplay help\n");
+            "\t-h, --help\t\t\tDisplay help\n", DEFAULT_RATE_INTERVAL);
 }
 
-
 static struct option main_options[] = {
     { "index",		1, 0, 'i' },
     { "dest",		1, 0, 'd' },
-    { "sensor",     1, 0, 's' },
+    { "config",		1, 0, 'c' },
+    { "type",		1, 0, 't' },
+    { "sensor",		1, 0, 's' },
+    { "output",		1, 0, 'o' },
+    { "format",		1, 0, 'f' },
+    { "rate",		1, 0, 'r' },
     { "verbose",	0, 0, 'v' },
     { "help",		0, 0, 'h' },
     { }
 };
 
-
 int main(int argc, char *argv[])
 {
     int opt;
-    int sec = BT_SECURITY_LOW;
-    uint16_t mtu = 0;
-    uint8_t dst_type = BDADDR_LE_RANDOM;
-    bool dst_addr_given = false;
-    bdaddr_t src_addr, dst_addr;
+    const char *dst_type = NULL;
+    const char *output = NULL;
     int dev_id = -1;
-    int fd;
     sigset_t mask;
-    struct client *cli;
+    unsigned int rate_id = 0;
+    int ret = EXIT_SUCCESS;
 
-    while ((opt = getopt_long(argc, argv, "+hvs:d:i:",
+    devices = queue_new();
+    pending = queue_new();
+    sink.fd = STDOUT_FILENO;
+
+    while ((opt = getopt_long(argc, argv, "+hvs:d:i:c:t:o:f:r:",
                     main_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
@@ -542,29 +870,38 @@ int main(int argc, char *argv[])
                 verbose = true;
                 break;
             case 's':
-                if (strcmp(optarg, "temperture") == 0)
-                    thingy_sensor = THINGY_SENSOR_TEMPERATURE;
-                else if (strcmp(optarg, "pressure") == 0)
-                    thingy_sensor = THINGY_SENSOR_PRESSURE;
-                else if (strcmp(optarg, "humidity") == 0)
-                    thingy_sensor = THINGY_SENSOR_HUMIDITY;
-                else if (strcmp(optarg, "gas") == 0)
-                    thingy_sensor = THINGY_SENSOR_GAS;
-                else {
+                if (!parse_sensors(optarg)) {
                     fprintf(stderr, "Invalid thingy sensor type\n");
                     return EXIT_FAILURE;
                 }
                 break;
             case 'd':
-                if (str2ba(optarg, &dst_addr) < 0) {
-                    fprintf(stderr, "Invalid remote address: %s\n",
-                            optarg);
+                if (!add_device(optarg, dst_type, NULL))
+                    return EXIT_FAILURE;
+                break;
+            case 't':
+                dst_type = optarg;
+                break;
+            case 'c':
+                if (!load_config(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "csv"))
+                    sink.format = SINK_FORMAT_CSV;
+                else if (!strcmp(optarg, "binary"))
+                    sink.format = SINK_FORMAT_BINARY;
+                else {
+                    fprintf(stderr, "Invalid sample format\n");
                     return EXIT_FAILURE;
                 }
-
-                dst_addr_given = true;
                 break;
-
+            case 'r':
+                rate_interval = strtoul(optarg, NULL, 0);
+                break;
             case 'i':
                 dev_id = hci_devid(optarg);
                 if (dev_id < 0) {
@@ -579,11 +916,6 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!argc) {
-        usage();
-        return EXIT_SUCCESS;
-    }
-
     argc -= optind;
     argv += optind;
     optind = 0;
@@ -600,23 +932,32 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (!dst_addr_given) {
+    if (queue_isempty(devices)) {
         fprintf(stderr, "Destination address required!\n");
         return EXIT_FAILURE;
     }
 
+    if (output && strcmp(output, "-")) {
+        sink.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+        if (sink.fd < 0) {
+            perror("Failed to open output");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sink.format == SINK_FORMAT_CSV)
+        sink_csv_header();
+
     mainloop_init();
 
-    fd = l2cap_le_att_connect(&src_addr, &dst_addr, dst_type, sec);
-    if (fd < 0)
-        return EXIT_FAILURE;
+    queue_foreach(devices, push_pending, NULL);
+    connect_next();
 
-    cli = client_create(fd, mtu);
-    if (!cli) {
-        close(fd);
-        return EXIT_FAILURE;
-    }
+    timeout_add(SINK_FLUSH_INTERVAL_MS, sink_flush_cb, NULL, NULL);
 
+    if (rate_interval)
+        rate_id = timeout_add(rate_interval * 1000, rate_cb, NULL, NULL);
 
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
@@ -626,10 +967,24 @@ int main(int argc, char *argv[])
 
     mainloop_run();
 
-    printf("\n\nShutting down...\n");
+    PRLOG("\n\nShutting down...\n");
 
-    client_destroy(cli);
+    if (rate_id)
+        rate_cb(NULL);
 
-    return EXIT_SUCCESS;
-}
+    if (connecting) {
+        mainloop_remove_fd(connecting->fd);
+        close(connecting->fd);
+    }
 
+    queue_destroy(pending, NULL);
+    queue_destroy(devices, device_free);
+
+    if (!sink_flush() || sink.failed)
+        ret = EXIT_FAILURE;
+
+    if (sink.fd != STDOUT_FILENO)
+        close(sink.fd);
+
+    return ret;
+}